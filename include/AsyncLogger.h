@@ -0,0 +1,167 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+
+
+/**
+ * Logger that can be used from the real-time threads: the audio thread, the wave render threads and the MIDI callbacks.
+ *
+ * A log call doesn't format anything: it writes a fixed-size binary record (level, timestamp, code and a few numeric
+ * arguments) into a lock-free ring owned by the calling thread, and returns. The first call of each thread claims
+ * one of the rings, which are all allocated by start(). A background thread drains the rings every few milliseconds,
+ * formats the records after the format string of their code and writes them, ordered by time, to a log file.
+ * When the file grows over the maximum size it's rotated: path becomes path.1, path.1 becomes path.2 and so on.
+ *
+ * log() never allocates, locks or does I/O. If the ring of the thread is full the record is dropped and counted,
+ * and the number of dropped records is written to the file at the next drain.
+ */
+class AsyncLogger
+{
+public:
+
+    enum class Level : std::uint8_t {
+        VERBOSE,
+        INFO,
+        WARNING,
+        ERROR
+    };
+
+    /** What a record is about. The format string of each code, in AsyncLogger.cpp, tells how the arguments are printed */
+    enum class Code : std::uint16_t {
+        DEADLINE_MISS,        // the audio block came in late. arg0 = frame, arg1 = block interval in ms
+        PENDING_NOTES_FULL,   // no room to schedule a note, applied at the beginning of the block. arg0 = wave, arg1 = note frame
+        DIRECT_NOTE_DROPPED,  // the direct note queue of a MIDI port is full. arg0 = port, arg1 = wave, arg2 = midi note
+        MIDI_EVENT_DROPPED,   // the MIDI event queue of a port is full. arg0 = port, arg1 = total dropped
+        BENCHMARK,            // written by runBenchmark(), drained but never written to the file. arg0 = block, arg1 = call
+        NUM_CODES
+    };
+
+    static const std::size_t kNumArgs = 4;
+
+    /** One log call */
+    struct Record
+    {
+        std::uint64_t timestamp;  // LatencyProbe::now() at the time of the call
+        double args[kNumArgs];
+        std::uint16_t threadIdx;  // ring of the calling thread
+        Code code;
+        Level level;
+    };
+
+    /** The logger of the application */
+    static AsyncLogger& instance();
+
+    // no copies
+    AsyncLogger( const AsyncLogger &copy ) = delete;
+    AsyncLogger & operator=(const AsyncLogger &copy) = delete;
+
+    /**
+     * Allocates the rings, opens the log file and starts the background thread. Calls to log() before start() are dropped.
+     * \param path path of the log file
+     * \param maxFileSize size in bytes over which the file is rotated
+     * \param numFiles number of files kept, the current one included
+     * \param numThreads maximum number of threads logging at the same time
+     * \param ringSize number of records each thread can log between two drains
+     */
+    void start( const std::string &path, std::size_t maxFileSize, std::size_t numFiles, std::size_t numThreads, std::size_t ringSize );
+
+    /** Writes what's left in the rings and stops the background thread */
+    void stop();
+
+    /** Logs a record. Real-time safe. Returns false if the record was dropped */
+    bool log( Level level, Code code, double arg0 = 0.0, double arg1 = 0.0, double arg2 = 0.0, double arg3 = 0.0 );
+
+    /** Total number of records dropped because a ring was full or no ring was left */
+    std::uint64_t getNumDropped() const;
+
+    /**
+     * Measures the cost of log() on a thread that behaves like the audio thread: \a callsPerBlock calls every
+     * block period of \a blockDuration seconds, inside a RT_SAFETY_SCOPE. Returns a report of the distribution
+     * of the cost of a call. The records go through the rings and the drain like any other, but are not written to the file.
+     * Must be called after start()
+     */
+    std::string runBenchmark( std::size_t numBlocks, std::size_t callsPerBlock, double blockDuration );
+
+private:
+
+    struct Ring
+    {
+        std::unique_ptr< Record[] > records;
+        std::uint16_t index;
+        std::atomic< bool > claimed;
+        std::atomic< std::uint64_t > writeIdx;
+        std::atomic< std::uint64_t > readIdx;
+        std::atomic< std::uint64_t > numDropped;
+        std::uint64_t numDroppedReported;  // background thread only
+    };
+
+    AsyncLogger();
+
+    ~AsyncLogger();
+
+    // returns the ring of the calling thread, claiming one on the first call. nullptr if none is left
+    Ring* threadRing();
+
+    // pthread key destructor: gives the ring back when its thread exits
+    static void releaseRing( void *ring );
+
+    void run();
+
+    // moves the records out of the rings and writes them to the file. Background thread only
+    void drain();
+
+    void write( const char *line, std::size_t size );
+
+    void rotate();
+
+    std::string mPath;
+    std::size_t mMaxFileSize;
+    std::size_t mNumFiles;
+    std::size_t mRingSize;
+
+    std::vector< std::unique_ptr< Ring > > mRings;
+    pthread_key_t mRingKey;
+
+    // calls that found no ring left
+    std::atomic< std::uint64_t > mNumUnclaimedDropped;
+    std::uint64_t mNumUnclaimedDroppedReported;
+
+    // background thread only
+    std::vector< Record > mDrainBuffer;
+    std::FILE *mFile;
+    std::size_t mFileSize;
+    std::uint64_t mStartTime;
+
+    std::atomic< bool > mStarted;
+    std::atomic< bool > mRunning;
+    std::thread mThread;
+};
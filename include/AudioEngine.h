@@ -21,16 +21,19 @@
 
 #pragma once
 
-#include <array>
+#include <vector>
 
 #include "cinder/audio/Context.h"
-#include "cinder/audio/ChannelRouterNode.h"
-#include "cinder/audio/MonitorNode.h"
-#include "cinder/audio/FilterNode.h"
-#include "cinder/audio/GainNode.h"
-#include "BufferToWaveRecorderNode.h"
-#include "PGranularNode.h"
-#include "RingBufferPack.h"
+#include "cinder/audio/InputNode.h"
+#include "WaveEngine.h"
+#include "WaveMixerNode.h"
+#include "SpectrumTapNode.h"
+#include "XrunMonitor.h"
+#include "LatencyProbe.h"
+#include "ClockBridge.h"
+#include "ControlStream.h"
+
+#include <atomic>
 
 #include "Messages.h"
 #include "Config.h"
@@ -38,7 +41,8 @@
 
 /**
  * Audio engine of the application. It uses the Cinder library to process audio in input and output. 
- * The audio engine manages both waves. All methods have a waveIndx parameter to address a specific wave.
+ * The audio engine manages all the waves, one WaveEngine each. All methods have a waveIndx parameter to address a specific wave.
+ * The number of waves is read from Config at setup.
  */ 
 class AudioEngine
 {
@@ -59,6 +63,8 @@ public:
 
     size_t getSampleRate();
 
+    size_t getNumWaves() const { return mWaveEngines.size(); }
+
     void record( size_t index );
 
     void loopOn( size_t waveIdx );
@@ -69,6 +75,24 @@ public:
 
     void noteOff( size_t waveIdx, int note );
 
+    /**
+     * Called from the MIDI thread of the input port \a port. Sends the note straight to the audio thread, 
+     * without going through the graphic thread. \a timestamp is the host time (see LatencyProbe::now()) of the note.
+     * The note is scheduled at the audio frame corresponding to the timestamp, delayed by a constant amount
+     * so that the notes keep their relative timing regardless of the block size.
+     * Returns false if the note could not be queued, in which case the caller should use noteOn() instead.
+     */
+    bool directNoteOn( size_t port, size_t waveIdx, int note, uint64_t timestamp );
+
+    /** Same as directNoteOn() for note off */
+    bool directNoteOff( size_t port, size_t waveIdx, int note, uint64_t timestamp );
+
+    /** Called from the graphic thread. Plays the note at the audio frame \a frame, or as soon as possible if the frame is past */
+    void noteOnAt( size_t waveIdx, int note, uint64_t frame );
+
+    /** Same as noteOnAt() for note off */
+    void noteOffAt( size_t waveIdx, int note, uint64_t frame );
+
     /**
     * Returns the number of elements available to read in the wave ring buffer.
     * The wave ring buffer is used to pass the size of the wave chunks from the audio thread to the graphic thread, 
@@ -83,6 +107,24 @@ public:
     */
     bool readRecordWave( size_t waveIdx, RecordWaveMsg* buffer, size_t count );
 
+    /** Length of the recording buffer of the wave, in frames */
+    size_t getWaveNumFrames( size_t waveIdx ) const;
+
+    /** Number of frames recorded in the buffer of the wave. Called from any thread */
+    size_t getRecordedNumFrames( size_t waveIdx ) const;
+
+    /** Onsets of the recording of the wave, built while it's recorded or restored. Called from any thread */
+    const collidoscope::OnsetIndex& getOnsetIndex( size_t waveIdx ) const;
+
+    /** The recording buffer of the wave, one channel. Only the first getRecordedNumFrames() frames are meaningful */
+    const float* getRecordedSamples( size_t waveIdx );
+
+    /**
+     * Copies a recording, e.g. from a saved session, into the buffer of the wave. Called from the graphic thread
+     * when the wave is not recording. The chunks of the graphic wave are not updated.
+     */
+    void restoreRecording( size_t waveIdx, const float *samples, size_t numFrames );
+
     void setSelectionSize( size_t waveIdx, size_t size );
 
     void setSelectionStart( size_t waveIdx, size_t start );
@@ -92,32 +134,129 @@ public:
     void setFilterCutoff( size_t waveIdx, double cutoff );
 
     void setGain( size_t waveIdx, double cutoff );
+
+    /** Bends the pitch of the wave, sounding notes included. In semitones */
+    void setPitchBend( size_t waveIdx, double semitones );
+
+    /** Sets the time a new note of the wave takes to glide from the previous note. In seconds, 0 for no glide */
+    void setGlideTime( size_t waveIdx, double seconds );
+
+    /** Schedules the grains of the wave at \a grainsPerSecond, whatever the selection size. 0 for one grain every selection size */
+    void setGrainDensity( size_t waveIdx, double grainsPerSecond );
+
+    /** Sets the random jitter of the grain onsets of the wave when scheduled by density, in [0, 1] */
+    void setGrainJitter( size_t waveIdx, double jitter );
+
+    /** Sets the duration of the grains of the wave when scheduled by density, in seconds. It's scaled by the grain duration coefficient */
+    void setGrainTime( size_t waveIdx, double seconds );
     
     void checkCursorTriggers( size_t waveIdx, std::vector<CursorTriggerMsg>& cursorTriggers );
 
     /**
-     * Returns a const reference to the audio output buffer. This is the buffer that is sent off to the audio interface at each audio cycle. 
-     * It is used in the graphic thread to draw the oscilloscope.
+     * Grabs the latest snapshot of the audio output of the wave. Returns false if the audio thread hasn't published
+     * a new one since the last call. Called from the graphic thread.
+     */
+    bool updateScopeSnapshot( size_t waveIdx );
+
+    /**
+     * Returns the snapshot of the audio output of the wave grabbed by updateScopeSnapshot(). The snapshot is a copy taken
+     * by the audio thread, so it can be read safely. It is used in the graphic thread to draw the oscilloscope.
+     */
+    const std::vector< float >& getScopeSnapshot( size_t waveIdx ) const;
+
+    /** Number of frames of the oscilloscope snapshots of the wave */
+    size_t getScopeNumFrames( size_t waveIdx ) const;
+
+    /** Sets how the oscilloscope snapshots of every wave are aligned */
+    void setScopeTriggerMode( ScopeTapNode::TriggerMode mode );
+
+    /**
+     * Grabs the latest bands of the spectrum of the output. Returns false if the analyzer hasn't published new ones
+     * since the last call. Called from the graphic thread.
+     */
+    bool updateSpectrum() { return mSpectrumTapNode->update(); }
+
+    /** The bands of the spectrum grabbed by updateSpectrum(), from the lowest frequency, in [0, 1] */
+    const std::vector< float >& getSpectrum() const { return mSpectrumTapNode->getBands(); }
+
+    /**
+     * Called from the graphic thread. Polls the recorders and the input device for buffer overruns and underruns
+     * and asks the xrun monitor to dump a trace when one is found.
      */
-    const ci::audio::Buffer& getAudioOutputBuffer( size_t waveIdx ) const;
+    void checkXruns();
+
+    /** Returns the number of audio blocks that missed their deadline since the audio engine was set up */
+    size_t getNumDeadlineMisses() const;
+
+    /** Measures the key-to-sound latency of the notes */
+    LatencyProbe& getLatencyProbe() { return mLatencyProbe; }
+
+    /** Maps the host time onto the audio frames */
+    const ClockBridge& getClockBridge() const { return mClockBridge; }
+
+    /** Number of frames processed by the audio context, or rendered by renderOffline() when offline */
+    uint64_t getCurrentFrame() const;
+
+    size_t getFramesPerBlock() const;
+
+    /** Seed of the random offsets of the grains of wave 0, wave i uses seed + i */
+    uint32_t getRandomSeed() const { return mRandomSeed; }
+
+    /** Seeds the random offsets of the grains of all the waves again, from the next audio block */
+    void setRandomSeed( uint32_t seed );
+
+    /**
+     * Every engine call is reported to \a capture from now on, nullptr to stop. The notes sent from the MIDI threads
+     * are reported by them, the rest by the graphic thread. The capture must outlive the audio engine or be unset first.
+     */
+    void setCapture( ControlCapture *capture ) { mCapture.store( capture, std::memory_order_release ); }
+
+    /**
+     * Stops the audio device so that the waves can be rendered by hand with renderOffline(), on the calling thread.
+     * The messages sent to the waves are applied at the next rendered block as in real time.
+     */
+    void beginOffline();
+
+    /** Renders the next block of all the waves and mixes them into \a out, one channel. Returns the number of frames rendered */
+    size_t renderOffline( float *out );
+
+    /** Starts the audio device again */
+    void endOffline();
 
 private:
-    // nodes for mic input 
-    std::array< ci::audio::ChannelRouterNodeRef, NUM_WAVES > mInputRouterNodes;
-    // nodes for recording audio input into buffer. Also sends chunks information through 
-    // non-blocking queue 
-    std::array< BufferToWaveRecorderNodeRef, NUM_WAVES > mBufferRecorderNodes;
-    // pgranulars wrapped in a Cinder::Node 
-    std::array< PGranularNodeRef, NUM_WAVES > mPGranularNodes;
-
-    std::array< ci::audio::GainNodeRef, NUM_WAVES > mGainNodes;
-    std::array< ci::audio::ChannelRouterNodeRef, NUM_WAVES > mOutputRouterNodes;
-    // nodes to get the audio buffer scoped in the oscilloscope 
-    std::array< ci::audio::MonitorNodeRef, NUM_WAVES > mOutputMonitorNodes;
-    // nodes for lowpass filtering
-    std::array< cinder::audio::FilterLowPassNodeRef, NUM_WAVES> mLowPassFilterNodes;
-//    std::array< cinder::audio::FilterBandPassNodeRef, NUM_WAVES> mBandPassFilterNodes;
-
-    std::array< std::unique_ptr< RingBufferPack<CursorTriggerMsg> >, NUM_WAVES > mCursorTriggerRingBufferPacks;
+    // frame at which a note with the given host time is played 
+    uint64_t noteFrame( uint64_t timestamp ) const;
+
+    // report an engine call to the capture, if any. Frame 0 means the current frame 
+    void capture( controlstream::EngineCall call, size_t waveIdx, int arg = 0, double value = 0.0, uint64_t frame = 0 );
+    void captureFromMidi( size_t port, controlstream::EngineCall call, size_t waveIdx, int arg, uint64_t frame );
+
+    ci::audio::InputDeviceNodeRef mInputDeviceNode;
+
+    // audio graph and message queues of each wave 
+    std::vector< std::unique_ptr< WaveEngine > > mWaveEngines;
+
+    // renders the waves, possibly on several threads, and mixes them into the output 
+    WaveMixerNodeRef mWaveMixerNode;
+
+    // passes the output to the spectrum analyzer thread 
+    SpectrumTapNodeRef mSpectrumTapNode;
+
+    // watches the audio callback timing and keeps the post-mortem trace of the audio thread 
+    std::unique_ptr< XrunMonitor > mXrunMonitor;
+
+    LatencyProbe mLatencyProbe;
+
+    ClockBridge mClockBridge;
+    // delay added to the frame of the direct notes 
+    uint64_t mNoteSchedulingDelay = 0;
+
+    uint32_t mRandomSeed = 0;
+
+    std::atomic< ControlCapture* > mCapture;
+
+    // offline rendering, see beginOffline() 
+    bool mOffline;
+    uint64_t mOfflineFrame;
 
 };
@@ -52,6 +52,7 @@
 #include "cinder/Filesystem.h"
 
 #include "Messages.h"
+#include "OnsetIndex.h"
 
 typedef std::shared_ptr<class BufferToWaveRecorderNode> BufferToWaveRecorderNodeRef;
 
@@ -63,6 +64,7 @@ typedef ci::audio::dsp::RingBufferT<RecordWaveMsg> RecordWaveMsgRingBuffer;
  * This class is similar to \a cinder::audio::BufferRecorderNode (it's a derivative work of this class indeed) but it has an additional feature:
  * when recording, it uses the audio input samples to compute the size values of the visual chunks. 
  * The chunks values are stored in a ring buffer and fetched by the graphic thread to paint the wave as it gets recorded.
+ * In the same loop over the input samples it builds the index of the onsets of the recording, see collidoscope::OnsetIndex.
  *
  */
 class BufferToWaveRecorderNode : public ci::audio::SampleRecorderNode {
@@ -104,14 +106,23 @@ public:
     void writeToFile(const ci::fs::path &filePath, ci::audio::SampleType sampleType = ci::audio::SampleType::INT_16);
 
     //! Returns the frame of the last buffer overrun or 0 if none since the last time this method was called. When this happens, it means the recorded buffer probably has skipped some frames.
+    //! Filling the wave is the normal end of a recording: the frames coming after it are not an overrun.
     uint64_t getLastOverrun();
 
     //! returns a reference to the ring buffer when the size values of the chunks is stored, when a new wave is recorder
     RecordWaveMsgRingBuffer& getRingBuffer() { return mRingBuffer; }
 
+    //! \brief Copies \a numFrames samples into the recording buffer as if they had just been recorded, e.g. to restore a saved session.
+    //!
+    //! Must be called when the recorder is not recording. The chunks are not sent to the graphic thread.
+    void restore( const float *samples, size_t numFrames );
+
     //!returns a pointer to the buffer where the audio is recorder. This is used by the PGranular to create the granular synthesis 
     ci::audio::Buffer* getRecorderBuffer() { return &mRecorderBuffer; }
 
+    //! returns the index of the onsets of the recording, built as it gets recorded or restored. Read from any thread 
+    const collidoscope::OnsetIndex& getOnsetIndex() const { return mOnsetIndex; }
+
 
 protected:
     void initialize()               override;
@@ -125,6 +136,8 @@ protected:
     ci::audio::BufferDynamic        mRecorderBuffer;
     ci::audio::BufferDynamicRef     mCopiedBuffer;
     std::atomic<uint64_t>   mLastOverrun;
+    // true from start() until the wave is filled or stop() is called
+    std::atomic<bool>       mRecording;
 
     RecordWaveMsgRingBuffer mRingBuffer;
 
@@ -137,6 +150,8 @@ protected:
     float mChunkMaxAudioVal;
     float mChunkMinAudioVal;
 
+    collidoscope::OnsetIndex mOnsetIndex;
+
     float mEnvRamp;
     float mEnvRampRate;
     size_t mEnvRampLen;
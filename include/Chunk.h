@@ -25,7 +25,6 @@
 #pragma once
 
 #include "cinder/Color.h"
-#include "cinder/gl/Batch.h"
 
 class DrawInfo;
 
@@ -77,20 +76,29 @@ public:
     }
 
     /**
-     * Called in the graphic loop. It update this chunk. 
+     * Called in the graphic loop. It update this chunk. Returns true if the chunk changed its height.
      */ 
-    void update( const DrawInfo& di );
+    bool update( const DrawInfo& di );
 
     /**
-     * Called in the graphic loop. It draws this chunk. 
+     * Places this chunk on the x-axis. Called when the window size changes.
      */ 
-    void draw( const DrawInfo& di, ci::gl::BatchRef &batch );
+    void layout( const DrawInfo& di );
 
     /**
-     * Called in the graphic loop. It draws this chunk all the way to the bottom of the screen. 
-     * This method is called when the chunk is the first or last in a selection. 
+     * Returns the x of the left side of this chunk, in wave coordinates. Updated in update().
      */ 
-    void drawBar( const DrawInfo& di, ci::gl::BatchRef &batch );
+    float getX() const { return mX; }
+
+    /**
+     * Returns the height in pixels this chunk is drawn with, according to its top value and animation.
+     */ 
+    float getHeight( const DrawInfo& di ) const;
+
+    /**
+     * Returns whether this chunk is still growing or shrinking.
+     */ 
+    bool isAnimating() const { return mResetting || mAnimate < 1.0f; }
 
     /**
      * Informs this chunk that it's the first chunk of the selection.
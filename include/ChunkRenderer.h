@@ -0,0 +1,91 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/Color.h"
+#include "cinder/gl/gl.h"
+#include "cinder/gl/Batch.h"
+
+#include <vector>
+
+/**
+ * Draws the chunks of a wave with one instanced draw call.
+ *
+ * Every chunk (or selection bar) drawn in a frame is an instance made of its x position, its height and its color.
+ * The instances are added with add() in drawing order, uploaded to the GPU once per frame and drawn all at once by draw(),
+ * so that the CPU time spent drawing doesn't depend on the number of chunks.
+ */
+class ChunkRenderer
+{
+public:
+
+    /** Per-instance data, as laid out in the instance buffer */
+    struct Instance
+    {
+        float x;
+        float height;
+        ci::ColorA color;
+    };
+
+    /**
+     * Constructor, takes as argument the maximum number of instances drawn in a frame
+     */
+    ChunkRenderer( size_t maxInstances );
+
+    /** no copies */
+    ChunkRenderer( const ChunkRenderer &copy ) = delete;
+    ChunkRenderer & operator=(const ChunkRenderer &copy) = delete;
+
+    /** Removes all the instances added so far. Called at the beginning of each frame */
+    void clear() { mNumInstances = 0; }
+
+    /**
+     * Adds a chunk of width Chunk::kWidth, placed at \a x and centered vertically at the wave center.
+     * Instances beyond the maximum are ignored.
+     */
+    void add( float x, float height, const ci::ColorA &color )
+    {
+        if ( mNumInstances == mInstances.size() )
+            return;
+
+        Instance &instance = mInstances[mNumInstances++];
+        instance.x = x;
+        instance.height = height;
+        instance.color = color;
+    }
+
+    /**
+     * Uploads the instances and draws them with one draw call. \a waveCenterY is the y the chunks are centered on.
+     * The blending is left to the caller.
+     */
+    void draw( float waveCenterY );
+
+private:
+
+    std::vector< Instance > mInstances;
+
+    size_t mNumInstances;
+
+    ci::gl::VboRef mInstanceVbo;
+
+    ci::gl::BatchRef mBatch;
+};
@@ -0,0 +1,102 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+
+/**
+ * Maps the host clock (LatencyProbe::now(), nanoseconds of the steady clock) onto the frame counter of the audio context.
+ *
+ * The audio thread calls blockBegin() at every block with the number of frames processed so far. The time the callback
+ * is called jitters, so the host time of each block is filtered through a delay-locked loop, which also estimates
+ * the actual duration of a frame in host time: the drift between the audio device clock and the host clock.
+ *
+ * The filtered (frame, time, frame duration) triple is published with a sequence lock, so that the MIDI threads
+ * can call hostToFrame() at any time without locking the audio thread.
+ */
+class ClockBridge
+{
+public:
+
+    ClockBridge();
+
+    // no copies
+    ClockBridge( const ClockBridge &copy ) = delete;
+    ClockBridge & operator=(const ClockBridge &copy) = delete;
+
+    /** Called from the audio thread at the beginning of each block. \a hostNs is the current LatencyProbe::now() */
+    void blockBegin( std::uint64_t frame, std::size_t numFrames, std::size_t sampleRate, std::uint64_t hostNs );
+
+    /** Returns the audio frame corresponding to the host time passed as argument. Returns 0 until the first block is processed */
+    std::uint64_t hostToFrame( std::uint64_t hostNs ) const;
+
+    /** Drift of the audio device clock with respect to the host clock, in parts per million */
+    double getDriftPpm() const;
+
+private:
+
+    // delay-locked loop state, audio thread only
+    bool mLocked;
+    double mDllTime;       // filtered host time of the current block
+    double mDllNextTime;   // predicted host time of the next block
+    double mDllPeriod;     // filtered duration of one block
+    double mDllB;
+    double mDllC;
+    double mNominalFrameNs;
+    std::uint64_t mLastFrame;
+
+    // published mapping. mSequence is odd while the audio thread is writing
+    std::atomic< std::uint32_t > mSequence;
+    std::atomic< std::uint64_t > mPublishedFrame;
+    std::atomic< double > mPublishedTime;
+    std::atomic< double > mPublishedFrameNs;
+    std::atomic< double > mPublishedNominalFrameNs;
+};
+
+
+/**
+ * Turns the RtMidi delta times of one MIDI input port into host time.
+ *
+ * RtMidi gives the time elapsed since the previous message of the port, which comes from the driver time stamps.
+ * Their sum is the MIDI time of the port. The offset between the MIDI time and the host time at which the callback
+ * is called is the transport delay plus scheduling jitter. The smallest offset is the best estimate of the transport delay,
+ * so the filter follows new minima immediately and lets the estimate rise slowly to follow clock drift.
+ *
+ * Used by the MIDI thread of the port only.
+ */
+class MidiPortClock
+{
+public:
+
+    MidiPortClock();
+
+    /** Returns the host time of a message received now, given the RtMidi delta time of the message in seconds */
+    std::uint64_t messageTime( double deltaTime, std::uint64_t hostNow );
+
+private:
+    bool mStarted;
+    std::uint64_t mFirstHostTime;
+    double mMidiTime;   // seconds since the first message
+    double mOffset;     // estimated host time - midi time, in nanoseconds
+};
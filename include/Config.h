@@ -22,7 +22,11 @@
 #pragma once
 
 #include <string>
-#include <array>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cmath>
 #include "cinder/Color.h"
 #include "cinder/Xml.h"
 
@@ -51,6 +55,55 @@ public:
         return mAudioInputDeviceKey; 
     }
 
+    /**
+     * Returns the number of waves, that is the number of performers playing at the same time. 
+     */ 
+    std::size_t getNumWaves() const
+    {
+        return mNumWaves;
+    }
+
+    /** Sets the number of waves. Must be called before the audio engine and the graphics are set up */
+    void setNumWaves( std::size_t numWaves );
+
+    /** Maximum number of particles alive at the same time in each wave */
+    std::size_t getMaxParticles() const
+    {
+        return mMaxParticles;
+    }
+
+    /** Sets the maximum number of particles. Must be called before the graphics are set up */
+    void setMaxParticles( std::size_t maxParticles ) { mMaxParticles = std::max< std::size_t >( 1, maxParticles ); }
+
+    /**
+     * Returns the maximum number of threads rendering the waves' audio, the audio thread included.
+     * The waves are spread over the threads so that each wave's graph can run on its own core.
+     */ 
+    std::size_t getMaxWaveRenderThreads() const
+    {
+        const std::size_t numCores = std::thread::hardware_concurrency();
+        // leave one core to the graphic thread 
+        return std::max< std::size_t >( 1, numCores > 1 ? numCores - 1 : 1 );
+    }
+
+    /**
+     * Fraction of the audio block duration the audio thread waits for the render threads.
+     * The waves a late render thread has not started yet are then rendered by the audio thread itself.
+     */
+    double getWaveRenderWaitFraction() const
+    {
+        return 0.5;
+    }
+
+    /**
+     * Fraction of the audio block duration a render thread spins waiting for the next block, once done with its waves.
+     * After that it sleeps until the audio thread wakes it up.
+     */
+    double getWaveRenderSpinFraction() const
+    {
+        return 0.1;
+    }
+
     /**
      * Returns number of chunks in a wave 
      */ 
@@ -73,9 +126,14 @@ public:
         if (waveIdx == 0){
             return cinder::Color(243.0f / 255.0f, 6.0f / 255.0f, 62.0f / 255.0f);
         }
-        else{
+        else if (waveIdx == 1){
             return cinder::Color(255.0f / 255.0f, 204.0f / 255.0f, 0.0f / 255.0f);
         }
+        else{
+            // the other waves step around the hue circle by the golden ratio, so that no two get the same color
+            const float hue = std::fmod( 0.13f + float( waveIdx - 1 ) * 0.618034f, 1.0f );
+            return cinder::Color( cinder::CM_HSV, hue, 0.9f, 1.0f );
+        }
     }
 
     /**
@@ -86,10 +144,153 @@ public:
         return 512;
     }
 
-    /** returns the index of the wave associated to the MIDI channel passed as argument */
-    size_t getWaveForMIDIChannel( unsigned char channelIdx )
+    /**
+     * The size of the lock-free queue of each MIDI input port. Events coming when the queue is full are dropped
+     */ 
+    std::size_t getMIDIQueueSize() const
+    {
+        return 1024;
+    }
+
+    /**
+     * Maximum number of MIDI input ports whose notes go straight to the audio thread.
+     * The notes of the other ports go through the graphic thread.
+     */ 
+    std::size_t getMaxMIDIPorts() const
     {
-        return channelIdx;
+        return 8;
+    }
+
+    /**
+     * Notes coming straight from MIDI are played this many audio blocks after the time they were received,
+     * so that the distance between notes is kept even when it's smaller than a block.
+     */ 
+    std::size_t getMIDISchedulingDelay() const
+    {
+        return 1;
+    }
+
+    /**
+     * Seed of the random offsets of the grains. Wave i uses seed + i. Captured sessions are replayed with the seed they were captured with
+     */ 
+    uint32_t getRandomSeed() const
+    {
+        return 5489;
+    }
+
+    /**
+     * Maximum density of the grains when they are scheduled by density rather than by the selection size, in grains per second
+     */ 
+    double getMaxGrainDensity() const
+    {
+        return 1000.0;
+    }
+
+    /**
+     * Jitter of the onsets of the grains scheduled by density, in [0, 1]. 
+     * Each interval between two onsets is the mean interval times a random factor in [1 - jitter, 1 + jitter]
+     */ 
+    double getGrainJitter() const
+    {
+        return 0.5;
+    }
+
+    /**
+     * Duration of the grains scheduled by density, in seconds. It's multiplied by the grain duration coefficient
+     */ 
+    double getGrainTime() const
+    {
+        return 0.05;
+    }
+
+    /**
+     * The grains start at the closest onset of the recording within this time of where they would start, if there is one. 
+     * In seconds, 0 to start the grains anywhere
+     */ 
+    double getGrainOnsetSnapTime() const
+    {
+        return 0.01;
+    }
+
+    /**
+     * The start of a selection moves to the first onset in its first chunk, if there is one
+     */ 
+    bool getSnapSelectionToOnsets() const
+    {
+        return true;
+    }
+
+    /**
+     * Number of output channels each wave spreads its grains over. 0 or 1 is mono, each wave goes into one output channel.
+     * 2 is stereo, more channels are a ring of speakers. It can't be more than the output channels of the device
+     */ 
+    size_t getNumSpatialChannels() const
+    {
+        return 0;
+    }
+
+    /** How the grains of a wave are panned when getNumSpatialChannels() is 2 or more */
+    enum class GrainPanMode
+    {
+        RANDOM, // every grain at a random position around the wave position
+        VOICE   // the voices of the wave at fixed positions around the wave position
+    };
+
+    GrainPanMode getGrainPanMode() const
+    {
+        return GrainPanMode::RANDOM;
+    }
+
+    /**
+     * Width of the grain positions around the wave position. With two channels 1 is the whole stereo field, 
+     * with more channels 1 is the whole ring
+     */ 
+    double getGrainPanSpread() const
+    {
+        return 0.25;
+    }
+
+    /**
+     * Number of control events each thread can report between two writes of the control capture to disk
+     */ 
+    size_t getControlCaptureQueueSize() const
+    {
+        return 1024;
+    }
+
+    /**
+     * Error budgets of the optimized granular synthesizer with respect to the reference one, see GranularComparison.
+     * Max and rms errors are in sample amplitude, the spectral error in dB
+     */ 
+    double getGranularMaxErrorBudget() const
+    {
+        return 1.0e-4;
+    }
+
+    double getGranularRmsErrorBudget() const
+    {
+        return 1.0e-5;
+    }
+
+    double getGranularSpectralErrorBudget() const
+    {
+        return -80.0;
+    }
+
+    /** Duration of the scenario rendered by the granular comparison, in seconds */
+    double getGranularComparisonDuration() const
+    {
+        return 30.0;
+    }
+
+    /** returns the index of the wave associated to the MIDI channel passed as argument. Channels not associated to any wave go to wave 0 */
+    size_t getWaveForMIDIChannel( unsigned char channelIdx ) const
+    {
+        for ( size_t i = 0; i < mNumWaves; i++ ){
+            if ( mMidiChannels[i] == channelIdx )
+                return i;
+        }
+        return 0;
     }
 
     double getMaxGrainDurationCoeff() const
@@ -102,6 +303,18 @@ public:
         return 22050.;
     }
 
+    /** Pitch bend of the wheel all the way up or down, in semitones */
+    double getPitchBendRange() const
+    {
+        return 2.0;
+    }
+
+    /** Glide time with the portamento knob all the way up, in seconds */
+    double getMaxGlideTime() const
+    {
+        return 1.0;
+    }
+
     double getMinFilterCutoffFreq() const
     {
         return 200.;
@@ -130,13 +343,131 @@ public:
         return 4;
     }
 
+    /**
+     * Maximum number of points of the oscilloscope, whatever the size of the audio output buffer. 
+     * With larger buffers each point represents more samples.
+     */ 
+    size_t getOscilloscopeMaxNumPoints() const
+    {
+        return 512;
+    }
+
+    /**
+     * Size of the FFT of the spectrum analyzer of the output, a power of two. 
+     * The analyzer takes an FFT every getSpectrumFftSize() / getSpectrumOverlap() samples
+     */ 
+    size_t getSpectrumFftSize() const
+    {
+        return 2048;
+    }
+
+    size_t getSpectrumOverlap() const
+    {
+        return 4;
+    }
+
+    /**
+     * Number of bars of the spectrum view, spaced logarithmically in frequency
+     */ 
+    size_t getSpectrumNumBands() const
+    {
+        return 64;
+    }
+
+    /**
+     * Time the bars of the spectrum take to fall after the sound stops, in seconds
+     */ 
+    double getSpectrumReleaseTime() const
+    {
+        return 0.3;
+    }
+
+    /**
+     * Frame rate of the graphics. In adaptive frame mode it's the frame rate while something is moving on the screen
+     */ 
+    float getTargetFrameRate() const
+    {
+        return 60.0f;
+    }
+
+    /**
+     * Frame rate of the graphics in adaptive frame mode when nothing is moving on the screen
+     */ 
+    float getIdleFrameRate() const
+    {
+        return 10.0f;
+    }
+
+    /**
+     * Size in bytes over which the file of the real-time logger is rotated
+     */ 
+    size_t getRtLogMaxFileSize() const
+    {
+        return 1024 * 1024;
+    }
+
+    /**
+     * Number of files of the real-time logger kept on disk, the current one included
+     */ 
+    size_t getRtLogNumFiles() const
+    {
+        return 3;
+    }
+
+    /**
+     * Maximum number of threads logging through the real-time logger. Audio, wave render and MIDI threads each need one
+     */ 
+    size_t getRtLogMaxThreads() const
+    {
+        return 16;
+    }
+
+    /**
+     * Number of records each thread can log between two writes of the real-time logger to disk
+     */ 
+    size_t getRtLogRingSize() const
+    {
+        return 1024;
+    }
+
+    /**
+     * Number of audio blocks and number of audio thread events kept in the post-mortem trace
+     * that is written to disk when an audio glitch is detected.
+     */
+    size_t getXrunTraceNumBlocks() const
+    {
+        return 128;
+    }
+
+    size_t getXrunTraceNumEvents() const
+    {
+        return 1024;
+    }
+
+    /**
+     * An audio block is considered late (deadline miss) when it comes after more than
+     * getXrunToleranceCoeff() times the duration of a block.
+     */
+    double getXrunToleranceCoeff() const
+    {
+        return 1.5;
+    }
+
+    /** Prefix of the path of the trace files written when an audio glitch is detected */
+    std::string getXrunTraceFilePrefix() const
+    {
+        return "./collidoscope_xrun_";
+    }
+
 private:
 
     void parseWave( const ci::XmlTree &wave, int id );
 
     std::string mAudioInputDeviceKey;
+    std::size_t mNumWaves;
+    std::size_t mMaxParticles;
     std::size_t mNumChunks;
     double mWaveLen;
-    std::array< size_t, NUM_WAVES > mMidiChannels; 
+    std::vector< size_t > mMidiChannels; 
 
 };
@@ -0,0 +1,233 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "RingBufferPack.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+class AudioEngine;
+
+/**
+ * Control streams: a binary capture of the control events of a performance, that can be replayed later
+ * to get a real-world workload for benchmarking and profiling.
+ *
+ * A stream is a header followed by chunks. Event chunks hold ControlEvent records, recording chunks hold the content
+ * of a wave recorder buffer together with the frame it refers to, e.g. the frame at which a recording was started.
+ */
+namespace controlstream {
+
+    /** Where the event comes from */
+    enum class Source : std::uint8_t {
+        KNOB,   // a Knob event from MIDI::checkMessages(). type = Knob type, arg = port << 16 | channel << 8 | number
+        KEY,    // a key pressed on the keyboard. arg = character
+        ENGINE  // a call to the AudioEngine. type = EngineCall
+    };
+
+    /** AudioEngine calls. Only these are replayed: the knob and key events are kept to tell where the calls came from */
+    enum class EngineCall : std::uint8_t {
+        RECORD,
+        LOOP_ON,
+        LOOP_OFF,
+        NOTE_ON,          // arg = midi note. Applied at the beginning of the block
+        NOTE_OFF,         // arg = midi note. Applied at the beginning of the block
+        NOTE_ON_AT,       // arg = midi note. Applied at the exact frame of the event
+        NOTE_OFF_AT,      // arg = midi note. Applied at the exact frame of the event
+        SELECTION_SIZE,   // value = size in samples
+        SELECTION_START,  // value = start in samples
+        GRAIN_DURATION,   // value = grain duration coefficient
+        FILTER_CUTOFF,    // value = cutoff frequency in Hz
+        GAIN,             // value = gain
+        RESTORE,          // the recording of the wave was restored, e.g. from the saved session
+        PITCH_BEND,       // value = bend in semitones
+        GLIDE_TIME,       // value = glide time in seconds
+        GRAIN_DENSITY,    // value = grains per second, 0 for one grain every selection size
+        GRAIN_JITTER,     // value = jitter of the grain onsets in [0, 1]
+        GRAIN_TIME        // value = duration of the grains scheduled by density, in seconds
+    };
+
+    /** One event of the stream */
+    struct ControlEvent
+    {
+        std::uint64_t frame;    // audio frame at which the event was applied
+        double value;
+        std::int32_t arg;
+        std::uint16_t waveIdx;
+        Source source;
+        std::uint8_t type;
+    };
+
+    /** Utility function to create a new ControlEvent */
+    inline ControlEvent makeControlEvent( Source source, std::uint8_t type, std::uint64_t frame, std::size_t waveIdx = 0, std::int32_t arg = 0, double value = 0.0 )
+    {
+        ControlEvent event;
+
+        event.frame = frame;
+        event.value = value;
+        event.arg = arg;
+        event.waveIdx = std::uint16_t( waveIdx );
+        event.source = source;
+        event.type = type;
+
+        return event;
+    }
+
+    /** Content of a wave recorder buffer, applied at a given frame */
+    struct Recording
+    {
+        std::uint64_t frame;
+        std::size_t waveIdx;
+        std::vector< float > samples;
+    };
+
+}
+
+
+/**
+ * Captures the control stream to a file.
+ *
+ * The events are written into lock-free queues: one for the graphic thread, which reports the knob, key and engine calls,
+ * and one for each MIDI input port, which report the notes sent straight to the audio engine.
+ * A background thread drains the queues into the file.
+ *
+ * The audio input is captured as recordings: when a wave is restored, or finishes a recording started during the capture,
+ * the writer thread copies its buffer into the stream, at the frame of the RESTORE or RECORD call.
+ * The recordings present when the capture starts are written at the start frame.
+ */
+class ControlCapture
+{
+public:
+
+    /** \a numMidiPorts is the number of MIDI ports that can report notes through writeFromMidi() */
+    ControlCapture( std::size_t numMidiPorts, std::size_t queueSize );
+
+    ~ControlCapture();
+
+    // no copies
+    ControlCapture( const ControlCapture &copy ) = delete;
+    ControlCapture & operator=(const ControlCapture &copy) = delete;
+
+    /** Opens the file and starts the writer thread. Returns false if the file can't be opened */
+    bool start( const std::string &path, AudioEngine &audioEngine, std::uint32_t randomSeed );
+
+    /** Writes the remaining events and closes the file */
+    void stop();
+
+    bool isRunning() const { return mRunning; }
+
+    /** Reports an event from the graphic thread. Returns false if the queue is full */
+    bool write( const controlstream::ControlEvent &event );
+
+    /** Reports an engine call from the MIDI thread of \a port. Returns false if the queue is full */
+    bool writeFromMidi( std::size_t port, const controlstream::ControlEvent &event );
+
+    /** Number of events dropped because a queue was full */
+    std::size_t getNumDropped() const { return mNumDropped; }
+
+private:
+
+    void run();
+
+    // drains the queues into the file and writes the finished recordings. Writer thread only
+    void drain();
+
+    void writeRecording( std::uint64_t frame, std::size_t waveIdx, std::size_t numFrames );
+
+    std::vector< std::unique_ptr< RingBufferPack< controlstream::ControlEvent > > > mQueues;
+
+    std::FILE *mFile;
+    AudioEngine *mAudioEngine;
+
+    // frame of the RECORD call of the recordings in progress, kNoRecording if none. Writer thread only
+    static const std::uint64_t kNoRecording = ~std::uint64_t( 0 );
+    std::vector< std::uint64_t > mRecordingFrames;
+
+    std::atomic< std::size_t > mNumDropped;
+    std::atomic< bool > mRunning;
+    std::thread mThread;
+};
+
+
+/**
+ * Replays a captured control stream, driving the audio engine with the captured engine calls and recordings.
+ *
+ * In real time, update() is called every graphic frame and sends the calls that are due. Notes captured with their
+ * exact frame are sent a tenth of a second ahead and scheduled at that frame, the others are applied at the next block as they were
+ * when captured. Offline, runOffline() stops the audio device and renders the waves block by block on the calling
+ * thread: with the seed of the capture the output is the same at every run.
+ *
+ * The recording of a wave is applied all at once at the frame of its RECORD call.
+ */
+class ControlReplayer
+{
+public:
+
+    ControlReplayer();
+
+    /** Loads a stream written by ControlCapture. Returns false if it can't be read */
+    bool load( const std::string &path );
+
+    std::size_t getNumEvents() const { return mEvents.size(); }
+
+    /** Starts the real-time replay, from the current frame of the audio engine */
+    void start( AudioEngine &audioEngine );
+
+    /** Sends the calls due by now. Called from the graphic thread. Returns false once the whole stream has been sent */
+    bool update( AudioEngine &audioEngine );
+
+    bool isRunning() const { return mRunning; }
+
+    /**
+     * Replays the whole stream offline, as fast as possible, and returns a report with the rendering time
+     * and a hash of the output. The replay fails if any real-time safety violation is counted while rendering.
+     * The audio device is started again before returning
+     */
+    std::string runOffline( AudioEngine &audioEngine );
+
+private:
+
+    // applies the calls and recordings due by \a frame and sends the scheduled notes due by \a noteFrame, both in stream time.
+    // Returns false when the stream is over
+    bool applyDue( AudioEngine &audioEngine, std::int64_t frame, std::int64_t noteFrame );
+
+    std::uint32_t mRandomSeed;
+    std::uint64_t mStartFrame;   // frame of the audio context when the capture started
+    std::uint64_t mEndFrame;     // frame of the last event
+    std::size_t mNumWaves;
+
+    std::vector< controlstream::ControlEvent > mEvents;
+    std::vector< controlstream::Recording > mRecordings;
+
+    // next event to apply, next scheduled note to send and next recording to restore
+    std::size_t mNextEvent;
+    std::size_t mNextNote;
+    std::size_t mNextRecording;
+
+    bool mRunning;
+    std::int64_t mFrameOffset;  // audio context frame - stream frame
+};
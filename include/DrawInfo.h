@@ -35,10 +35,12 @@ class DrawInfo
 public:
 
     /**
-     * Constructor. Takes the index of the wave as argument.
+     * Constructor. Takes the index of the wave and the total number of waves as argument.
+     * The screen is split in one horizontal tier per wave, with wave 0 at the bottom.
      */ 
-    DrawInfo( size_t waveIndex ):
+    DrawInfo( size_t waveIndex, size_t numWaves ):
         mWaveIndex( waveIndex ),
+        mNumWaves( numWaves ),
         mWindowWidth(0),
         mWindowHeight(0),
         mSelectionBarHeight(0),
@@ -53,7 +55,7 @@ public:
     {
         mWindowWidth = bounds.getWidth();
         mWindowHeight = bounds.getHeight();
-        mSelectionBarHeight = mWindowHeight / NUM_WAVES;
+        mSelectionBarHeight = mWindowHeight / int32_t( mNumWaves );
         mShrinkFactor = shrinkFactor;
     }
 
@@ -92,21 +94,29 @@ public:
      */ 
     int32_t getWaveCenterY() const
     {
+        const int32_t numWaves = int32_t( mNumWaves );
         if ( mWaveIndex == 0 )
-            return mWindowHeight - ( mWindowHeight / ( 2 * NUM_WAVES ) ) + 1;
+            return mWindowHeight - ( mWindowHeight / ( 2 * numWaves ) ) + 1;
         else
-            return mWindowHeight / (NUM_WAVES * 2);
+            return mWindowHeight - ( ( 2 * int32_t( mWaveIndex ) + 1 ) * mWindowHeight ) / ( 2 * numWaves );
     }
 
     /**
      * Flips y according to the index of the wave. It is needed because the second wave in collidoscope is drawn upside down in the screen.
+     * Waves other than the first are also moved into their own tier.
      */ 
     int flipY(int y) const 
     {
         if ( mWaveIndex == 0)
             return mWindowHeight - y;
         else
-            return y;
+            return y + getTierTop();
+    }
+
+    /** Returns the y of the top of this wave's tier */
+    int32_t getTierTop() const
+    {
+        return mWindowHeight - ( int32_t( mWaveIndex ) + 1 ) * mWindowHeight / int32_t( mNumWaves );
     }
 
     /**
@@ -143,6 +153,7 @@ public:
 
 private:
     const size_t mWaveIndex;
+    const size_t mNumWaves;
 
     int32_t mWindowHeight;
     int32_t mWindowWidth;
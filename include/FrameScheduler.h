@@ -0,0 +1,107 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+
+/**
+ * Paces the graphic loop of the app, so that update() and draw() don't spin as fast as possible.
+ *
+ * Modes:
+ *  - VSYNC: frames are paced by the vertical sync of the display.
+ *  - FIXED: frames run at the target frame rate.
+ *  - ADAPTIVE: frames run at the target frame rate while something is moving on the screen and drop to the idle
+ *    frame rate after a short time with nothing to animate. wake() brings back the target frame rate at once.
+ *
+ * The scheduler also keeps statistics of the frame interval and of the time spent in update() and draw().
+ * All the methods but wake() must be called from the main thread.
+ */
+class FrameScheduler
+{
+public:
+
+    enum class Mode
+    {
+        VSYNC,
+        FIXED,
+        ADAPTIVE
+    };
+
+    FrameScheduler();
+
+    // no copies
+    FrameScheduler( const FrameScheduler &copy ) = delete;
+    FrameScheduler & operator=(const FrameScheduler &copy) = delete;
+
+    /** Sets the mode and the frame rates, and applies them to the app */
+    void setup( Mode mode, float targetFrameRate, float idleFrameRate );
+
+    void setMode( Mode mode );
+
+    Mode getMode() const { return mMode; }
+
+    /** Called at the beginning of update() */
+    void frameBegin();
+
+    /** Called at the end of draw(). \a animating is whether anything on the screen is moving or has changed in this frame */
+    void frameEnd( bool animating );
+
+    /**
+     * In adaptive mode, brings the frame rate back to the target as soon as possible.
+     * Can be called from any thread. It allocates at most once per idle period, so it's not for the audio thread.
+     */
+    void wake();
+
+    /** Clears the statistics */
+    void resetStats();
+
+    /** Returns a one line summary of the frame statistics */
+    std::string getReport() const;
+
+private:
+
+    // switches between target and idle frame rate in adaptive mode 
+    void setActive( bool active );
+
+    Mode mMode;
+    float mTargetFrameRate;
+    float mIdleFrameRate;
+
+    // whether the adaptive mode is running at the target frame rate
+    std::atomic< bool > mActive;
+    // whether a wake up has been dispatched to the main thread and not run yet
+    std::atomic< bool > mWakePending;
+    // consecutive frames with nothing to animate
+    std::uint32_t mNumIdleFrames;
+
+    // statistics, main thread only
+    std::uint64_t mFrameBeginNs;
+    std::uint64_t mNumFrames;
+    std::uint64_t mNumIdleRateFrames;
+    std::uint64_t mSumIntervalNs;
+    std::uint64_t mMaxIntervalNs;
+    std::uint64_t mSumWorkNs;
+    std::uint64_t mMaxWorkNs;
+};
@@ -0,0 +1,109 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+/**
+ * Numeric check of the optimized granular synthesizer against the reference one.
+ *
+ * run() renders the same seeded scenario through PGranular (float samples, the one used by the audio engine) and
+ * through PGranularReference (double samples and arithmetic), then compares the two outputs:
+ *  - max error: largest absolute difference of one sample
+ *  - rms error: rms of the difference over the whole render
+ *  - spectral error: energy of the difference of the magnitude spectra relative to the energy of the reference spectra,
+ *    in dB, over the frames with sound. Also reported for the worst frame.
+ *
+ * The scenario is a synthetic recording (harmonic partials and noise) played by a note that changes pitch, selection,
+ * grain duration and pitch bend every few blocks, with glides, note offs and silences in between. Both synthesizers get the same
+ * parameter changes at the same blocks and draw their random offsets from generators with the same seed.
+ *
+ * PGranular renders inside a RT_SAFETY_SCOPE: the real-time safety violations counted during the render are reported too.
+ *
+ * An optimization of PGranular is accepted when the three errors are within the budgets passed to run()
+ * and the render caused no real-time safety violation.
+ */
+class GranularComparison
+{
+public:
+
+    /** Error budgets: the maximum errors for an optimization to be accepted */
+    struct Budgets
+    {
+        double maxError;
+        double rmsError;
+        double spectralErrorDb;
+    };
+
+    GranularComparison( std::uint32_t seed, std::size_t sampleRate, std::size_t framesPerBlock );
+
+    /**
+     * Renders \a numSeconds of the scenario through both synthesizers and compares them.
+     * Returns true if the errors are within \a budgets and no real-time safety violation was counted during the render
+     */
+    bool run( double numSeconds, const Budgets &budgets );
+
+    double getMaxError() const { return mMaxError; }
+
+    double getRmsError() const { return mRmsError; }
+
+    /** Spectral error over the whole render, in dB */
+    double getSpectralErrorDb() const { return mSpectralErrorDb; }
+
+    /** Number of real-time safety violations counted during the render */
+    std::size_t getNumRtViolations() const { return mNumRtViolations; }
+
+    /** Report of the last run(): errors, budgets and the time spent in each synthesizer */
+    std::string getReport() const;
+
+private:
+
+    // renders the scenario through both synthesizers into mOutput and mReferenceOutput
+    void render( std::size_t numFrames );
+
+    void compare();
+
+    const std::uint32_t mSeed;
+    const std::size_t mSampleRate;
+    const std::size_t mFramesPerBlock;
+
+    std::vector< float > mOutput;
+    std::vector< double > mReferenceOutput;
+
+    Budgets mBudgets;
+    bool mPassed;
+
+    double mMaxError;
+    std::size_t mMaxErrorFrame;
+    double mRmsError;
+    double mSpectralErrorDb;
+    double mWorstFrameSpectralErrorDb;
+    std::size_t mNumSpectralFrames;
+    std::size_t mNumRtViolations;
+
+    // time spent rendering, in nanoseconds
+    std::uint64_t mRenderNs;
+    std::uint64_t mReferenceRenderNs;
+};
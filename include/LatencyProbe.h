@@ -0,0 +1,71 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+
+/**
+ * Measures the key-to-sound latency of the notes.
+ *
+ * Note messages are stamped with LatencyProbe::now() when the MIDI callback receives them. When the audio thread
+ * applies a note it records the time elapsed since the stamp. The latency reported adds the duration of one audio block,
+ * which is the time it takes for the block being processed to be handed to the audio device.
+ * The latency of the audio device itself is not included.
+ *
+ * recordNote() can be called concurrently by the audio thread and the wave render threads. It doesn't lock or allocate.
+ */
+class LatencyProbe
+{
+public:
+
+    LatencyProbe();
+
+    // no copies
+    LatencyProbe( const LatencyProbe &copy ) = delete;
+    LatencyProbe & operator=(const LatencyProbe &copy) = delete;
+
+    /** Time stamp of the notes, in nanoseconds of the steady clock */
+    static std::uint64_t now();
+
+    /** Sets the duration of one audio block, added to every measured latency */
+    void setBlockDuration( double seconds );
+
+    /** Called from the audio thread when a note stamped with \a timestamp is applied. Timestamp 0 means not stamped */
+    void recordNote( std::uint64_t timestamp );
+
+    /** Clears the statistics */
+    void reset();
+
+    /** Returns a one line summary: number of notes, min, average and max latency in milliseconds */
+    std::string getReport() const;
+
+private:
+    std::atomic< std::uint64_t > mBlockDurationNs;
+
+    std::atomic< std::uint64_t > mNumNotes;
+    std::atomic< std::uint64_t > mSumNs;
+    std::atomic< std::uint64_t > mMinNs;
+    std::atomic< std::uint64_t > mMaxNs;
+};
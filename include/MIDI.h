@@ -22,24 +22,31 @@
 #pragma once
 
 #include "RtMidi.h"
+#include "RingBufferPack.h"
+#include "ClockBridge.h"
 #include <memory>
-#include <mutex>
+#include <atomic>
+#include <vector>
+#include <cstdint>
 #include <array>
 
 class Config;
+class AudioEngine;
+class FrameScheduler;
 
 
-class Knob
+/**
+ * A control event coming from the MIDI input devices.
+ * It's a POD so that it goes through the lock-free queues between the MIDI threads and the graphic thread
+ * without any heap allocation.
+ */
+struct Knob
 {
-public:
     int mType;
-    float mValue;
-    
-    Knob( int type, float value = 0.f ) :
-    mType(type),
-    mValue(value)
-    {
-    }
+    float mValue;          // normalized controller value, [-1, 1] for PITCHBEND, or note number for NOTEON/NOTEOFF
+    std::uint8_t mPort;    // index of the MIDI input port the event came from
+    std::uint8_t mChannel; // MIDI channel [0, 15]
+    std::uint8_t mNumber;  // controller number, or note number for NOTEON/NOTEOFF
     
     enum {
         NOTEON,
@@ -50,10 +57,30 @@ public:
         FILTERFREQ,
         DURATION,
         GAIN,
-        SELECTIONSTART
+        SELECTIONSTART,
+        PITCHBEND,
+        GLIDE,
+        DENSITY,
+        JITTER
     };
 };
 
+/**
+ * Utility function to create a new Knob.
+ */
+inline Knob makeKnob( int type, float value, std::uint8_t port, std::uint8_t channel, std::uint8_t number )
+{
+    Knob knob;
+
+    knob.mType = type;
+    knob.mValue = value;
+    knob.mPort = port;
+    knob.mChannel = channel;
+    knob.mNumber = number;
+
+    return knob;
+}
+
 
 namespace collidoscope {
     
@@ -80,6 +107,17 @@ namespace collidoscope {
     /**
      * Handles MIDI messages from the keyboards and Teensy. It uses RtMidi library.
      *
+     * Every input port has its own lock-free single producer single consumer queue: RtMidi calls back from
+     * one thread per port, which writes the port queue, and the graphic thread reads all the queues in checkMessages().
+     * No lock is taken and no memory is allocated per message. When a queue is full the new events are dropped and counted.
+     *
+     * When an AudioEngine is passed to setup() or setAudioEngine(), notes don't go through the graphic thread: the MIDI thread
+     * sends them straight to the audio thread, stamped with the time they were received, and only the events
+     * relevant to the graphics are queued for checkMessages().
+     *
+     * Continuous controllers (selection size and start, filter, duration, gain) are coalesced at each poll:
+     * only the latest value of each (port, channel, controller) is passed on, so that a burst of knob motion costs
+     * one event per controller per frame. Notes and the other events are passed on in arrival order.
      */
     class MIDI
     {
@@ -89,33 +127,75 @@ namespace collidoscope {
         MIDI();
         ~MIDI();
         
-        void setup( const Config& );
+        /**
+         * Opens all the MIDI input ports. If \a audioEngine is not null notes are sent straight to it from the MIDI threads.
+         * If \a frameScheduler is not null it's woken up by every MIDI event, so that the graphics respond at full frame rate.
+         * Throws MIDIException.
+         */
+        void setup( const Config&, AudioEngine *audioEngine = nullptr, FrameScheduler *frameScheduler = nullptr );
+
+        /**
+         * Sends the notes straight to \a audioEngine from now on. Lets the ports be opened while the audio engine
+         * is still being set up: until then the notes go through the graphic thread.
+         */
+        void setAudioEngine( AudioEngine *audioEngine ) { mAudioEngine.store( audioEngine, std::memory_order_release ); }
         
         /**
-         * Check new incoming messages and stores them into the vector passed as argument by reference.
+         * Check new incoming messages and appends them to the vector passed as argument by reference.
+         * The events of each port are in arrival order, with continuous controllers coalesced.
+         * Reserve the vector capacity to avoid allocations.
+         *
+         * Returns the number of controller events collapsed by the coalescing.
          */
-        void checkMessages( std::vector< Knob* >&  );
+        size_t checkMessages( std::vector< Knob >& knobs );
+
+        /** Number of events dropped because a port queue was full, since setup */
+        size_t getNumDroppedEvents() const { return mNumDroppedEvents; }
+
+        /** Number of controller events collapsed by the coalescing, since setup */
+        size_t getNumCollapsedEvents() const { return mNumCollapsedEvents; }
         
     private:
-        typedef struct {
+        struct MidiPortInfo {
+            MidiPortInfo( int portNum, MIDI* thate, size_t queueSize ) :
+                portNum( portNum ),
+                thate( thate ),
+                events( queueSize )
+            {}
+
             int portNum;
             MIDI* thate;
-        } MidiPortInfo;
+            // written by the RtMidi thread of this port, read by the graphic thread
+            RingBufferPack< Knob > events;
+            // turns the RtMidi delta times into host time. Used by the RtMidi thread of this port only
+            MidiPortClock clock;
+        };
         
         // callback passed to RtMidi library
         static void RtMidiInCallback( double deltatime, std::vector<unsigned char> *message, void *userData );
         
-        // parse RtMidi messages and turns them into more readable collidoscope::MIDIMessages
-        Knob* parseRtMidiMessage( std::vector<unsigned char> *message, int interfaceNumber );
-        
-        // messages to pass to checkMessages caller
-        std::vector< Knob* > mKnobs;
+        // parse RtMidi messages and turns them into more readable Knobs. Returns false if the message is not handled
+        static bool parseRtMidiMessage( const std::vector<unsigned char> *message, int interfaceNumber, Knob &knob );
+
+        // keeps only the latest value per (port, channel, controller) of the continuous controllers in knobs[begin, end)
+        size_t coalesce( std::vector< Knob >& knobs, size_t begin );
         
+        // one for each input port. Declared before mInputs so that the ports are destroyed first
+        std::vector< std::unique_ptr< MidiPortInfo > > mPortInfos;
+
         // vector containing all the MIDI input devices detected.
         std::vector< std::unique_ptr <RtMidiIn> > mInputs;
         
-        // Used for mutual access to the MIDI messages by the MIDI thread and the graphic thread.
-        std::mutex mMutex;
+        std::atomic< size_t > mNumDroppedEvents;
+
+        // direct note path. Read only by the MIDI threads after setup, except the audio engine that can be set later
+        std::atomic< AudioEngine* > mAudioEngine;
+        std::array< std::uint8_t, 16 > mWaveForChannel;
+        FrameScheduler *mFrameScheduler;
+
+        // index in the polled vector of the latest event for each (port, channel, controller). Only used by the graphic thread
+        std::vector< int > mLatestControllerEvent;
+        size_t mNumCollapsedEvents;
     };
     
 
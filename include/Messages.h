@@ -21,6 +21,8 @@
 
 #pragma once
 
+#include <cstdint>
+
 /**
  * Enumeration of all the possible commands exchanged between audio thread and graphic thread.
  *
@@ -103,18 +105,22 @@ struct NoteMsg
     Command cmd; // NOTE_ON/OFF ot LOOP_ON/OFF 
     int midiNote;
     double rate;
+    std::uint64_t timestamp; // LatencyProbe::now() when the note was received from MIDI, 0 if unknown 
+    std::uint64_t frame;     // audio context frame at which the note must be applied, 0 for as soon as possible 
 };
 
 /**
  * Utility function to create a new NoteMsg.
  */ 
-inline NoteMsg makeNoteMsg( Command cmd, int midiNote, double rate )
+inline NoteMsg makeNoteMsg( Command cmd, int midiNote, double rate, std::uint64_t timestamp = 0, std::uint64_t frame = 0 )
 {
     NoteMsg msg;
 
     msg.cmd = cmd;
     msg.midiNote = midiNote;
     msg.rate = rate;
+    msg.timestamp = timestamp;
+    msg.frame = frame;
 
     return msg;
 }
@@ -0,0 +1,231 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+
+
+namespace collidoscope {
+
+/**
+ * Index of the onsets (the beginnings of the transients) of a recording, built while the recording goes on.
+ *
+ * The recorder feeds each sample to addSample() in the loop it already runs over the block, so the audio is not read twice.
+ * Every kHopSize samples the energy of the hop is compared with the energy of the previous hop: the onset detection
+ * function is the rise of the energy in dB. A hop is an onset when its rise is a peak, it's kThresholdDb above the recent
+ * average of the function, the hop is not silent and the previous onset is at least kMinInterval seconds before.
+ * The detection costs a few operations per sample and one log per hop.
+ *
+ * The onsets are frames of the recording in increasing order. They are published one by one: the recorder is the only writer
+ * and any thread can read the index at any time without locking, e.g. the audio thread to snap the grains (see PGranular)
+ * and the graphic thread to snap the selections. When a new recording starts the index is cleared, and a reader can
+ * briefly see onsets of the old recording.
+ *
+ * Like PGranular it's header based and only depends on the std library.
+ */
+class OnsetIndex
+{
+public:
+    // samples per hop of the detection function, about 6 ms at 44.1 kHz
+    static const size_t kHopSize = 256;
+
+    OnsetIndex() :
+        mCapacity( 0 ),
+        mNumOnsets( 0 ),
+        mMinInterval( kHopSize ),
+        mAverageCoeff( 0.0 )
+    {
+        reset();
+    }
+
+    // no copies
+    OnsetIndex( const OnsetIndex &copy ) = delete;
+    OnsetIndex & operator=(const OnsetIndex &copy) = delete;
+
+    /** Allocates the index for a recording of \a numFrames frames. Not to be called while recording */
+    void setup( size_t numFrames, size_t sampleRate )
+    {
+        mMinInterval = size_t( kMinInterval * sampleRate );
+        if ( mMinInterval < kHopSize )
+            mMinInterval = kHopSize;
+        mCapacity = numFrames / mMinInterval + 1;
+        mOnsets.reset( new std::atomic< size_t >[mCapacity] );
+        mAverageCoeff = 1.0 - std::exp( -double( kHopSize ) / ( kAverageTime * sampleRate ) );
+        reset();
+    }
+
+    /** Clears the index and starts the detection from frame 0. Called by the writer */
+    void reset()
+    {
+        mNumOnsets.store( 0, std::memory_order_release );
+        mFrame = 0;
+        mHopEnergy = 0.0f;
+        mHopCounter = 0;
+        mLastEnergyDb = kSilenceDb;
+        mAverage = 0.0;
+        mRise[0] = mRise[1] = 0.0;
+        mLastOnset = 0;
+    }
+
+    /** Adds the next sample of the recording. Called by the writer, real-time safe */
+    void addSample( float sample )
+    {
+        mHopEnergy += sample * sample;
+        if ( ++mHopCounter == kHopSize )
+            endHop();
+    }
+
+    /** Builds the index of a whole recording at once, e.g. a recording restored from a saved session. Called by the writer */
+    void analyze( const float *samples, size_t numFrames )
+    {
+        reset();
+        for ( size_t i = 0; i < numFrames; i++ ){
+            addSample( samples[i] );
+        }
+    }
+
+    /** Number of onsets found so far. Called from any thread */
+    size_t getNumOnsets() const { return mNumOnsets.load( std::memory_order_acquire ); }
+
+    /** Frame of the onset \a idx, less than getNumOnsets(). Called from any thread */
+    size_t getOnset( size_t idx ) const { return mOnsets[idx].load( std::memory_order_relaxed ); }
+
+    /** Finds the onset closest to \a frame, no farther than \a maxDistance. Returns false if there is none. Called from any thread */
+    bool findNearest( size_t frame, size_t maxDistance, size_t &onset ) const
+    {
+        const size_t numOnsets = getNumOnsets();
+        const size_t next = lowerBound( frame, numOnsets );
+
+        // the onsets are not before frame from next on. Both distances wrap and fail the test if a new recording
+        // is overwriting the index 
+        bool found = false;
+        if ( next < numOnsets && getOnset( next ) - frame <= maxDistance ){
+            onset = getOnset( next );
+            found = true;
+        }
+        if ( next > 0 ){
+            const size_t previous = getOnset( next - 1 );
+            if ( frame - previous <= maxDistance && ( !found || frame - previous < onset - frame ) ){
+                onset = previous;
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    /** Finds the first onset in [ \a begin, \a end ). Returns false if there is none. Called from any thread */
+    bool findFirst( size_t begin, size_t end, size_t &onset ) const
+    {
+        const size_t numOnsets = getNumOnsets();
+        const size_t next = lowerBound( begin, numOnsets );
+        if ( next == numOnsets || getOnset( next ) >= end )
+            return false;
+
+        onset = getOnset( next );
+        return true;
+    }
+
+private:
+    // rise of the hop energy above the average of the detection function, for a hop to be an onset. In dB
+    static constexpr double kThresholdDb = 6.0;
+    // hops quieter than this are not onsets. Mean square in dB
+    static constexpr double kSilenceDb = -60.0;
+    // minimum distance between two onsets. In seconds
+    static constexpr double kMinInterval = 0.05;
+    // time constant of the average of the detection function. In seconds
+    static constexpr double kAverageTime = 0.1;
+
+    // index of the first onset not before frame, among the first numOnsets 
+    size_t lowerBound( size_t frame, size_t numOnsets ) const
+    {
+        size_t first = 0;
+        size_t count = numOnsets;
+        while ( count > 0 ){
+            const size_t half = count / 2;
+            if ( getOnset( first + half ) < frame ){
+                first += half + 1;
+                count -= half + 1;
+            }
+            else {
+                count = half;
+            }
+        }
+        return first;
+    }
+
+    void endHop()
+    {
+        double energyDb = 10.0 * std::log10( double( mHopEnergy ) / double( kHopSize ) + 1.0e-12 );
+        if ( energyDb < kSilenceDb )
+            energyDb = kSilenceDb;
+
+        const double rise = energyDb > mLastEnergyDb ? energyDb - mLastEnergyDb : 0.0;
+
+        // the previous hop is an onset if its rise is a peak above the threshold. The average doesn't include it yet.
+        // The first hop has no rise, so there is a previous hop when the test passes 
+        if ( mRise[1] > mRise[0] && mRise[1] >= rise && mRise[1] > mAverage + kThresholdDb && mLastEnergyDb > kSilenceDb ){
+            const size_t previousHop = mFrame - kHopSize;
+            if ( mNumOnsets.load( std::memory_order_relaxed ) == 0 || previousHop - mLastOnset >= mMinInterval )
+                publish( previousHop );
+        }
+
+        mAverage += ( mRise[1] - mAverage ) * mAverageCoeff;
+        mRise[0] = mRise[1];
+        mRise[1] = rise;
+        mLastEnergyDb = energyDb;
+
+        mFrame += kHopSize;
+        mHopEnergy = 0.0f;
+        mHopCounter = 0;
+    }
+
+    void publish( size_t frame )
+    {
+        const size_t numOnsets = mNumOnsets.load( std::memory_order_relaxed );
+        if ( numOnsets == mCapacity )
+            return;
+
+        mOnsets[numOnsets].store( frame, std::memory_order_relaxed );
+        mNumOnsets.store( numOnsets + 1, std::memory_order_release );
+        mLastOnset = frame;
+    }
+
+    std::unique_ptr< std::atomic< size_t >[] > mOnsets;
+    size_t mCapacity;
+    std::atomic< size_t > mNumOnsets;
+
+    // detection state, writer only 
+    size_t mMinInterval;
+    double mAverageCoeff;
+    size_t mFrame;          // first frame of the current hop 
+    float mHopEnergy;
+    size_t mHopCounter;
+    double mLastEnergyDb;   // energy of the previous hop 
+    double mAverage;        // average of the detection function 
+    double mRise[2];        // rise of the hop before the previous one and of the previous one 
+    size_t mLastOnset;
+};
+
+} // namespace collidoscope
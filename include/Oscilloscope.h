@@ -22,71 +22,60 @@
 #pragma once
 
 #include "cinder/gl/gl.h"
+#include "cinder/gl/Batch.h"
 
 #include "DrawInfo.h"
 
+#include <vector>
 
 
 /**
  * The oscilloscope that oscillates when Collidoscope is played 
+ *
+ * The points are computed from a whole audio buffer at once in setPoints(), which decimates the buffer
+ * to the number of points of the oscilloscope. The line is kept in a vertex buffer on the GPU,
+ * rewritten with one mapped write each time the points are set.
  */ 
 class Oscilloscope
 {
 
 public:
 
+    /** How the audio samples are reduced to the points of the oscilloscope */
+    enum class DecimationMode
+    {
+        EVERY_NTH,  // one sample every N
+        AVERAGE,    // mean of each group of N samples
+        PEAK,       // min and max of each group of N samples, two vertices per point
+    };
+
     /**
      * Constructor, accepts as argument the number of points that make up the oscilloscope line 
      */ 
-    Oscilloscope( size_t numPoints ):
-        mNumPoints( numPoints ),
-        mLine( std::vector<ci::vec2>( numPoints, ci::vec2() ) )
-        {}
+    Oscilloscope( size_t numPoints, DecimationMode mode = DecimationMode::EVERY_NTH );
+
+    /** no copies */
+    Oscilloscope( const Oscilloscope &copy ) = delete;
+    Oscilloscope & operator=(const Oscilloscope &copy) = delete;
 
     /**
-     * Sets the value of a point of the oscilloscope. The value is passed in audio coordinates [-1.0, 1.0].
-     * A reference to DrawInfo is passed to calculate the graphic coordinate of the point based on the audio values passed. 
+     * Sets all the points of the oscilloscope from \a numSamples audio samples in audio coordinates [-1.0, 1.0].
+     * The samples are decimated to the number of points according to the decimation mode.
+     * A reference to DrawInfo is passed to calculate the graphic coordinates of the points.
      */ 
-    void  setPoint( int index, float audioVal, const DrawInfo &di ){
-
-        if ( audioVal > 1.0f ){
-            audioVal = 1.0f;
-        }
-        else if ( audioVal < -1.0f ){
-            audioVal = -1.0f;
-        }
-
-        audioVal *= 0.8f;
-        // map audio val from [-1.0, 1.0] to [0.0, 1.0]
-        // then map the value obtained to the height of the wave tier ( window height / NUM_WAVES ) 
-        float yRatio = ((1 + audioVal) / 2.0f) * (di.getWindowHeight() / NUM_WAVES );
-        float xRatio = index * (di.getWindowWidth() / (float)mLine.size());
-
-        // this flips the coordinates for the second wave 
-        mLine.getPoints()[index].x = float( di.flipX( int(xRatio) ) );
-        mLine.getPoints()[index].y = float( di.flipY( int(yRatio) ) );
-
-        // add the missing line to reach the right of the window.
-        // Indeed, the scope starts from 0 to size-1 and adds xRatio
-        // to each new point. The line from n-1 to n is therefore missing.
-        if (index == mNumPoints - 1){
-            xRatio += ( di.getWindowWidth() / mNumPoints );
-            xRatio = ceil( xRatio ); // ceil because the division might left one pixel out
-
-            mLine.getPoints()[mNumPoints - 1].x = di.flipX( xRatio ); 
-            mLine.getPoints()[mNumPoints - 1].y = di.flipY( yRatio );
-        }
+    void setPoints( const float *audio, size_t numSamples, const DrawInfo &di );
 
-    }
+    /** Sets all the points of the oscilloscope to zero */
+    void reset( const DrawInfo &di );
+
+    void setDecimationMode( DecimationMode mode ) { mDecimationMode = mode; }
+
+    DecimationMode getDecimationMode() const { return mDecimationMode; }
 
     /**
-     * Draws this oscilloscope as a cinder::PolyLine2f
+     * Draws this oscilloscope as a line strip
      */ 
-    void draw()
-    {
-        ci::gl::color(1.0f, 1.0f, 1.0f);
-        ci::gl::draw( mLine );
-    }
+    void draw();
 
     size_t getNumPoints() const
     {
@@ -94,7 +83,28 @@ public:
     }
 
 private:
-    size_t mNumPoints;
-    ci::PolyLine2f  mLine;
 
+    // turns the first numVertices decimated samples into vertices and copies them onto the GPU 
+    void updateVertices( size_t numVertices, const DrawInfo &di );
+
+    const size_t mNumPoints;
+
+    DecimationMode mDecimationMode;
+
+    // vertices of the line, x and y interleaved. Two vertices per point in peak mode 
+    std::vector< ci::vec2 > mVertices;
+    // vertices currently in the line
+    size_t mNumVertices;
+
+    // window width and number of vertices the x of the vertices were computed for 
+    int mXWindowWidth;
+    size_t mXNumVertices;
+
+    // decimated samples, before they are turned into y coordinates 
+    std::vector< float > mDecimated;
+    // filter used to average the samples 
+    std::vector< float > mAverageFilter;
+
+    ci::gl::VboRef mLineVbo;
+    ci::gl::BatchRef mLineBatch;
 };
@@ -23,9 +23,12 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
 #include <type_traits>
 
 #include "EnvASR.h"
+#include "SemitoneRatios.h"
+#include "OnsetIndex.h"
 
 
 namespace collidoscope {
@@ -46,7 +49,25 @@ using std::size_t;
  *
  * PGranular uses a linear ASR envelope with 10 milliseconds attack and 50 milliseconds release.
  *
- * Note that PGranular is header based and only depends on std library and on "EnvASR.h" (also header based).
+ * The pitch of the synth can be bent and glided (see setPitchBend() and glideFrom()), which changes the rate of
+ * the alive grains as well. Bend and glide move linearly in semitones, so while the pitch moves the rate of the grains
+ * is multiplied by the same factor at every sample. The rate is looked up from the SemitoneRatios table at the beginning
+ * of segments of kRateSegmentLen samples (cut short where a bend or glide ends) and then updated with one multiplication
+ * per sample, so the inner loop of the grains stays tight and std::pow is never called.
+ *
+ * The synth renders either one channel, or several channels with each grain panned (see setPan()): a grain is placed
+ * at a pan position when it's triggered, and the pair of equal-power channel gains is computed once for the whole grain.
+ * The mono output is the same as without panning, sample for sample.
+ *
+ * The grains can also start at the onsets of the sample rather than anywhere, see setOnsetSnap().
+ *
+ * By default a new grain starts every selection size samples and lasts selection size * duration coeff samples, so
+ * the density of the grains goes with the selection size. With setDensity() the grains are scheduled asynchronously instead:
+ * the onsets come at a set density, with a random jitter, and each grain starts at a random point of the selection.
+ * The onsets of each block are computed one after the other, as events, so the cost of a grain doesn't depend on the density
+ * and up to kMaxGrains grains can overlap.
+ *
+ * Note that PGranular is header based and only depends on std library and on "EnvASR.h", "SemitoneRatios.h" and "OnsetIndex.h" (also header based).
  * This means you can embedd it in two your project just by copying these two files over.
  *
  * Template arguments: 
@@ -60,8 +81,10 @@ class PGranular
 {
 
 public:
-    static const size_t kMaxGrains = 32;
+    static const size_t kMaxGrains = 256;
     static const size_t kMinGrainsDuration = 640;
+    // the rate of the grains is looked up again every kRateSegmentLen samples while the pitch is bending or gliding
+    static const size_t kRateSegmentLen = 32;
 
     static inline T interpolateLin( double xn, double xn_1, double decimal )
     {
@@ -83,6 +106,11 @@ public:
         double b1;       // hann envelope from Ross Becina's "Implementing real time Granular Synthesis"
         double y1;
         double y2;
+
+        size_t channelA; // the grain is panned between these two channels. Multichannel output only 
+        size_t channelB;
+        T gainA;
+        T gainB;
     };
 
 
@@ -112,7 +140,22 @@ public:
         mTriggerCallback( triggerCallback ),
         mEnvASR( 1.0f, 0.01f, 0.05f, sampleRate ),
         mAttenuation( T(0.25118864315096) ),
-        mID( ID )
+        mID( ID ),
+        mSampleRate( double( sampleRate ) ),
+        mSemitoneRatios( SemitoneRatios::get() ),
+        mPitchRatio( 1.0 ),
+        mPanCenter( 0.5 ),
+        mPanSpread( 0.0 ),
+        mOnsetIndex( nullptr ),
+        mOnsetSnapDistance( 0 ),
+        mDensityInterval( 0.0 ),
+        mDensityJitter( 0.0 ),
+        mDensityBaseDuration( kMinGrainsDuration ),
+        mDensityDuration( kMinGrainsDuration ),
+        mDensityTrigger( 0.0 ),
+        mEnvDuration( 0 ),
+        mEnvB1( 0.0 ),
+        mEnvY1( 0.0 )
     {
         static_assert(std::is_pod<PGrain>::value, "PGrain must be POD");
 #ifdef _WINDOW
@@ -126,6 +169,11 @@ public:
             mGrains[grainIdx].age = 0;
             mGrains[grainIdx].duration = 1;
         }
+
+        mPitchBend.jump( 0.0 );
+        mGlide.jump( 0.0 );
+
+        seedRandom( std::uint32_t( ID + 1 ) );
     }
 
     ~PGranular(){}
@@ -139,6 +187,8 @@ public:
 
         if ( mGrainsDuration < kMinGrainsDuration )
             mGrainsDuration = kMinGrainsDuration;
+
+        updateDensityDuration();
     }
 
     /** Sets rate of grains. e.g rate = 2 means one octave higer */
@@ -167,6 +217,78 @@ public:
 
     }
 
+    /**
+     * Bends the pitch of the synth, alive grains included, by \a semitones with respect to the rate of the note.
+     * The bend moves linearly from its current value and gets there in \a rampSamples samples.
+     * An idle synth is not processed, so its bend jumps to \a semitones straight away
+     */
+    void setPitchBend( double semitones, size_t rampSamples )
+    {
+        if ( isIdle() )
+            mPitchBend.jump( semitones );
+        else
+            mPitchBend.start( semitones, rampSamples );
+
+        updatePitchRatio();
+    }
+
+    /**
+     * Makes the note start \a semitones away from its pitch and glide linearly to it in \a glideSamples samples.
+     * To be called right after noteOn(). The synth being idle cancels the glide
+     */
+    void glideFrom( double semitones, size_t glideSamples )
+    {
+        mGlide.jump( semitones );
+        mGlide.start( 0.0, glideSamples );
+        updatePitchRatio();
+    }
+
+    /**
+     * Sets where the grains go in the multichannel output. With two channels the pan goes from 0 (channel 0) to 1 (channel 1).
+     * With more channels the speakers are in a ring, channel c at c / numChannels of a turn, and the pan is in turns.
+     * Each grain is placed at \a center plus a random offset within +/- \a spread / 2
+     */
+    void setPan( double center, double spread )
+    {
+        mPanCenter = center;
+        mPanSpread = spread;
+    }
+
+    /** Seeds the generators of the random pan offsets and of the asynchronous scheduling */
+    void seedRandom( std::uint32_t seed )
+    {
+        mPanRandom.seed( seed );
+        mScheduleRandom.seed( seed ^ 0x5BD1E995 );
+    }
+
+    /**
+     * Schedules the grains asynchronously, \a grainsPerSecond grains per second whatever the selection size. 0 goes back to
+     * one grain every selection size samples. Each interval between two onsets is the mean interval times a random factor 
+     * in [ 1 - \a jitter, 1 + \a jitter ], \a jitter in [0, 1]. The grains last \a durationSamples samples times the duration coeff,
+     * and start at a random point of the selection
+     */
+    void setDensity( double grainsPerSecond, double jitter, size_t durationSamples )
+    {
+        // no more than a grain per sample 
+        if ( grainsPerSecond > mSampleRate )
+            grainsPerSecond = mSampleRate;
+
+        mDensityInterval = grainsPerSecond > 0.0 ? mSampleRate / grainsPerSecond : 0.0;
+        mDensityJitter = jitter < 0.0 ? 0.0 : ( jitter > 1.0 ? 1.0 : jitter );
+        mDensityBaseDuration = durationSamples;
+        updateDensityDuration();
+    }
+
+    /**
+     * Makes the grains start at the onset of \a onsetIndex closest to where they would start, if there is one within \a maxDistance samples.
+     * The index is read as it grows while the sample is recorded. nullptr to start the grains anywhere
+     */
+    void setOnsetSnap( const OnsetIndex *onsetIndex, size_t maxDistance )
+    {
+        mOnsetIndex = onsetIndex;
+        mOnsetSnapDistance = maxDistance;
+    }
+
     /** Sets the attenuation of the grains with respect to the level of the recorded sample
      *  attenuation is in amp value and defaule value is 0.25118864315096 (-12dB) */
     void setAttenuation( T attenuation )
@@ -211,7 +333,17 @@ public:
      */ 
     void process( T* audioOut, T* tempBuffer, size_t numSamples )
     {
-        
+        T* const channels[1] = { audioOut };
+        process( channels, 1, tempBuffer, numSamples );
+    }
+
+    /**
+     * Runs the granular engine and adds the output into \a numChannels channels, each grain panned as set by setPan().
+     * With one channel it's the same as the mono process()
+     */
+    void process( T* const* channels, size_t numChannels, T* tempBuffer, size_t numSamples )
+    {
+
         // num samples worth of sound ( due to envelope possibly finishing )
         size_t envSamples = 0;
         bool becameIdle = false;
@@ -229,7 +361,13 @@ public:
         }
 
         // does the actual grains processing 
-        processGrains( audioOut, tempBuffer, envSamples );
+        processGrains( channels, numChannels, tempBuffer, envSamples );
+
+        if ( isPitchMoving() ){
+            mPitchBend.advance( numSamples );
+            mGlide.advance( numSamples );
+            updatePitchRatio();
+        }
 
         // becomes idle if the envelope goes to idle state 
         if ( becameIdle ){
@@ -240,12 +378,242 @@ public:
 
 private:
 
-    void processGrains( T* audioOut, T* envelopeValues, size_t numSamples )
+    // a pitch offset in semitones, moving linearly towards its target 
+    struct PitchRamp
+    {
+        double value;
+        double target;
+        double step;         // semitones per sample 
+        size_t samplesLeft;
+
+        // value \a offset samples from now 
+        double valueAt( size_t offset ) const
+        {
+            return offset < samplesLeft ? value + step * double( offset ) : target;
+        }
+
+        void start( double newTarget, size_t numSamples )
+        {
+            if ( numSamples == 0 ){
+                jump( newTarget );
+                return;
+            }
+
+            target = newTarget;
+            step = ( target - value ) / double( numSamples );
+            samplesLeft = numSamples;
+        }
+
+        void jump( double newValue )
+        {
+            value = target = newValue;
+            step = 0.0;
+            samplesLeft = 0;
+        }
+
+        void advance( size_t numSamples )
+        {
+            if ( numSamples >= samplesLeft ){
+                jump( target );
+            }
+            else {
+                value += step * double( numSamples );
+                samplesLeft -= numSamples;
+            }
+        }
+    };
+
+    bool isPitchMoving() const
+    {
+        return mPitchBend.samplesLeft > 0 || mGlide.samplesLeft > 0;
+    }
+
+    // the pitch ratio used while the pitch is still 
+    void updatePitchRatio()
+    {
+        mPitchRatio = mSemitoneRatios.ratio( mPitchBend.value + mGlide.value );
+    }
+
+    // the pitch ratio \a offset samples from the beginning of the block 
+    double pitchRatioAt( size_t offset ) const
+    {
+        return mSemitoneRatios.ratio( mPitchBend.valueAt( offset ) + mGlide.valueAt( offset ) );
+    }
+
+    // the rate segment containing the sample \a offset of the block: kRateSegmentLen samples, cut where the bend or the glide ends
+    // so that the pitch moves by the same amount at every sample of the segment 
+    void rateSegment( size_t offset, size_t &segmentStart, size_t &segmentEnd ) const
+    {
+        segmentStart = offset / kRateSegmentLen * kRateSegmentLen;
+        segmentEnd = segmentStart + kRateSegmentLen;
+
+        const size_t rampEnds[] = { mPitchBend.samplesLeft, mGlide.samplesLeft };
+        for ( size_t rampEnd : rampEnds ){
+            if ( rampEnd <= offset )
+                segmentStart = std::max( segmentStart, rampEnd );
+            else
+                segmentEnd = std::min( segmentEnd, rampEnd );
+        }
+    }
+
+    // adds the output of the grain to one channel 
+    struct MonoOutput
+    {
+        T* out;
+
+        void operator()( size_t sampleIdx, T value ) const
+        {
+            out[sampleIdx] += value;
+        }
+    };
+
+    // adds the output of the grain to two channels, with a gain each 
+    struct PairOutput
+    {
+        T* outA;
+        T* outB;
+        T gainA;
+        T gainB;
+
+        void operator()( size_t sampleIdx, T value ) const
+        {
+            outA[sampleIdx] += value * gainA;
+            outB[sampleIdx] += value * gainB;
+        }
+    };
+
+    // 32 bits xorshift 
+    struct XorShift32
+    {
+        std::uint32_t state;
+
+        void seed( std::uint32_t seed )
+        {
+            // xorshift doesn't get out of 0 
+            state = seed != 0 ? seed : 0x9E3779B9;
+        }
+
+        // uniform in [0, 1) 
+        double next()
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return double( state ) * ( 1.0 / 4294967296.0 );
+        }
+    };
+
+    void updateDensityDuration()
+    {
+        mDensityDuration = std::lround( mDensityBaseDuration * mGrainsDurationCoeff );
+        if ( mDensityDuration < kMinGrainsDuration )
+            mDensityDuration = kMinGrainsDuration;
+    }
+
+    // the onset of the grain started at phase, snapped to the closest onset of the sample if any 
+    double snapToOnset( double phase ) const
+    {
+        size_t onset;
+        if ( mOnsetIndex != nullptr && mOnsetIndex->findNearest( size_t( phase ), mOnsetSnapDistance, onset ) && onset < mBufferLen )
+            return double( onset );
+
+        return phase;
+    }
+
+    // starts a new grain at offset in the block and synthesizes its first samples. Returns false if there is no room for it 
+    bool triggerGrain( double phase, size_t duration, T* const* channels, size_t numChannels, T* envelopeValues, size_t numSamples, size_t offset )
+    {
+        if ( mNumAliveGrains == kMaxGrains )
+            return false;
+
+        // get next grain will be placed at the end of the alive ones 
+        PGrain &grain = mGrains[mNumAliveGrains];
+        mNumAliveGrains++;
+
+        grain.phase = phase;
+        grain.rate = mGrainsRate;
+        grain.alive = true;
+        grain.age = 0;
+        grain.duration = duration;
+
+        // the coefficients of the hann envelope only change with the duration 
+        if ( duration != mEnvDuration ){
+            const double w = 3.14159265358979323846 / duration;
+            mEnvB1 = 2.0 * std::cos( w );
+            mEnvY1 = std::sin( w );
+            mEnvDuration = duration;
+        }
+        grain.b1 = mEnvB1;
+        grain.y1 = mEnvY1;
+        grain.y2 = 0.0;
+
+        if ( numChannels > 1 )
+            panGrain( grain, numChannels );
+
+        synthesizeGrain( grain, channels, numChannels, envelopeValues + offset, numSamples - offset, offset );
+
+        if ( grain.alive == false ) {
+            mNumAliveGrains--;
+        }
+
+        return true;
+    }
+
+    // triggers the grains of the block at the set density 
+    bool triggerDensityGrains( T* const* channels, size_t numChannels, T* envelopeValues, size_t numSamples )
+    {
+        bool newGrainWasTriggered = false;
+
+        while ( mDensityTrigger < double( numSamples ) ){
+            // anywhere in the selection 
+            double phase = mGrainsStart + mScheduleRandom.next() * double( mTriggerRate );
+            if ( phase >= mBufferLen )
+                phase -= mBufferLen;
+
+            if ( triggerGrain( snapToOnset( phase ), mDensityDuration, channels, numChannels, envelopeValues, numSamples, size_t( mDensityTrigger ) ) )
+                newGrainWasTriggered = true;
+
+            mDensityTrigger += mDensityInterval * ( 1.0 + mDensityJitter * ( 2.0 * mScheduleRandom.next() - 1.0 ) );
+        }
+
+        mDensityTrigger -= double( numSamples );
+        return newGrainWasTriggered;
+    }
+
+    // places a new grain and computes its pair of equal-power gains 
+    void panGrain( PGrain &grain, size_t numChannels )
+    {
+        double pan = mPanCenter;
+        if ( mPanSpread > 0.0 )
+            pan += mPanSpread * ( mPanRandom.next() - 0.5 );
+
+        double position;
+        if ( numChannels == 2 ){
+            position = pan < 0.0 ? 0.0 : ( pan > 1.0 ? 1.0 : pan );
+            grain.channelA = 0;
+            grain.channelB = 1;
+        }
+        else {
+            // between the two closest speakers of the ring 
+            position = ( pan - std::floor( pan ) ) * double( numChannels );
+            grain.channelA = size_t( position );
+            if ( grain.channelA >= numChannels )
+                grain.channelA = 0;
+            position -= std::floor( position );
+            grain.channelB = grain.channelA + 1 == numChannels ? 0 : grain.channelA + 1;
+        }
+
+        const double angle = position * 1.57079632679489661923;
+        grain.gainA = T( std::cos( angle ) );
+        grain.gainB = T( std::sin( angle ) );
+    }
+
+    void processGrains( T* const* channels, size_t numChannels, T* envelopeValues, size_t numSamples )
     {
 
         /* process all existing alive grains */
         for ( size_t grainIdx = 0; grainIdx < mNumAliveGrains;  ){
-            synthesizeGrain( mGrains[grainIdx], audioOut, envelopeValues, numSamples );
+            synthesizeGrain( mGrains[grainIdx], channels, numChannels, envelopeValues, numSamples, 0 );
 
             if ( !mGrains[grainIdx].alive ){
                 // this grain is dead so copy the last of the active grains here 
@@ -266,44 +634,28 @@ private:
             return;
         }
 
+        if ( mDensityInterval > 0.0 ){
+            if ( triggerDensityGrains( channels, numChannels, envelopeValues, numSamples ) )
+                mTriggerCallback( 't', mID );
+            return;
+        }
+
         size_t randOffset =  mRand();
         bool newGrainWasTriggered = false;
 
+        // all the grains of this block start at the same sample 
+        double grainsStart = mGrainsStart + double( randOffset );
+        if ( grainsStart >= mBufferLen )
+            grainsStart -= mBufferLen;
+
+        grainsStart = snapToOnset( grainsStart );
+
         // trigger new grain and synthesize them as well 
         while ( mTrigger < numSamples ){
             
             // if there is room to accommodate new grains 
-            if ( mNumAliveGrains < kMaxGrains ){
-                // get next grain will be placed at the end of the alive ones 
-                size_t grainIdx = mNumAliveGrains;
-                mNumAliveGrains++;
-
-                // initialize and synthesise the grain 
-                PGrain &grain = mGrains[grainIdx];
-                
-                double phase = mGrainsStart + double( randOffset );
-                if ( phase >= mBufferLen )
-                    phase -= mBufferLen;
-
-                grain.phase = phase;
-                grain.rate = mGrainsRate;
-                grain.alive = true;
-                grain.age = 0;
-                grain.duration = mGrainsDuration;
-
-                const double w = 3.14159265358979323846 / mGrainsDuration;
-                grain.b1 = 2.0 * std::cos( w );
-                grain.y1 = std::sin( w );
-                grain.y2 = 0.0;
-
-                synthesizeGrain( grain, audioOut + mTrigger, envelopeValues + mTrigger, numSamples - mTrigger );
-
-                if ( grain.alive == false ) {
-                    mNumAliveGrains--;
-                }
-
+            if ( triggerGrain( grainsStart, mGrainsDuration, channels, numChannels, envelopeValues, numSamples, mTrigger ) )
                 newGrainWasTriggered = true;
-            }
 
             // update trigger even if no new grain was started 
             mTrigger += mTriggerRate;
@@ -317,10 +669,26 @@ private:
         }
     }
 
+    // synthesize a single grain into the channels of the block 
+    // blockOffset = offset from the beginning of the block where the grain starts in this block 
+    void synthesizeGrain( PGrain &grain, T* const* channels, size_t numChannels, T* envelopeValues, size_t numSamples, size_t blockOffset )
+    {
+        if ( numChannels == 1 ){
+            const MonoOutput output = { channels[0] + blockOffset };
+            synthesizeGrain( grain, output, envelopeValues, numSamples, blockOffset );
+        }
+        else {
+            const PairOutput output = { channels[grain.channelA] + blockOffset, channels[grain.channelB] + blockOffset, grain.gainA, grain.gainB };
+            synthesizeGrain( grain, output, envelopeValues, numSamples, blockOffset );
+        }
+    }
+
     // synthesize a single grain 
-    // audioOut = pointer to audio block to fill 
+    // output = adds the samples to the audio block to fill 
     // numSamples = number of samples to process for this block
-    void synthesizeGrain( PGrain &grain, T* audioOut, T* envelopeValues, size_t numSamples )
+    // blockOffset = offset of the output from the beginning of the block, to line up the rate segments 
+    template< typename Output >
+    void synthesizeGrain( PGrain &grain, const Output &output, T* envelopeValues, size_t numSamples, size_t blockOffset )
     {
 
         // copy all grain data into local variable for faster processing
@@ -337,30 +705,54 @@ private:
         // only process minimum between samples of this block and time left to leave for this grain 
         auto numSamplesToOut = std::min( numSamples, duration - age );
 
-        for ( size_t sampleIdx = 0; sampleIdx < numSamplesToOut; sampleIdx++ ){
+        const bool pitchMoving = isPitchMoving();
+
+        size_t sampleIdx = 0;
+        while ( sampleIdx < numSamplesToOut ){
+
+            // the phase increment is constant over the whole block when the pitch is still. When it moves, 
+            // it's looked up at the current sample and multiplied by the ratio of the pitch step of each sample 
+            size_t segmentEnd = numSamplesToOut;
+            double increment = rate * mPitchRatio;
+            double incrementFactor = 1.0;
+            if ( pitchMoving ){
+                const size_t offset = blockOffset + sampleIdx;
+                size_t segmentStart;
+                size_t segmentStop;
+                rateSegment( offset, segmentStart, segmentStop );
+                segmentEnd = std::min( numSamplesToOut, segmentStop - blockOffset );
+
+                increment = rate * pitchRatioAt( offset );
+                const double pitchStep = ( offset < mPitchBend.samplesLeft ? mPitchBend.step : 0.0 ) + ( offset < mGlide.samplesLeft ? mGlide.step : 0.0 );
+                incrementFactor = mSemitoneRatios.ratio( pitchStep );
+            }
 
-            const size_t readIndex = (size_t)phase;
-            const size_t nextReadIndex = (readIndex == mBufferLen - 1) ? 0 : readIndex + 1; // wrap on the read buffer if needed 
+            for ( ; sampleIdx < segmentEnd; sampleIdx++ ){
 
-            const double decimal = phase - readIndex;
+                const size_t readIndex = (size_t)phase;
+                const size_t nextReadIndex = (readIndex == mBufferLen - 1) ? 0 : readIndex + 1; // wrap on the read buffer if needed 
 
-            T out = interpolateLin( mBuffer[readIndex], mBuffer[nextReadIndex], decimal );
-            
-            // apply raised cosine bell envelope 
-            auto y0 = b1 * y1 - y2;
-            y2 = y1;
-            y1 = y0;
-            out *= T(y0);
+                const double decimal = phase - readIndex;
 
-            audioOut[sampleIdx] += out * envelopeValues[sampleIdx] * mAttenuation;
+                T out = interpolateLin( mBuffer[readIndex], mBuffer[nextReadIndex], decimal );
+                
+                // apply raised cosine bell envelope 
+                auto y0 = b1 * y1 - y2;
+                y2 = y1;
+                y1 = y0;
+                out *= T(y0);
 
-            // increment age one sample 
-            age++;
-            // increment the phase according to the rate of this grain 
-            phase += rate;
+                output( sampleIdx, out * envelopeValues[sampleIdx] * mAttenuation );
 
-            if ( phase >= mBufferLen ){   // wrap the phase if needed 
-                phase -= mBufferLen;
+                // increment age one sample 
+                age++;
+                // increment the phase according to the rate of this grain and the pitch of the synth 
+                phase += increment;
+                increment *= incrementFactor;
+
+                if ( phase >= mBufferLen ){   // wrap the phase if needed 
+                    phase -= mBufferLen;
+                }
             }
         }
 
@@ -384,7 +776,13 @@ private:
 
     void reset()
     {
+        // the glide belongs to the note, the bend stays as the wheel is. A ramp in progress would not move while idle
+        mGlide.jump( 0.0 );
+        mPitchBend.jump( mPitchBend.target );
+        updatePitchRatio();
+
         mTrigger = 0;
+        mDensityTrigger = 0.0;
         for ( size_t i = 0; i < mNumAliveGrains; i++ ){
             mGrains[i].alive = false;
         }
@@ -424,6 +822,36 @@ private:
     TriggerCallbackFunc &mTriggerCallback;
 
     EnvASR<T> mEnvASR;
+
+    const double mSampleRate;
+
+    const SemitoneRatios &mSemitoneRatios;
+    PitchRamp mPitchBend;
+    PitchRamp mGlide;
+    // ratio of the current pitch, bend and glide, to the pitch of the note 
+    double mPitchRatio;
+
+    // pan of the grains in the multichannel output 
+    double mPanCenter;
+    double mPanSpread;
+    XorShift32 mPanRandom;
+
+    // onsets the grains start at, if any 
+    const OnsetIndex *mOnsetIndex;
+    size_t mOnsetSnapDistance;
+
+    // asynchronous scheduling, see setDensity(). The mean interval between two onsets is 0 when off 
+    double mDensityInterval;
+    double mDensityJitter;
+    size_t mDensityBaseDuration;
+    size_t mDensityDuration;
+    double mDensityTrigger;   // next onset, from the beginning of the block 
+    XorShift32 mScheduleRandom;
+
+    // coefficients of the hann envelope of the last grain duration 
+    size_t mEnvDuration;
+    double mEnvB1;
+    double mEnvY1;
 };
 
 
@@ -27,6 +27,8 @@
 #include "boost/optional.hpp"
 #include "Messages.h"
 #include "RingBufferPack.h"
+#include "XrunMonitor.h"
+#include "LatencyProbe.h"
 
 #include <memory>
 
@@ -47,8 +49,21 @@ class PGranularNode : public ci::audio::Node
 public:
     static const size_t kMaxVoices = 6;
     static const int kNoMidiNote = -50;
-
-    explicit PGranularNode( ci::audio::Buffer *grainBuffer, CursorTriggerMsgRingBuffer &triggerRingBuffer );
+    // notes received but not yet due, waiting for their frame 
+    static const size_t kMaxPendingNotes = 128;
+    // maximum number of output channels the grains are panned over 
+    static const size_t kMaxChannels = 16;
+
+    /**
+     * Constructor. \a numDirectNoteQueues is the number of note queues written straight by the MIDI threads, one per input port,
+     * in addition to the queue written by the graphic thread. \a randomSeed seeds the random offsets and the pan of the grains.
+     * The grains start at the onsets of \a onsetIndex within \a onsetSnapTime seconds of their start, if any, see PGranular::setOnsetSnap().
+     *
+     * With \a numChannels more than 1 each grain is panned over the channels, see PGranular::setPan(): at a random position
+     * within \a panSpread around \a panCenter, or, if \a panVoices is true, each voice at its own position within \a panSpread.
+     */
+    PGranularNode( ci::audio::Buffer *grainBuffer, const collidoscope::OnsetIndex *onsetIndex, double onsetSnapTime, CursorTriggerMsgRingBuffer &triggerRingBuffer, XrunMonitor &xrunMonitor, LatencyProbe &latencyProbe, int waveIdx, size_t numDirectNoteQueues, uint32_t randomSeed,
+        size_t numChannels = 1, double panCenter = 0.5, double panSpread = 0.0, bool panVoices = false );
     ~PGranularNode();
 
     /** Set selection size in samples */
@@ -68,11 +83,56 @@ public:
         mGrainDurationCoeff.set( coeff );
     }
 
+    /** Bends the pitch of the loop and of the voices, sounding grains included. In semitones */
+    void setPitchBend( double semitones )
+    {
+        mPitchBend.set( semitones );
+    }
+
+    /** Sets the time a new note takes to glide from the pitch of the previous note. In seconds, 0 for no glide */
+    void setGlideTime( double seconds )
+    {
+        mGlideTime.set( seconds );
+    }
+
+    /** Schedules the grains at \a grainsPerSecond rather than one every selection size, see PGranular::setDensity(). 0 to go back */
+    void setGrainDensity( double grainsPerSecond )
+    {
+        mGrainDensity.set( grainsPerSecond );
+    }
+
+    /** Sets the random jitter of the grain onsets when scheduled by density, in [0, 1] */
+    void setGrainJitter( double jitter )
+    {
+        mGrainJitter.set( jitter );
+    }
+
+    /** Sets the duration of the grains when scheduled by density, in seconds */
+    void setGrainTime( double seconds )
+    {
+        mGrainTime.set( seconds );
+    }
+
+    /** Seeds the random offsets of the grains again, at the beginning of the next block */
+    void setRandomSeed( uint32_t seed );
+
+    /**
+     * When offline the node is pulled by hand with the audio context disabled, and the frame of the next block is
+     * set by the caller rather than read from the context. Used to replay captured sessions
+     */
+    void setOffline( bool offline, uint64_t frame = 0 );
+
     /* PGranularNode passes itself as trigger callback in PGranular */
     void operator()( char msgType, int ID );
 
+    /** Note queue written by the graphic thread */
     ci::audio::dsp::RingBufferT<NoteMsg>& getNoteRingBuffer() { return mNoteMsgRingBufferPack.getBuffer(); }
 
+    size_t getNumDirectNoteRingBuffers() const { return mDirectNoteMsgRingBufferPacks.size(); }
+
+    /** Note queue written by the MIDI thread of the input port \a port */
+    ci::audio::dsp::RingBufferT<NoteMsg>& getDirectNoteRingBuffer( size_t port ) { return mDirectNoteMsgRingBufferPacks[port]->getBuffer(); }
+
 protected:
     
     void initialize()                           override;
@@ -109,6 +169,12 @@ private:
             }
         }
 
+        // the value returned by the last get() that returned one, or the initial value 
+        T current() const
+        {
+            return mPreviousVal;
+        }
+
     private:
         std::atomic<T> mAtomic;
         T mPreviousVal;
@@ -117,11 +183,24 @@ private:
     // creates or re-start a PGranular and sets the pitch according to the MIDI note passed as argument
     void handleNoteMsg( const NoteMsg &msg );
 
+    // reads all the messages in the queue and adds them to the pending notes, sorted by frame
+    void queueNoteMsgs( RingBufferPack<NoteMsg> &ringBufferPack, uint64_t blockStart );
+
+    // processes the loop and the voices into the channels 
+    void renderGrains( float* const* channels, size_t numChannels, float *tempBuffer, size_t numFrames );
+
+    // seeds the random pan and scheduling of the loop and of the voices 
+    void seedRandom( uint32_t seed );
+
     // pointers to PGranular objects 
     std::unique_ptr < collidoscope::PGranular<float, RandomGenerator, PGranularNode > > mPGranularLoop;
     std::array<std::unique_ptr < collidoscope::PGranular<float, RandomGenerator, PGranularNode > >, kMaxVoices> mPGranularNotes;
     // maps midi notes to pgranulars. When a noteOff is received makes sure the right PGranular is turned off
     std::array<int, kMaxVoices> mMidiNotes;
+    // the last note started, where the next note glides from 
+    int mLastMidiNote;
+    // glide time in samples, 0 for no glide 
+    size_t mGlideSamples;
 
     // pointer to the random generator struct passed over to PGranular 
     std::unique_ptr< RandomGenerator > mRandomOffset;
@@ -129,10 +208,26 @@ private:
     // buffer containing the recorded audio, to pass to PGranular in initialize()
     ci::audio::Buffer *mGrainBuffer;
 
+    // onsets of the recorded audio, the grains are snapped to 
+    const collidoscope::OnsetIndex *mOnsetIndex;
+    const double mOnsetSnapTime;
+
     ci::audio::BufferRef mTempBuffer;
 
     CursorTriggerMsgRingBuffer &mTriggerRingBuffer;
     RingBufferPack<NoteMsg> mNoteMsgRingBufferPack;
+    std::vector< std::unique_ptr< RingBufferPack<NoteMsg> > > mDirectNoteMsgRingBufferPacks;
+
+    // notes waiting for their frame, sorted by frame. Notes with the same frame are in arrival order
+    std::array< NoteMsg, kMaxPendingNotes > mPendingNotes;
+    size_t mNumPendingNotes;
+
+    // notes, grains and parameter changes are logged in the xrun monitor trace
+    XrunMonitor &mXrunMonitor;
+    const int mWaveIdx;
+
+    // key-to-sound latency of the notes
+    LatencyProbe &mLatencyProbe;
 
     LazyAtomic<size_t> mSelectionSize;
     
@@ -140,6 +235,27 @@ private:
     
     LazyAtomic<double> mGrainDurationCoeff;
 
+    LazyAtomic<double> mPitchBend;
+
+    LazyAtomic<double> mGlideTime;
+
+    LazyAtomic<double> mGrainDensity;
+
+    LazyAtomic<double> mGrainJitter;
+
+    LazyAtomic<double> mGrainTime;
+
+    // pan of the grains 
+    const double mPanCenter;
+    const double mPanSpread;
+    const bool mPanVoices;
+
+    std::atomic< uint32_t > mRandomSeed;
+    std::atomic< bool > mSeedPending;
+
+    std::atomic< bool > mOffline;
+    std::atomic< uint64_t > mOfflineFrame;
+
 
 };
 
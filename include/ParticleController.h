@@ -28,40 +28,60 @@
 
 /**
  * The ParticleController creates/updates/draws and destroys particles
+ *
+ * The particles are stored as a structure of arrays, so that the update loops run over contiguous floats
+ * and can be vectorized by the compiler. Dead particles are removed by moving the last particle in their place,
+ * so the live particles are always the first mNumParticles of each array. Only these are uploaded to the GPU and drawn.
  */ 
 class ParticleController {
 
-    struct Particle {
+    // the particle positions, all the x followed by all the y. This is also the layout of the vertex buffer 
+    std::vector< float > mPositions;
+    float *mPosX;
+    float *mPosY;
 
-        ci::vec2	mCloudCenter; // initial positin of the particle 
-        ci::vec2	mVel;         // velocity 
-        float       mCloudSize;   // how big is the area where particle float around. When a particle hits the 
-                                  // border of the area it gets deflected 
+    // velocity 
+    std::vector< float > mVelX;
+    std::vector< float > mVelY;
 
-        int			mAge;      // when mAge == mLifeSpan the particle is disposed 
-        int			mLifespan; // how long a particle lives
-        bool        mFlyOver;  // some particles last longer and fly over the screen and reach the other user
+    // initial position of the particle 
+    std::vector< float > mCloudCenterX;
+    std::vector< float > mCloudCenterY;
 
-    };
+    // square of how big is the area where particle float around. When a particle hits the 
+    // border of the area it gets deflected. Infinite for the particles that fly over 
+    std::vector< float > mCloudSizeSq;
 
-    static const int kMaxParticles = 150;
+    std::vector< int > mAge;      // when mAge > mLifeSpan the particle is disposed 
+    std::vector< int > mLifespan; // how long a particle lives
 
-	std::vector<Particle> mParticles;
-    std::vector< ci::vec2 > mParticlePositions;
+    const size_t mMaxParticles;
 
     // current number of active particles
     size_t mNumParticles;
+    // number of particles in the vertex buffer, drawn by draw() 
+    size_t mNumUploadedParticles;
 
     ci::gl::VboRef			mParticleVbo;    // virtual buffer object 
     ci::gl::BatchRef		mParticleBatch;
 
+    // moves the last particle in place of the particle at index i 
+    void removeParticle( size_t i );
+
  public:
     /**
      * Every time addParticles is run, up to kMaxParticleAdd are added at once
      */ 
     static const int kMaxParticleAdd = 22;
 
-    ParticleController();
+    /**
+     * Constructor, takes as argument the maximum number of particles alive at the same time
+     */ 
+    ParticleController( size_t maxParticles );
+
+    /** no copies */
+    ParticleController( const ParticleController &copy ) = delete;
+    ParticleController & operator=(const ParticleController &copy) = delete;
 
     /**
      * Adds \a amount particles and places them in \a initialLocation. 
@@ -74,13 +94,16 @@ class ParticleController {
      */ 
     void updateParticles();
 
+    /** Number of particles alive */
+    size_t getNumParticles() const { return mNumParticles; }
+
     /**
-     * Draws all the particles
+     * Draws the live particles
      */ 
     inline void draw()
     {
-        mParticleBatch->draw();
+        if ( mNumUploadedParticles > 0 )
+            mParticleBatch->draw( 0, GLsizei( mNumUploadedParticles ) );
     }
 	
 };
-
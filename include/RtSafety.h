@@ -0,0 +1,95 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+
+namespace collidoscope {
+
+/**
+ * Real-time safety checker for the audio thread.
+ *
+ * When the project is built with RT_SAFETY_CHECKS defined (Debug configuration) the checker intercepts
+ * operator new/delete, the malloc family of the default malloc zone and pthread_mutex_lock.
+ * If one of them is called while the current thread is tagged as audio thread, the violation is
+ * reported on stderr together with a stack trace.
+ *
+ * The audio thread is tagged by placing RT_SAFETY_SCOPE() at the top of the process() methods of the nodes.
+ * In builds without RT_SAFETY_CHECKS all the functions are no-ops and the macros expand to nothing.
+ */
+namespace rtsafety {
+
+    /** Installs the interceptors. Call once at startup, before the audio graph is enabled */
+    void install();
+
+    /** When true every violation aborts the program after being reported. Default false */
+    void setAbortOnViolation( bool abort );
+
+    /** Number of violations detected since install() */
+    std::size_t getNumViolations();
+
+    /** Whether the checker is compiled in, that is RT_SAFETY_CHECKS is defined. When false no violation is ever counted */
+    bool isEnabled();
+
+    /** Tags the current thread as audio thread for the lifetime of the object */
+    class ScopedAudioThread
+    {
+    public:
+        ScopedAudioThread();
+        ~ScopedAudioThread();
+
+        ScopedAudioThread( const ScopedAudioThread &copy ) = delete;
+        ScopedAudioThread & operator=(const ScopedAudioThread &copy) = delete;
+
+    private:
+        std::size_t mPreviousState;
+    };
+
+    /**
+     * Allows blocking calls in the audio thread for the lifetime of the object.
+     * Only meant for calls that are known to be safe, e.g. the first use of a lazily initialized library.
+     */
+    class ScopedAllowBlocking
+    {
+    public:
+        ScopedAllowBlocking();
+        ~ScopedAllowBlocking();
+
+        ScopedAllowBlocking( const ScopedAllowBlocking &copy ) = delete;
+        ScopedAllowBlocking & operator=(const ScopedAllowBlocking &copy) = delete;
+
+    private:
+        std::size_t mPreviousState;
+    };
+
+} // namespace rtsafety
+
+} // namespace collidoscope
+
+
+#ifdef RT_SAFETY_CHECKS
+#define RT_SAFETY_SCOPE() collidoscope::rtsafety::ScopedAudioThread rtSafetyScope_
+#define RT_SAFETY_ALLOW_BLOCKING() collidoscope::rtsafety::ScopedAllowBlocking rtSafetyAllowBlocking_
+#else
+#define RT_SAFETY_SCOPE()
+#define RT_SAFETY_ALLOW_BLOCKING()
+#endif
@@ -0,0 +1,101 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/Cinder.h"
+#include "cinder/audio/Node.h"
+
+#include "TripleBuffer.h"
+
+#include <atomic>
+#include <vector>
+
+typedef std::shared_ptr<class ScopeTapNode> ScopeTapNodeRef;
+
+
+/**
+ * A node in the Cinder audio graph that passes the audio through untouched and takes snapshots of it for the oscilloscope.
+ *
+ * At each block the audio thread writes a snapshot, decimated if the block is longer than the maximum snapshot size,
+ * into a triple buffer. The graphic thread grabs the latest snapshot with update() and reads it with getSnapshot(),
+ * never touching the audio buffers. Consecutive silent snapshots are published only once, so that the graphics
+ * don't need to change when there is no sound.
+ *
+ * Multichannel audio is summed into one channel before the snapshot is taken.
+ *
+ * The node keeps two snapshots worth of history. In TriggerMode::ZERO_CROSSING the snapshot starts at the latest
+ * rising zero crossing of the history, so that periodic waveforms stand still on the screen.
+ */
+class ScopeTapNode : public ci::audio::Node
+{
+public:
+
+    enum class TriggerMode
+    {
+        FREE_RUN,       // the snapshot is the last block
+        ZERO_CROSSING   // the snapshot starts at a rising zero crossing, when there is one
+    };
+
+    /**
+     * Constructor. \a maxSnapshotFrames is the maximum length of a snapshot, longer blocks are decimated
+     */
+    ScopeTapNode( size_t maxSnapshotFrames, const Format &format = Format() );
+
+    void setTriggerMode( TriggerMode mode ) { mTriggerMode = mode; }
+
+    TriggerMode getTriggerMode() const { return mTriggerMode; }
+
+    /** Grabs the latest snapshot of the audio. Returns false if nothing new was published. Called from the graphic thread */
+    bool update() { return mSnapshots.update(); }
+
+    /** Returns the snapshot grabbed by the last update(). Called from the graphic thread */
+    const std::vector< float >& getSnapshot() const { return mSnapshots.getReadBuffer(); }
+
+    /** Number of frames in a snapshot. Valid after the node has been initialized */
+    size_t getNumSnapshotFrames() const { return mNumSnapshotFrames; }
+
+protected:
+    void initialize() override;
+
+    void process( ci::audio::Buffer *buffer ) override;
+
+private:
+    const size_t mMaxSnapshotFrames;
+
+    // how many frames of a block are averaged into one frame of the snapshot
+    size_t mDecimation;
+
+    size_t mNumSnapshotFrames;
+
+    // the last two snapshots worth of audio. Audio thread only
+    std::vector< float > mHistory;
+
+    // the channels summed into one, when there are more than one. Audio thread only
+    std::vector< float > mMix;
+
+    TripleBuffer< std::vector< float > > mSnapshots;
+
+    // whether the last snapshot published was silent. Audio thread only
+    bool mLastSnapshotSilent;
+
+    std::atomic< TriggerMode > mTriggerMode;
+};
@@ -0,0 +1,100 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+
+
+namespace collidoscope {
+
+/**
+ * Precomputed table of the frequency ratios of pitch intervals, so that notes, pitch bends and glides
+ * can be turned into playback rates without calling std::pow in the audio thread.
+ *
+ * The table covers +/- kMaxSemitones with kStepsPerSemitone entries per semitone. Whole semitones
+ * are entries of the table, so their ratio is exact. For the intervals in between the closest lower entry is multiplied
+ * by the ratio of the remainder, from the first terms of the series of the exponential: the remainder is less than
+ * 1/kStepsPerSemitone of a semitone, so the ratio is within 1e-11 of the exact one. The grains keep the rate for
+ * seconds, so a bend that is not exact would drift their phase audibly.
+ *
+ * Like PGranular it's header based and only depends on the std library.
+ */
+class SemitoneRatios
+{
+public:
+    static const int kMaxSemitones = 96;
+    static const int kStepsPerSemitone = 16;
+
+    /** The table shared by all the synthesizers. The first call fills it, so make it before the audio starts */
+    static const SemitoneRatios& get()
+    {
+        static const SemitoneRatios ratios;
+        return ratios;
+    }
+
+    SemitoneRatios()
+    {
+        for ( size_t i = 0; i < kTableSize; i++ ){
+            const int step = int( i ) - kMaxSemitones * kStepsPerSemitone;
+            mTable[i] = std::pow( 2.0, double( step ) / double( 12 * kStepsPerSemitone ) );
+        }
+    }
+
+    /** Frequency ratio of an interval of \a semitones, clamped to +/- kMaxSemitones */
+    double ratio( double semitones ) const
+    {
+        double position = ( semitones + kMaxSemitones ) * kStepsPerSemitone;
+        if ( position <= 0.0 )
+            return mTable.front();
+        if ( position >= double( kTableSize - 1 ) )
+            return mTable.back();
+
+        const size_t index = size_t( position );
+        const double decimal = position - double( index );
+        if ( decimal == 0.0 )
+            return mTable[index];
+
+        // 2^( decimal / ( 12 * kStepsPerSemitone ) ) = e^x
+        const double x = decimal * ( 0.69314718055994530942 / double( 12 * kStepsPerSemitone ) );
+        return mTable[index] * ( 1.0 + x * ( 1.0 + x * ( 0.5 + x * ( 1.0 / 6.0 ) ) ) );
+    }
+
+    /** Frequency ratio of an interval of whole \a semitones, clamped to +/- kMaxSemitones */
+    double ratio( int semitones ) const
+    {
+        if ( semitones < -kMaxSemitones )
+            semitones = -kMaxSemitones;
+        else if ( semitones > kMaxSemitones )
+            semitones = kMaxSemitones;
+
+        return mTable[size_t( ( semitones + kMaxSemitones ) * kStepsPerSemitone )];
+    }
+
+private:
+    static const size_t kTableSize = 2 * kMaxSemitones * kStepsPerSemitone + 1;
+
+    std::array< double, kTableSize > mTable;
+};
+
+} // namespace collidoscope
@@ -0,0 +1,149 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class AudioEngine;
+
+
+/**
+ * Keeps the session on disk so that after a crash or a reboot the application comes back as it was left:
+ * the recorded waves, the peaks of their chunks and the parameters of every wave.
+ *
+ * The session file is a versioned binary image mapped in memory. It's made of a header followed by one section per wave,
+ * each holding the parameters, the chunk peaks and the samples of the recorder buffer. open() maps the file at startup
+ * and the content of the previous session is read straight from the mapping. The file is discarded when its version
+ * or layout (number of waves, chunks, frames, sample rate) doesn't match the current configuration.
+ *
+ * After start() a background thread writes the session incrementally: at every pass it copies only the parameters
+ * and chunks that changed and the frames recorded since the previous pass, then flushes the dirty pages.
+ * The graphic thread reports the changes through setParam(), setChunk() and clearChunks().
+ */
+class SessionStore
+{
+public:
+
+    static const std::uint32_t kVersion = 1;
+
+    /** Parameters of a wave saved in the session */
+    enum Param {
+        kParamSelectionStart,  // in chunks
+        kParamSelectionSize,   // in chunks
+        kParamDuration,        // grain duration coefficient
+        kParamFilter,          // filter knob value, 0 to 1
+        kParamGain,            // gain knob value, 0 to 1
+        kNumParams
+    };
+
+    SessionStore();
+
+    ~SessionStore();
+
+    // no copies
+    SessionStore( const SessionStore &copy ) = delete;
+    SessionStore & operator=(const SessionStore &copy) = delete;
+
+    /**
+     * Maps the session file, creating it if it doesn't exist or doesn't match the layout passed as argument.
+     * Returns true if the file holds a session saved by a previous run. Returns false and leaves the store
+     * unusable if the file can't be mapped.
+     */
+    bool open( const std::string &path, std::size_t numWaves, std::size_t numChunks, std::size_t numFrames, std::size_t sampleRate );
+
+    /** Whether open() succeeded */
+    bool isOpen() const { return mMapping != nullptr; }
+
+    /** Number of frames recorded in the saved wave */
+    std::size_t getNumRecordedFrames( std::size_t waveIdx ) const;
+
+    /** Samples of the saved wave, straight from the mapped file */
+    const float* getSamples( std::size_t waveIdx ) const;
+
+    /** Number of chunks of the saved wave that have been set */
+    std::size_t getNumChunksSet( std::size_t waveIdx ) const;
+
+    /** Peaks of the saved chunk, straight from the mapped file */
+    void getChunk( std::size_t waveIdx, std::size_t chunkIdx, float &min, float &max ) const;
+
+    /** Returns true and sets \a value if the parameter was saved */
+    bool getParam( std::size_t waveIdx, Param param, float &value ) const;
+
+    /** Records a parameter change. Called from the graphic thread */
+    void setParam( std::size_t waveIdx, Param param, float value );
+
+    /** Records the peaks of a chunk. Called from the graphic thread */
+    void setChunk( std::size_t waveIdx, std::size_t chunkIdx, float min, float max );
+
+    /** Forgets the chunks and the recorded frames of the wave, when a new recording starts. Called from the graphic thread */
+    void clearChunks( std::size_t waveIdx );
+
+    /**
+     * Starts the background thread writing the session. The recordings are read from \a audioEngine,
+     * which must outlive the store or be followed by stop()
+     */
+    void start( AudioEngine &audioEngine );
+
+    /** Writes the last changes, stops the background thread and unmaps the file */
+    void stop();
+
+private:
+
+    struct WaveState
+    {
+        std::vector< bool > dirtyChunks;
+        bool chunksCleared = false;
+        std::uint32_t paramsDirty = 0;  // one bit per Param
+        float params[kNumParams];
+        std::size_t numFramesWritten = 0;  // background thread only
+    };
+
+    void run();
+
+    // copies the changes into the mapping. Background thread only
+    void writeChanges();
+
+    std::uint8_t* waveSection( std::size_t waveIdx ) const;
+
+    std::uint8_t *mMapping;
+    std::size_t mMappingSize;
+    int mFile;
+
+    std::size_t mNumWaves;
+    std::size_t mNumChunks;
+    std::size_t mNumFrames;
+    std::size_t mWaveSectionSize;
+
+    // changes reported by the graphic thread, not written yet
+    std::mutex mMutex;
+    std::vector< WaveState > mWaveStates;
+
+    AudioEngine *mAudioEngine;
+
+    std::atomic< bool > mRunning;
+    std::thread mThread;
+};
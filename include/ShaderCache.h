@@ -0,0 +1,53 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/gl/GlslProg.h"
+
+#include <cstddef>
+
+
+/**
+ * Cache of the GLSL programs of the application, keyed by their source code.
+ *
+ * Every wave has its own chunk renderer and particle controller, each with its own batch. The batches can't be shared
+ * as they draw different buffers, but they all run one of the same few programs: getting the programs from the cache
+ * compiles and links each of them only once, however many waves there are.
+ *
+ * Must be used from the thread owning the GL context only.
+ */
+class ShaderCache
+{
+public:
+
+    /** Returns the program built from \a format, building it the first time the same sources are passed */
+    static ci::gl::GlslProgRef get( const ci::gl::GlslProg::Format &format );
+
+    /** Number of programs built */
+    static std::size_t getNumPrograms();
+
+    /** Number of calls to get() that found the program in the cache */
+    static std::size_t getNumHits();
+
+    /** Releases all the programs. The batches using them keep their own reference */
+    static void clear();
+};
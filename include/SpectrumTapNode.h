@@ -0,0 +1,122 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/Cinder.h"
+#include "cinder/audio/Node.h"
+#include "cinder/audio/dsp/RingBuffer.h"
+#include "cinder/audio/dsp/Fft.h"
+
+#include "TripleBuffer.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+typedef std::shared_ptr<class SpectrumTapNode> SpectrumTapNodeRef;
+
+
+/**
+ * A node in the Cinder audio graph that passes the audio through untouched and feeds a spectrum analyzer running on its own thread.
+ *
+ * At each block the audio thread sums the channels into one and writes them into a ring buffer: that's all it does.
+ * The analyzer thread reads the ring buffer a hop at a time and, for each hop, takes the FFT of the last fftSize samples
+ * (Hann window, overlap of fftSize / hop) with ci::audio::dsp::Fft, which is the vectorized real FFT of the platform.
+ * The power of the FFT bins is gathered in numBands bands spaced logarithmically in frequency, turned into dB and
+ * scaled to [0, 1] between kMinDb and 0 dBFS. The bands jump up at once and fall with a release time,
+ * then they are published through a triple buffer: the graphic thread grabs the latest bands with update() and reads
+ * them with getBands(). Once the bands have fallen to zero they are published only once, like the silent oscilloscope snapshots.
+ *
+ * If the analyzer thread falls behind, the blocks that don't fit in the ring buffer are dropped.
+ * The thread is started in initialize() and stopped in uninitialize().
+ */
+class SpectrumTapNode : public ci::audio::Node
+{
+public:
+
+    // bottom of the scale of the bands, in dBFS
+    static const int kMinDb = -90;
+
+    /**
+     * Constructor. \a fftSize is the size of the FFT, a power of two, and \a hopSize the number of samples between two FFTs.
+     * \a numBands is the number of bands of the spectrum and \a releaseTime the time a band takes to fall by 1/e of the scale, in seconds
+     */
+    SpectrumTapNode( size_t fftSize, size_t hopSize, size_t numBands, double releaseTime, const Format &format = Format() );
+
+    ~SpectrumTapNode();
+
+    /** Grabs the latest bands of the spectrum. Returns false if nothing new was published. Called from the graphic thread */
+    bool update() { return mBands.update(); }
+
+    /** Returns the bands grabbed by the last update(), from the lowest frequency, in [0, 1]. Called from the graphic thread */
+    const std::vector< float >& getBands() const { return mBands.getReadBuffer(); }
+
+    size_t getNumBands() const { return mNumBands; }
+
+    /** Number of audio blocks dropped because the analyzer thread fell behind */
+    size_t getNumDroppedBlocks() const { return mNumDroppedBlocks; }
+
+protected:
+    void initialize() override;
+
+    void uninitialize() override;
+
+    void process( ci::audio::Buffer *buffer ) override;
+
+private:
+
+    // analyzer thread function 
+    void run();
+
+    // FFT of the current frame, published to the graphic thread 
+    void analyze();
+
+    void stopThread();
+
+    const size_t mFftSize;
+    const size_t mHopSize;
+    const size_t mNumBands;
+    const double mReleaseTime;
+
+    // the channels summed into one. Audio thread only 
+    std::vector< float > mMix;
+
+    std::unique_ptr< ci::audio::dsp::RingBuffer > mRingBuffer;
+    std::atomic< size_t > mNumDroppedBlocks;
+
+    // analyzer thread only 
+    std::unique_ptr< ci::audio::dsp::Fft > mFft;
+    std::vector< float > mWindow;
+    std::vector< float > mFrame;           // last fftSize samples 
+    ci::audio::Buffer mFftInput;
+    ci::audio::BufferSpectral mSpectrum;
+    std::vector< size_t > mBandEdges;      // first bin of each band, and one past the last bin of the last band 
+    std::vector< float > mSmoothedBands;
+    float mReleaseCoeff;
+    bool mLastBandsSilent;
+
+    TripleBuffer< std::vector< float > > mBands;
+
+    std::thread mThread;
+    std::atomic< bool > mRunning;
+};
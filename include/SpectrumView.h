@@ -0,0 +1,79 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/Color.h"
+#include "cinder/gl/gl.h"
+#include "cinder/gl/Batch.h"
+
+#include <vector>
+
+
+/**
+ * Draws the spectrum of the output as bars, with one instanced draw call.
+ *
+ * Every band is an instance made of its index and its height in [0, 1]. The heights are set with setBands() only when
+ * the analyzer publishes new ones, and copied onto the GPU with one mapped write. The vertex shader spreads the bars over
+ * the width of the window and scales them to the height of the view, so resizing the window doesn't touch the instances.
+ */
+class SpectrumView
+{
+public:
+
+    /**
+     * Constructor, takes as argument the number of bands of the spectrum
+     */
+    SpectrumView( size_t numBands );
+
+    /** no copies */
+    SpectrumView( const SpectrumView &copy ) = delete;
+    SpectrumView & operator=(const SpectrumView &copy) = delete;
+
+    /** Sets the heights of the bars from \a numBands bands in [0, 1]. Bands beyond the number of bars are ignored */
+    void setBands( const float *bands, size_t numBands );
+
+    /** Sets all the bars to zero */
+    void reset();
+
+    /**
+     * Draws the bars over the width of the window, from \a bottomY up to \a height pixels.
+     * The blending is left to the caller.
+     */
+    void draw( float windowWidth, float bottomY, float height, const ci::ColorA &color );
+
+    size_t getNumBands() const { return mInstances.size(); }
+
+private:
+
+    /** Per-instance data, as laid out in the instance buffer */
+    struct Instance
+    {
+        float index;
+        float height;
+    };
+
+    std::vector< Instance > mInstances;
+
+    ci::gl::VboRef mInstanceVbo;
+
+    ci::gl::BatchRef mBatch;
+};
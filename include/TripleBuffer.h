@@ -0,0 +1,93 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+
+
+/**
+ * Triple buffer to pass snapshots of data from one writer thread to one reader thread without locks.
+ *
+ * The writer fills getWriteBuffer() and calls publish(). The reader calls update() and then reads getReadBuffer().
+ * Writer and reader always own a slot each and the third slot is exchanged atomically between them, so
+ * neither ever waits for the other and the reader never sees a slot while it's being written.
+ * If the writer publishes more often than the reader updates, only the latest snapshot is kept.
+ */
+template <typename T>
+class TripleBuffer {
+
+public:
+
+    TripleBuffer() :
+        mMiddle( 1 ),
+        mWrite( 0 ),
+        mRead( 2 )
+    {
+    }
+
+    // no copy
+    TripleBuffer( const TripleBuffer &copy ) = delete;
+    TripleBuffer & operator=(const TripleBuffer &copy) = delete;
+
+    /** Access to the three slots, to allocate them before the threads start */
+    T& getSlot( size_t i ) { return mSlots[i]; }
+
+    /** Slot owned by the writer thread */
+    T& getWriteBuffer() { return mSlots[mWrite]; }
+
+    /** Makes the content of the write buffer available to the reader. Called by the writer thread */
+    void publish()
+    {
+        mWrite = mMiddle.exchange( mWrite | kNewData ) & kIndexMask;
+    }
+
+    /** 
+     * Grabs the latest snapshot published, if any. Called by the reader thread.
+     * Returns true if a new snapshot is available in getReadBuffer()
+     */
+    bool update()
+    {
+        if ( ( mMiddle.load() & kNewData ) == 0 )
+            return false;
+
+        mRead = mMiddle.exchange( mRead ) & kIndexMask;
+        return true;
+    }
+
+    /** Slot owned by the reader thread */
+    const T& getReadBuffer() const { return mSlots[mRead]; }
+
+private:
+
+    static const unsigned kNewData = 4;
+    static const unsigned kIndexMask = 3;
+
+    std::array< T, 3 > mSlots;
+
+    // index of the slot that is neither written nor read, plus the kNewData flag when the writer published it
+    std::atomic< unsigned > mMiddle;
+
+    unsigned mWrite;
+    unsigned mRead;
+
+};
@@ -26,9 +26,11 @@
 #include "cinder/app/App.h"
 #include "cinder/gl/gl.h"
 #include "cinder/gl/Batch.h"
+#include "cinder/gl/Fbo.h"
 
 
 #include "Chunk.h"
+#include "ChunkRenderer.h"
 #include "DrawInfo.h"
 
 #ifdef USE_PARTICLES
@@ -40,7 +42,8 @@
 #include "cinder/Rand.h"
 
 #include <vector>
-#include <map>
+#include <array>
+#include <cstdint>
 
 
 class DrawInfo;
@@ -57,8 +60,11 @@ using ci::ColorA;
  */ 
 struct Cursor {
     static const int kNoPosition = -100;
+    static const int kInactive = -1;
     int pos;
     double lastUpdate;
+    // index of this cursor in the wave's list of active cursors, kInactive when the cursor is not active
+    int activeIdx = kInactive;
 };
 
 /**
@@ -112,6 +118,7 @@ public:
         inline void setToNull(){
             mParticleSpread = 1.0f;
             mNull = true;
+            mWave->mStaticLayerDirty = true;
         }
 
         inline bool isNull() const{
@@ -146,10 +153,18 @@ public:
 
     
 
-    /* Maps id of the synth to cursor. There is one cursor for each Synth being played */
-    std::map < SynthID, Cursor > mCursors;
-    /** Holds the positions of the cursor, namely on which chunk the cursor is currently on */
-    std::vector<int> mCursorsPos;
+    /** Synth IDs travel as one byte in the cursor trigger messages, so there are at most 256 cursors */
+    static const size_t kMaxCursors = 256;
+
+    /* Cursors indexed by synth ID (see cursorSlot()). There is one cursor for each Synth being played */
+    std::array< Cursor, kMaxCursors > mCursors;
+    /* Slots of the active cursors, in no particular order */
+    std::array< std::uint8_t, kMaxCursors > mActiveCursors;
+    size_t mNumActiveCursors = 0;
+    /** For each chunk, whether a cursor is on it. Filled once per frame in draw() */
+    std::vector< std::uint8_t > mChunkHasCursor;
+
+    static size_t cursorSlot( SynthID id ) { return std::uint8_t( id ); }
 
 public:
     
@@ -178,7 +193,12 @@ public:
      *  If the cursor doesn't exist it is created */
     inline void setCursorPos( SynthID id, int pos, const DrawInfo& di ){
 
-        Cursor & cursor = mCursors[id];
+        const size_t slot = cursorSlot( id );
+        Cursor & cursor = mCursors[slot];
+        if ( cursor.activeIdx == Cursor::kInactive ){
+            cursor.activeIdx = int( mNumActiveCursors );
+            mActiveCursors[mNumActiveCursors++] = std::uint8_t( slot );
+        }
         cursor.pos = pos;
         cursor.lastUpdate = ci::app::getElapsedSeconds();
 
@@ -212,10 +232,18 @@ public:
 
     void update( double secondsPerChunk, const DrawInfo& di );
 
-    void removeCursor( SynthID id ) { mCursors.erase( id ); }
+    void removeCursor( SynthID id );
+
+    /** Returns whether anything of this wave is moving: cursors, particles or chunks being created or reset */
+    bool isAnimating() const;
 
     /** Sets the transparency of this wave. \a alpha ranges from 0 to 1 */
-    inline void setselectionAlpha(float alpha){ mFilterCoeff = alpha;}
+    inline void setselectionAlpha(float alpha){ 
+        if ( alpha != mFilterCoeff ){
+            mFilterCoeff = alpha;
+            mStaticLayerDirty = true;
+        }
+    }
 
     void draw( const DrawInfo& di );
 
@@ -225,7 +253,8 @@ public:
 
     void setScopePoint(int index, float audioVal);
 
-    Wave( size_t numChunks, Color selectionColor );
+    /** Constructor. \a maxParticles is the maximum number of particles of the wave, when particles are enabled */
+    Wave( size_t numChunks, Color selectionColor, size_t maxParticles );
 
     /** no copies */
     Wave( const Wave &copy ) = delete;
@@ -245,8 +274,19 @@ private:
     // How much filter is applied in audio. It affects the alpha value of the selection color.
     float mFilterCoeff;
 
-    // cinder gl batch for batch drawing 
-    ci::gl::BatchRef mChunkBatch;
+    // draws all the chunks of the wave with one draw call 
+    ChunkRenderer mChunkRenderer;
+
+    // cache of the static layer of the wave: chunks and selection, without the cursors. Premultiplied alpha
+    ci::gl::FboRef mStaticLayerFbo;
+    // whether the cache has to be drawn again. Set when the chunks, the selection or the window change
+    bool mStaticLayerDirty = true;
+
+    // scales the x-axis of the model view so that the wave fits the window 
+    void scaleToWindow( const DrawInfo& di );
+
+    // draws the static layer in the cache 
+    void drawStaticLayer( const DrawInfo& di );
 
 };
 
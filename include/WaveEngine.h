@@ -0,0 +1,189 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/audio/Context.h"
+#include "cinder/audio/InputNode.h"
+#include "cinder/audio/ChannelRouterNode.h"
+#include "cinder/audio/FilterNode.h"
+#include "cinder/audio/GainNode.h"
+#include "BufferToWaveRecorderNode.h"
+#include "PGranularNode.h"
+#include "ScopeTapNode.h"
+#include "RingBufferPack.h"
+#include "XrunMonitor.h"
+#include "LatencyProbe.h"
+
+#include "Messages.h"
+#include "Config.h"
+
+typedef std::shared_ptr<class WaveOutputNode> WaveOutputNodeRef;
+
+
+/**
+ * The end of the output part of a wave graph. It is not connected to the context output:
+ * the wave graph is pulled explicitly through render(), possibly from a thread other than the audio thread.
+ */
+class WaveOutputNode : public ci::audio::Node
+{
+public:
+    WaveOutputNode( const Format &format = Format() );
+
+    /** Pulls the wave graph for the current block and leaves the result in the render buffer */
+    void render();
+
+    /** Buffer containing the last block rendered by render() */
+    const ci::audio::Buffer& getRenderBuffer() const { return mRenderBuffer; }
+
+protected:
+    void initialize() override;
+
+    void process( ci::audio::Buffer *buffer ) override {}
+
+private:
+    ci::audio::BufferDynamic mRenderBuffer;
+};
+
+
+/**
+ * Holds the audio graph of one wave: recorder, granular synth, filter, gain, oscilloscope monitor
+ * and the queues used to talk to the graphic thread.
+ *
+ * The input part (input router and recorder) is processed by the audio thread as usual.
+ * The output part (granular synth, filter and gain) ends in a WaveOutputNode and it's rendered by WaveMixerNode,
+ * that can spread the waves of the audio engine over several threads.
+ *
+ * With Config::getNumSpatialChannels() set, the output part has that many channels and each grain is panned over them.
+ */
+class WaveEngine
+{
+public:
+
+    WaveEngine( const Config &config, size_t waveIdx, const ci::audio::InputDeviceNodeRef &inputDeviceNode, XrunMonitor &xrunMonitor, LatencyProbe &latencyProbe );
+
+    // no copies
+    WaveEngine( const WaveEngine &copy ) = delete;
+    WaveEngine & operator=(const WaveEngine &copy) = delete;
+
+    void record();
+
+    /** Sends a note message (loop on/off, note on/off) to the granular synth. Called from the graphic thread */
+    void sendNoteMsg( const NoteMsg &msg );
+
+    /**
+     * Sends a note message to the granular synth. Called from the MIDI thread of the input port \a port.
+     * Returns false if there is no direct queue for the port or the queue is full.
+     */
+    bool sendDirectNoteMsg( size_t port, const NoteMsg &msg );
+
+    size_t getRecordWaveAvailable();
+
+    bool readRecordWave( RecordWaveMsg* buffer, size_t count );
+
+    void setSelectionSize( size_t size );
+
+    void setSelectionStart( size_t start );
+
+    void setGrainDurationCoeff( double coeff );
+
+    void setFilterCutoff( double cutoff );
+
+    void setGain( double gain );
+
+    /** Bends the pitch of the granular synth, in semitones */
+    void setPitchBend( double semitones );
+
+    /** Sets the portamento time of the granular synth, in seconds */
+    void setGlideTime( double seconds );
+
+    /** Schedules the grains at \a grainsPerSecond, see PGranular::setDensity(). 0 for one grain every selection size */
+    void setGrainDensity( double grainsPerSecond );
+
+    void setGrainJitter( double jitter );
+
+    /** Duration of the grains scheduled by density, in seconds */
+    void setGrainTime( double seconds );
+
+    void checkCursorTriggers( std::vector<CursorTriggerMsg>& cursorTriggers );
+
+    /** Grabs the latest snapshot of the audio scoped in the oscilloscope. Returns false if there is none new. Called from the graphic thread */
+    bool updateScopeSnapshot() { return mScopeTapNode->update(); }
+
+    /** The snapshot grabbed by the last updateScopeSnapshot(). Called from the graphic thread */
+    const std::vector< float >& getScopeSnapshot() const { return mScopeTapNode->getSnapshot(); }
+
+    size_t getScopeNumFrames() const { return mScopeTapNode->getNumSnapshotFrames(); }
+
+    void setScopeTriggerMode( ScopeTapNode::TriggerMode mode ) { mScopeTapNode->setTriggerMode( mode ); }
+
+    /** Length of the recorder buffer in frames */
+    size_t getRecorderNumFrames() const { return mBufferRecorderNode->getNumFrames(); }
+
+    /** Number of frames recorded so far. Called from any thread */
+    size_t getRecordedNumFrames() const { return mBufferRecorderNode->getWritePosition(); }
+
+    /** The recorder buffer. Only the first getRecordedNumFrames() frames are meaningful */
+    const float* getRecordedSamples() { return mBufferRecorderNode->getRecorderBuffer()->getData(); }
+
+    /** Copies a recording into the recorder buffer. Called from the graphic thread when the wave is not recording */
+    void restoreRecording( const float *samples, size_t numFrames ) { mBufferRecorderNode->restore( samples, numFrames ); }
+
+    /** Onsets of the recording, built while it's recorded or restored. Called from any thread */
+    const collidoscope::OnsetIndex& getOnsetIndex() const { return mBufferRecorderNode->getOnsetIndex(); }
+
+    /** Frame of the last recorder overrun. Zero if none since the last call */
+    uint64_t getLastRecorderOverrun();
+
+    /** Seeds the random offsets of the grains again, from the next block */
+    void setRandomSeed( uint32_t seed ) { mPGranularNode->setRandomSeed( seed ); }
+
+    /** Sets the frame of the next block rendered by hand with the audio context disabled, see PGranularNode::setOffline() */
+    void setOffline( bool offline, uint64_t frame = 0 ) { mPGranularNode->setOffline( offline, frame ); }
+
+    /** Renders the output part of the wave graph. Called by WaveMixerNode, from the audio thread or a wave render thread */
+    void render() { mOutputNode->render(); }
+
+    /** The last block rendered by render(). One channel, or Config::getNumSpatialChannels() channels when the grains are panned */
+    const ci::audio::Buffer& getRenderBuffer() const { return mOutputNode->getRenderBuffer(); }
+
+    size_t getWaveIdx() const { return mWaveIdx; }
+
+private:
+    const size_t mWaveIdx;
+
+    // node for mic input
+    ci::audio::ChannelRouterNodeRef mInputRouterNode;
+    // node for recording audio input into buffer. Also sends chunks information through
+    // non-blocking queue
+    BufferToWaveRecorderNodeRef mBufferRecorderNode;
+    // pgranulars wrapped in a Cinder::Node
+    PGranularNodeRef mPGranularNode;
+    // node for lowpass filtering
+    ci::audio::FilterLowPassNodeRef mLowPassFilterNode;
+    // node taking the snapshots of the audio scoped in the oscilloscope
+    ScopeTapNodeRef mScopeTapNode;
+    ci::audio::GainNodeRef mGainNode;
+    // end of the output graph, pulled by the WaveMixerNode
+    WaveOutputNodeRef mOutputNode;
+
+    std::unique_ptr< RingBufferPack<CursorTriggerMsg> > mCursorTriggerRingBufferPack;
+};
@@ -0,0 +1,136 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/Cinder.h"
+#include "cinder/audio/Node.h"
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <memory>
+
+class WaveEngine;
+class ClockBridge;
+class XrunMonitor;
+
+typedef std::shared_ptr<class WaveMixerNode> WaveMixerNodeRef;
+
+
+/**
+ * A node in the Cinder audio graph that renders the output graph of every wave and mixes them into the context output.
+ *
+ * The waves are spread over a number of render lanes. Lane 0 is the audio thread itself, every other lane
+ * has its own thread, so that with N cores up to N waves are rendered at the same time.
+ * At each audio block the audio thread wakes up the render threads, renders the waves of lane 0, waits for
+ * the other lanes to finish and finally mixes each wave into output channel ( wave index % number of output channels ).
+ * The render threads follow an atomic block counter: after rendering they spin on it for a small fraction of the block
+ * period, then park on a semaphore that the audio thread signals, without taking any lock, when it moves the counter.
+ * The audio thread waits for the other lanes at most a fraction of the block duration: after that it renders itself
+ * the waves that a late lane has not started yet, and only waits for the ones already being rendered.
+ * The waves whose grains are panned over several channels are mixed channel by channel instead.
+ *
+ * The render threads are started in initialize() and stopped in uninitialize().
+ * At the beginning of each block the node also stamps the block in the ClockBridge, before the waves read their notes,
+ * and in the XrunMonitor, before the waves log their events.
+ */
+class WaveMixerNode : public ci::audio::Node
+{
+public:
+
+    /**
+     * Constructor.
+     * \param waves the wave engines to render. They must outlive the node
+     * \param numLanes maximum number of threads rendering the waves, audio thread included
+     * \param clockBridge maps the host time onto the frame counter, stamped at every block
+     * \param xrunMonitor watches the timing of the blocks, stamped at every block
+     * \param waitFraction fraction of the block duration the audio thread waits for the other lanes before rendering their waves
+     * \param spinFraction fraction of the block duration a render thread spins waiting for the next block before parking
+     */
+    WaveMixerNode( const std::vector< WaveEngine* > &waves, size_t numLanes, ClockBridge &clockBridge, XrunMonitor &xrunMonitor, double waitFraction, double spinFraction, const Format &format = Format() );
+
+    ~WaveMixerNode();
+
+    /** Number of threads rendering the waves, audio thread included */
+    size_t getNumLanes() const { return mLanes.size(); }
+
+protected:
+    void initialize()                           override;
+
+    void uninitialize()                         override;
+
+    void process( ci::audio::Buffer *buffer )   override;
+
+private:
+
+    class Semaphore;
+
+    struct Lane
+    {
+        Lane();
+        ~Lane();
+
+        std::vector< WaveEngine* > waves;
+        // index of the next wave to render in the current block, claimed by either the lane's thread or the audio thread
+        std::atomic< size_t > nextWave;
+        // number of waves rendered in the current block
+        std::atomic< size_t > numRendered;
+        // set by the lane's thread before it waits on wakeUp, cleared by whoever signals it
+        std::atomic< bool > parked;
+        std::unique_ptr< Semaphore > wakeUp;
+        std::thread thread;
+    };
+
+    // thread function of lanes other than 0
+    void run( Lane *lane );
+
+    // spins for at most spinNs, then parks, until the block counter moves past lastBlock or the node stops.
+    // Returns the new block counter
+    uint64_t waitForBlock( Lane *lane, uint64_t lastBlock, uint64_t spinNs );
+
+    // wakes up the lane's thread if it's parked. Real-time safe
+    static void unpark( Lane *lane );
+
+    // renders the waves of the lane that nobody has claimed yet in the current block
+    static void renderUnclaimed( Lane *lane );
+
+    void startThreads();
+
+    void stopThreads();
+
+    const std::vector< WaveEngine* > mWaves;
+
+    ClockBridge &mClockBridge;
+
+    XrunMonitor &mXrunMonitor;
+
+    std::vector< std::unique_ptr< Lane > > mLanes;
+
+    // incremented by the audio thread at each block to wake up the render threads
+    std::atomic< uint64_t > mBlockCounter;
+
+    const double mWaitFraction;
+    const double mSpinFraction;
+
+    std::atomic< bool > mRunning;
+};
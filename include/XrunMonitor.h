@@ -0,0 +1,191 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/Cinder.h"
+#include "cinder/audio/dsp/RingBuffer.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+/**
+ * Watches the timing of the audio callback and keeps a post-mortem trace of what happened in the audio thread.
+ *
+ * Every audio block is stamped by WaveMixerNode, before it renders the waves, so that the events logged while a block
+ * renders are counted in that block. If the time elapsed since the previous block exceeds the block period
+ * (times a tolerance coefficient) the block is considered a deadline miss. The audio nodes also log the events they handle
+ * (note messages, grains triggered and parameter changes) into a fixed-size event ring.
+ *
+ * When a miss is detected, or when an overrun/underrun is reported from the graphic thread through requestDump(),
+ * the audio thread freezes a copy of the last N blocks and events. A background thread then writes the frozen trace to disk.
+ * The audio thread never allocates, locks or does I/O.
+ *
+ * blockBegin() must be called from the audio thread only. logEvent() can also be called by the threads rendering the waves
+ * in parallel with the audio thread, as every call claims its own slot in the event ring.
+ */
+class XrunMonitor
+{
+public:
+
+    /** Type of the events stored in the trace */
+    enum class EventType : std::uint8_t {
+        NOTE,             // a NoteMsg was applied. arg1 = Command, arg2 = midi note
+        GRAIN_TRIGGER,    // new grains were triggered. arg1 = synth ID
+        SYNTH_END,        // synth became idle. arg1 = synth ID
+        PARAM_CHANGE,     // a parameter was applied. arg1 = Param, value = new value
+        DEADLINE_MISS,    // the block came in late. value = interval in milliseconds
+        RECORDER_OVERRUN, // the recorder skipped frames. arg1 = frame of the overrun
+        INPUT_UNDERRUN,   // the input device underrun. arg1 = frame of the underrun
+        INPUT_OVERRUN     // the input device overrun. arg1 = frame of the overrun
+    };
+
+    /** Parameters logged with EventType::PARAM_CHANGE */
+    enum Param {
+        kParamSelectionSize,
+        kParamSelectionStart,
+        kParamGrainDurationCoeff,
+        kParamPitchBend,
+        kParamGlideTime,
+        kParamGrainDensity,
+        kParamGrainJitter,
+        kParamGrainTime
+    };
+
+    /** One audio block worth of timing information */
+    struct BlockRecord
+    {
+        std::uint64_t frame;     // number of frames processed by the audio context at the beginning of the block
+        std::uint64_t timeNs;    // time the block started, in nanoseconds from the monitor creation
+        std::uint64_t intervalNs;// time since the beginning of the previous block
+        std::uint32_t numEvents; // number of events logged in this block
+        bool late;               // whether this block missed the deadline
+    };
+
+    /** An event that happened in the audio thread */
+    struct EventRecord
+    {
+        std::uint64_t frame;
+        EventType type;
+        std::int8_t waveIdx;
+        std::int64_t arg1;
+        std::int64_t arg2;
+        double value;
+    };
+
+    /**
+     * Constructor.
+     * \param numBlocks number of blocks kept in the trace ring
+     * \param numEvents number of events kept in the trace ring
+     * \param tolerance a block is late when it comes after more than tolerance * block period
+     * \param filePrefix prefix of the path of the trace files written to disk
+     */
+    XrunMonitor( std::size_t numBlocks, std::size_t numEvents, double tolerance, const std::string &filePrefix );
+
+    ~XrunMonitor();
+
+    // no copies
+    XrunMonitor( const XrunMonitor &copy ) = delete;
+    XrunMonitor & operator=(const XrunMonitor &copy) = delete;
+
+    /** Starts the background thread that flushes the frozen traces to disk */
+    void start();
+
+    /** Stops the background thread. Any trace still frozen is flushed before returning */
+    void stop();
+
+    /** Called from the audio thread at the beginning of each block */
+    void blockBegin( std::uint64_t frame, std::size_t numFrames, std::size_t sampleRate );
+
+    /** Called from the audio thread, or from a wave render thread, to log an event in the trace */
+    void logEvent( EventType type, int waveIdx, std::int64_t arg1 = 0, std::int64_t arg2 = 0, double value = 0.0 );
+
+    /**
+     * Called from a non real-time thread when an overrun or underrun is detected.
+     * The audio thread logs the event and freezes the trace at the beginning of the next block in which no trace is frozen,
+     * so requests made close together get a trace each. When too many requests are pending the new ones are dropped.
+     */
+    void requestDump( EventType type, int waveIdx, std::uint64_t frame );
+
+    /** Number of deadline misses since the monitor was created */
+    std::size_t getNumMisses() const { return mNumMisses; }
+
+    /** Number of traces written to disk since the monitor was created */
+    std::size_t getNumDumps() const { return mNumDumps; }
+
+private:
+
+    // called in the audio thread. Copies the trace rings in the frozen arrays
+    void freeze( EventType reason );
+
+    // background thread function
+    void run();
+
+    // writes the frozen trace to disk
+    void flush();
+
+    std::uint64_t nowNs() const;
+
+    const double mTolerance;
+    const std::string mFilePrefix;
+    const std::chrono::steady_clock::time_point mCreationTime;
+
+    // trace rings. Blocks are written by the audio thread only, events by the audio thread and the wave render threads
+    std::vector<BlockRecord> mBlocks;
+    std::vector<EventRecord> mEvents;
+    std::size_t mBlockWriteIdx;
+    std::size_t mNumBlocksTotal;
+    std::atomic<std::size_t> mNumEventsTotal;
+    std::atomic<std::size_t> mNumEventsLogged;
+    std::uint64_t mCurrentFrame;
+    std::uint64_t mLastBlockTimeNs;
+
+    // frozen copy of the rings. Owned by the audio thread when mFrozen is false and by the writer thread when it's true
+    std::vector<BlockRecord> mFrozenBlocks;
+    std::vector<EventRecord> mFrozenEvents;
+    std::size_t mFrozenNumBlocks;
+    std::size_t mFrozenNumEvents;
+    EventType mFrozenReason;
+    std::atomic<bool> mFrozen;
+
+    // dumps requested by the graphic thread, read by the audio thread
+    struct DumpRequest
+    {
+        EventType type;
+        int waveIdx;
+        std::uint64_t frame;
+    };
+
+    static const std::size_t kMaxPendingDumps;
+
+    ci::audio::dsp::RingBufferT<DumpRequest> mDumpRequests;
+
+    std::atomic<std::size_t> mNumMisses;
+    std::atomic<std::size_t> mNumDumps;
+
+    std::atomic<bool> mRunning;
+    std::thread mWriterThread;
+};
+
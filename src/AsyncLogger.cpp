@@ -0,0 +1,382 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "AsyncLogger.h"
+#include "LatencyProbe.h"
+#include "RtSafety.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+
+
+namespace {
+
+// how often the background thread drains the rings
+const std::chrono::milliseconds kDrainInterval( 20 );
+
+const char * const kLevelNames[] = { "VERBOSE", "INFO", "WARNING", "ERROR" };
+
+// format string of each AsyncLogger::Code. The four arguments are always passed as doubles
+const char * const kCodeFormats[] = {
+    "deadline miss at frame %.0f, block interval %.3f ms",
+    "pending notes full, wave %.0f: note for frame %.0f applied at the beginning of the block",
+    "direct note queue full, port %.0f wave %.0f: note %.0f sent through the graphic thread",
+    "MIDI event queue full, port %.0f: %.0f events dropped so far",
+    "benchmark block %.0f call %.0f"
+};
+
+static_assert( sizeof( kCodeFormats ) / sizeof( kCodeFormats[0] ) == std::size_t( AsyncLogger::Code::NUM_CODES ), "one format per code" );
+
+}
+
+
+AsyncLogger& AsyncLogger::instance()
+{
+    static AsyncLogger logger;
+    return logger;
+}
+
+AsyncLogger::AsyncLogger() :
+    mMaxFileSize( 0 ),
+    mNumFiles( 1 ),
+    mRingSize( 0 ),
+    mNumUnclaimedDropped( 0 ),
+    mNumUnclaimedDroppedReported( 0 ),
+    mFile( nullptr ),
+    mFileSize( 0 ),
+    mStartTime( 0 ),
+    mStarted( false ),
+    mRunning( false )
+{
+    // the ring of each thread is kept in pthread specific data, for the same reason as in RtSafety.cpp
+    pthread_key_create( &mRingKey, &AsyncLogger::releaseRing );
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    stop();
+}
+
+void AsyncLogger::start( const std::string &path, std::size_t maxFileSize, std::size_t numFiles, std::size_t numThreads, std::size_t ringSize )
+{
+    if ( mStarted )
+        return;
+
+    mPath = path;
+    mMaxFileSize = maxFileSize;
+    mNumFiles = std::max< std::size_t >( numFiles, 1 );
+    mRingSize = ringSize;
+
+    for ( std::size_t i = 0; i < numThreads; i++ ){
+        std::unique_ptr< Ring > ring( new Ring );
+        ring->records.reset( new Record[ringSize] );
+        ring->index = std::uint16_t( i );
+        ring->claimed = false;
+        ring->writeIdx = 0;
+        ring->readIdx = 0;
+        ring->numDropped = 0;
+        ring->numDroppedReported = 0;
+        mRings.push_back( std::move( ring ) );
+    }
+
+    // enough room to sort the content of all the rings at once
+    mDrainBuffer.reserve( numThreads * ringSize );
+
+    mFile = std::fopen( mPath.c_str(), "a" );
+    if ( mFile != nullptr ){
+        std::fseek( mFile, 0, SEEK_END );
+        mFileSize = std::size_t( std::ftell( mFile ) );
+    }
+
+    mStartTime = LatencyProbe::now();
+
+    const std::time_t wallTime = std::time( nullptr );
+    char line[128];
+    const int size = std::snprintf( line, sizeof( line ), "---- log started %s", std::ctime( &wallTime ) );
+    write( line, std::size_t( size ) );
+
+    mStarted.store( true, std::memory_order_release );
+    mRunning = true;
+    mThread = std::thread( &AsyncLogger::run, this );
+}
+
+void AsyncLogger::stop()
+{
+    if ( !mRunning )
+        return;
+
+    mRunning = false;
+    if ( mThread.joinable() )
+        mThread.join();
+
+    if ( mFile != nullptr ){
+        std::fclose( mFile );
+        mFile = nullptr;
+    }
+}
+
+AsyncLogger::Ring* AsyncLogger::threadRing()
+{
+    Ring *ring = static_cast< Ring* >( pthread_getspecific( mRingKey ) );
+    if ( ring != nullptr )
+        return ring;
+
+    for ( auto &candidate : mRings ){
+        bool claimed = false;
+        if ( candidate->claimed.compare_exchange_strong( claimed, true ) ){
+            pthread_setspecific( mRingKey, candidate.get() );
+            return candidate.get();
+        }
+    }
+
+    return nullptr;
+}
+
+void AsyncLogger::releaseRing( void *ring )
+{
+    // the records left in the ring are drained as usual: the next owner goes on from the same write index
+    static_cast< Ring* >( ring )->claimed = false;
+}
+
+bool AsyncLogger::log( Level level, Code code, double arg0, double arg1, double arg2, double arg3 )
+{
+    if ( !mStarted.load( std::memory_order_acquire ) )
+        return false;
+
+    Ring *ring = threadRing();
+    if ( ring == nullptr ){
+        mNumUnclaimedDropped.fetch_add( 1, std::memory_order_relaxed );
+        return false;
+    }
+
+    // single producer: only this thread moves the write index
+    const std::uint64_t writeIdx = ring->writeIdx.load( std::memory_order_relaxed );
+    if ( writeIdx - ring->readIdx.load( std::memory_order_acquire ) >= mRingSize ){
+        ring->numDropped.fetch_add( 1, std::memory_order_relaxed );
+        return false;
+    }
+
+    Record &record = ring->records[writeIdx % mRingSize];
+    record.timestamp = LatencyProbe::now();
+    record.args[0] = arg0;
+    record.args[1] = arg1;
+    record.args[2] = arg2;
+    record.args[3] = arg3;
+    record.threadIdx = ring->index;
+    record.code = code;
+    record.level = level;
+
+    ring->writeIdx.store( writeIdx + 1, std::memory_order_release );
+    return true;
+}
+
+std::uint64_t AsyncLogger::getNumDropped() const
+{
+    std::uint64_t numDropped = mNumUnclaimedDropped;
+    for ( auto &ring : mRings )
+        numDropped += ring->numDropped;
+
+    return numDropped;
+}
+
+void AsyncLogger::run()
+{
+    while ( mRunning ){
+        drain();
+        std::this_thread::sleep_for( kDrainInterval );
+    }
+
+    // whatever was logged right before stop()
+    drain();
+}
+
+void AsyncLogger::drain()
+{
+    mDrainBuffer.clear();
+
+    char line[512];
+
+    for ( std::size_t i = 0; i < mRings.size(); i++ ){
+        Ring &ring = *mRings[i];
+
+        const std::uint64_t readIdx = ring.readIdx.load( std::memory_order_relaxed );
+        const std::uint64_t writeIdx = ring.writeIdx.load( std::memory_order_acquire );
+        for ( std::uint64_t idx = readIdx; idx < writeIdx; idx++ ){
+            mDrainBuffer.push_back( ring.records[idx % mRingSize] );
+        }
+        ring.readIdx.store( writeIdx, std::memory_order_release );
+
+        const std::uint64_t numDropped = ring.numDropped;
+        if ( numDropped != ring.numDroppedReported ){
+            const int size = std::snprintf( line, sizeof( line ), "[thread %zu] %llu records dropped, ring full\n",
+                i, static_cast< unsigned long long >( numDropped - ring.numDroppedReported ) );
+            write( line, std::size_t( size ) );
+            ring.numDroppedReported = numDropped;
+        }
+    }
+
+    const std::uint64_t numUnclaimedDropped = mNumUnclaimedDropped;
+    if ( numUnclaimedDropped != mNumUnclaimedDroppedReported ){
+        const int size = std::snprintf( line, sizeof( line ), "%llu records dropped, no ring left\n",
+            static_cast< unsigned long long >( numUnclaimedDropped - mNumUnclaimedDroppedReported ) );
+        write( line, std::size_t( size ) );
+        mNumUnclaimedDroppedReported = numUnclaimedDropped;
+    }
+
+    // each ring is in order, merge them by time
+    std::stable_sort( mDrainBuffer.begin(), mDrainBuffer.end(), []( const Record &a, const Record &b ){
+        return a.timestamp < b.timestamp;
+    } );
+
+    for ( const Record &record : mDrainBuffer ){
+        // the benchmark records only measure log(): written out they would rotate away the real diagnostics
+        if ( record.code == Code::BENCHMARK )
+            continue;
+
+        const double seconds = record.timestamp > mStartTime ? double( record.timestamp - mStartTime ) / 1.0e9 : 0.0;
+
+        int size = std::snprintf( line, sizeof( line ), "%12.6f [thread %u] %s: ", seconds, unsigned( record.threadIdx ),
+            kLevelNames[std::size_t( record.level )] );
+
+        size += std::snprintf( line + size, sizeof( line ) - size, kCodeFormats[std::size_t( record.code )],
+            record.args[0], record.args[1], record.args[2], record.args[3] );
+
+        size = std::min( size, int( sizeof( line ) ) - 2 );
+        line[size++] = '\n';
+        line[size] = '\0';
+
+        write( line, std::size_t( size ) );
+    }
+
+    if ( mFile != nullptr )
+        std::fflush( mFile );
+}
+
+void AsyncLogger::write( const char *line, std::size_t size )
+{
+    if ( mFile == nullptr )
+        return;
+
+    if ( mMaxFileSize > 0 && mFileSize + size > mMaxFileSize )
+        rotate();
+
+    if ( mFile == nullptr )
+        return;
+
+    std::fwrite( line, 1, size, mFile );
+    mFileSize += size;
+}
+
+void AsyncLogger::rotate()
+{
+    std::fclose( mFile );
+
+    // path.(n-2) -> path.(n-1) ... path -> path.1. The oldest file is overwritten
+    for ( std::size_t i = mNumFiles - 1; i > 0; i-- ){
+        const std::string from = i == 1 ? mPath : mPath + "." + std::to_string( i - 1 );
+        const std::string to = mPath + "." + std::to_string( i );
+        std::rename( from.c_str(), to.c_str() );
+    }
+
+    // with one file only it's just truncated
+    mFile = std::fopen( mPath.c_str(), "w" );
+    mFileSize = 0;
+}
+
+std::string AsyncLogger::runBenchmark( std::size_t numBlocks, std::size_t callsPerBlock, double blockDuration )
+{
+    std::ostringstream report;
+    if ( !mStarted ){
+        report << "AsyncLogger benchmark: logger not started";
+        return report.str();
+    }
+
+    const std::size_t numCalls = numBlocks * callsPerBlock;
+    std::vector< std::uint64_t > costs( numCalls );
+    std::uint64_t numDropped = 0;
+    std::uint64_t timerCost = std::numeric_limits< std::uint64_t >::max();
+
+    // a fresh thread, so that it claims its own ring like the audio thread does
+    std::thread benchmarkThread( [&]() {
+        // cost of reading the clock twice, subtracted from the measures
+        for ( int i = 0; i < 1000; i++ ){
+            const std::uint64_t begin = LatencyProbe::now();
+            timerCost = std::min( timerCost, LatencyProbe::now() - begin );
+        }
+
+        const auto period = std::chrono::nanoseconds( std::uint64_t( blockDuration * 1.0e9 ) );
+        auto blockStart = std::chrono::steady_clock::now();
+
+        for ( std::size_t block = 0; block < numBlocks; block++ ){
+            {
+                RT_SAFETY_SCOPE();
+
+                for ( std::size_t call = 0; call < callsPerBlock; call++ ){
+                    const std::uint64_t begin = LatencyProbe::now();
+                    const bool logged = log( Level::VERBOSE, Code::BENCHMARK, double( block ), double( call ) );
+                    const std::uint64_t end = LatencyProbe::now();
+
+                    costs[block * callsPerBlock + call] = end - begin;
+                    if ( !logged )
+                        numDropped++;
+                }
+            }
+
+            blockStart += period;
+            std::this_thread::sleep_until( blockStart );
+        }
+    } );
+    benchmarkThread.join();
+
+    for ( auto &cost : costs )
+        cost = cost > timerCost ? cost - timerCost : 0;
+
+    std::sort( costs.begin(), costs.end() );
+
+    std::uint64_t total = 0;
+    for ( auto cost : costs )
+        total += cost;
+
+    auto percentile = [&costs]( double p ) {
+        return costs[std::min( costs.size() - 1, std::size_t( p * double( costs.size() ) ) )];
+    };
+
+    report << "AsyncLogger benchmark: " << numCalls << " calls, " << callsPerBlock << " per block of "
+        << std::fixed << std::setprecision( 3 ) << blockDuration * 1000.0 << " ms\n";
+
+    if ( numCalls > 0 ){
+        report << "  cost per call (ns): min " << costs.front()
+            << ", mean " << std::setprecision( 1 ) << double( total ) / double( numCalls )
+            << ", median " << percentile( 0.5 )
+            << ", p99 " << percentile( 0.99 )
+            << ", p99.9 " << percentile( 0.999 )
+            << ", max " << costs.back() << "\n";
+    }
+
+    report << "  timer overhead subtracted: " << timerCost << " ns\n";
+    report << "  dropped: " << numDropped;
+
+    return report.str();
+}
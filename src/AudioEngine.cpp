@@ -24,116 +24,79 @@
 // app.h include not used 
 #include "cinder/app/App.h"
 #include "Log.h"
+#include "ControlStream.h"
+#include "SemitoneRatios.h"
 
-using namespace ci::audio;
-
-/* Frequency ratios in the chromatic scale */
-double chromaticRatios[] = { 
-    1, 
-    1.0594630943591, 
-    1.1224620483089, 
-    1.1892071150019, 
-    1.2599210498937, 
-    1.3348398541685, 
-    1.4142135623711, 
-    1.4983070768743, 
-    1.5874010519653, 
-    1.6817928305039, 
-    1.7817974362766, 
-    1.8877486253586 
-};
+#include <algorithm>
 
+using namespace ci::audio;
+using namespace controlstream;
 
 /*
  * Calculates the ratio between the frequency of the midi note passed as argument and middle C note ( MIDI value = 60 ).
  * This is used for pitch shifting the granular synth output, according to the key pressed by the user.
  * The middle C is taken as reference in pitch in the pitch shifting of Collidoscope output.
  * That is, with the middle C the output is not pitch shifted at all and is equal in frequency to the recorder sample.
- *
+ * The ratio comes from the semitone table shared with the granular synths, so it's just a lookup also from the MIDI threads.
  */ 
 inline double calculateMidiNoteRatio( int midiNote )
 {
-    int distanceFromCenter = midiNote - 60; // 60 is the central midi note 
-
-    if ( distanceFromCenter < 0 ){
-        int diffAmount = -distanceFromCenter;
-        int octaves = diffAmount / 12;
-        int intervals = diffAmount % 12;
-
-        return std::pow( 0.5, octaves ) / chromaticRatios[intervals];
-    }
-    else{
-        int octaves = distanceFromCenter / 12;
-        int intervals = distanceFromCenter % 12;
-
-        return std::pow( 2, octaves ) * chromaticRatios[intervals];
-    }
+    return collidoscope::SemitoneRatios::get().ratio( midiNote - 60 ); // 60 is the central midi note 
 }
 
 
-AudioEngine::AudioEngine()
+AudioEngine::AudioEngine() :
+    mCapture( nullptr ),
+    mOffline( false ),
+    mOfflineFrame( 0 )
 {}
 
 AudioEngine::~AudioEngine()
-{}
+{
+    // the nodes keep references to the monitor and to the ring buffers: stop the audio before they are destroyed 
+    Context::master()->disable();
+
+    if ( mXrunMonitor )
+        mXrunMonitor->stop();
+}
 
 void AudioEngine::setup(const Config& config)
 {
-    
-    for ( int i = 0; i < NUM_WAVES; i++ ){
-        mCursorTriggerRingBufferPacks[i].reset( new RingBufferPack<CursorTriggerMsg>( 512 ) ); // FIXME 
-    }
+    mXrunMonitor.reset( new XrunMonitor( 
+        config.getXrunTraceNumBlocks(), 
+        config.getXrunTraceNumEvents(), 
+        config.getXrunToleranceCoeff(), 
+        config.getXrunTraceFilePrefix() ) );
 
     /* audio context */
     auto ctx = Context::master();
 
     /* audio input device */
-    auto inputDeviceNode = ctx->createInputDeviceNode( Device::getDefaultInput() );
+    mInputDeviceNode = ctx->createInputDeviceNode( Device::getDefaultInput() );
  
+    /* one wave graph for each wave, the audio input channels are routed to the waves */
+    std::vector< WaveEngine* > waves;
+    for ( size_t i = 0; i < config.getNumWaves(); i++ ){
+        mWaveEngines.push_back( std::unique_ptr< WaveEngine >( new WaveEngine( config, i, mInputDeviceNode, *mXrunMonitor, mLatencyProbe ) ) );
+        waves.push_back( mWaveEngines.back().get() );
+    }
 
-    /* route the audio input, which is two channels, to one wave graph for each channel */
-    for ( int chan = 0; chan < NUM_WAVES; chan++ ){
-
-        /* one channel router */
-        mInputRouterNodes[chan] = ctx->makeNode( new ChannelRouterNode( Node::Format().channels( 1 ) ) );
-
-        /* buffer recorders */  
-        mBufferRecorderNodes[chan] = ctx->makeNode( new BufferToWaveRecorderNode( config.getNumChunks(), config.getWaveLen() ) );
-        /* this prevents the node from recording before record is pressed */
-        mBufferRecorderNodes[chan]->setAutoEnabled( false );
-
-        // route the input part of the audio graph. Two channels input goes into one channel route
-        // and from one channel route to one channel buffer recorder 
-        inputDeviceNode >> mInputRouterNodes[chan]->route( chan, 0, 1 ) >> mBufferRecorderNodes[chan];
-
-        // create PGranular loops passing the buffer of the RecorderNode as argument to the contructor 
-        // use -1 as ID as the loop corresponds to no midi note 
-        mPGranularNodes[chan] = ctx->makeNode( new PGranularNode( mBufferRecorderNodes[chan]->getRecorderBuffer(), mCursorTriggerRingBufferPacks[chan]->getBuffer() ) );
-
-        // create filter nodes 
-        mLowPassFilterNodes[chan] = ctx->makeNode( new FilterLowPassNode( MonitorNode::Format().channels( 1 ) ) );
-        mLowPassFilterNodes[chan]->setCutoffFreq( config.getMaxFilterCutoffFreq() );
-        mLowPassFilterNodes[chan]->setQ( 0.707f );
-
-        // create monitor nodes for oscilloscopes
-        mOutputMonitorNodes[chan] = ctx->makeNode( new MonitorNode( MonitorNode::Format().channels( 1 ) ) );
-        mGainNodes[chan] = ctx->makeNode( new GainNode( MonitorNode::Format().channels( 1 ) ) );
+    /* the mixer renders the waves spread over the cores and sends them to output */
+    mWaveMixerNode = ctx->makeNode( new WaveMixerNode( waves, config.getMaxWaveRenderThreads(), mClockBridge, *mXrunMonitor, config.getWaveRenderWaitFraction(), config.getWaveRenderSpinFraction(), Node::Format().channels( ctx->getOutput()->getNumChannels() ) ) );
+    /* the output goes through the spectrum analyzer tap, that only copies it for the analyzer thread */
+    mSpectrumTapNode = ctx->makeNode( new SpectrumTapNode( config.getSpectrumFftSize(), config.getSpectrumFftSize() / config.getSpectrumOverlap(), 
+        config.getSpectrumNumBands(), config.getSpectrumReleaseTime(), Node::Format().channels( ctx->getOutput()->getNumChannels() ) ) );
+    mWaveMixerNode >> mSpectrumTapNode >> ctx->getOutput();
 
-        // all output goes to the filter 
-        mPGranularNodes[chan] >> mLowPassFilterNodes[chan];
-        
-        mOutputRouterNodes[chan] = ctx->makeNode( new ChannelRouterNode( Node::Format().channels( 2 ) ) );
+    mXrunMonitor->start();
 
-        // filter goes to output 
-        mLowPassFilterNodes[chan] >> mGainNodes[chan] >> mOutputRouterNodes[chan]->route( 0, chan, 1 ) >> ctx->getOutput();
-        
-        // what goes to output goes to oscilloscope as well
-        mLowPassFilterNodes[chan] >> mOutputMonitorNodes[chan];
-    }
+    mLatencyProbe.setBlockDuration( double( ctx->getFramesPerBlock() ) / double( ctx->getSampleRate() ) );
+    mNoteSchedulingDelay = config.getMIDISchedulingDelay() * ctx->getFramesPerBlock();
+    mRandomSeed = config.getRandomSeed();
 
     ctx->getOutput()->enableClipDetection( false );
     /* enable the whole audio graph */
-    inputDeviceNode->enable();
+    mInputDeviceNode->enable();
     ctx->enable();
 }
 
@@ -144,61 +107,271 @@ size_t AudioEngine::getSampleRate()
 
 void AudioEngine::loopOn( size_t waveIdx )
 {
+    capture( EngineCall::LOOP_ON, waveIdx );
+
     NoteMsg msg = makeNoteMsg( Command::LOOP_ON, 1, 1.0 );
-    mPGranularNodes[waveIdx]->getNoteRingBuffer().write( &msg, 1 );
+    mWaveEngines[waveIdx]->sendNoteMsg( msg );
 }
 
 void AudioEngine::loopOff( size_t waveIdx )
 {
+    capture( EngineCall::LOOP_OFF, waveIdx );
+
     NoteMsg msg = makeNoteMsg( Command::LOOP_OFF, 0, 0.0 );
-    mPGranularNodes[waveIdx]->getNoteRingBuffer().write( &msg, 1 );
+    mWaveEngines[waveIdx]->sendNoteMsg( msg );
 }
 
 void AudioEngine::record( size_t waveIdx )
 {
-    mBufferRecorderNodes[waveIdx]->start();
+    mWaveEngines[waveIdx]->record();
+
+    // reported after the recorder is reset, so that the capture doesn't take the previous recording for this one 
+    capture( EngineCall::RECORD, waveIdx );
 }
 
 void AudioEngine::noteOn( size_t waveIdx, int midiNote )
 {
+    capture( EngineCall::NOTE_ON, waveIdx, midiNote );
     
     double midiAsRate = calculateMidiNoteRatio(midiNote);
     NoteMsg msg = makeNoteMsg( Command::NOTE_ON, midiNote, midiAsRate );
 
-    mPGranularNodes[waveIdx]->getNoteRingBuffer().write( &msg, 1 );
+    mWaveEngines[waveIdx]->sendNoteMsg( msg );
 }
 
 void AudioEngine::noteOff( size_t waveIdx, int midiNote )
 {
+    capture( EngineCall::NOTE_OFF, waveIdx, midiNote );
+
     NoteMsg msg = makeNoteMsg( Command::NOTE_OFF, midiNote, 0.0 );
-    mPGranularNodes[waveIdx]->getNoteRingBuffer().write( &msg, 1 );
+    mWaveEngines[waveIdx]->sendNoteMsg( msg );
 }
 
+void AudioEngine::noteOnAt( size_t waveIdx, int midiNote, uint64_t frame )
+{
+    capture( EngineCall::NOTE_ON_AT, waveIdx, midiNote, 0.0, frame );
+
+    NoteMsg msg = makeNoteMsg( Command::NOTE_ON, midiNote, calculateMidiNoteRatio( midiNote ), 0, frame );
+    mWaveEngines[waveIdx]->sendNoteMsg( msg );
+}
+
+void AudioEngine::noteOffAt( size_t waveIdx, int midiNote, uint64_t frame )
+{
+    capture( EngineCall::NOTE_OFF_AT, waveIdx, midiNote, 0.0, frame );
+
+    NoteMsg msg = makeNoteMsg( Command::NOTE_OFF, midiNote, 0.0, 0, frame );
+    mWaveEngines[waveIdx]->sendNoteMsg( msg );
+}
 
+uint64_t AudioEngine::noteFrame( uint64_t timestamp ) const
+{
+    const uint64_t frame = mClockBridge.hostToFrame( timestamp );
+    // the audio hasn't started yet: as soon as possible 
+    if ( frame == 0 )
+        return 0;
+
+    return frame + mNoteSchedulingDelay;
+}
+
+bool AudioEngine::directNoteOn( size_t port, size_t waveIdx, int midiNote, uint64_t timestamp )
+{
+    if ( waveIdx >= mWaveEngines.size() )
+        return false;
+
+    const uint64_t frame = noteFrame( timestamp );
+    NoteMsg msg = makeNoteMsg( Command::NOTE_ON, midiNote, calculateMidiNoteRatio( midiNote ), timestamp, frame );
+    if ( !mWaveEngines[waveIdx]->sendDirectNoteMsg( port, msg ) )
+        return false;
+
+    captureFromMidi( port, EngineCall::NOTE_ON_AT, waveIdx, midiNote, frame );
+    return true;
+}
+
+bool AudioEngine::directNoteOff( size_t port, size_t waveIdx, int midiNote, uint64_t timestamp )
+{
+    if ( waveIdx >= mWaveEngines.size() )
+        return false;
+
+    const uint64_t frame = noteFrame( timestamp );
+    NoteMsg msg = makeNoteMsg( Command::NOTE_OFF, midiNote, 0.0, timestamp, frame );
+    if ( !mWaveEngines[waveIdx]->sendDirectNoteMsg( port, msg ) )
+        return false;
+
+    captureFromMidi( port, EngineCall::NOTE_OFF_AT, waveIdx, midiNote, frame );
+    return true;
+}
+
+
+
+size_t AudioEngine::getWaveNumFrames( size_t waveIdx ) const
+{
+    return mWaveEngines[waveIdx]->getRecorderNumFrames();
+}
+
+const collidoscope::OnsetIndex& AudioEngine::getOnsetIndex( size_t waveIdx ) const
+{
+    return mWaveEngines[waveIdx]->getOnsetIndex();
+}
+
+size_t AudioEngine::getRecordedNumFrames( size_t waveIdx ) const
+{
+    return mWaveEngines[waveIdx]->getRecordedNumFrames();
+}
+
+const float* AudioEngine::getRecordedSamples( size_t waveIdx )
+{
+    return mWaveEngines[waveIdx]->getRecordedSamples();
+}
+
+void AudioEngine::restoreRecording( size_t waveIdx, const float *samples, size_t numFrames )
+{
+    mWaveEngines[waveIdx]->restoreRecording( samples, numFrames );
+
+    capture( EngineCall::RESTORE, waveIdx );
+}
 
 void AudioEngine::setSelectionSize( size_t waveIdx, size_t size )
 {
-    mPGranularNodes[waveIdx]->setSelectionSize( size );
+    capture( EngineCall::SELECTION_SIZE, waveIdx, 0, double( size ) );
+    mWaveEngines[waveIdx]->setSelectionSize( size );
 }
 
 void AudioEngine::setSelectionStart( size_t waveIdx, size_t start )
 {
-    mPGranularNodes[waveIdx]->setSelectionStart( start );
+    capture( EngineCall::SELECTION_START, waveIdx, 0, double( start ) );
+    mWaveEngines[waveIdx]->setSelectionStart( start );
 }
 
 void AudioEngine::setGrainDurationCoeff( size_t waveIdx, double coeff )
 {
-    mPGranularNodes[waveIdx]->setGrainsDurationCoeff( coeff );
+    capture( EngineCall::GRAIN_DURATION, waveIdx, 0, coeff );
+    mWaveEngines[waveIdx]->setGrainDurationCoeff( coeff );
 }
 
 void AudioEngine::setFilterCutoff( size_t waveIdx, double cutoff )
 {
-    mLowPassFilterNodes[waveIdx]->setCutoffFreq(cutoff);
+    capture( EngineCall::FILTER_CUTOFF, waveIdx, 0, cutoff );
+    mWaveEngines[waveIdx]->setFilterCutoff( cutoff );
 }
 
 void AudioEngine::setGain( size_t waveIdx, double cutoff )
 {
-    mGainNodes[waveIdx]->setValue( cutoff );
+    capture( EngineCall::GAIN, waveIdx, 0, cutoff );
+    mWaveEngines[waveIdx]->setGain( cutoff );
+}
+
+void AudioEngine::setPitchBend( size_t waveIdx, double semitones )
+{
+    capture( EngineCall::PITCH_BEND, waveIdx, 0, semitones );
+    mWaveEngines[waveIdx]->setPitchBend( semitones );
+}
+
+void AudioEngine::setGlideTime( size_t waveIdx, double seconds )
+{
+    capture( EngineCall::GLIDE_TIME, waveIdx, 0, seconds );
+    mWaveEngines[waveIdx]->setGlideTime( seconds );
+}
+
+void AudioEngine::setGrainDensity( size_t waveIdx, double grainsPerSecond )
+{
+    capture( EngineCall::GRAIN_DENSITY, waveIdx, 0, grainsPerSecond );
+    mWaveEngines[waveIdx]->setGrainDensity( grainsPerSecond );
+}
+
+void AudioEngine::setGrainJitter( size_t waveIdx, double jitter )
+{
+    capture( EngineCall::GRAIN_JITTER, waveIdx, 0, jitter );
+    mWaveEngines[waveIdx]->setGrainJitter( jitter );
+}
+
+void AudioEngine::setGrainTime( size_t waveIdx, double seconds )
+{
+    capture( EngineCall::GRAIN_TIME, waveIdx, 0, seconds );
+    mWaveEngines[waveIdx]->setGrainTime( seconds );
+}
+
+uint64_t AudioEngine::getCurrentFrame() const
+{
+    return mOffline ? mOfflineFrame : Context::master()->getNumProcessedFrames();
+}
+
+size_t AudioEngine::getFramesPerBlock() const
+{
+    return Context::master()->getFramesPerBlock();
+}
+
+void AudioEngine::setRandomSeed( uint32_t seed )
+{
+    mRandomSeed = seed;
+    for ( size_t i = 0; i < mWaveEngines.size(); i++ ){
+        mWaveEngines[i]->setRandomSeed( seed + uint32_t( i ) );
+    }
+}
+
+void AudioEngine::capture( EngineCall call, size_t waveIdx, int arg, double value, uint64_t frame )
+{
+    ControlCapture *controlCapture = mCapture.load( std::memory_order_acquire );
+    if ( controlCapture == nullptr )
+        return;
+
+    controlCapture->write( makeControlEvent( Source::ENGINE, uint8_t( call ), frame != 0 ? frame : getCurrentFrame(), waveIdx, arg, value ) );
+}
+
+void AudioEngine::captureFromMidi( size_t port, EngineCall call, size_t waveIdx, int arg, uint64_t frame )
+{
+    ControlCapture *controlCapture = mCapture.load( std::memory_order_acquire );
+    if ( controlCapture == nullptr )
+        return;
+
+    // a note without frame is played as soon as possible 
+    if ( frame == 0 )
+        call = call == EngineCall::NOTE_ON_AT ? EngineCall::NOTE_ON : EngineCall::NOTE_OFF;
+
+    controlCapture->writeFromMidi( port, makeControlEvent( Source::ENGINE, uint8_t( call ), frame != 0 ? frame : getCurrentFrame(), waveIdx, arg ) );
+}
+
+void AudioEngine::beginOffline()
+{
+    auto ctx = Context::master();
+
+    // the audio thread and the render threads stay idle until endOffline() 
+    ctx->disable();
+
+    mOfflineFrame = ctx->getNumProcessedFrames();
+    mOffline = true;
+}
+
+size_t AudioEngine::renderOffline( float *out )
+{
+    const size_t numFrames = getFramesPerBlock();
+    std::fill( out, out + numFrames, 0.0f );
+
+    for ( auto &waveEngine : mWaveEngines ){
+        waveEngine->setOffline( true, mOfflineFrame );
+        waveEngine->render();
+
+        // the channels of the spatialized waves are summed 
+        const ci::audio::Buffer &renderBuffer = waveEngine->getRenderBuffer();
+        for ( size_t ch = 0; ch < renderBuffer.getNumChannels(); ch++ ){
+            const float *rendered = renderBuffer.getChannel( ch );
+            for ( size_t i = 0; i < numFrames; i++ ){
+                out[i] += rendered[i];
+            }
+        }
+    }
+
+    mOfflineFrame += numFrames;
+    return numFrames;
+}
+
+void AudioEngine::endOffline()
+{
+    for ( auto &waveEngine : mWaveEngines ){
+        waveEngine->setOffline( false );
+    }
+
+    mOffline = false;
+    Context::master()->enable();
 }
 
 // ------------------------------------------------------
@@ -207,32 +380,63 @@ void AudioEngine::setGain( size_t waveIdx, double cutoff )
 
 size_t AudioEngine::getRecordWaveAvailable( size_t waveIdx )
 {
-    return mBufferRecorderNodes[waveIdx]->getRingBuffer().getAvailableRead();
+    return mWaveEngines[waveIdx]->getRecordWaveAvailable();
 }
 
  
 bool AudioEngine::readRecordWave( size_t waveIdx, RecordWaveMsg* buffer, size_t count )
 {
-    return mBufferRecorderNodes[waveIdx]->getRingBuffer().read( buffer, count );
+    return mWaveEngines[waveIdx]->readRecordWave( buffer, count );
 }
 
 void AudioEngine::checkCursorTriggers( size_t waveIdx, std::vector<CursorTriggerMsg>& cursorTriggers )
 {
-    ci::audio::dsp::RingBufferT<CursorTriggerMsg> &ringBuffer = mCursorTriggerRingBufferPacks[waveIdx]->getBuffer();
-    CursorTriggerMsg* ringBufferReadArray = mCursorTriggerRingBufferPacks[waveIdx]->getExchangeArray();
+    mWaveEngines[waveIdx]->checkCursorTriggers( cursorTriggers );
+}
 
-    size_t availableRead = ringBuffer.getAvailableRead();
-    bool successfulRead = ringBuffer.read( ringBufferReadArray, availableRead );
+bool AudioEngine::updateScopeSnapshot( size_t waveIdx )
+{
+    return mWaveEngines[waveIdx]->updateScopeSnapshot();
+}
 
-    if ( successfulRead ){
-        for ( size_t i = 0; i < availableRead; i++ ){
-            cursorTriggers.push_back( ringBufferReadArray[i] );
-        }
+const std::vector< float >& AudioEngine::getScopeSnapshot( size_t waveIdx ) const
+{
+    return mWaveEngines[waveIdx]->getScopeSnapshot();
+}
+
+size_t AudioEngine::getScopeNumFrames( size_t waveIdx ) const
+{
+    return mWaveEngines[waveIdx]->getScopeNumFrames();
+}
+
+void AudioEngine::setScopeTriggerMode( ScopeTapNode::TriggerMode mode )
+{
+    for ( auto &waveEngine : mWaveEngines ){
+        waveEngine->setScopeTriggerMode( mode );
     }
 }
 
-const ci::audio::Buffer& AudioEngine::getAudioOutputBuffer( size_t waveIdx ) const
+void AudioEngine::checkXruns()
 {
-    return mOutputMonitorNodes[waveIdx]->getBuffer();
+    for ( size_t i = 0; i < mWaveEngines.size(); i++ ){
+        const uint64_t overrunFrame = mWaveEngines[i]->getLastRecorderOverrun();
+        if ( overrunFrame != 0 ){
+            mXrunMonitor->requestDump( XrunMonitor::EventType::RECORDER_OVERRUN, int( i ), overrunFrame );
+        }
+    }
+
+    const uint64_t inputUnderrunFrame = mInputDeviceNode->getLastUnderrun();
+    if ( inputUnderrunFrame != 0 ){
+        mXrunMonitor->requestDump( XrunMonitor::EventType::INPUT_UNDERRUN, -1, inputUnderrunFrame );
+    }
+
+    const uint64_t inputOverrunFrame = mInputDeviceNode->getLastOverrun();
+    if ( inputOverrunFrame != 0 ){
+        mXrunMonitor->requestDump( XrunMonitor::EventType::INPUT_OVERRUN, -1, inputOverrunFrame );
+    }
 }
 
+size_t AudioEngine::getNumDeadlineMisses() const
+{
+    return mXrunMonitor->getNumMisses();
+}
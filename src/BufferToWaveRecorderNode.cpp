@@ -44,6 +44,7 @@
 */
 
 #include "BufferToWaveRecorderNode.h"
+#include "RtSafety.h"
 #include "cinder/audio/Context.h"
 #include "cinder/audio/Target.h"
 
@@ -100,6 +101,7 @@ void resizeBufferAndShuffleChannels(ci::audio::BufferDynamic *buffer, size_t res
 BufferToWaveRecorderNode::BufferToWaveRecorderNode( std::size_t numChunks, double numSeconds )
     : SampleRecorderNode( Format().channels( 1 ) ),
     mLastOverrun( 0 ),
+    mRecording( false ),
     mNumChunks( numChunks ),
     mNumSeconds( numSeconds ),
     mRingBuffer( numChunks ),
@@ -125,6 +127,8 @@ void BufferToWaveRecorderNode::initialize()
     // FIXME probably could be done in constructor body 
     mNumSamplesPerChunk = std::lround( float( getNumFrames() ) / mNumChunks );
 
+    mOnsetIndex.setup( getNumFrames(), getSampleRate() );
+
     // if the buffer had already been resized, zero out any possibly existing data.
     if( resize )
         mRecorderBuffer.zero();
@@ -149,11 +153,13 @@ void BufferToWaveRecorderNode::start()
 {
     mWritePos = 0;
     mChunkIndex = 0;
+    mRecording = true;
     enable();
 }
 
 void BufferToWaveRecorderNode::stop()
 {
+    mRecording = false;
     disable();
 }
 
@@ -202,6 +208,18 @@ void BufferToWaveRecorderNode::writeToFile(const ci::fs::path &filePath, ci::aud
     target->write(copiedBuffer.get(), currentWritePos);
 }
 
+void BufferToWaveRecorderNode::restore( const float *samples, size_t numFrames )
+{
+    std::lock_guard<std::mutex> lock( getContext()->getMutex() );
+
+    numFrames = std::min( numFrames, mRecorderBuffer.getNumFrames() );
+    memcpy( mRecorderBuffer.getData(), samples, numFrames * sizeof( float ) );
+    mOnsetIndex.analyze( mRecorderBuffer.getData(), numFrames );
+
+    mChunkIndex = mNumChunks;
+    mWritePos = numFrames;
+}
+
 uint64_t BufferToWaveRecorderNode::getLastOverrun()
 {
     uint64_t result = mLastOverrun;
@@ -212,6 +230,8 @@ uint64_t BufferToWaveRecorderNode::getLastOverrun()
 
 void BufferToWaveRecorderNode::process(ci::audio::Buffer *buffer)
 {
+    RT_SAFETY_SCOPE();
+
     size_t writePos = mWritePos;
     size_t numWriteFrames = buffer->getNumFrames();
 
@@ -225,16 +245,23 @@ void BufferToWaveRecorderNode::process(ci::audio::Buffer *buffer)
         mChunkSampleCounter = 0;
         mChunkIndex = 0;
         mEnvRamp = 0.0f;
+        mOnsetIndex.reset();
     }
 
     // if buffer has too many frames (because we're nearly at the end or at the end ) 
     // of mRecoderBuffer then numWriteFrames becomes the number of samples left to 
     // fill mRecorderBuffer. Which is 0 if the buffer is at the end.
-    if ( writePos + numWriteFrames > mRecorderBuffer.getNumFrames() )
+    if ( writePos >= mRecorderBuffer.getNumFrames() )
+        numWriteFrames = 0;
+    else if ( writePos + numWriteFrames > mRecorderBuffer.getNumFrames() )
         numWriteFrames = mRecorderBuffer.getNumFrames() - writePos;
 
-    if ( numWriteFrames <= 0 )
+    if ( numWriteFrames <= 0 ){
+        // still recording with no room left: the recording lost this block
+        if ( mRecording )
+            mLastOverrun = getContext()->getNumProcessedFrames();
         return;
+    }
 
 
     // apply envelope to the buffer at the edges to avoid clicks 
@@ -258,12 +285,15 @@ void BufferToWaveRecorderNode::process(ci::audio::Buffer *buffer)
 
     mRecorderBuffer.copyOffset(*buffer, numWriteFrames, writePos, 0);
 
-    if ( numWriteFrames < buffer->getNumFrames() )
-        mLastOverrun = getContext()->getNumProcessedFrames();
+    // the wave is full: the recording ends normally, and the part of the block that didn't fit is not lost audio
+    if ( writePos + numWriteFrames == mRecorderBuffer.getNumFrames() )
+        mRecording = false;
 
-    /* find max and minimum of this buffer */
+    /* find max and minimum of this buffer and look for onsets */
     for ( size_t i = 0; i < numWriteFrames; i++ ){
 
+        mOnsetIndex.addSample( buffer->getData()[i] );
+
         if ( buffer->getData()[i] < mChunkMinAudioVal ){
             mChunkMinAudioVal = buffer->getData()[i];
         }
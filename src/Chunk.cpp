@@ -26,13 +26,11 @@
 #include "DrawInfo.h"
 
 
-#include "cinder/gl/gl.h"
-
-
 Chunk::Chunk( size_t index ) :
     mIndex( int(index) ),
     mAudioTop(0.0f),
-    mAudioBottom(0.0f)
+    mAudioBottom(0.0f),
+    mX(0.0f)
     {}
 
 
@@ -41,20 +39,19 @@ void update( const DrawInfo& di )
 
 }
 
-void Chunk::update( const DrawInfo &di )
+bool Chunk::update( const DrawInfo &di )
 {
     using namespace ci;
     /* if resetting animate the chunks to nicely shrink to 0 size */
     if ( mResetting ){
-        if ( mAnimate > 0.0f ){
-            mAnimate -= 0.1f;
-            if ( mAnimate <= 0.0f ){
-                mAnimate = 0.0f;
-                mResetting = false;
-                mAudioTop = 0.0f;
-                mAudioBottom = 0.0f;
-            }
+        mAnimate -= 0.1f;
+        if ( mAnimate <= 0.0f ){
+            mAnimate = 0.0f;
+            mResetting = false;
+            mAudioTop = 0.0f;
+            mAudioBottom = 0.0f;
         }
+        return true;
     }
     /* animate makes the chunks pop nicely when they are created */
     else if ( mAnimate < 1.0f ){
@@ -62,44 +59,20 @@ void Chunk::update( const DrawInfo &di )
         if ( mAnimate > 1.0f ){ // clip to one
             mAnimate = 1.0f;
         }
+        return true;
     }
 
-    mX = di.flipX( 1 + (mIndex * (2 + kWidth)) ); // FIXME more efficient if it happens only once when resized 
+    return false;
 }
 
-void Chunk::draw( const DrawInfo& di, ci::gl::BatchRef &batch ){
-    using namespace ci;
-    
-    gl::pushModelMatrix();
-
-    const float chunkHeight = mAnimate * mAudioTop * di.getMaxChunkHeight();
-
-    // place the chunk in the right position brings back the y of chunkHeight/2 so
-    // so that after scaling the wave is still centered at the wave center 
-    gl::translate( mX, di.getWaveCenterY() - ( chunkHeight / 2 ) - 1 );
-
-    // scale according to audio amplitude 
-    gl::scale( 1.0f, chunkHeight );
-    batch->draw();
-    
-    
-    gl::popModelMatrix();
+void Chunk::layout( const DrawInfo &di )
+{
+    mX = di.flipX( 1 + (mIndex * (2 + kWidth)) );
 }
 
-
-void Chunk::drawBar( const DrawInfo& di, ci::gl::BatchRef &batch ){
-    using namespace ci;
-
-    gl::pushModelMatrix();
-
-    const float barHeight = di.getSelectionBarHeight();
-
-    gl::translate( mX, di.getWaveCenterY() - ( barHeight / 2 ) - 1 );
-    gl::scale( 1.0f, barHeight );
-
-    batch->draw();
-
-    gl::popModelMatrix();
+float Chunk::getHeight( const DrawInfo& di ) const
+{
+    return mAnimate * mAudioTop * di.getMaxChunkHeight();
 }
 
 
@@ -0,0 +1,117 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ChunkRenderer.h"
+#include "Chunk.h"
+#include "ShaderCache.h"
+
+#include <cstddef>
+#include <cstring>
+
+using namespace ci;
+
+
+ChunkRenderer::ChunkRenderer( size_t maxInstances ) :
+    mInstances( maxInstances ),
+    mNumInstances( 0 )
+{
+    mInstanceVbo = gl::Vbo::create( GL_ARRAY_BUFFER, mInstances, GL_DYNAMIC_DRAW );
+
+    // one chunk is a rect of width kWidth and height 1, moved and stretched by the instance data
+    auto mesh = gl::VboMesh::create( geom::Rect( ci::Rectf( 0, 0, Chunk::kWidth, 1 ) ) );
+
+    geom::BufferLayout instanceLayout;
+    instanceLayout.append( geom::Attrib::CUSTOM_0, 2, sizeof( Instance ), offsetof( Instance, x ), 1 /* per instance */ );
+    instanceLayout.append( geom::Attrib::CUSTOM_1, 4, sizeof( Instance ), offsetof( Instance, color ), 1 /* per instance */ );
+    mesh->appendVbo( instanceLayout, mInstanceVbo );
+
+    // the chunk is placed at x and moved up by height/2 so that after scaling it's still centered at the wave center.
+    // The program is shared by the chunk renderers of all the waves
+#if ! defined( CINDER_GL_ES )
+    auto glsl = ShaderCache::get( gl::GlslProg::Format()
+        .vertex( CI_GLSL( 150,
+            uniform mat4    ciModelViewProjection;
+            uniform float   uWaveCenterY;
+            in vec4         ciPosition;
+            in vec2         iChunk; // x, height
+            in vec4         iColor;
+            out vec4        vColor;
+
+            void main( void ) {
+                vec4 pos = vec4( ciPosition.x + iChunk.x, uWaveCenterY - ( iChunk.y / 2.0 ) - 1.0 + ciPosition.y * iChunk.y, 0.0, 1.0 );
+                gl_Position = ciModelViewProjection * pos;
+                vColor = iColor;
+            }
+        ) )
+        .fragment( CI_GLSL( 150,
+            in vec4 vColor;
+            out vec4 oColor;
+
+            void main( void ) {
+                oColor = vColor;
+            }
+        ) )
+    );
+#else
+    auto glsl = ShaderCache::get( gl::GlslProg::Format()
+        .vertex( CI_GLSL( 300 es,
+            uniform mat4    ciModelViewProjection;
+            uniform float   uWaveCenterY;
+            in vec4         ciPosition;
+            in vec2         iChunk;
+            in vec4         iColor;
+            out vec4        vColor;
+
+            void main( void ) {
+                vec4 pos = vec4( ciPosition.x + iChunk.x, uWaveCenterY - ( iChunk.y / 2.0 ) - 1.0 + ciPosition.y * iChunk.y, 0.0, 1.0 );
+                gl_Position = ciModelViewProjection * pos;
+                vColor = iColor;
+            }
+        ) )
+        .fragment( CI_GLSL( 300 es,
+            precision highp float;
+            in vec4 vColor;
+            out vec4 oColor;
+
+            void main( void ) {
+                oColor = vColor;
+            }
+        ) )
+    );
+#endif
+
+    mBatch = gl::Batch::create( mesh, glsl, { { geom::Attrib::CUSTOM_0, "iChunk" }, { geom::Attrib::CUSTOM_1, "iColor" } } );
+}
+
+void ChunkRenderer::draw( float waveCenterY )
+{
+    if ( mNumInstances == 0 )
+        return;
+
+    // only the instances of this frame are copied onto the GPU
+    void *gpuMem = mInstanceVbo->mapReplace();
+    memcpy( gpuMem, mInstances.data(), mNumInstances * sizeof( Instance ) );
+    mInstanceVbo->unmap();
+
+    mBatch->getGlslProg()->uniform( "uWaveCenterY", waveCenterY );
+
+    mBatch->drawInstanced( GLsizei( mNumInstances ) );
+}
@@ -0,0 +1,168 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ClockBridge.h"
+
+#include <cmath>
+#include <algorithm>
+
+
+namespace {
+
+// bandwidth of the delay-locked loop in Hz. Lower is smoother but slower to follow changes
+const double kDllBandwidth = 0.5;
+
+// the loop is reset when the block comes this many periods away from the prediction, e.g. after a device restart
+const double kDllMaxErrorPeriods = 8.0;
+
+// how fast the MIDI offset estimate rises towards larger offsets, per message
+const double kMidiOffsetRise = 0.001;
+
+}
+
+
+ClockBridge::ClockBridge() :
+    mLocked( false ),
+    mDllTime( 0.0 ),
+    mDllNextTime( 0.0 ),
+    mDllPeriod( 0.0 ),
+    mDllB( 0.0 ),
+    mDllC( 0.0 ),
+    mNominalFrameNs( 0.0 ),
+    mLastFrame( 0 ),
+    mSequence( 0 ),
+    mPublishedFrame( 0 ),
+    mPublishedTime( 0.0 ),
+    mPublishedFrameNs( 0.0 ),
+    mPublishedNominalFrameNs( 0.0 )
+{
+}
+
+void ClockBridge::blockBegin( std::uint64_t frame, std::size_t numFrames, std::size_t sampleRate, std::uint64_t hostNs )
+{
+    const double now = double( hostNs );
+    const double nominalPeriod = 1.0e9 * double( numFrames ) / double( sampleRate );
+
+    if ( mLocked ){
+        const double error = now - mDllNextTime;
+        const bool discontinuity = frame != mLastFrame + numFrames || std::abs( error ) > kDllMaxErrorPeriods * nominalPeriod;
+
+        if ( discontinuity ){
+            mLocked = false;
+        }
+        else {
+            mDllTime = mDllNextTime;
+            mDllNextTime += mDllB * error + mDllPeriod;
+            mDllPeriod += mDllC * error;
+        }
+    }
+
+    if ( !mLocked ){
+        // (re)start the loop on the nominal period. See F. Adriaensen, "Using a DLL to filter time"
+        const double omega = 2.0 * M_PI * kDllBandwidth * nominalPeriod * 1.0e-9;
+        mDllB = std::sqrt( 2.0 ) * omega;
+        mDllC = omega * omega;
+        mDllPeriod = nominalPeriod;
+        mDllTime = now;
+        mDllNextTime = now + nominalPeriod;
+        mNominalFrameNs = nominalPeriod / double( numFrames );
+        mLocked = true;
+    }
+
+    mLastFrame = frame;
+
+    // publish
+    mSequence.fetch_add( 1 );
+    mPublishedFrame = frame;
+    mPublishedTime = mDllTime;
+    mPublishedFrameNs = mDllPeriod / double( numFrames );
+    mPublishedNominalFrameNs = mNominalFrameNs;
+    mSequence.fetch_add( 1 );
+}
+
+std::uint64_t ClockBridge::hostToFrame( std::uint64_t hostNs ) const
+{
+    std::uint64_t frame;
+    double time;
+    double frameNs;
+
+    std::uint32_t sequence;
+    do {
+        sequence = mSequence;
+        if ( sequence == 0 )
+            return 0; // no block processed yet
+
+        frame = mPublishedFrame;
+        time = mPublishedTime;
+        frameNs = mPublishedFrameNs;
+    } while ( ( sequence & 1 ) != 0 || sequence != mSequence );
+
+    const double frameOffset = ( double( hostNs ) - time ) / frameNs;
+    const double result = double( frame ) + frameOffset;
+
+    return result > 0.0 ? std::uint64_t( std::llround( result ) ) : 0;
+}
+
+double ClockBridge::getDriftPpm() const
+{
+    const double nominalFrameNs = mPublishedNominalFrameNs;
+    if ( nominalFrameNs == 0.0 )
+        return 0.0;
+
+    return ( mPublishedFrameNs / nominalFrameNs - 1.0 ) * 1.0e6;
+}
+
+
+MidiPortClock::MidiPortClock() :
+    mStarted( false ),
+    mFirstHostTime( 0 ),
+    mMidiTime( 0.0 ),
+    mOffset( 0.0 )
+{
+}
+
+std::uint64_t MidiPortClock::messageTime( double deltaTime, std::uint64_t hostNow )
+{
+    if ( !mStarted ){
+        mStarted = true;
+        mFirstHostTime = hostNow;
+        return hostNow;
+    }
+
+    mMidiTime += deltaTime;
+
+    // work relative to the first message to keep the precision of the doubles
+    const double midiNs = mMidiTime * 1.0e9;
+    const double offset = double( hostNow - mFirstHostTime ) - midiNs;
+
+    // the message that came with the smallest delay gives the best estimate of the offset
+    if ( offset < mOffset )
+        mOffset = offset;
+    else
+        mOffset += ( offset - mOffset ) * kMidiOffsetRise;
+
+    const double time = midiNs + mOffset;
+    if ( time <= 0.0 )
+        return mFirstHostTime;
+
+    // a message can't be from the future
+    return std::min( hostNow, mFirstHostTime + std::uint64_t( time ) );
+}
@@ -32,12 +32,26 @@ using ci::loadFile;
 
 Config::Config() :
     mAudioInputDeviceKey( "" ),
+    mNumWaves( 1 ),
+    mMaxParticles( 150 ),
     mNumChunks(150),
-    mWaveLen(2.0)
+    mWaveLen(2.0),
+    mMidiChannels( 1, 0 )
 {
 
 }
 
+void Config::setNumWaves( std::size_t numWaves )
+{
+    mNumWaves = std::max< std::size_t >( 1, numWaves );
+
+    // by default each wave listens to the MIDI channel with its own index 
+    mMidiChannels.resize( mNumWaves );
+    for ( size_t i = 0; i < mNumWaves; i++ ){
+        mMidiChannels[i] = i;
+    }
+}
+
 // uses Cinder api to parse configuration in XML file 
 void Config::loadFromFile( std::string&& path )
 {
@@ -55,10 +69,24 @@ void Config::loadFromFile( std::string&& path )
         boost::trim(waveLenStr);
         mWaveLen = ci::fromString<double>(waveLenStr);
 
+        // number of waves, optional 
+        if ( collidoscope.hasChild( "num_waves" ) ){
+            std::string numWavesStr = collidoscope.getChild( "num_waves" ).getValue();
+            boost::trim( numWavesStr );
+            setNumWaves( ci::fromString<size_t>( numWavesStr ) );
+        }
+
+        // maximum number of particles per wave, optional 
+        if ( collidoscope.hasChild( "max_particles" ) ){
+            std::string maxParticlesStr = collidoscope.getChild( "max_particles" ).getValue();
+            boost::trim( maxParticlesStr );
+            setMaxParticles( ci::fromString<size_t>( maxParticlesStr ) );
+        }
+
         // channel for each wave 
         XmlTree waves = collidoscope.getChild( "waves" );
 
-        for ( int i = 0; i < NUM_WAVES; i++ ){
+        for ( int i = 0; i < int( mNumWaves ); i++ ){
             for ( auto &wave : waves.getChildren() ){
                 int id = ci::fromString<int>( wave->getAttribute( "id" ) );
                 if ( id == i ){
@@ -0,0 +1,494 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ControlStream.h"
+#include "AudioEngine.h"
+#include "LatencyProbe.h"
+#include "Log.h"
+#include "RtSafety.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+using namespace controlstream;
+
+
+namespace {
+
+const char kMagic[8] = { 'C', 'O', 'L', 'L', 'C', 'T', 'R', 'L' };
+const std::uint32_t kVersion = 1;
+
+const std::uint32_t kEventsTag = 0x53545645;    // "EVTS"
+const std::uint32_t kRecordingTag = 0x44434552; // "RECD"
+
+// how often the writer thread drains the queues
+const std::chrono::milliseconds kWriteInterval( 100 );
+
+// notes with a frame are sent this long before they are due in the real-time replay, in seconds
+const double kNoteLookahead = 0.1;
+
+// the offline replay goes on this long after the last event, so that the grains can fade out, in seconds
+const double kOfflineTail = 2.0;
+
+struct FileHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t numWaves;
+    std::uint32_t sampleRate;
+    std::uint32_t framesPerBlock;
+    std::uint32_t randomSeed;
+    std::uint32_t reserved;
+    std::uint64_t startFrame;
+};
+
+struct ChunkHeader
+{
+    std::uint32_t tag;
+    std::uint32_t count;  // number of events, or 1 for a recording
+};
+
+struct RecordingHeader
+{
+    std::uint64_t frame;
+    std::uint32_t waveIdx;
+    std::uint32_t numFrames;
+};
+
+static_assert( sizeof( ControlEvent ) == 24, "ControlEvent is written as is" );
+
+// notes that are played at their exact frame, rather than at the beginning of the block
+inline bool isScheduledNote( const ControlEvent &event )
+{
+    return event.source == Source::ENGINE &&
+        ( event.type == std::uint8_t( EngineCall::NOTE_ON_AT ) || event.type == std::uint8_t( EngineCall::NOTE_OFF_AT ) );
+}
+
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+// MARK: - ControlCapture
+// ----------------------------------------------------------------------------------------------------
+
+ControlCapture::ControlCapture( std::size_t numMidiPorts, std::size_t queueSize ) :
+    mFile( nullptr ),
+    mAudioEngine( nullptr ),
+    mNumDropped( 0 ),
+    mRunning( false )
+{
+    // queue 0 is the graphic thread's, then one per MIDI port
+    for ( std::size_t i = 0; i < numMidiPorts + 1; i++ ){
+        mQueues.push_back( std::unique_ptr< RingBufferPack< ControlEvent > >( new RingBufferPack< ControlEvent >( queueSize ) ) );
+    }
+}
+
+ControlCapture::~ControlCapture()
+{
+    stop();
+}
+
+bool ControlCapture::start( const std::string &path, AudioEngine &audioEngine, std::uint32_t randomSeed )
+{
+    if ( mRunning )
+        return true;
+
+    mFile = std::fopen( path.c_str(), "wb" );
+    if ( mFile == nullptr ){
+        logError( "ControlCapture: cannot open capture file " + path );
+        return false;
+    }
+
+    mAudioEngine = &audioEngine;
+    mRecordingFrames.assign( audioEngine.getNumWaves(), kNoRecording );
+
+    FileHeader header;
+    std::memset( &header, 0, sizeof( header ) );
+    std::memcpy( header.magic, kMagic, sizeof( kMagic ) );
+    header.version = kVersion;
+    header.numWaves = std::uint32_t( audioEngine.getNumWaves() );
+    header.sampleRate = std::uint32_t( audioEngine.getSampleRate() );
+    header.framesPerBlock = std::uint32_t( audioEngine.getFramesPerBlock() );
+    header.randomSeed = randomSeed;
+    header.startFrame = audioEngine.getCurrentFrame();
+    std::fwrite( &header, sizeof( header ), 1, mFile );
+
+    // the input recorded so far
+    for ( std::size_t i = 0; i < audioEngine.getNumWaves(); i++ ){
+        const std::size_t numFrames = audioEngine.getRecordedNumFrames( i );
+        if ( numFrames > 0 )
+            writeRecording( header.startFrame, i, numFrames );
+    }
+
+    mRunning = true;
+    mThread = std::thread( &ControlCapture::run, this );
+    return true;
+}
+
+void ControlCapture::stop()
+{
+    if ( !mRunning )
+        return;
+
+    mRunning = false;
+    if ( mThread.joinable() )
+        mThread.join();
+
+    std::fclose( mFile );
+    mFile = nullptr;
+}
+
+bool ControlCapture::write( const ControlEvent &event )
+{
+    if ( !mQueues[0]->getBuffer().write( &event, 1 ) ){
+        mNumDropped++;
+        return false;
+    }
+
+    return true;
+}
+
+bool ControlCapture::writeFromMidi( std::size_t port, const ControlEvent &event )
+{
+    if ( port + 1 >= mQueues.size() || !mQueues[port + 1]->getBuffer().write( &event, 1 ) ){
+        mNumDropped++;
+        return false;
+    }
+
+    return true;
+}
+
+void ControlCapture::run()
+{
+    while ( mRunning ){
+        std::this_thread::sleep_for( kWriteInterval );
+        drain();
+    }
+
+    // the events reported right before stop()
+    drain();
+}
+
+void ControlCapture::drain()
+{
+    for ( auto &queue : mQueues ){
+        ci::audio::dsp::RingBufferT< ControlEvent > &ringBuffer = queue->getBuffer();
+        ControlEvent *events = queue->getExchangeArray();
+
+        const std::size_t availableRead = ringBuffer.getAvailableRead();
+        if ( availableRead == 0 || !ringBuffer.read( events, availableRead ) )
+            continue;
+
+        const ChunkHeader chunk = { kEventsTag, std::uint32_t( availableRead ) };
+        std::fwrite( &chunk, sizeof( chunk ), 1, mFile );
+        std::fwrite( events, sizeof( ControlEvent ), availableRead, mFile );
+
+        for ( std::size_t i = 0; i < availableRead; i++ ){
+            const ControlEvent &event = events[i];
+            if ( event.source != Source::ENGINE || event.waveIdx >= mRecordingFrames.size() )
+                continue;
+
+            if ( event.type == std::uint8_t( EngineCall::RECORD ) ){
+                // written once the recording is over
+                mRecordingFrames[event.waveIdx] = event.frame;
+            }
+            else if ( event.type == std::uint8_t( EngineCall::RESTORE ) ){
+                mRecordingFrames[event.waveIdx] = kNoRecording;
+                writeRecording( event.frame, event.waveIdx, mAudioEngine->getRecordedNumFrames( event.waveIdx ) );
+            }
+        }
+    }
+
+    for ( std::size_t i = 0; i < mRecordingFrames.size(); i++ ){
+        if ( mRecordingFrames[i] == kNoRecording )
+            continue;
+
+        const std::size_t numFrames = mAudioEngine->getRecordedNumFrames( i );
+        if ( numFrames >= mAudioEngine->getWaveNumFrames( i ) ){
+            writeRecording( mRecordingFrames[i], i, numFrames );
+            mRecordingFrames[i] = kNoRecording;
+        }
+    }
+
+    std::fflush( mFile );
+}
+
+void ControlCapture::writeRecording( std::uint64_t frame, std::size_t waveIdx, std::size_t numFrames )
+{
+    const ChunkHeader chunk = { kRecordingTag, 1 };
+    const RecordingHeader recording = { frame, std::uint32_t( waveIdx ), std::uint32_t( numFrames ) };
+
+    std::fwrite( &chunk, sizeof( chunk ), 1, mFile );
+    std::fwrite( &recording, sizeof( recording ), 1, mFile );
+    std::fwrite( mAudioEngine->getRecordedSamples( waveIdx ), sizeof( float ), numFrames, mFile );
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+// MARK: - ControlReplayer
+// ----------------------------------------------------------------------------------------------------
+
+ControlReplayer::ControlReplayer() :
+    mRandomSeed( 0 ),
+    mStartFrame( 0 ),
+    mEndFrame( 0 ),
+    mNumWaves( 0 ),
+    mNextEvent( 0 ),
+    mNextNote( 0 ),
+    mNextRecording( 0 ),
+    mRunning( false ),
+    mFrameOffset( 0 )
+{
+}
+
+bool ControlReplayer::load( const std::string &path )
+{
+    std::FILE *file = std::fopen( path.c_str(), "rb" );
+    if ( file == nullptr ){
+        logError( "ControlReplayer: cannot open capture file " + path );
+        return false;
+    }
+
+    FileHeader header;
+    if ( std::fread( &header, sizeof( header ), 1, file ) != 1 || std::memcmp( header.magic, kMagic, sizeof( kMagic ) ) != 0
+        || header.version != kVersion ){
+        logError( "ControlReplayer: " + path + " is not a control stream of version " + std::to_string( kVersion ) );
+        std::fclose( file );
+        return false;
+    }
+
+    mRandomSeed = header.randomSeed;
+    mStartFrame = header.startFrame;
+    mNumWaves = header.numWaves;
+    mEvents.clear();
+    mRecordings.clear();
+
+    ChunkHeader chunk;
+    bool truncated = false;
+    while ( std::fread( &chunk, sizeof( chunk ), 1, file ) == 1 ){
+        if ( chunk.tag == kEventsTag ){
+            const std::size_t first = mEvents.size();
+            mEvents.resize( first + chunk.count );
+            if ( std::fread( mEvents.data() + first, sizeof( ControlEvent ), chunk.count, file ) != chunk.count ){
+                mEvents.resize( first );
+                truncated = true;
+                break;
+            }
+        }
+        else if ( chunk.tag == kRecordingTag ){
+            RecordingHeader recordingHeader;
+            Recording recording;
+            if ( std::fread( &recordingHeader, sizeof( recordingHeader ), 1, file ) != 1 ){
+                truncated = true;
+                break;
+            }
+
+            recording.frame = recordingHeader.frame;
+            recording.waveIdx = recordingHeader.waveIdx;
+            recording.samples.resize( recordingHeader.numFrames );
+            if ( std::fread( recording.samples.data(), sizeof( float ), recordingHeader.numFrames, file ) != recordingHeader.numFrames ){
+                truncated = true;
+                break;
+            }
+            mRecordings.push_back( std::move( recording ) );
+        }
+        else {
+            truncated = true;
+            break;
+        }
+    }
+    std::fclose( file );
+
+    // e.g. the application was killed while capturing: what was read so far is still good
+    if ( truncated )
+        logError( "ControlReplayer: " + path + " is truncated, replaying the events read so far" );
+
+    // each queue is in order, but the queues are written one after the other
+    std::stable_sort( mEvents.begin(), mEvents.end(), []( const ControlEvent &a, const ControlEvent &b ) {
+        return a.frame < b.frame;
+    } );
+    std::stable_sort( mRecordings.begin(), mRecordings.end(), []( const Recording &a, const Recording &b ) {
+        return a.frame < b.frame;
+    } );
+
+    mEndFrame = mStartFrame;
+    if ( !mEvents.empty() )
+        mEndFrame = std::max( mEndFrame, mEvents.back().frame );
+    if ( !mRecordings.empty() )
+        mEndFrame = std::max( mEndFrame, mRecordings.back().frame );
+
+    return true;
+}
+
+void ControlReplayer::start( AudioEngine &audioEngine )
+{
+    const std::uint64_t lookahead = std::uint64_t( kNoteLookahead * audioEngine.getSampleRate() );
+
+    // the first event is due after the lookahead, so that the notes can be scheduled at their exact frame
+    mFrameOffset = std::int64_t( audioEngine.getCurrentFrame() + lookahead ) - std::int64_t( mStartFrame );
+    mNextEvent = 0;
+    mNextNote = 0;
+    mNextRecording = 0;
+    mRunning = true;
+
+    audioEngine.setRandomSeed( mRandomSeed );
+}
+
+bool ControlReplayer::update( AudioEngine &audioEngine )
+{
+    if ( !mRunning )
+        return false;
+
+    const std::int64_t lookahead = std::int64_t( kNoteLookahead * audioEngine.getSampleRate() );
+    const std::int64_t now = std::int64_t( audioEngine.getCurrentFrame() ) - mFrameOffset;
+
+    mRunning = applyDue( audioEngine, now, now + lookahead );
+    return mRunning;
+}
+
+bool ControlReplayer::applyDue( AudioEngine &audioEngine, std::int64_t frame, std::int64_t noteFrame )
+{
+    // recordings first, the events of the same frame may play them
+    while ( mNextRecording < mRecordings.size() && std::int64_t( mRecordings[mNextRecording].frame ) <= frame ){
+        const Recording &recording = mRecordings[mNextRecording++];
+        if ( recording.waveIdx < audioEngine.getNumWaves() )
+            audioEngine.restoreRecording( recording.waveIdx, recording.samples.data(), recording.samples.size() );
+    }
+
+    // the scheduled notes are sent ahead with their frame, the rest of the calls when due
+    for ( ; mNextNote < mEvents.size(); mNextNote++ ){
+        const ControlEvent &event = mEvents[mNextNote];
+        if ( !isScheduledNote( event ) || event.waveIdx >= audioEngine.getNumWaves() )
+            continue;
+        if ( std::int64_t( event.frame ) > noteFrame )
+            break;
+
+        const std::uint64_t contextFrame = std::uint64_t( std::int64_t( event.frame ) + mFrameOffset );
+        if ( event.type == std::uint8_t( EngineCall::NOTE_ON_AT ) )
+            audioEngine.noteOnAt( event.waveIdx, event.arg, contextFrame );
+        else
+            audioEngine.noteOffAt( event.waveIdx, event.arg, contextFrame );
+    }
+
+    for ( ; mNextEvent < mEvents.size(); mNextEvent++ ){
+        const ControlEvent &event = mEvents[mNextEvent];
+        if ( event.source != Source::ENGINE || isScheduledNote( event ) || event.waveIdx >= audioEngine.getNumWaves() )
+            continue;
+        if ( std::int64_t( event.frame ) > frame )
+            break;
+
+        const std::size_t waveIdx = event.waveIdx;
+        switch ( EngineCall( event.type ) ){
+        case EngineCall::LOOP_ON:         audioEngine.loopOn( waveIdx ); break;
+        case EngineCall::LOOP_OFF:        audioEngine.loopOff( waveIdx ); break;
+        case EngineCall::NOTE_ON:         audioEngine.noteOn( waveIdx, event.arg ); break;
+        case EngineCall::NOTE_OFF:        audioEngine.noteOff( waveIdx, event.arg ); break;
+        case EngineCall::SELECTION_SIZE:  audioEngine.setSelectionSize( waveIdx, std::size_t( event.value ) ); break;
+        case EngineCall::SELECTION_START: audioEngine.setSelectionStart( waveIdx, std::size_t( event.value ) ); break;
+        case EngineCall::GRAIN_DURATION:  audioEngine.setGrainDurationCoeff( waveIdx, event.value ); break;
+        case EngineCall::FILTER_CUTOFF:   audioEngine.setFilterCutoff( waveIdx, event.value ); break;
+        case EngineCall::GAIN:            audioEngine.setGain( waveIdx, event.value ); break;
+        case EngineCall::PITCH_BEND:      audioEngine.setPitchBend( waveIdx, event.value ); break;
+        case EngineCall::GLIDE_TIME:      audioEngine.setGlideTime( waveIdx, event.value ); break;
+        case EngineCall::GRAIN_DENSITY:   audioEngine.setGrainDensity( waveIdx, event.value ); break;
+        case EngineCall::GRAIN_JITTER:    audioEngine.setGrainJitter( waveIdx, event.value ); break;
+        case EngineCall::GRAIN_TIME:      audioEngine.setGrainTime( waveIdx, event.value ); break;
+        default:
+            // RECORD and RESTORE: the audio comes from the recordings of the stream
+            break;
+        }
+    }
+
+    return mNextRecording < mRecordings.size() || mNextNote < mEvents.size() || mNextEvent < mEvents.size();
+}
+
+std::string ControlReplayer::runOffline( AudioEngine &audioEngine )
+{
+    audioEngine.beginOffline();
+    audioEngine.setRandomSeed( mRandomSeed );
+
+    const std::size_t framesPerBlock = audioEngine.getFramesPerBlock();
+    std::vector< float > block( framesPerBlock );
+
+    mFrameOffset = std::int64_t( audioEngine.getCurrentFrame() ) - std::int64_t( mStartFrame );
+    mNextEvent = 0;
+    mNextNote = 0;
+    mNextRecording = 0;
+
+    const std::uint64_t numFrames = mEndFrame - mStartFrame + std::uint64_t( kOfflineTail * audioEngine.getSampleRate() );
+
+    std::uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    double sumSquares = 0.0;
+    float peak = 0.0f;
+    std::uint64_t maxBlockNs = 0;
+    std::size_t numBlocks = 0;
+
+    // the nodes render inside their RT_SAFETY_SCOPE: any violation counted during the replay fails it
+    const std::size_t numViolationsBefore = collidoscope::rtsafety::getNumViolations();
+    const std::uint64_t start = LatencyProbe::now();
+
+    for ( std::uint64_t rendered = 0; rendered < numFrames; rendered += framesPerBlock ){
+        // the calls due at the beginning of the block, and the notes due during the block at their frame
+        const std::int64_t frame = std::int64_t( mStartFrame + rendered );
+        applyDue( audioEngine, frame, frame + std::int64_t( framesPerBlock ) - 1 );
+
+        const std::uint64_t blockStart = LatencyProbe::now();
+        audioEngine.renderOffline( block.data() );
+        maxBlockNs = std::max( maxBlockNs, LatencyProbe::now() - blockStart );
+        numBlocks++;
+
+        for ( float sample : block ){
+            std::uint32_t bits;
+            std::memcpy( &bits, &sample, sizeof( bits ) );
+            hash = ( hash ^ bits ) * 1099511628211ULL;
+
+            sumSquares += double( sample ) * double( sample );
+            peak = std::max( peak, std::abs( sample ) );
+        }
+    }
+
+    const double elapsedMs = double( LatencyProbe::now() - start ) / 1.0e6;
+    const std::size_t numViolations = collidoscope::rtsafety::getNumViolations() - numViolationsBefore;
+    const double audioMs = 1000.0 * double( numBlocks * framesPerBlock ) / double( audioEngine.getSampleRate() );
+
+    audioEngine.endOffline();
+
+    // without the checker compiled in no violation is ever counted: the replay can't pass or fail
+    const bool rtChecked = collidoscope::rtsafety::isEnabled();
+    const char *verdict = !rtChecked ? "not checked" : ( numViolations == 0 ? "PASSED" : "FAILED" );
+
+    std::ostringstream report;
+    report << std::fixed << std::setprecision( 2 )
+        << "Offline replay: " << verdict << ", " << mEvents.size() << " events, "
+        << mRecordings.size() << " recordings, seed " << mRandomSeed << "\n"
+        << "  rendered " << audioMs << " ms of audio in " << elapsedMs << " ms (" << ( elapsedMs > 0.0 ? audioMs / elapsedMs : 0.0 ) << "x real time)\n"
+        << "  block of " << framesPerBlock << " frames: mean " << ( numBlocks > 0 ? elapsedMs * 1000.0 / numBlocks : 0.0 )
+        << " us, max " << double( maxBlockNs ) / 1000.0 << " us\n"
+        << "  real-time safety: " << ( rtChecked ? std::to_string( numViolations ) + " violations" : std::string( "not checked, built without RT_SAFETY_CHECKS" ) ) << "\n"
+        << "  output rms " << std::sqrt( sumSquares / double( std::max< std::size_t >( numBlocks * framesPerBlock, 1 ) ) )
+        << ", peak " << peak << ", hash " << std::hex << hash;
+
+    return report.str();
+}
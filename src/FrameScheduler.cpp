@@ -0,0 +1,168 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "FrameScheduler.h"
+#include "LatencyProbe.h"
+
+#include "cinder/app/App.h"
+#include "cinder/gl/gl.h"
+
+#include <algorithm>
+#include <sstream>
+
+
+namespace {
+
+// how long the adaptive mode waits with nothing to animate before dropping to the idle frame rate
+const float kIdleDelaySeconds = 0.5f;
+
+}
+
+
+FrameScheduler::FrameScheduler() :
+    mMode( Mode::ADAPTIVE ),
+    mTargetFrameRate( 60.0f ),
+    mIdleFrameRate( 10.0f ),
+    mActive( true ),
+    mWakePending( false ),
+    mNumIdleFrames( 0 )
+{
+    resetStats();
+}
+
+void FrameScheduler::setup( Mode mode, float targetFrameRate, float idleFrameRate )
+{
+    mTargetFrameRate = targetFrameRate;
+    mIdleFrameRate = std::min( idleFrameRate, targetFrameRate );
+    setMode( mode );
+}
+
+void FrameScheduler::setMode( Mode mode )
+{
+    ci::app::App *app = ci::app::App::get();
+
+    mMode = mode;
+    mNumIdleFrames = 0;
+    mActive = true;
+
+    switch ( mode ){
+    case Mode::VSYNC:
+        // swapping the buffers blocks until the vertical sync 
+        ci::gl::enableVerticalSync( true );
+        app->disableFrameRate();
+        break;
+
+    case Mode::FIXED:
+    case Mode::ADAPTIVE:
+        ci::gl::enableVerticalSync( false );
+        app->setFrameRate( mTargetFrameRate );
+        break;
+    }
+}
+
+void FrameScheduler::setActive( bool active )
+{
+    mActive = active;
+    mNumIdleFrames = 0;
+    ci::app::App::get()->setFrameRate( active ? mTargetFrameRate : mIdleFrameRate );
+}
+
+void FrameScheduler::frameBegin()
+{
+    const std::uint64_t now = LatencyProbe::now();
+
+    if ( mFrameBeginNs != 0 ){
+        const std::uint64_t interval = now - mFrameBeginNs;
+        mSumIntervalNs += interval;
+        mMaxIntervalNs = std::max( mMaxIntervalNs, interval );
+    }
+
+    mFrameBeginNs = now;
+}
+
+void FrameScheduler::frameEnd( bool animating )
+{
+    const std::uint64_t work = LatencyProbe::now() - mFrameBeginNs;
+    mSumWorkNs += work;
+    mMaxWorkNs = std::max( mMaxWorkNs, work );
+    mNumFrames++;
+
+    if ( mMode != Mode::ADAPTIVE )
+        return;
+
+    if ( !mActive ){
+        mNumIdleRateFrames++;
+        if ( animating )
+            setActive( true );
+    }
+    else if ( animating ){
+        mNumIdleFrames = 0;
+    }
+    else if ( ++mNumIdleFrames >= std::uint32_t( mTargetFrameRate * kIdleDelaySeconds ) ){
+        setActive( false );
+    }
+}
+
+void FrameScheduler::wake()
+{
+    if ( mMode != Mode::ADAPTIVE || mActive )
+        return;
+
+    // only one wake up at a time goes to the main thread 
+    if ( mWakePending.exchange( true ) )
+        return;
+
+    ci::app::App::get()->dispatchAsync( [this] {
+        mWakePending = false;
+        if ( mMode == Mode::ADAPTIVE && !mActive )
+            setActive( true );
+    } );
+}
+
+void FrameScheduler::resetStats()
+{
+    mFrameBeginNs = 0;
+    mNumFrames = 0;
+    mNumIdleRateFrames = 0;
+    mSumIntervalNs = 0;
+    mMaxIntervalNs = 0;
+    mSumWorkNs = 0;
+    mMaxWorkNs = 0;
+}
+
+std::string FrameScheduler::getReport() const
+{
+    static const char *modeNames[] = { "vsync", "fixed", "adaptive" };
+
+    std::ostringstream report;
+    report << "frames (" << modeNames[int( mMode )] << "): " << mNumFrames << " frames";
+    if ( mNumFrames > 1 ){
+        report << ", interval avg " << double( mSumIntervalNs ) / double( mNumFrames - 1 ) / 1.0e6 << " ms"
+               << ", max " << double( mMaxIntervalNs ) / 1.0e6 << " ms"
+               << ", update+draw avg " << double( mSumWorkNs ) / double( mNumFrames ) / 1.0e6 << " ms"
+               << ", max " << double( mMaxWorkNs ) / 1.0e6 << " ms";
+    }
+    if ( mMode == Mode::ADAPTIVE ){
+        report << ", " << mNumIdleRateFrames << " frames at idle rate";
+    }
+
+    return report.str();
+}
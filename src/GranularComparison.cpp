@@ -0,0 +1,330 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "GranularComparison.h"
+#include "PGranular.h"
+#include "PGranularReference.h"
+#include "LatencyProbe.h"
+#include "RtSafety.h"
+
+#include "cinder/Rand.h"
+#include "cinder/audio/Buffer.h"
+#include "cinder/audio/dsp/Dsp.h"
+#include "cinder/audio/dsp/Fft.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+
+
+namespace {
+
+// length of the synthetic recording, in seconds
+const double kRecordingDuration = 2.0;
+
+// the scenario changes something every kMinStepBlocks to kMaxStepBlocks blocks
+const std::uint32_t kMinStepBlocks = 8;
+const std::uint32_t kMaxStepBlocks = 64;
+
+// spectral comparison: hann windowed frames, half overlapped
+const std::size_t kFftSize = 2048;
+const std::size_t kFftHop = kFftSize / 2;
+
+// frames quieter than this (mean energy of a sample of the reference) are not compared, in dB
+const double kSilenceDb = -90.0;
+
+// the same random offsets as the audio engine, see PGranularNode
+struct SeededOffset
+{
+    SeededOffset( std::size_t max, std::uint32_t seed ) : mMax( max ), mRand( seed )
+    {}
+
+    std::size_t operator()() {
+        return mRand.nextUint( std::uint32_t( mMax ) );
+    }
+
+    std::size_t mMax;
+    ci::Rand mRand;
+};
+
+struct NoTrigger
+{
+    void operator()( char msgType, int ID ) {}
+};
+
+inline double toDb( double ratio )
+{
+    // floor at -300 dB, e.g. when the outputs are identical
+    return 10.0 * std::log10( std::max( ratio, 1.0e-30 ) );
+}
+
+}
+
+
+GranularComparison::GranularComparison( std::uint32_t seed, std::size_t sampleRate, std::size_t framesPerBlock ) :
+    mSeed( seed ),
+    mSampleRate( sampleRate ),
+    mFramesPerBlock( framesPerBlock ),
+    mBudgets{ 0.0, 0.0, 0.0 },
+    mPassed( false ),
+    mMaxError( 0.0 ),
+    mMaxErrorFrame( 0 ),
+    mRmsError( 0.0 ),
+    mSpectralErrorDb( 0.0 ),
+    mWorstFrameSpectralErrorDb( 0.0 ),
+    mNumSpectralFrames( 0 ),
+    mNumRtViolations( 0 ),
+    mRenderNs( 0 ),
+    mReferenceRenderNs( 0 )
+{
+}
+
+bool GranularComparison::run( double numSeconds, const Budgets &budgets )
+{
+    mBudgets = budgets;
+
+    // the checker counts the violations of all the threads: any increase during the render fails the comparison
+    const std::size_t numViolationsBefore = collidoscope::rtsafety::getNumViolations();
+    render( std::size_t( numSeconds * mSampleRate ) );
+    mNumRtViolations = collidoscope::rtsafety::getNumViolations() - numViolationsBefore;
+
+    compare();
+
+    mPassed = mMaxError <= mBudgets.maxError && mRmsError <= mBudgets.rmsError && mSpectralErrorDb <= mBudgets.spectralErrorDb
+        && mNumRtViolations == 0;
+    return mPassed;
+}
+
+void GranularComparison::render( std::size_t numFrames )
+{
+    ci::Rand rand( mSeed );
+
+    // synthetic recording: a few decaying harmonic partials over some noise, the same samples for both synthesizers
+    const std::size_t recordingLen = std::size_t( kRecordingDuration * mSampleRate );
+    std::vector< float > recording( recordingLen );
+    std::vector< double > referenceRecording( recordingLen );
+
+    const double f0 = 110.0 * std::pow( 2.0, double( rand.nextUint( 24 ) ) / 12.0 );
+    for ( std::size_t i = 0; i < recordingLen; i++ ){
+        const double t = double( i ) / double( mSampleRate );
+        double sample = 0.05 * ( rand.nextFloat() * 2.0 - 1.0 );
+        for ( int partial = 1; partial <= 6; partial++ ){
+            sample += 0.3 / partial * std::exp( -t * partial ) * std::sin( 2.0 * M_PI * f0 * partial * t );
+        }
+
+        recording[i] = float( sample );
+        referenceRecording[i] = double( recording[i] );
+    }
+
+    SeededOffset offset( mSampleRate / 100, mSeed );
+    SeededOffset referenceOffset( mSampleRate / 100, mSeed );
+    NoTrigger trigger;
+
+    collidoscope::PGranular< float, SeededOffset, NoTrigger > granular( recording.data(), recordingLen, mSampleRate, offset, trigger, 0 );
+    collidoscope::PGranularReference< double, SeededOffset, NoTrigger > reference( referenceRecording.data(), recordingLen, mSampleRate, referenceOffset, trigger, 0 );
+
+    mOutput.assign( numFrames, 0.0f );
+    mReferenceOutput.assign( numFrames, 0.0 );
+    std::vector< float > tempBuffer( mFramesPerBlock );
+    std::vector< double > referenceTempBuffer( mFramesPerBlock );
+
+    mRenderNs = 0;
+    mReferenceRenderNs = 0;
+
+    // start playing straight away
+    const std::size_t startSelectionSize = mSampleRate / 10;
+    granular.setSelectionSize( startSelectionSize );
+    reference.setSelectionSize( startSelectionSize );
+    granular.noteOn( 1.0 );
+    reference.noteOn( 1.0 );
+    bool playing = true;
+
+    std::size_t block = 0;
+    std::size_t nextStep = kMinStepBlocks;
+
+    for ( std::size_t frame = 0; frame < numFrames; frame += mFramesPerBlock, block++ ){
+        if ( block == nextStep ){
+            nextStep += rand.nextUint( kMaxStepBlocks - kMinStepBlocks ) + kMinStepBlocks;
+
+            const float action = rand.nextFloat();
+            if ( action < 0.25f ){
+                const std::size_t start = rand.nextUint( std::uint32_t( recordingLen ) );
+                granular.setSelectionStart( start );
+                reference.setSelectionStart( start );
+            }
+            else if ( action < 0.4f ){
+                const std::size_t size = rand.nextUint( std::uint32_t( mSampleRate / 2 ) ) + collidoscope::PGranular< float, SeededOffset, NoTrigger >::kMinGrainsDuration;
+                granular.setSelectionSize( size );
+                reference.setSelectionSize( size );
+            }
+            else if ( action < 0.55f ){
+                const double coeff = 1.0 + 7.0 * rand.nextFloat();
+                granular.setGrainsDurationCoeff( coeff );
+                reference.setGrainsDurationCoeff( coeff );
+            }
+            else if ( action < 0.7f ){
+                // a move of the pitch bend wheel, +/- 2 semitones, smoothed over a few milliseconds
+                const double bend = 4.0 * rand.nextFloat() - 2.0;
+                const std::size_t rampSamples = rand.nextUint( std::uint32_t( mSampleRate / 100 ) );
+                granular.setPitchBend( bend, rampSamples );
+                reference.setPitchBend( bend, rampSamples );
+            }
+            else if ( playing ){
+                granular.noteOff();
+                reference.noteOff();
+                playing = false;
+            }
+            else {
+                // a new note, at a pitch between one octave below and two octaves above the recording
+                const double rate = std::pow( 2.0, ( double( rand.nextUint( 36 ) ) - 12.0 ) / 12.0 );
+                granular.noteOn( rate );
+                reference.noteOn( rate );
+                playing = true;
+
+                // half of the notes glide from up to one octave away, in up to half a second
+                if ( rand.nextFloat() < 0.5f ){
+                    const double semitones = 24.0 * rand.nextFloat() - 12.0;
+                    const std::size_t glideSamples = rand.nextUint( std::uint32_t( mSampleRate / 2 ) );
+                    granular.glideFrom( semitones, glideSamples );
+                    reference.glideFrom( semitones, glideSamples );
+                }
+            }
+        }
+
+        const std::size_t blockSize = std::min( mFramesPerBlock, numFrames - frame );
+
+        const std::uint64_t start = LatencyProbe::now();
+        {
+            // the synthesizer under test must stay real-time safe
+            RT_SAFETY_SCOPE();
+            granular.process( mOutput.data() + frame, tempBuffer.data(), blockSize );
+        }
+        const std::uint64_t referenceStart = LatencyProbe::now();
+        reference.process( mReferenceOutput.data() + frame, referenceTempBuffer.data(), blockSize );
+        const std::uint64_t end = LatencyProbe::now();
+
+        mRenderNs += referenceStart - start;
+        mReferenceRenderNs += end - referenceStart;
+    }
+}
+
+void GranularComparison::compare()
+{
+    const std::size_t numFrames = mOutput.size();
+
+    mMaxError = 0.0;
+    mMaxErrorFrame = 0;
+    double sumSquares = 0.0;
+
+    for ( std::size_t i = 0; i < numFrames; i++ ){
+        const double error = std::abs( double( mOutput[i] ) - mReferenceOutput[i] );
+        sumSquares += error * error;
+
+        if ( error > mMaxError ){
+            mMaxError = error;
+            mMaxErrorFrame = i;
+        }
+    }
+
+    mRmsError = numFrames > 0 ? std::sqrt( sumSquares / double( numFrames ) ) : 0.0;
+
+    // magnitude spectra of both outputs, frame by frame
+    ci::audio::dsp::Fft fft( kFftSize );
+    std::vector< float > window( kFftSize );
+    ci::audio::dsp::generateWindow( ci::audio::dsp::WindowType::HANN, window.data(), kFftSize );
+
+    ci::audio::Buffer frameBuffer( kFftSize );
+    ci::audio::Buffer referenceFrameBuffer( kFftSize );
+    ci::audio::BufferSpectral spectrum( kFftSize );
+    ci::audio::BufferSpectral referenceSpectrum( kFftSize );
+    const std::size_t numBins = kFftSize / 2;
+
+    const double silence = std::pow( 10.0, kSilenceDb / 10.0 ) * double( kFftSize );
+
+    double errorEnergy = 0.0;
+    double referenceEnergy = 0.0;
+    mWorstFrameSpectralErrorDb = -std::numeric_limits< double >::infinity();
+    mNumSpectralFrames = 0;
+
+    for ( std::size_t frame = 0; frame + kFftSize <= numFrames; frame += kFftHop ){
+        double frameEnergy = 0.0;
+        for ( std::size_t i = 0; i < kFftSize; i++ ){
+            frameBuffer[i] = mOutput[frame + i] * window[i];
+            referenceFrameBuffer[i] = float( mReferenceOutput[frame + i] ) * window[i];
+            frameEnergy += mReferenceOutput[frame + i] * mReferenceOutput[frame + i];
+        }
+
+        if ( frameEnergy < silence )
+            continue;
+
+        fft.forward( &frameBuffer, &spectrum );
+        fft.forward( &referenceFrameBuffer, &referenceSpectrum );
+
+        double frameErrorEnergy = 0.0;
+        double frameReferenceEnergy = 0.0;
+        for ( std::size_t bin = 0; bin < numBins; bin++ ){
+            const double magnitude = std::hypot( spectrum.getReal()[bin], spectrum.getImag()[bin] );
+            const double referenceMagnitude = std::hypot( referenceSpectrum.getReal()[bin], referenceSpectrum.getImag()[bin] );
+
+            frameErrorEnergy += ( magnitude - referenceMagnitude ) * ( magnitude - referenceMagnitude );
+            frameReferenceEnergy += referenceMagnitude * referenceMagnitude;
+        }
+
+        errorEnergy += frameErrorEnergy;
+        referenceEnergy += frameReferenceEnergy;
+        mWorstFrameSpectralErrorDb = std::max( mWorstFrameSpectralErrorDb, toDb( frameErrorEnergy / frameReferenceEnergy ) );
+        mNumSpectralFrames++;
+    }
+
+    mSpectralErrorDb = referenceEnergy > 0.0 ? toDb( errorEnergy / referenceEnergy ) : 0.0;
+    if ( mNumSpectralFrames == 0 )
+        mWorstFrameSpectralErrorDb = 0.0;
+}
+
+std::string GranularComparison::getReport() const
+{
+    const double seconds = double( mOutput.size() ) / double( mSampleRate );
+    auto verdict = []( bool within ) { return within ? "ok" : "OVER BUDGET"; };
+
+    std::ostringstream report;
+    report << "Granular comparison: " << ( mPassed ? "PASSED" : "FAILED" ) << ", seed " << mSeed << ", "
+        << std::fixed << std::setprecision( 1 ) << seconds << " s at " << mSampleRate << " Hz, blocks of " << mFramesPerBlock << " frames\n"
+        << std::scientific << std::setprecision( 3 )
+        << "  max error " << mMaxError << " at frame " << mMaxErrorFrame << " (budget " << mBudgets.maxError << ") " << verdict( mMaxError <= mBudgets.maxError ) << "\n"
+        << "  rms error " << mRmsError << " (budget " << mBudgets.rmsError << ") " << verdict( mRmsError <= mBudgets.rmsError ) << "\n"
+        << std::fixed << std::setprecision( 1 )
+        << "  spectral error " << mSpectralErrorDb << " dB, worst frame " << mWorstFrameSpectralErrorDb << " dB over " << mNumSpectralFrames 
+        << " frames (budget " << mBudgets.spectralErrorDb << " dB) " << verdict( mSpectralErrorDb <= mBudgets.spectralErrorDb ) << "\n";
+
+    if ( collidoscope::rtsafety::isEnabled() )
+        report << "  real-time safety: " << mNumRtViolations << " violations " << ( mNumRtViolations == 0 ? "ok" : "FAILED" ) << "\n";
+    else
+        report << "  real-time safety: not checked, built without RT_SAFETY_CHECKS\n";
+
+    report
+        << std::setprecision( 2 )
+        << "  render time: PGranular " << double( mRenderNs ) / 1.0e6 << " ms, reference " << double( mReferenceRenderNs ) / 1.0e6 << " ms ("
+        << ( mRenderNs > 0 ? double( mReferenceRenderNs ) / double( mRenderNs ) : 0.0 ) << "x)";
+
+    return report.str();
+}
@@ -0,0 +1,88 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "LatencyProbe.h"
+
+#include <chrono>
+#include <limits>
+#include <sstream>
+
+
+LatencyProbe::LatencyProbe() :
+    mBlockDurationNs( 0 ),
+    mNumNotes( 0 ),
+    mSumNs( 0 ),
+    mMinNs( std::numeric_limits< std::uint64_t >::max() ),
+    mMaxNs( 0 )
+{
+}
+
+std::uint64_t LatencyProbe::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void LatencyProbe::setBlockDuration( double seconds )
+{
+    mBlockDurationNs = std::uint64_t( seconds * 1.0e9 );
+}
+
+void LatencyProbe::recordNote( std::uint64_t timestamp )
+{
+    if ( timestamp == 0 )
+        return;
+
+    const std::uint64_t time = now();
+    const std::uint64_t latency = ( time > timestamp ? time - timestamp : 0 ) + mBlockDurationNs;
+
+    mNumNotes++;
+    mSumNs += latency;
+
+    std::uint64_t min = mMinNs;
+    while ( latency < min && !mMinNs.compare_exchange_weak( min, latency ) ){}
+
+    std::uint64_t max = mMaxNs;
+    while ( latency > max && !mMaxNs.compare_exchange_weak( max, latency ) ){}
+}
+
+void LatencyProbe::reset()
+{
+    mNumNotes = 0;
+    mSumNs = 0;
+    mMinNs = std::numeric_limits< std::uint64_t >::max();
+    mMaxNs = 0;
+}
+
+std::string LatencyProbe::getReport() const
+{
+    const std::uint64_t numNotes = mNumNotes;
+
+    std::ostringstream report;
+    report << "key-to-sound latency: " << numNotes << " notes";
+    if ( numNotes != 0 ){
+        report << ", min " << double( mMinNs ) / 1.0e6 << " ms"
+               << ", avg " << double( mSumNs ) / double( numNotes ) / 1.0e6 << " ms"
+               << ", max " << double( mMaxNs ) / 1.0e6 << " ms";
+    }
+    report << " (block " << double( mBlockDurationNs ) / 1.0e6 << " ms included, device latency excluded)";
+
+    return report.str();
+}
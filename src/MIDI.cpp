@@ -21,9 +21,49 @@
 
 #include "MIDI.h"
 #include "Config.h"
+#include "AudioEngine.h"
+#include "LatencyProbe.h"
+#include "FrameScheduler.h"
+#include "AsyncLogger.h"
 
 
-collidoscope::MIDI::MIDI()
+namespace {
+
+const size_t kNumChannels = 16;
+const size_t kNumControllers = 128;
+
+// the knobs whose latest value is all that matters 
+inline bool isContinuous( const Knob &knob )
+{
+    switch ( knob.mType ){
+    case Knob::SELECTIONSIZE:
+    case Knob::SELECTIONSTART:
+    case Knob::FILTERFREQ:
+    case Knob::DURATION:
+    case Knob::GAIN:
+    case Knob::PITCHBEND:
+    case Knob::GLIDE:
+    case Knob::DENSITY:
+    case Knob::JITTER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+inline size_t controllerKey( const Knob &knob )
+{
+    return ( size_t( knob.mPort ) * kNumChannels + knob.mChannel ) * kNumControllers + knob.mNumber;
+}
+
+}
+
+
+collidoscope::MIDI::MIDI() :
+    mNumDroppedEvents( 0 ),
+    mAudioEngine( nullptr ),
+    mFrameScheduler( nullptr ),
+    mNumCollapsedEvents( 0 )
 {
 }
 
@@ -41,17 +81,48 @@ void collidoscope::MIDI::RtMidiInCallback( double deltatime, std::vector<unsigne
     MidiPortInfo* midiPortInfo = reinterpret_cast<MidiPortInfo*>(userData);
     
     collidoscope::MIDI* midi = midiPortInfo->thate;
-    std::lock_guard< std::mutex > lock( midi->mMutex );
-    
-    Knob* control = midi->parseRtMidiMessage( message, midiPortInfo->portNum );
-    if ( control != nullptr ) {
-        midi->mKnobs.push_back( control );
+
+    // the delta time of every message must go through the clock, also for the messages that are not handled 
+    const uint64_t timestamp = midiPortInfo->clock.messageTime( deltatime, LatencyProbe::now() );
+
+    Knob knob;
+    if ( !parseRtMidiMessage( message, midiPortInfo->portNum, knob ) )
+        return;
+
+    if ( midi->mFrameScheduler != nullptr )
+        midi->mFrameScheduler->wake();
+
+    // notes go straight to the audio thread, the graphic thread doesn't need them 
+    AudioEngine *audioEngine = midi->mAudioEngine.load( std::memory_order_acquire );
+    if ( audioEngine != nullptr && ( knob.mType == Knob::NOTEON || knob.mType == Knob::NOTEOFF ) ){
+        const size_t waveIdx = midi->mWaveForChannel[knob.mChannel];
+
+        const bool sent = knob.mType == Knob::NOTEON ?
+            audioEngine->directNoteOn( midiPortInfo->portNum, waveIdx, knob.mNumber, timestamp ) :
+            audioEngine->directNoteOff( midiPortInfo->portNum, waveIdx, knob.mNumber, timestamp );
+
+        if ( sent )
+            return;
+
+        // otherwise fall back on the graphic thread 
+        AsyncLogger::instance().log( AsyncLogger::Level::WARNING, AsyncLogger::Code::DIRECT_NOTE_DROPPED, midiPortInfo->portNum, waveIdx, knob.mNumber );
+    }
+
+    if ( !midiPortInfo->events.getBuffer().write( &knob, 1 ) ){
+        midi->mNumDroppedEvents++;
+        AsyncLogger::instance().log( AsyncLogger::Level::ERROR, AsyncLogger::Code::MIDI_EVENT_DROPPED, midiPortInfo->portNum, double( midi->mNumDroppedEvents ) );
     }
 }
 
 
-void collidoscope::MIDI::setup( const Config& config )
+void collidoscope::MIDI::setup( const Config& config, AudioEngine *audioEngine, FrameScheduler *frameScheduler )
 {
+    setAudioEngine( audioEngine );
+    mFrameScheduler = frameScheduler;
+    for ( size_t channel = 0; channel < mWaveForChannel.size(); channel++ ){
+        mWaveForChannel[channel] = std::uint8_t( config.getWaveForMIDIChannel( (unsigned char)channel ) );
+    }
+
     unsigned int numPorts = 0;
     
     try {
@@ -66,16 +137,15 @@ void collidoscope::MIDI::setup( const Config& config )
         throw MIDIException(" no MIDI input found ");
     }
     
+    mLatestControllerEvent.assign( numPorts * kNumChannels * kNumControllers, -1 );
+
     for ( unsigned int portNum = 0; portNum < numPorts; portNum++ ) {
         try {
             std::unique_ptr< RtMidiIn > input ( new RtMidiIn() );
             input->openPort( portNum, "Collidoscope Input" );
-            // Here we could build a structure that contains the THIS ptr and channel number.
-            // Thus we can tell from which interface the data came...
-            MidiPortInfo* midiPortInfo = new MidiPortInfo;
-            midiPortInfo->portNum = portNum;
-            midiPortInfo->thate = this;
-            input->setCallback( &RtMidiInCallback, midiPortInfo );
+            // the port info tells the callback which interface the data came from and which queue to write 
+            mPortInfos.push_back( std::unique_ptr< MidiPortInfo >( new MidiPortInfo( portNum, this, config.getMIDIQueueSize() ) ) );
+            input->setCallback( &RtMidiInCallback, mPortInfos.back().get() );
             cinder::app::console() << portNum << "  " << input->getPortName(portNum) << std::endl;
             mInputs.push_back( std::move(input) );
             
@@ -87,10 +157,51 @@ void collidoscope::MIDI::setup( const Config& config )
 }
 
 
-void collidoscope::MIDI::checkMessages( std::vector<Knob*>& knobs )
+size_t collidoscope::MIDI::checkMessages( std::vector<Knob>& knobs )
 {
-    std::lock_guard<std::mutex> lock( mMutex );
-    knobs.swap( mKnobs );
+    const size_t begin = knobs.size();
+
+    for ( auto & portInfo : mPortInfos ){
+        ci::audio::dsp::RingBufferT< Knob > &ringBuffer = portInfo->events.getBuffer();
+        Knob* readArray = portInfo->events.getExchangeArray();
+
+        const size_t availableRead = ringBuffer.getAvailableRead();
+        if ( ringBuffer.read( readArray, availableRead ) ){
+            knobs.insert( knobs.end(), readArray, readArray + availableRead );
+        }
+    }
+
+    return coalesce( knobs, begin );
+}
+
+size_t collidoscope::MIDI::coalesce( std::vector<Knob>& knobs, size_t begin )
+{
+    // first pass: find the latest event of each controller 
+    for ( size_t i = begin; i < knobs.size(); i++ ){
+        if ( isContinuous( knobs[i] ) ){
+            mLatestControllerEvent[controllerKey( knobs[i] )] = int( i );
+        }
+    }
+
+    // second pass: compact in place, keeping a controller event only where its latest value was
+    size_t writeIdx = begin;
+    for ( size_t i = begin; i < knobs.size(); i++ ){
+        if ( isContinuous( knobs[i] ) ){
+            const size_t key = controllerKey( knobs[i] );
+            if ( mLatestControllerEvent[key] != int( i ) )
+                continue;
+
+            mLatestControllerEvent[key] = -1;
+        }
+
+        knobs[writeIdx++] = knobs[i];
+    }
+
+    const size_t numCollapsed = knobs.size() - writeIdx;
+    knobs.resize( writeIdx );
+
+    mNumCollapsedEvents += numCollapsed;
+    return numCollapsed;
 }
 
 /*
@@ -103,62 +214,79 @@ void collidoscope::MIDI::checkMessages( std::vector<Knob*>& knobs )
  Control Change                Bx      Controller number   Controller value
  Program Change                Cx      Program number      None
  Channel Pressure              Dx      Pressure value      None
- Pitch Bend                    Ex      MSB                 LSB
+ Pitch Bend                    Ex      LSB                 MSB
  
  */
 
-// only call this function when the size of mRtMidiMessage != 0
-Knob* collidoscope::MIDI::parseRtMidiMessage( std::vector<unsigned char> *rtMidiMessage, int interfaceNumber )
+bool collidoscope::MIDI::parseRtMidiMessage( const std::vector<unsigned char> *rtMidiMessage, int interfaceNumber, Knob &knob )
 {
-    Knob* knob = nullptr;
-    
+    // all the handled messages are three bytes long
+    if ( rtMidiMessage->size() < 3 )
+        return false;
+
     // voice is the 4 most significant bits
     unsigned char voice = (*rtMidiMessage)[0] >> 4;
-    //unsigned char channel = (*rtMidiMessage)[0] & 0x0f;
+    unsigned char channel = (*rtMidiMessage)[0] & 0x0f;
     
     unsigned char ctlNum = (*rtMidiMessage)[1];
+    const std::uint8_t port = std::uint8_t( interfaceNumber );
     
     switch ( voice ){
         case 0x9: {
             unsigned char velocity = (*rtMidiMessage)[2];
             if (velocity != 0)
-                knob = new Knob( Knob::NOTEON, ctlNum );
+                knob = makeKnob( Knob::NOTEON, ctlNum, port, channel, ctlNum );
             else
-                knob = new Knob( Knob::NOTEOFF, ctlNum );
-        } break;
+                knob = makeKnob( Knob::NOTEOFF, ctlNum, port, channel, ctlNum );
+        } return true;
             
         case 0x8: {
-            knob = new Knob( Knob::NOTEOFF, ctlNum );
-        } break;
+            knob = makeKnob( Knob::NOTEOFF, ctlNum, port, channel, ctlNum );
+        } return true;
             
         case 0xB:
         {
             unsigned char controlVal = (*rtMidiMessage)[2];
             switch ( ctlNum ){
+                case 5: // portamento time 
+                    knob = makeKnob( Knob::GLIDE, controlVal / 127.f, port, channel, ctlNum );
+                    return true;
+                case 12: // effect control 1 
+                    knob = makeKnob( Knob::DENSITY, controlVal / 127.f, port, channel, ctlNum );
+                    return true;
+                case 13: // effect control 2 
+                    knob = makeKnob( Knob::JITTER, controlVal / 127.f, port, channel, ctlNum );
+                    return true;
                 case 52:
-                    knob = new Knob( Knob::RECORD );
-                    break;
+                    knob = makeKnob( Knob::RECORD, 0.f, port, channel, ctlNum );
+                    return true;
                 case 53:
-                    knob = new Knob( Knob::LOOPTOGGLE, controlVal < 32 );
-                    break;
+                    knob = makeKnob( Knob::LOOPTOGGLE, controlVal < 32, port, channel, ctlNum );
+                    return true;
                 case 54:
-                    knob = new Knob( Knob::SELECTIONSIZE, controlVal / 127.f );
-                    break;
+                    knob = makeKnob( Knob::SELECTIONSIZE, controlVal / 127.f, port, channel, ctlNum );
+                    return true;
                 case 55:
-                    knob = new Knob( Knob::FILTERFREQ, controlVal / 127.f );
-                    break;
+                    knob = makeKnob( Knob::FILTERFREQ, controlVal / 127.f, port, channel, ctlNum );
+                    return true;
                 case 56:
-                    knob = new Knob( Knob::DURATION, controlVal / 127.f );
-                    break;
+                    knob = makeKnob( Knob::DURATION, controlVal / 127.f, port, channel, ctlNum );
+                    return true;
                 case 57:
-                    knob = new Knob( Knob::GAIN, controlVal / 127.f );
-                    break;
+                    knob = makeKnob( Knob::GAIN, controlVal / 127.f, port, channel, ctlNum );
+                    return true;
                 case 58:
-                    knob = new Knob( Knob::SELECTIONSTART, controlVal / 127.f );
-                    break;
+                    knob = makeKnob( Knob::SELECTIONSTART, controlVal / 127.f, port, channel, ctlNum );
+                    return true;
             }
         } break;
+
+        case 0xE: {
+            // 14 bits, centered on 8192. The number is 0 for all the pitch bend knobs of a channel 
+            const int bend = ( int( (*rtMidiMessage)[2] ) << 7 | int( ctlNum ) ) - 8192;
+            knob = makeKnob( Knob::PITCHBEND, bend / 8192.f, port, channel, 0 );
+        } return true;
     }
     
-    return knob;
+    return false;
 }
@@ -0,0 +1,183 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Oscilloscope.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef CINDER_MAC
+#include <Accelerate/Accelerate.h>
+#endif
+
+using namespace ci;
+
+
+Oscilloscope::Oscilloscope( size_t numPoints, DecimationMode mode ) :
+    mNumPoints( numPoints ),
+    mDecimationMode( mode ),
+    mVertices( 2 * numPoints, vec2() ),
+    mNumVertices( 0 ),
+    mXWindowWidth( -1 ),
+    mXNumVertices( 0 ),
+    mDecimated( 2 * numPoints, 0.0f )
+{
+    mLineVbo = gl::Vbo::create( GL_ARRAY_BUFFER, mVertices, GL_DYNAMIC_DRAW );
+
+    geom::BufferLayout lineLayout;
+    lineLayout.append( geom::Attrib::POSITION, 2, sizeof( vec2 ), 0 );
+
+    auto mesh = gl::VboMesh::create( uint32_t( mVertices.size() ), GL_LINE_STRIP, { { lineLayout, mLineVbo } } );
+    mLineBatch = gl::Batch::create( mesh, gl::getStockShader( gl::ShaderDef().color() ) );
+}
+
+void Oscilloscope::setPoints( const float *audio, size_t numSamples, const DrawInfo &di )
+{
+    if ( mNumPoints == 0 )
+        return;
+
+    // each point of the oscilloscope represents step samples 
+    const size_t step = std::max< size_t >( 1, numSamples / mNumPoints );
+    const size_t numPoints = std::min( mNumPoints, numSamples / step );
+    if ( numPoints == 0 )
+        return;
+
+    float *decimated = mDecimated.data();
+    size_t numVertices = numPoints;
+
+    // decimate and clip to [-1.0, 1.0] 
+#ifdef CINDER_MAC
+    const float lo = -1.0f;
+    const float hi = 1.0f;
+
+    switch ( mDecimationMode ){
+    case DecimationMode::EVERY_NTH:
+        vDSP_vclip( audio, vDSP_Stride( step ), &lo, &hi, decimated, 1, numPoints );
+        break;
+
+    case DecimationMode::AVERAGE:
+        if ( mAverageFilter.size() != step )
+            mAverageFilter.assign( step, 1.0f / float( step ) );
+        vDSP_desamp( audio, vDSP_Stride( step ), mAverageFilter.data(), decimated, numPoints, step );
+        vDSP_vclip( decimated, 1, &lo, &hi, decimated, 1, numPoints );
+        break;
+
+    case DecimationMode::PEAK:
+        numVertices = 2 * numPoints;
+        for ( size_t i = 0; i < numPoints; i++ ){
+            vDSP_minv( audio + i * step, 1, &decimated[2 * i], step );
+            vDSP_maxv( audio + i * step, 1, &decimated[2 * i + 1], step );
+        }
+        vDSP_vclip( decimated, 1, &lo, &hi, decimated, 1, numVertices );
+        break;
+    }
+#else
+    switch ( mDecimationMode ){
+    case DecimationMode::EVERY_NTH:
+        for ( size_t i = 0; i < numPoints; i++ ){
+            decimated[i] = audio[i * step];
+        }
+        break;
+
+    case DecimationMode::AVERAGE:
+        for ( size_t i = 0; i < numPoints; i++ ){
+            float sum = 0.0f;
+            for ( size_t j = 0; j < step; j++ ){
+                sum += audio[i * step + j];
+            }
+            decimated[i] = sum / float( step );
+        }
+        break;
+
+    case DecimationMode::PEAK:
+        numVertices = 2 * numPoints;
+        for ( size_t i = 0; i < numPoints; i++ ){
+            const float *group = audio + i * step;
+            decimated[2 * i] = *std::min_element( group, group + step );
+            decimated[2 * i + 1] = *std::max_element( group, group + step );
+        }
+        break;
+    }
+
+    for ( size_t i = 0; i < numVertices; i++ ){
+        decimated[i] = std::max( -1.0f, std::min( 1.0f, decimated[i] ) );
+    }
+#endif
+
+    updateVertices( numVertices, di );
+}
+
+void Oscilloscope::reset( const DrawInfo &di )
+{
+    std::fill( mDecimated.begin(), mDecimated.end(), 0.0f );
+    updateVertices( mDecimationMode == DecimationMode::PEAK ? 2 * mNumPoints : mNumPoints, di );
+}
+
+void Oscilloscope::updateVertices( size_t numVertices, const DrawInfo &di )
+{
+    if ( numVertices == 0 )
+        return;
+
+    // the x of the vertices only depends on the window, so it's computed again only when the window or the number of vertices change. 
+    // The vertices are spread evenly so that the last one reaches the right of the window 
+    if ( di.getWindowWidth() != mXWindowWidth || numVertices != mXNumVertices ){
+        mXWindowWidth = di.getWindowWidth();
+        mXNumVertices = numVertices;
+
+        const float xStep = numVertices > 1 ? float( mXWindowWidth ) / float( numVertices - 1 ) : 0.0f;
+        for ( size_t i = 0; i < numVertices; i++ ){
+            mVertices[i].x = float( di.flipX( int( i * xStep ) ) );
+        }
+    }
+
+    // audio values are scaled by 0.8 and mapped from [-1.0, 1.0] to the height of the wave tier ( window height / number of waves ).
+    // flipY is linear, so the whole transformation is y = audio * scale + offset 
+    const float barHeight = float( di.getSelectionBarHeight() );
+    const float flipOffset = float( di.flipY( 0 ) );
+    const float flipSign = float( di.flipY( 1 ) - di.flipY( 0 ) );
+    const float scale = flipSign * 0.4f * barHeight;
+    const float offset = flipOffset + flipSign * 0.5f * barHeight;
+
+    float *y = &mVertices[0].y;
+#ifdef CINDER_MAC
+    vDSP_vsmsa( mDecimated.data(), 1, &scale, &offset, y, 2, numVertices );
+#else
+    for ( size_t i = 0; i < numVertices; i++ ){
+        y[2 * i] = mDecimated[i] * scale + offset;
+    }
+#endif
+
+    mNumVertices = numVertices;
+
+    // Copy the line onto the GPU with one mapped write 
+    void *gpuMem = mLineVbo->mapReplace();
+    memcpy( gpuMem, mVertices.data(), mNumVertices * sizeof( vec2 ) );
+    mLineVbo->unmap();
+}
+
+void Oscilloscope::draw()
+{
+    if ( mNumVertices == 0 )
+        return;
+
+    gl::color( 1.0f, 1.0f, 1.0f );
+    mLineBatch->draw( 0, GLsizei( mNumVertices ) );
+}
@@ -20,36 +20,77 @@
 */
 
 #include "PGranularNode.h"
+#include "RtSafety.h"
+#include "AsyncLogger.h"
 
 #include "cinder/audio/Context.h"
 
 #include "cinder/Rand.h"
 
+#include <algorithm>
+
+namespace {
+
+// a change of the pitch bend is smoothed over this time, so that a coarse pitch wheel doesn't zip. In seconds
+const double kPitchBendSmoothing = 0.005;
+
+}
+
 // generate random numbers from 0 to max 
-// it's passed to PGranular to randomize the phase offset at grain creation 
+// it's passed to PGranular to randomize the phase offset at grain creation.
+// Each node has its own seeded generator, so that a replay with the same seed triggers the same grains 
 struct RandomGenerator
 {
 
-    RandomGenerator( size_t max ) : mMax( max )
+    RandomGenerator( size_t max, uint32_t seed ) : mMax( max ), mRand( seed )
     {}
 
-    size_t operator()() const {
-        return ci::Rand::randUint( int(mMax) );
+    size_t operator()() {
+        return mRand.nextUint( uint32_t(mMax) );
+    }
+
+    void seed( uint32_t seed ) {
+        mRand.seed( seed );
     }
 
     size_t mMax;
+    ci::Rand mRand;
 };
-// FIXME maybe use only one random gen 
 
-PGranularNode::PGranularNode( ci::audio::Buffer *grainBuffer, CursorTriggerMsgRingBuffer &triggerRingBuffer ) :
-    Node( Format().channels( 1 ) ),
+PGranularNode::PGranularNode( ci::audio::Buffer *grainBuffer, const collidoscope::OnsetIndex *onsetIndex, double onsetSnapTime, CursorTriggerMsgRingBuffer &triggerRingBuffer, XrunMonitor &xrunMonitor, LatencyProbe &latencyProbe, int waveIdx, size_t numDirectNoteQueues, uint32_t randomSeed,
+    size_t numChannels, double panCenter, double panSpread, bool panVoices ) :
+    Node( Format().channels( std::max< size_t >( 1, std::min( numChannels, kMaxChannels ) ) ) ),
+    mLastMidiNote( kNoMidiNote ),
+    mGlideSamples( 0 ),
     mGrainBuffer(grainBuffer),
+    mOnsetIndex( onsetIndex ),
+    mOnsetSnapTime( onsetSnapTime ),
+    mTriggerRingBuffer( triggerRingBuffer ),
+    mNoteMsgRingBufferPack( 128 ),
+    mNumPendingNotes( 0 ),
+    mXrunMonitor( xrunMonitor ),
+    mWaveIdx( waveIdx ),
+    mLatencyProbe( latencyProbe ),
     mSelectionStart( 0 ),
     mSelectionSize( 0 ),
     mGrainDurationCoeff( 1 ),
-    mTriggerRingBuffer( triggerRingBuffer ),
-    mNoteMsgRingBufferPack( 128 )
+    mPitchBend( 0 ),
+    mGlideTime( 0 ),
+    mGrainDensity( 0 ),
+    mGrainJitter( 0 ),
+    mGrainTime( 0 ),
+    mPanCenter( panCenter ),
+    mPanSpread( panSpread ),
+    mPanVoices( panVoices ),
+    mRandomSeed( randomSeed ),
+    mSeedPending( false ),
+    mOffline( false ),
+    mOfflineFrame( 0 )
 {
+    for ( size_t i = 0; i < numDirectNoteQueues; i++ ){
+        mDirectNoteMsgRingBufferPacks.push_back( std::unique_ptr< RingBufferPack<NoteMsg> >( new RingBufferPack<NoteMsg>( 128 ) ) );
+    }
+
     for ( int i = 0; i < kMaxVoices; i++ ){
         mMidiNotes[i] = kNoMidiNote;
 
@@ -65,7 +106,7 @@ void PGranularNode::initialize()
 {
     mTempBuffer = std::make_shared< ci::audio::Buffer >( getFramesPerBlock() );
 
-    mRandomOffset.reset( new RandomGenerator( getSampleRate() / 100 ) ); // divided by 100 corresponds to multiplied by 0.01 in the time domain 
+    mRandomOffset.reset( new RandomGenerator( getSampleRate() / 100, mRandomSeed ) ); // divided by 100 corresponds to multiplied by 0.01 in the time domain 
 
     /* create the PGranular object for looping */
     mPGranularLoop.reset( new collidoscope::PGranular<float, RandomGenerator, PGranularNode>( mGrainBuffer->getData(), mGrainBuffer->getNumFrames(), getSampleRate(), *mRandomOffset, *this, -1 ) );
@@ -75,13 +116,63 @@ void PGranularNode::initialize()
         mPGranularNotes[i].reset( new collidoscope::PGranular<float, RandomGenerator, PGranularNode>( mGrainBuffer->getData(), mGrainBuffer->getNumFrames(), getSampleRate(), *mRandomOffset, *this, int(i)) );
     }
 
+    /* the loop sits at the center, the voices either spread their grains or sit in a row across the spread */
+    if ( mPanVoices ){
+        mPGranularLoop->setPan( mPanCenter, 0.0 );
+        for ( size_t i = 0; i < kMaxVoices; i++ ){
+            const double voicePosition = ( double( i ) + 0.5 ) / double( kMaxVoices ) - 0.5;
+            mPGranularNotes[i]->setPan( mPanCenter + mPanSpread * voicePosition, 0.0 );
+        }
+    }
+    else {
+        mPGranularLoop->setPan( mPanCenter, mPanSpread );
+        for ( size_t i = 0; i < kMaxVoices; i++ ){
+            mPGranularNotes[i]->setPan( mPanCenter, mPanSpread );
+        }
+    }
+    seedRandom( mRandomSeed );
+
+    const size_t onsetSnapDistance = size_t( mOnsetSnapTime * getSampleRate() );
+    mPGranularLoop->setOnsetSnap( mOnsetIndex, onsetSnapDistance );
+    for ( size_t i = 0; i < kMaxVoices; i++ ){
+        mPGranularNotes[i]->setOnsetSnap( mOnsetIndex, onsetSnapDistance );
+    }
+
+}
+
+void PGranularNode::setRandomSeed( uint32_t seed )
+{
+    mRandomSeed = seed;
+    mSeedPending.store( true, std::memory_order_release );
+}
+
+void PGranularNode::seedRandom( uint32_t seed )
+{
+    mPGranularLoop->seedRandom( seed );
+    for ( size_t i = 0; i < kMaxVoices; i++ ){
+        mPGranularNotes[i]->seedRandom( seed + uint32_t( i + 1 ) );
+    }
+}
+
+void PGranularNode::setOffline( bool offline, uint64_t frame )
+{
+    mOfflineFrame = frame;
+    mOffline = offline;
 }
 
 void PGranularNode::process (ci::audio::Buffer *buffer )
 {
+    RT_SAFETY_SCOPE();
+
+    if ( mSeedPending.exchange( false, std::memory_order_acquire ) ){
+        mRandomOffset->seed( mRandomSeed );
+        seedRandom( mRandomSeed );
+    }
+
     // only update PGranular if the atomic value has changed from the previous time
     const boost::optional<size_t> selectionSize = mSelectionSize.get();
     if ( selectionSize ){
+        mXrunMonitor.logEvent( XrunMonitor::EventType::PARAM_CHANGE, mWaveIdx, XrunMonitor::kParamSelectionSize, 0, double( *selectionSize ) );
         mPGranularLoop->setSelectionSize( *selectionSize );
         for ( size_t i = 0; i < kMaxVoices; i++ ){
             mPGranularNotes[i]->setSelectionSize( *selectionSize );
@@ -90,6 +181,7 @@ void PGranularNode::process (ci::audio::Buffer *buffer )
 
     const boost::optional<size_t> selectionStart = mSelectionStart.get();
     if ( selectionStart ){
+        mXrunMonitor.logEvent( XrunMonitor::EventType::PARAM_CHANGE, mWaveIdx, XrunMonitor::kParamSelectionStart, 0, double( *selectionStart ) );
         mPGranularLoop->setSelectionStart( *selectionStart );
         for ( size_t i = 0; i < kMaxVoices; i++ ){
             mPGranularNotes[i]->setSelectionStart( *selectionStart );
@@ -98,23 +190,99 @@ void PGranularNode::process (ci::audio::Buffer *buffer )
 
     const boost::optional<double> grainDurationCoeff = mGrainDurationCoeff.get();
     if ( grainDurationCoeff ){
+        mXrunMonitor.logEvent( XrunMonitor::EventType::PARAM_CHANGE, mWaveIdx, XrunMonitor::kParamGrainDurationCoeff, 0, *grainDurationCoeff );
         mPGranularLoop->setGrainsDurationCoeff( *grainDurationCoeff );
         for ( size_t i = 0; i < kMaxVoices; i++ ){
             mPGranularNotes[i]->setGrainsDurationCoeff( *grainDurationCoeff );
         }
     }
 
-    // check messages to start/stop notes or loop 
-    size_t availableRead = mNoteMsgRingBufferPack.getBuffer().getAvailableRead();
-    mNoteMsgRingBufferPack.getBuffer().read( mNoteMsgRingBufferPack.getExchangeArray(), availableRead );
-    for ( size_t i = 0; i < availableRead; i++ ){
-        handleNoteMsg( mNoteMsgRingBufferPack.getExchangeArray()[i] );
+    const boost::optional<double> pitchBend = mPitchBend.get();
+    if ( pitchBend ){
+        mXrunMonitor.logEvent( XrunMonitor::EventType::PARAM_CHANGE, mWaveIdx, XrunMonitor::kParamPitchBend, 0, *pitchBend );
+        const size_t rampSamples = size_t( kPitchBendSmoothing * getSampleRate() );
+        mPGranularLoop->setPitchBend( *pitchBend, rampSamples );
+        for ( size_t i = 0; i < kMaxVoices; i++ ){
+            mPGranularNotes[i]->setPitchBend( *pitchBend, rampSamples );
+        }
     }
 
+    const boost::optional<double> glideTime = mGlideTime.get();
+    if ( glideTime ){
+        mXrunMonitor.logEvent( XrunMonitor::EventType::PARAM_CHANGE, mWaveIdx, XrunMonitor::kParamGlideTime, 0, *glideTime );
+        mGlideSamples = size_t( *glideTime * getSampleRate() );
+    }
+
+    // the three parameters of the scheduling by density are set together 
+    const boost::optional<double> grainDensity = mGrainDensity.get();
+    const boost::optional<double> grainJitter = mGrainJitter.get();
+    const boost::optional<double> grainTime = mGrainTime.get();
+    if ( grainDensity || grainJitter || grainTime ){
+        if ( grainDensity )
+            mXrunMonitor.logEvent( XrunMonitor::EventType::PARAM_CHANGE, mWaveIdx, XrunMonitor::kParamGrainDensity, 0, *grainDensity );
+        if ( grainJitter )
+            mXrunMonitor.logEvent( XrunMonitor::EventType::PARAM_CHANGE, mWaveIdx, XrunMonitor::kParamGrainJitter, 0, *grainJitter );
+        if ( grainTime )
+            mXrunMonitor.logEvent( XrunMonitor::EventType::PARAM_CHANGE, mWaveIdx, XrunMonitor::kParamGrainTime, 0, *grainTime );
+
+        const double density = mGrainDensity.current();
+        const double jitter = mGrainJitter.current();
+        const size_t durationSamples = size_t( mGrainTime.current() * getSampleRate() );
+        mPGranularLoop->setDensity( density, jitter, durationSamples );
+        for ( size_t i = 0; i < kMaxVoices; i++ ){
+            mPGranularNotes[i]->setDensity( density, jitter, durationSamples );
+        }
+    }
+
+    // check messages to start/stop notes or loop, from the graphic thread and straight from the MIDI threads
+    const uint64_t blockStart = mOffline ? mOfflineFrame.load() : getContext()->getNumProcessedFrames();
+    queueNoteMsgs( mNoteMsgRingBufferPack, blockStart );
+    for ( auto &ringBufferPack : mDirectNoteMsgRingBufferPacks ){
+        queueNoteMsgs( *ringBufferPack, blockStart );
+    }
+
+    // render the block in slices, so that each note due in this block starts at its exact frame
+    const size_t numChannels = buffer->getNumChannels();
+    float* channels[kMaxChannels];
+    const size_t numFrames = buffer->getNumFrames();
+    const uint64_t blockEnd = blockStart + numFrames;
+
+    size_t renderedFrames = 0;
+    size_t numKeptNotes = 0;
+    for ( size_t i = 0; i < mNumPendingNotes; i++ ){
+        const NoteMsg &msg = mPendingNotes[i];
+
+        if ( msg.frame >= blockEnd ){
+            // due in a later block 
+            mPendingNotes[numKeptNotes++] = msg;
+            continue;
+        }
+
+        const size_t offset = msg.frame > blockStart ? size_t( msg.frame - blockStart ) : 0;
+        if ( offset > renderedFrames ){
+            for ( size_t ch = 0; ch < numChannels; ch++ )
+                channels[ch] = buffer->getChannel( ch ) + renderedFrames;
+            renderGrains( channels, numChannels, mTempBuffer->getData(), offset - renderedFrames );
+            renderedFrames = offset;
+        }
+
+        handleNoteMsg( msg );
+    }
+    mNumPendingNotes = numKeptNotes;
+
+    for ( size_t ch = 0; ch < numChannels; ch++ )
+        channels[ch] = buffer->getChannel( ch ) + renderedFrames;
+    renderGrains( channels, numChannels, mTempBuffer->getData(), numFrames - renderedFrames );
+}
+
+void PGranularNode::renderGrains( float* const* channels, size_t numChannels, float *tempBuffer, size_t numFrames )
+{
+    if ( numFrames == 0 )
+        return;
+
     // process loop if not idle 
     if ( !mPGranularLoop->isIdle() ){
-        /* buffer is one channel only so I can use getData */
-        mPGranularLoop->process( buffer->getData(), mTempBuffer->getData(), buffer->getSize() );
+        mPGranularLoop->process( channels, numChannels, tempBuffer, numFrames );
     }
 
     // process notes if not idle 
@@ -122,7 +290,7 @@ void PGranularNode::process (ci::audio::Buffer *buffer )
         if ( mPGranularNotes[i]->isIdle() )
             continue;
 
-        mPGranularNotes[i]->process( buffer->getData(), mTempBuffer->getData(), buffer->getSize() );
+        mPGranularNotes[i]->process( channels, numChannels, tempBuffer, numFrames );
 
         if ( mPGranularNotes[i]->isIdle() ){
             // this note became idle so update mMidiNotes
@@ -137,12 +305,14 @@ void PGranularNode::operator()( char msgType, int ID ) {
 
     switch ( msgType ){
     case 't':  { // trigger 
+        mXrunMonitor.logEvent( XrunMonitor::EventType::GRAIN_TRIGGER, mWaveIdx, ID );
         CursorTriggerMsg msg = makeCursorTriggerMsg( Command::TRIGGER_UPDATE, ID ); // put ID 
         mTriggerRingBuffer.write( &msg, 1 );
     };
         break;
 
     case 'e': // end envelope 
+        mXrunMonitor.logEvent( XrunMonitor::EventType::SYNTH_END, mWaveIdx, ID );
         CursorTriggerMsg msg = makeCursorTriggerMsg( Command::TRIGGER_END, ID ); // put ID 
         mTriggerRingBuffer.write( &msg, 1 );
         break;
@@ -151,8 +321,47 @@ void PGranularNode::operator()( char msgType, int ID ) {
     
 }
 
+void PGranularNode::queueNoteMsgs( RingBufferPack<NoteMsg> &ringBufferPack, uint64_t blockStart )
+{
+    const size_t availableRead = ringBufferPack.getBuffer().getAvailableRead();
+    if ( availableRead == 0 )
+        return;
+
+    ringBufferPack.getBuffer().read( ringBufferPack.getExchangeArray(), availableRead );
+    for ( size_t i = 0; i < availableRead; i++ ){
+        NoteMsg msg = ringBufferPack.getExchangeArray()[i];
+
+        // a frame more than one second ahead comes from a clock estimate gone wrong: play the note now 
+        if ( msg.frame > blockStart + getSampleRate() ){
+            msg.frame = 0;
+        }
+
+        if ( mNumPendingNotes == kMaxPendingNotes ){
+            // no room to wait: apply it at the beginning of the block 
+            AsyncLogger::instance().log( AsyncLogger::Level::WARNING, AsyncLogger::Code::PENDING_NOTES_FULL, mWaveIdx, double( msg.frame ) );
+            handleNoteMsg( msg );
+            continue;
+        }
+
+        // insertion sort, after the notes with the same frame 
+        size_t pos = mNumPendingNotes;
+        while ( pos > 0 && mPendingNotes[pos - 1].frame > msg.frame ){
+            mPendingNotes[pos] = mPendingNotes[pos - 1];
+            pos--;
+        }
+        mPendingNotes[pos] = msg;
+        mNumPendingNotes++;
+    }
+}
+
 void PGranularNode::handleNoteMsg( const NoteMsg &msg )
 {
+    mXrunMonitor.logEvent( XrunMonitor::EventType::NOTE, mWaveIdx, int( msg.cmd ), msg.midiNote, msg.rate );
+
+    if ( msg.cmd == Command::NOTE_ON ){
+        mLatencyProbe.recordNote( msg.timestamp );
+    }
+
     switch ( msg.cmd ){
     case Command::NOTE_ON: {
         bool synthFound = false;
@@ -161,6 +370,7 @@ void PGranularNode::handleNoteMsg( const NoteMsg &msg )
             // note was already on, so re-attack
             if ( mMidiNotes[i] == msg.midiNote ){
                 mPGranularNotes[i]->noteOn( msg.rate );
+                mLastMidiNote = msg.midiNote;
                 synthFound = true;
                 break;
             }
@@ -172,6 +382,13 @@ void PGranularNode::handleNoteMsg( const NoteMsg &msg )
 
                 if ( mMidiNotes[i] == kNoMidiNote ){
                     mPGranularNotes[i]->noteOn( msg.rate );
+
+                    // portamento: the new note starts at the pitch of the previous one 
+                    if ( mGlideSamples > 0 && mLastMidiNote != kNoMidiNote && mLastMidiNote != msg.midiNote ){
+                        mPGranularNotes[i]->glideFrom( double( mLastMidiNote - msg.midiNote ), mGlideSamples );
+                    }
+
+                    mLastMidiNote = msg.midiNote;
                     mMidiNotes[i] = msg.midiNote;
                     synthFound = true;
                     break;
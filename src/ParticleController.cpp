@@ -22,39 +22,64 @@
 */
 
 #include "ParticleController.h"
+#include "ShaderCache.h"
 #include "cinder/Rand.h"
 
-#include <type_traits>
+#include <cmath>
+#include <limits>
 
 using namespace ci;
-using std::list;
 
-ParticleController::ParticleController() :
-mNumParticles( 0 )
+namespace {
 
+// a particle that reaches the border of its cloud is deflected by rotating its velocity by this angle (radians) 
+const float kDeflectionAngle = 5.0f;
+const float kDeflectionCos = std::cos( kDeflectionAngle );
+const float kDeflectionSin = std::sin( kDeflectionAngle );
+
+// particles flying over the screen live this long 
+const int kFlyOverLifespan = 299;
+
+}
+
+ParticleController::ParticleController( size_t maxParticles ) :
+    mPositions( 2 * maxParticles, 0.0f ),
+    mVelX( maxParticles ),
+    mVelY( maxParticles ),
+    mCloudCenterX( maxParticles ),
+    mCloudCenterY( maxParticles ),
+    mCloudSizeSq( maxParticles ),
+    mAge( maxParticles ),
+    mLifespan( maxParticles ),
+    mMaxParticles( maxParticles ),
+    mNumParticles( 0 ),
+    mNumUploadedParticles( 0 )
 {
+    mPosX = mPositions.data();
+    mPosY = mPositions.data() + maxParticles;
+
     // uses Cinder (and OpenGL) drawing based on virtual buffer object
     // see ParticleSphereCPU example in Cinder library 
-     
-    mParticles.assign( kMaxParticles, Particle() );
-    mParticlePositions.assign( kMaxParticles, vec2( -1, -1 ) );
 
-    mParticleVbo = gl::Vbo::create( GL_ARRAY_BUFFER, mParticlePositions, GL_DYNAMIC_DRAW );
+    mParticleVbo = gl::Vbo::create( GL_ARRAY_BUFFER, mPositions, GL_DYNAMIC_DRAW );
 
+    // x and y come from the two halves of the buffer 
     geom::BufferLayout particleLayout;
-    particleLayout.append( geom::Attrib::POSITION, 2, sizeof( vec2 ), 0 );
+    particleLayout.append( geom::Attrib::CUSTOM_0, 1, sizeof( float ), 0 );
+    particleLayout.append( geom::Attrib::CUSTOM_1, 1, sizeof( float ), maxParticles * sizeof( float ) );
 
-    auto mesh = gl::VboMesh::create( int(mParticlePositions.size()), GL_POINTS, { { particleLayout, mParticleVbo } } );
+    auto mesh = gl::VboMesh::create( uint32_t( maxParticles ), GL_POINTS, { { particleLayout, mParticleVbo } } );
 
-    // creates glsl program to run the batch with 
+    // the glsl program to run the batch with is shared by the particle controllers of all the waves 
 #if ! defined( CINDER_GL_ES )
-    auto glsl = gl::GlslProg::create( gl::GlslProg::Format()
+    auto glsl = ShaderCache::get( gl::GlslProg::Format()
         .vertex( CI_GLSL( 150,
             uniform mat4	ciModelViewProjection;
-            in vec4			ciPosition;
+            in float		iPosX;
+            in float		iPosY;
 
             void main( void ) {
-                gl_Position = ciModelViewProjection * ciPosition;
+                gl_Position = ciModelViewProjection * vec4( iPosX, iPosY, 0.0, 1.0 );
                 gl_PointSize = 1.0;
             }
             ) )
@@ -67,16 +92,15 @@ mNumParticles( 0 )
         ) )
     );
 
-    mParticleBatch = gl::Batch::create( mesh, glsl );
-
 #else
-    auto glsl = gl::GlslProg::create( gl::GlslProg::Format()
+    auto glsl = ShaderCache::get( gl::GlslProg::Format()
         .vertex( CI_GLSL( 100,
             uniform mat4	ciModelViewProjection;
-            attribute vec4			ciPosition;
+            attribute float			iPosX;
+            attribute float			iPosY;
 
             void main( void ) {
-                gl_Position = ciModelViewProjection * ciPosition;
+                gl_Position = ciModelViewProjection * vec4( iPosX, iPosY, 0.0, 1.0 );
                 gl_PointSize = 1.0;
             }
         ) )
@@ -88,81 +112,121 @@ mNumParticles( 0 )
             }
         ) ) 
     );
-
-    mParticleBatch = gl::Batch::create( mesh, glsl );
 #endif
 
+    mParticleBatch = gl::Batch::create( mesh, glsl, { { geom::Attrib::CUSTOM_0, "iPosX" }, { geom::Attrib::CUSTOM_1, "iPosY" } } );
+}
 
+void ParticleController::removeParticle( size_t i )
+{
+    const size_t last = mNumParticles - 1;
+
+    mPosX[i] = mPosX[last];
+    mPosY[i] = mPosY[last];
+    mVelX[i] = mVelX[last];
+    mVelY[i] = mVelY[last];
+    mCloudCenterX[i] = mCloudCenterX[last];
+    mCloudCenterY[i] = mCloudCenterY[last];
+    mCloudSizeSq[i] = mCloudSizeSq[last];
+    mAge[i] = mAge[last];
+    mLifespan[i] = mLifespan[last];
+
+    mNumParticles--;
 }
 
 void ParticleController::updateParticles()
 {
-    // update the positions of the particles and dispose them if they've reached their timespan
-    for ( size_t i = 0; i < mNumParticles; i++ ){
-
-        Particle &particle = mParticles[i];
-        vec2 &pos = mParticlePositions[i];
-
-        particle.mAge++;
-
+    // nothing to move and nothing to take off the screen 
+    if ( mNumParticles == 0 && mNumUploadedParticles == 0 )
+        return;
 
-        if ( (!particle.mFlyOver && particle.mAge > particle.mLifespan) 
-                || (particle.mFlyOver && particle.mAge >= 300) ){
-            // dispose particle 
-            mParticles[i] = mParticles[mNumParticles - 1];
-            mParticlePositions[i] = mParticlePositions[mNumParticles - 1];
-            mParticlePositions[mNumParticles - 1].x = -1.0f;
-            mParticlePositions[mNumParticles - 1].y = -1.0f;
-            mNumParticles--;
-            continue;
-        }
+    const size_t numParticles = mNumParticles;
+
+    float * const posX = mPosX;
+    float * const posY = mPosY;
+    float * const velX = mVelX.data();
+    float * const velY = mVelY.data();
+    const float * const centerX = mCloudCenterX.data();
+    const float * const centerY = mCloudCenterY.data();
+    const float * const cloudSizeSq = mCloudSizeSq.data();
+    int * const age = mAge.data();
+
+    // update the positions of the particles. The loop has no branches so that it can be vectorized 
+    for ( size_t i = 0; i < numParticles; i++ ){
+        age[i]++;
+
+        const float x = posX[i] + velX[i];
+        const float y = posY[i] + velY[i];
+        posX[i] = x;
+        posY[i] = y;
+
+        // deflect the particles that are out of their cloud 
+        const float dx = x - centerX[i];
+        const float dy = y - centerY[i];
+        const bool out = dx * dx + dy * dy > cloudSizeSq[i];
+
+        const float vx = velX[i];
+        const float vy = velY[i];
+        velX[i] = out ? vx * kDeflectionCos - vy * kDeflectionSin : vx;
+        velY[i] = out ? vx * kDeflectionSin + vy * kDeflectionCos : vy;
+    }
 
-        pos += particle.mVel;
-        if ( ci::distance( pos, particle.mCloudCenter ) >  particle.mCloudSize && !particle.mFlyOver ){
-            particle.mVel = rotate<float>( particle.mVel, 5 );
-        }
+    // dispose the particles that have reached their timespan 
+    for ( size_t i = 0; i < mNumParticles; ){
+        if ( mAge[i] > mLifespan[i] )
+            removeParticle( i ); // check again the particle moved in place of the removed one 
+        else
+            i++;
     }
 
-    // Copy particle data onto the GPU.
-	// Map the GPU memory and write over it.
-    void *gpuMem = mParticleVbo->mapReplace();
-    memcpy( gpuMem, mParticlePositions.data(), mParticlePositions.size() * sizeof( vec2 ) );
-    mParticleVbo->unmap();
+    // Copy the positions of the live particles onto the GPU, the rest of the buffer is not drawn 
+    if ( mNumParticles > 0 ){
+        const GLsizeiptr size = GLsizeiptr( mNumParticles * sizeof( float ) );
+        mParticleVbo->bufferSubData( 0, size, mPosX );
+        mParticleVbo->bufferSubData( GLintptr( mMaxParticles * sizeof( float ) ), size, mPosY );
+    }
+    mNumUploadedParticles = mNumParticles;
 }
 
 void ParticleController::addParticles(int amount, const vec2 &initialLocation, const float cloudSize)
 {
     // reduce the particles linearly to the total number of particles already present 
     // the more particles aleary present the less particle are added
-    int reduction = ci::lmap<int>(int(mNumParticles), 0, kMaxParticles, 0, kMaxParticleAdd);
+    int reduction = ci::lmap<int>(int(mNumParticles), 0, int(mMaxParticles), 0, kMaxParticleAdd);
     amount -= reduction;
 
-    if ( mNumParticles + amount > kMaxParticles ){
-		//a.k.a. return if reached kMaxParticles 
-        amount = int(kMaxParticles - mNumParticles);
-	}
-
     if( amount <= 0 )
         return;
 
-	for( size_t i = 0; i < amount; i++ ){
+    if ( mNumParticles + amount > mMaxParticles ){
+        //a.k.a. return if reached mMaxParticles 
+        amount = int(mMaxParticles - mNumParticles);
+        if ( amount <= 0 )
+            return;
+    }
+
+    for( size_t i = mNumParticles; i < mNumParticles + amount; i++ ){
         // init new particle 
-        Particle &particle = mParticles[mNumParticles + i];
-        vec2 &pos = mParticlePositions[mNumParticles + i];
-
-        pos = initialLocation + Rand::randVec2() * 5.0f; // find a location nearby the initial location
-        particle.mCloudCenter = pos;
-        particle.mVel = Rand::randVec2() * Rand::randFloat( 1.0f, 5.0f );
-        particle.mCloudSize = cloudSize;
-        particle.mAge = 0;
-        particle.mLifespan = Rand::randInt( 30, 60 );
-        particle.mFlyOver = (Rand::randInt( 500 ) == 0);
-		
-	}
+        const vec2 pos = initialLocation + Rand::randVec2() * 5.0f; // find a location nearby the initial location
+        const vec2 vel = Rand::randVec2() * Rand::randFloat( 1.0f, 5.0f );
+
+        mPosX[i] = pos.x;
+        mPosY[i] = pos.y;
+        mCloudCenterX[i] = pos.x;
+        mCloudCenterY[i] = pos.y;
+        mVelX[i] = vel.x;
+        mVelY[i] = vel.y;
+        mAge[i] = 0;
+        mLifespan[i] = Rand::randInt( 30, 60 );
+        mCloudSizeSq[i] = cloudSize * cloudSize;
+
+        // some particles last longer and fly over the screen and reach the other user. They are never deflected 
+        if ( Rand::randInt( 500 ) == 0 ){
+            mLifespan[i] = kFlyOverLifespan;
+            mCloudSizeSq[i] = std::numeric_limits< float >::infinity();
+        }
+    }
     
     mNumParticles += amount ;
 
 }
-
-
-
@@ -0,0 +1,530 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "RtSafety.h"
+
+#ifdef RT_SAFETY_CHECKS
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <execinfo.h>
+
+#if defined( __APPLE__ )
+#include <malloc/malloc.h>
+#include <mach/mach.h>
+#endif
+
+
+namespace {
+
+// The state of each thread is kept in pthread specific data rather than in a thread_local variable:
+// on macOS thread_local storage is allocated lazily with malloc, which would recurse into the malloc hooks.
+pthread_key_t sStateKey;
+std::atomic<bool> sInstalled( false );
+std::atomic<bool> sAbortOnViolation( false );
+std::atomic<std::size_t> sNumViolations( 0 );
+
+enum : std::size_t {
+    kAudioThread = 1,      // the thread is inside a RT_SAFETY_SCOPE
+    kReporting = 2,        // a violation is being reported: the report itself can allocate
+    kAllowBlocking = 4     // inside a RT_SAFETY_ALLOW_BLOCKING
+};
+
+inline std::size_t getState()
+{
+    if ( !sInstalled.load( std::memory_order_relaxed ) )
+        return 0;
+
+    return reinterpret_cast<std::size_t>( pthread_getspecific( sStateKey ) );
+}
+
+inline void setState( std::size_t state )
+{
+    if ( sInstalled.load( std::memory_order_relaxed ) )
+        pthread_setspecific( sStateKey, reinterpret_cast<void*>( state ) );
+}
+
+void writeStderr( const char *str )
+{
+    ssize_t ignored = ::write( STDERR_FILENO, str, std::strlen( str ) );
+    (void)ignored;
+}
+
+// Reports the violation if the current thread is tagged as audio thread.
+// Only uses write() and backtrace_symbols_fd(), which don't go through malloc.
+void checkViolation( const char *what )
+{
+    const std::size_t state = getState();
+    if ( (state & kAudioThread) == 0 || (state & (kReporting | kAllowBlocking)) != 0 )
+        return;
+
+    setState( state | kReporting );
+
+    sNumViolations++;
+
+    writeStderr( "*** RT safety violation: " );
+    writeStderr( what );
+    writeStderr( " called in the audio thread\n" );
+
+    void *frames[64];
+    const int numFrames = backtrace( frames, 64 );
+    backtrace_symbols_fd( frames, numFrames, STDERR_FILENO );
+
+    setState( state );
+
+    if ( sAbortOnViolation )
+        std::abort();
+}
+
+
+#if defined( __APPLE__ )
+
+// ------------------------------------------------------------
+// malloc family, intercepted in the default malloc zone
+// ------------------------------------------------------------
+
+malloc_zone_t sOriginalZone;
+
+void* hookMalloc( malloc_zone_t *zone, size_t size )
+{
+    checkViolation( "malloc" );
+    return sOriginalZone.malloc( zone, size );
+}
+
+void* hookCalloc( malloc_zone_t *zone, size_t numItems, size_t size )
+{
+    checkViolation( "calloc" );
+    return sOriginalZone.calloc( zone, numItems, size );
+}
+
+void* hookValloc( malloc_zone_t *zone, size_t size )
+{
+    checkViolation( "valloc" );
+    return sOriginalZone.valloc( zone, size );
+}
+
+void* hookRealloc( malloc_zone_t *zone, void *ptr, size_t size )
+{
+    checkViolation( "realloc" );
+    return sOriginalZone.realloc( zone, ptr, size );
+}
+
+void hookFree( malloc_zone_t *zone, void *ptr )
+{
+    if ( ptr != nullptr )
+        checkViolation( "free" );
+    sOriginalZone.free( zone, ptr );
+}
+
+void* hookMemalign( malloc_zone_t *zone, size_t alignment, size_t size )
+{
+    checkViolation( "memalign" );
+    return sOriginalZone.memalign( zone, alignment, size );
+}
+
+void installMallocHooks()
+{
+    malloc_zone_t *zone = malloc_default_zone();
+    sOriginalZone = *zone;
+
+    // the default zone is write protected
+    vm_protect( mach_task_self(), (vm_address_t)zone, sizeof( malloc_zone_t ), 0, VM_PROT_READ | VM_PROT_WRITE );
+
+    zone->malloc = &hookMalloc;
+    zone->calloc = &hookCalloc;
+    zone->valloc = &hookValloc;
+    zone->realloc = &hookRealloc;
+    zone->free = &hookFree;
+    if ( zone->version >= 5 ){
+        zone->memalign = &hookMemalign;
+    }
+
+    vm_protect( mach_task_self(), (vm_address_t)zone, sizeof( malloc_zone_t ), 0, VM_PROT_READ );
+}
+
+#else
+
+void installMallocHooks()
+{
+    // on glibc malloc is replaced below, elsewhere only operator new/delete are checked
+}
+
+#endif // __APPLE__
+
+} // anonymous namespace
+
+
+#if !defined( __APPLE__ ) && defined( __GLIBC__ )
+
+// ------------------------------------------------------------
+// malloc family, replaced in the executable. glibc forwards its own calls here too
+// and exports the original implementations as __libc_*
+// ------------------------------------------------------------
+
+extern "C" {
+
+void* __libc_malloc( std::size_t size );
+void* __libc_calloc( std::size_t numItems, std::size_t size );
+void* __libc_realloc( void *ptr, std::size_t size );
+void* __libc_memalign( std::size_t alignment, std::size_t size );
+void* __libc_valloc( std::size_t size );
+void* __libc_pvalloc( std::size_t size );
+void __libc_free( void *ptr );
+
+void* malloc( std::size_t size )
+{
+    checkViolation( "malloc" );
+    return __libc_malloc( size );
+}
+
+void* calloc( std::size_t numItems, std::size_t size )
+{
+    checkViolation( "calloc" );
+    return __libc_calloc( numItems, size );
+}
+
+void* realloc( void *ptr, std::size_t size )
+{
+    checkViolation( "realloc" );
+    return __libc_realloc( ptr, size );
+}
+
+void free( void *ptr )
+{
+    if ( ptr != nullptr )
+        checkViolation( "free" );
+    __libc_free( ptr );
+}
+
+void* memalign( std::size_t alignment, std::size_t size )
+{
+    checkViolation( "memalign" );
+    return __libc_memalign( alignment, size );
+}
+
+void* aligned_alloc( std::size_t alignment, std::size_t size )
+{
+    checkViolation( "aligned_alloc" );
+    return __libc_memalign( alignment, size );
+}
+
+int posix_memalign( void **ptr, std::size_t alignment, std::size_t size )
+{
+    checkViolation( "posix_memalign" );
+
+    if ( alignment % sizeof( void* ) != 0 || (alignment & (alignment - 1)) != 0 )
+        return EINVAL;
+
+    void *result = __libc_memalign( alignment, size );
+    if ( result == nullptr )
+        return ENOMEM;
+
+    *ptr = result;
+    return 0;
+}
+
+void* valloc( std::size_t size )
+{
+    checkViolation( "valloc" );
+    return __libc_valloc( size );
+}
+
+void* pvalloc( std::size_t size )
+{
+    checkViolation( "pvalloc" );
+    return __libc_pvalloc( size );
+}
+
+} // extern "C"
+
+#endif // __GLIBC__
+
+
+#if defined( __APPLE__ )
+
+// ------------------------------------------------------------
+// pthread_mutex_lock, interposed by dyld
+// ------------------------------------------------------------
+
+// dyld replaces pthread_mutex_lock with this function in every image other than the one declaring the
+// interpose tuple, therefore the call below still reaches the original function.
+extern "C" int rtSafetyPthreadMutexLock( pthread_mutex_t *mutex )
+{
+    checkViolation( "pthread_mutex_lock" );
+    return pthread_mutex_lock( mutex );
+}
+
+namespace {
+
+struct InterposeTuple
+{
+    const void *replacement;
+    const void *replacee;
+};
+
+__attribute__((used)) const InterposeTuple sInterposeMutexLock __attribute__((section( "__DATA,__interpose" ))) = {
+    reinterpret_cast<const void*>( &rtSafetyPthreadMutexLock ),
+    reinterpret_cast<const void*>( &pthread_mutex_lock )
+};
+
+}
+
+#endif // __APPLE__
+
+
+// ------------------------------------------------------------
+// operator new/delete
+// ------------------------------------------------------------
+
+void* operator new( std::size_t size )
+{
+    checkViolation( "operator new" );
+
+    // don't report the same allocation twice in the malloc hook
+    const std::size_t state = getState();
+    setState( state | kReporting );
+    void *ptr = std::malloc( size == 0 ? 1 : size );
+    setState( state );
+
+    if ( ptr == nullptr )
+        throw std::bad_alloc();
+
+    return ptr;
+}
+
+void* operator new[]( std::size_t size )
+{
+    return ::operator new( size );
+}
+
+void* operator new( std::size_t size, const std::nothrow_t& ) noexcept
+{
+    try {
+        return ::operator new( size );
+    }
+    catch ( ... ){
+        return nullptr;
+    }
+}
+
+void* operator new[]( std::size_t size, const std::nothrow_t& ) noexcept
+{
+    return ::operator new( size, std::nothrow );
+}
+
+void operator delete( void *ptr ) noexcept
+{
+    if ( ptr == nullptr )
+        return;
+
+    checkViolation( "operator delete" );
+
+    const std::size_t state = getState();
+    setState( state | kReporting );
+    std::free( ptr );
+    setState( state );
+}
+
+void operator delete[]( void *ptr ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+void operator delete( void *ptr, const std::nothrow_t& ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+void operator delete[]( void *ptr, const std::nothrow_t& ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+void operator delete( void *ptr, std::size_t ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+void operator delete[]( void *ptr, std::size_t ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+#if defined( __cpp_aligned_new )
+
+void* operator new( std::size_t size, std::align_val_t alignment )
+{
+    checkViolation( "operator new" );
+
+    // posix_memalign wants at least the alignment of a pointer
+    const std::size_t align = std::max( std::size_t( alignment ), sizeof( void* ) );
+
+    const std::size_t state = getState();
+    setState( state | kReporting );
+    void *ptr = nullptr;
+    const int error = posix_memalign( &ptr, align, size == 0 ? 1 : size );
+    setState( state );
+
+    if ( error != 0 )
+        throw std::bad_alloc();
+
+    return ptr;
+}
+
+void* operator new[]( std::size_t size, std::align_val_t alignment )
+{
+    return ::operator new( size, alignment );
+}
+
+void* operator new( std::size_t size, std::align_val_t alignment, const std::nothrow_t& ) noexcept
+{
+    try {
+        return ::operator new( size, alignment );
+    }
+    catch ( ... ){
+        return nullptr;
+    }
+}
+
+void* operator new[]( std::size_t size, std::align_val_t alignment, const std::nothrow_t& ) noexcept
+{
+    return ::operator new( size, alignment, std::nothrow );
+}
+
+// posix_memalign memory is released with free, the same as the unaligned allocations
+void operator delete( void *ptr, std::align_val_t ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+void operator delete[]( void *ptr, std::align_val_t ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+void operator delete( void *ptr, std::size_t, std::align_val_t ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+void operator delete[]( void *ptr, std::size_t, std::align_val_t ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+void operator delete( void *ptr, std::align_val_t, const std::nothrow_t& ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+void operator delete[]( void *ptr, std::align_val_t, const std::nothrow_t& ) noexcept
+{
+    ::operator delete( ptr );
+}
+
+#endif // __cpp_aligned_new
+
+
+namespace collidoscope { namespace rtsafety {
+
+void install()
+{
+    if ( sInstalled )
+        return;
+
+    pthread_key_create( &sStateKey, nullptr );
+    sInstalled = true;
+
+    installMallocHooks();
+}
+
+void setAbortOnViolation( bool abort )
+{
+    sAbortOnViolation = abort;
+}
+
+std::size_t getNumViolations()
+{
+    return sNumViolations;
+}
+
+bool isEnabled()
+{
+    return true;
+}
+
+ScopedAudioThread::ScopedAudioThread() :
+    mPreviousState( getState() )
+{
+    setState( mPreviousState | kAudioThread );
+}
+
+ScopedAudioThread::~ScopedAudioThread()
+{
+    setState( mPreviousState );
+}
+
+ScopedAllowBlocking::ScopedAllowBlocking() :
+    mPreviousState( getState() )
+{
+    setState( mPreviousState | kAllowBlocking );
+}
+
+ScopedAllowBlocking::~ScopedAllowBlocking()
+{
+    setState( mPreviousState );
+}
+
+} } // namespace collidoscope::rtsafety
+
+
+#else // RT_SAFETY_CHECKS
+
+
+namespace collidoscope { namespace rtsafety {
+
+void install() {}
+
+void setAbortOnViolation( bool ) {}
+
+std::size_t getNumViolations() { return 0; }
+
+bool isEnabled() { return false; }
+
+ScopedAudioThread::ScopedAudioThread() : mPreviousState( 0 ) {}
+
+ScopedAudioThread::~ScopedAudioThread() {}
+
+ScopedAllowBlocking::ScopedAllowBlocking() : mPreviousState( 0 ) {}
+
+ScopedAllowBlocking::~ScopedAllowBlocking() {}
+
+} } // namespace collidoscope::rtsafety
+
+
+#endif // RT_SAFETY_CHECKS
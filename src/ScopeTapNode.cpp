@@ -0,0 +1,120 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ScopeTapNode.h"
+#include "RtSafety.h"
+
+#include <algorithm>
+
+using namespace ci::audio;
+
+
+ScopeTapNode::ScopeTapNode( size_t maxSnapshotFrames, const Format &format ) :
+    Node( format ),
+    mMaxSnapshotFrames( std::max< size_t >( 1, maxSnapshotFrames ) ),
+    mDecimation( 1 ),
+    mNumSnapshotFrames( 0 ),
+    mLastSnapshotSilent( false ),
+    mTriggerMode( TriggerMode::ZERO_CROSSING )
+{
+}
+
+void ScopeTapNode::initialize()
+{
+    const size_t framesPerBlock = getFramesPerBlock();
+
+    mDecimation = ( framesPerBlock + mMaxSnapshotFrames - 1 ) / mMaxSnapshotFrames;
+    mNumSnapshotFrames = framesPerBlock / mDecimation;
+
+    // allocate here, the audio thread only copies 
+    mHistory.assign( 2 * mNumSnapshotFrames, 0.0f );
+    if ( getNumChannels() > 1 )
+        mMix.assign( framesPerBlock, 0.0f );
+    for ( size_t i = 0; i < 3; i++ ){
+        mSnapshots.getSlot( i ).assign( mNumSnapshotFrames, 0.0f );
+    }
+}
+
+void ScopeTapNode::process( Buffer *buffer )
+{
+    RT_SAFETY_SCOPE();
+
+    const size_t numFrames = mNumSnapshotFrames;
+    const size_t numInputFrames = std::min( buffer->getNumFrames(), numFrames * mDecimation );
+    const float *in = buffer->getChannel( 0 );
+
+    if ( buffer->getNumChannels() > 1 ){
+        std::copy( in, in + numInputFrames, mMix.begin() );
+        for ( size_t ch = 1; ch < buffer->getNumChannels(); ch++ ){
+            const float *channel = buffer->getChannel( ch );
+            for ( size_t i = 0; i < numInputFrames; i++ ){
+                mMix[i] += channel[i];
+            }
+        }
+        in = mMix.data();
+    }
+
+    // shift the history back by one snapshot and append the new block, decimated 
+    std::copy( mHistory.begin() + numFrames, mHistory.end(), mHistory.begin() );
+
+    float *newest = &mHistory[numFrames];
+    if ( mDecimation == 1 ){
+        std::copy( in, in + numInputFrames, newest );
+    }
+    else {
+        const float scale = 1.0f / float( mDecimation );
+        for ( size_t i = 0; i < numFrames; i++ ){
+            float sum = 0.0f;
+            for ( size_t j = 0; j < mDecimation; j++ ){
+                sum += in[i * mDecimation + j];
+            }
+            newest[i] = sum * scale;
+        }
+    }
+
+    // by default the snapshot is the latest block
+    size_t start = numFrames;
+
+    if ( mTriggerMode == TriggerMode::ZERO_CROSSING ){
+        // latest rising zero crossing that leaves a whole snapshot after it 
+        for ( size_t i = numFrames; i > 0; i-- ){
+            if ( mHistory[i - 1] < 0.0f && mHistory[i] >= 0.0f ){
+                start = i;
+                break;
+            }
+        }
+    }
+
+    std::vector< float > &snapshot = mSnapshots.getWriteBuffer();
+    bool silent = true;
+    for ( size_t i = 0; i < numFrames; i++ ){
+        const float sample = mHistory[start + i];
+        snapshot[i] = sample;
+        silent &= sample == 0.0f;
+    }
+
+    // a silent snapshot after a silent snapshot doesn't change the oscilloscope 
+    if ( silent && mLastSnapshotSilent )
+        return;
+
+    mLastSnapshotSilent = silent;
+    mSnapshots.publish();
+}
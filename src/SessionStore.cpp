@@ -0,0 +1,342 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SessionStore.h"
+#include "AudioEngine.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace {
+
+// how often the background thread writes the changes
+const std::chrono::milliseconds kWriteInterval( 1000 );
+
+const char kMagic[8] = { 'C', 'O', 'L', 'L', 'S', 'E', 'S', 'S' };
+
+// the sections are aligned so that the samples start on a page boundary
+const std::size_t kHeaderSize = 64;
+const std::size_t kPageSize = 4096;
+
+struct FileHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t numWaves;
+    std::uint32_t numChunks;
+    std::uint32_t sampleRate;
+    std::uint64_t numFrames;
+    std::uint64_t waveSectionSize;
+};
+
+struct WaveHeader
+{
+    std::uint64_t numRecordedFrames;
+    std::uint32_t numChunksSet;
+    std::uint32_t paramsSet;  // one bit per SessionStore::Param
+    float params[SessionStore::kNumParams];
+};
+
+static_assert( sizeof( FileHeader ) <= kHeaderSize, "file header too big" );
+static_assert( sizeof( WaveHeader ) <= kHeaderSize, "wave header too big" );
+
+inline std::size_t alignUp( std::size_t size, std::size_t alignment )
+{
+    return ( size + alignment - 1 ) / alignment * alignment;
+}
+
+// each wave section: header, chunks (min and max of each), samples
+inline std::size_t chunksOffset() { return kHeaderSize; }
+
+inline std::size_t samplesOffset( std::size_t numChunks )
+{
+    return alignUp( kHeaderSize + numChunks * 2 * sizeof( float ), kPageSize );
+}
+
+}
+
+
+SessionStore::SessionStore() :
+    mMapping( nullptr ),
+    mMappingSize( 0 ),
+    mFile( -1 ),
+    mNumWaves( 0 ),
+    mNumChunks( 0 ),
+    mNumFrames( 0 ),
+    mWaveSectionSize( 0 ),
+    mAudioEngine( nullptr ),
+    mRunning( false )
+{
+}
+
+SessionStore::~SessionStore()
+{
+    stop();
+}
+
+bool SessionStore::open( const std::string &path, std::size_t numWaves, std::size_t numChunks, std::size_t numFrames, std::size_t sampleRate )
+{
+    mNumWaves = numWaves;
+    mNumChunks = numChunks;
+    mNumFrames = numFrames;
+    mWaveSectionSize = alignUp( samplesOffset( numChunks ) + numFrames * sizeof( float ), kPageSize );
+    mMappingSize = kPageSize + numWaves * mWaveSectionSize;
+
+    mFile = ::open( path.c_str(), O_RDWR | O_CREAT, 0644 );
+    if ( mFile < 0 ){
+        logError( "SessionStore: cannot open session file " + path );
+        return false;
+    }
+
+    // check the session left by the previous run against the current layout
+    FileHeader expected;
+    std::memset( &expected, 0, sizeof( expected ) );
+    std::memcpy( expected.magic, kMagic, sizeof( kMagic ) );
+    expected.version = kVersion;
+    expected.numWaves = std::uint32_t( numWaves );
+    expected.numChunks = std::uint32_t( numChunks );
+    expected.sampleRate = std::uint32_t( sampleRate );
+    expected.numFrames = numFrames;
+    expected.waveSectionSize = mWaveSectionSize;
+
+    FileHeader header;
+    struct stat fileStat;
+    const bool valid = fstat( mFile, &fileStat ) == 0 && std::size_t( fileStat.st_size ) == mMappingSize
+        && pread( mFile, &header, sizeof( header ), 0 ) == ssize_t( sizeof( header ) )
+        && std::memcmp( &header, &expected, sizeof( header ) ) == 0;
+
+    if ( !valid ){
+        // start a new session. Truncating first zeroes the whole file
+        if ( ftruncate( mFile, 0 ) != 0 || ftruncate( mFile, off_t( mMappingSize ) ) != 0 ){
+            logError( "SessionStore: cannot resize session file " + path );
+            ::close( mFile );
+            mFile = -1;
+            return false;
+        }
+    }
+
+    void *mapping = mmap( nullptr, mMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFile, 0 );
+    if ( mapping == MAP_FAILED ){
+        logError( "SessionStore: cannot map session file " + path );
+        ::close( mFile );
+        mFile = -1;
+        return false;
+    }
+    mMapping = static_cast< std::uint8_t* >( mapping );
+
+    if ( !valid )
+        std::memcpy( mMapping, &expected, sizeof( expected ) );
+
+    mWaveStates.clear();
+    mWaveStates.resize( numWaves );
+    for ( std::size_t i = 0; i < numWaves; i++ ){
+        mWaveStates[i].dirtyChunks.assign( numChunks, false );
+        // what is already in the file doesn't need to be written again
+        mWaveStates[i].numFramesWritten = getNumRecordedFrames( i );
+    }
+
+    return valid;
+}
+
+std::uint8_t* SessionStore::waveSection( std::size_t waveIdx ) const
+{
+    return mMapping + kPageSize + waveIdx * mWaveSectionSize;
+}
+
+std::size_t SessionStore::getNumRecordedFrames( std::size_t waveIdx ) const
+{
+    const WaveHeader *header = reinterpret_cast< const WaveHeader* >( waveSection( waveIdx ) );
+    return std::min( std::size_t( header->numRecordedFrames ), mNumFrames );
+}
+
+const float* SessionStore::getSamples( std::size_t waveIdx ) const
+{
+    return reinterpret_cast< const float* >( waveSection( waveIdx ) + samplesOffset( mNumChunks ) );
+}
+
+std::size_t SessionStore::getNumChunksSet( std::size_t waveIdx ) const
+{
+    const WaveHeader *header = reinterpret_cast< const WaveHeader* >( waveSection( waveIdx ) );
+    return std::min( std::size_t( header->numChunksSet ), mNumChunks );
+}
+
+void SessionStore::getChunk( std::size_t waveIdx, std::size_t chunkIdx, float &min, float &max ) const
+{
+    const float *chunks = reinterpret_cast< const float* >( waveSection( waveIdx ) + chunksOffset() );
+    min = chunks[chunkIdx * 2];
+    max = chunks[chunkIdx * 2 + 1];
+}
+
+bool SessionStore::getParam( std::size_t waveIdx, Param param, float &value ) const
+{
+    const WaveHeader *header = reinterpret_cast< const WaveHeader* >( waveSection( waveIdx ) );
+    if ( ( header->paramsSet & ( 1u << param ) ) == 0 )
+        return false;
+
+    value = header->params[param];
+    return true;
+}
+
+void SessionStore::setParam( std::size_t waveIdx, Param param, float value )
+{
+    if ( !isOpen() )
+        return;
+
+    std::lock_guard< std::mutex > lock( mMutex );
+    mWaveStates[waveIdx].params[param] = value;
+    mWaveStates[waveIdx].paramsDirty |= 1u << param;
+}
+
+void SessionStore::setChunk( std::size_t waveIdx, std::size_t chunkIdx, float min, float max )
+{
+    if ( !isOpen() || chunkIdx >= mNumChunks )
+        return;
+
+    // the peaks are small: they go in the mapping right away and only the header update is deferred
+    float *chunks = reinterpret_cast< float* >( waveSection( waveIdx ) + chunksOffset() );
+
+    std::lock_guard< std::mutex > lock( mMutex );
+    chunks[chunkIdx * 2] = min;
+    chunks[chunkIdx * 2 + 1] = max;
+    mWaveStates[waveIdx].dirtyChunks[chunkIdx] = true;
+}
+
+void SessionStore::clearChunks( std::size_t waveIdx )
+{
+    if ( !isOpen() )
+        return;
+
+    std::lock_guard< std::mutex > lock( mMutex );
+    std::fill( mWaveStates[waveIdx].dirtyChunks.begin(), mWaveStates[waveIdx].dirtyChunks.end(), false );
+    mWaveStates[waveIdx].chunksCleared = true;
+}
+
+void SessionStore::start( AudioEngine &audioEngine )
+{
+    if ( !isOpen() || mRunning )
+        return;
+
+    mAudioEngine = &audioEngine;
+    mRunning = true;
+    mThread = std::thread( &SessionStore::run, this );
+}
+
+void SessionStore::stop()
+{
+    if ( mRunning ){
+        mRunning = false;
+        if ( mThread.joinable() )
+            mThread.join();
+    }
+
+    if ( mMapping != nullptr ){
+        msync( mMapping, mMappingSize, MS_SYNC );
+        munmap( mMapping, mMappingSize );
+        mMapping = nullptr;
+    }
+
+    if ( mFile >= 0 ){
+        ::close( mFile );
+        mFile = -1;
+    }
+}
+
+void SessionStore::run()
+{
+    while ( mRunning ){
+        std::this_thread::sleep_for( kWriteInterval );
+        writeChanges();
+    }
+
+    // the changes made right before stop()
+    writeChanges();
+}
+
+void SessionStore::writeChanges()
+{
+    bool changed = false;
+
+    for ( std::size_t i = 0; i < mNumWaves; i++ ){
+        WaveHeader *header = reinterpret_cast< WaveHeader* >( waveSection( i ) );
+        WaveState &state = mWaveStates[i];
+
+        // a new recording started: WAVE_START arrived since the last pass
+        bool newRecording = false;
+
+        {
+            std::lock_guard< std::mutex > lock( mMutex );
+
+            for ( std::size_t param = 0; param < kNumParams; param++ ){
+                if ( state.paramsDirty & ( 1u << param ) ){
+                    header->params[param] = state.params[param];
+                    header->paramsSet |= 1u << param;
+                }
+            }
+            changed |= state.paramsDirty != 0;
+            state.paramsDirty = 0;
+
+            // the peaks are already in the mapping, only the number of chunks set is updated.
+            // The recorder sends the chunks in order
+            std::size_t numChunksSet = state.chunksCleared ? 0 : header->numChunksSet;
+            while ( numChunksSet < mNumChunks && state.dirtyChunks[numChunksSet] ){
+                state.dirtyChunks[numChunksSet] = false;
+                numChunksSet++;
+            }
+            changed |= state.chunksCleared || numChunksSet != header->numChunksSet;
+            header->numChunksSet = std::uint32_t( numChunksSet );
+            newRecording = state.chunksCleared;
+            state.chunksCleared = false;
+        }
+
+        // only the frames recorded since the last pass are copied. A new recording is copied from the start,
+        // even when it has already gone past the position the previous one was written to
+        const std::size_t numRecordedFrames = std::min( mAudioEngine->getRecordedNumFrames( i ), mNumFrames );
+        if ( newRecording || numRecordedFrames < state.numFramesWritten ){
+            header->numRecordedFrames = 0;
+            state.numFramesWritten = 0;
+            changed = true;
+        }
+
+        if ( numRecordedFrames == state.numFramesWritten )
+            continue;
+
+        float *samples = reinterpret_cast< float* >( waveSection( i ) + samplesOffset( mNumChunks ) );
+        std::memcpy( samples + state.numFramesWritten, mAudioEngine->getRecordedSamples( i ) + state.numFramesWritten,
+            ( numRecordedFrames - state.numFramesWritten ) * sizeof( float ) );
+
+        // the samples go before the count, so that the count never covers samples not written yet
+        header->numRecordedFrames = numRecordedFrames;
+        state.numFramesWritten = numRecordedFrames;
+        changed = true;
+    }
+
+    // only the dirty pages are written
+    if ( changed )
+        msync( mMapping, mMappingSize, MS_ASYNC );
+}
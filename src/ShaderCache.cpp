@@ -0,0 +1,66 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ShaderCache.h"
+
+#include <map>
+#include <string>
+
+
+namespace {
+
+std::map< std::string, ci::gl::GlslProgRef > sPrograms;
+std::size_t sNumHits = 0;
+
+}
+
+
+ci::gl::GlslProgRef ShaderCache::get( const ci::gl::GlslProg::Format &format )
+{
+    // the sources define the program. The separator keeps the two sources from running into each other
+    const std::string key = format.getVertex() + '\0' + format.getFragment();
+
+    auto found = sPrograms.find( key );
+    if ( found != sPrograms.end() ){
+        sNumHits++;
+        return found->second;
+    }
+
+    auto program = ci::gl::GlslProg::create( format );
+    sPrograms.emplace( key, program );
+    return program;
+}
+
+std::size_t ShaderCache::getNumPrograms()
+{
+    return sPrograms.size();
+}
+
+std::size_t ShaderCache::getNumHits()
+{
+    return sNumHits;
+}
+
+void ShaderCache::clear()
+{
+    sPrograms.clear();
+    sNumHits = 0;
+}
@@ -0,0 +1,197 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SpectrumTapNode.h"
+#include "RtSafety.h"
+
+#include "cinder/audio/dsp/Dsp.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using namespace ci::audio;
+
+
+namespace {
+
+// how often the analyzer thread looks for new audio
+const std::chrono::milliseconds kPollInterval( 5 );
+
+// lowest frequency of the spectrum, in Hz
+const double kMinFrequency = 40.0;
+
+}
+
+
+SpectrumTapNode::SpectrumTapNode( size_t fftSize, size_t hopSize, size_t numBands, double releaseTime, const Format &format ) :
+    Node( format ),
+    mFftSize( fftSize ),
+    mHopSize( std::max< size_t >( 1, std::min( hopSize, fftSize ) ) ),
+    mNumBands( std::max< size_t >( 1, numBands ) ),
+    mReleaseTime( releaseTime ),
+    mNumDroppedBlocks( 0 ),
+    mFftInput( fftSize ),
+    mSpectrum( fftSize ),
+    mReleaseCoeff( 1.0f ),
+    mLastBandsSilent( false ),
+    mRunning( false )
+{
+}
+
+SpectrumTapNode::~SpectrumTapNode()
+{
+    stopThread();
+}
+
+void SpectrumTapNode::initialize()
+{
+    // initialize is called again when the context is reconfigured 
+    stopThread();
+
+    const size_t framesPerBlock = getFramesPerBlock();
+    const double sampleRate = double( getSampleRate() );
+
+    // allocate here, the audio thread only copies 
+    mMix.assign( framesPerBlock, 0.0f );
+    mRingBuffer.reset( new dsp::RingBuffer( std::max( 4 * mFftSize, 8 * framesPerBlock ) ) );
+
+    mFft.reset( new dsp::Fft( mFftSize ) );
+    mWindow.resize( mFftSize );
+    dsp::generateWindow( dsp::WindowType::HANN, mWindow.data(), mFftSize );
+    mFrame.assign( mFftSize, 0.0f );
+
+    // the bands are evenly spaced on a log scale from kMinFrequency to the Nyquist frequency, and at least one bin wide 
+    const size_t numBins = mFftSize / 2;
+    const double binFrequency = sampleRate / double( mFftSize );
+    const double maxFrequency = sampleRate / 2.0;
+
+    mBandEdges.resize( mNumBands + 1 );
+    mBandEdges[0] = std::max< size_t >( 1, size_t( kMinFrequency / binFrequency ) );
+    for ( size_t i = 1; i <= mNumBands; i++ ){
+        const double frequency = kMinFrequency * std::pow( maxFrequency / kMinFrequency, double( i ) / double( mNumBands ) );
+        const size_t edge = size_t( std::lround( frequency / binFrequency ) );
+        mBandEdges[i] = std::min( numBins, std::max( edge, mBandEdges[i - 1] + 1 ) );
+    }
+
+    mSmoothedBands.assign( mNumBands, 0.0f );
+    mLastBandsSilent = false;
+    for ( size_t i = 0; i < 3; i++ ){
+        mBands.getSlot( i ).assign( mNumBands, 0.0f );
+    }
+
+    // fall by 1/e of the scale in releaseTime, one step each hop 
+    const double hopTime = double( mHopSize ) / sampleRate;
+    mReleaseCoeff = mReleaseTime > 0.0 ? float( 1.0 - std::exp( -hopTime / mReleaseTime ) ) : 1.0f;
+
+    mRunning = true;
+    mThread = std::thread( &SpectrumTapNode::run, this );
+}
+
+void SpectrumTapNode::uninitialize()
+{
+    stopThread();
+}
+
+void SpectrumTapNode::stopThread()
+{
+    mRunning = false;
+    if ( mThread.joinable() )
+        mThread.join();
+}
+
+void SpectrumTapNode::process( Buffer *buffer )
+{
+    RT_SAFETY_SCOPE();
+
+    const size_t numFrames = std::min( buffer->getNumFrames(), mMix.size() );
+    const float *in = buffer->getChannel( 0 );
+
+    if ( buffer->getNumChannels() > 1 ){
+        std::copy( in, in + numFrames, mMix.begin() );
+        for ( size_t ch = 1; ch < buffer->getNumChannels(); ch++ ){
+            dsp::add( mMix.data(), buffer->getChannel( ch ), mMix.data(), numFrames );
+        }
+        in = mMix.data();
+    }
+
+    // the ring buffer writes all or nothing 
+    if ( !mRingBuffer->write( in, numFrames ) )
+        mNumDroppedBlocks++;
+}
+
+void SpectrumTapNode::run()
+{
+    while ( mRunning ){
+        while ( mRingBuffer->getAvailableRead() >= mHopSize ){
+            // slide the frame by one hop 
+            std::copy( mFrame.begin() + mHopSize, mFrame.end(), mFrame.begin() );
+            mRingBuffer->read( mFrame.data() + mFftSize - mHopSize, mHopSize );
+            analyze();
+        }
+
+        std::this_thread::sleep_for( kPollInterval );
+    }
+}
+
+void SpectrumTapNode::analyze()
+{
+    dsp::mul( mFrame.data(), mWindow.data(), mFftInput.getData(), mFftSize );
+    mFft->forward( &mFftInput, &mSpectrum );
+
+    const float *real = mSpectrum.getReal();
+    const float *imag = mSpectrum.getImag();
+
+    // a full scale sine in the middle of a bin is at 0 dB: the hann window halves the amplitude and the FFT is not normalized 
+    const float powerScale = 16.0f / float( mFftSize * mFftSize );
+    const float dbScale = 1.0f / float( -kMinDb );
+
+    bool silent = true;
+    for ( size_t band = 0; band < mNumBands; band++ ){
+        // the loudest bin of the band, so that a pure tone has the same height in any band 
+        float power = 0.0f;
+        for ( size_t bin = mBandEdges[band]; bin < mBandEdges[band + 1]; bin++ ){
+            power = std::max( power, real[bin] * real[bin] + imag[bin] * imag[bin] );
+        }
+
+        const float db = 10.0f * std::log10( power * powerScale + 1.0e-20f );
+        const float value = std::max( 0.0f, std::min( 1.0f, ( db - float( kMinDb ) ) * dbScale ) );
+
+        float &smoothed = mSmoothedBands[band];
+        if ( value >= smoothed )
+            smoothed = value;
+        else
+            smoothed += ( value - smoothed ) * mReleaseCoeff;
+
+        if ( smoothed < 1.0e-3f )
+            smoothed = 0.0f;
+        else
+            silent = false;
+    }
+
+    if ( silent && mLastBandsSilent )
+        return;
+    mLastBandsSilent = silent;
+
+    std::vector< float > &bands = mBands.getWriteBuffer();
+    std::copy( mSmoothedBands.begin(), mSmoothedBands.end(), bands.begin() );
+    mBands.publish();
+}
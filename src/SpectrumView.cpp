@@ -0,0 +1,128 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London 
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+ 
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SpectrumView.h"
+#include "ShaderCache.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+using namespace ci;
+
+
+SpectrumView::SpectrumView( size_t numBands ) :
+    mInstances( numBands )
+{
+    for ( size_t i = 0; i < mInstances.size(); i++ ){
+        mInstances[i].index = float( i );
+        mInstances[i].height = 0.0f;
+    }
+
+    mInstanceVbo = gl::Vbo::create( GL_ARRAY_BUFFER, mInstances, GL_DYNAMIC_DRAW );
+
+    // one bar is a unit rect, moved and stretched by the instance data and the uniforms. A gap of 20% separates the bars 
+    auto mesh = gl::VboMesh::create( geom::Rect( ci::Rectf( 0, 0, 0.8f, 1 ) ) );
+
+    geom::BufferLayout instanceLayout;
+    instanceLayout.append( geom::Attrib::CUSTOM_0, 2, sizeof( Instance ), offsetof( Instance, index ), 1 /* per instance */ );
+    mesh->appendVbo( instanceLayout, mInstanceVbo );
+
+#if ! defined( CINDER_GL_ES )
+    auto glsl = ShaderCache::get( gl::GlslProg::Format()
+        .vertex( CI_GLSL( 150,
+            uniform mat4    ciModelViewProjection;
+            uniform vec3    uView; // bar width, bottom y, height
+            in vec4         ciPosition;
+            in vec2         iBar;  // index, height
+
+            void main( void ) {
+                vec4 pos = vec4( ( ciPosition.x + iBar.x ) * uView.x, uView.y - ciPosition.y * iBar.y * uView.z, 0.0, 1.0 );
+                gl_Position = ciModelViewProjection * pos;
+            }
+        ) )
+        .fragment( CI_GLSL( 150,
+            uniform vec4 uColor;
+            out vec4 oColor;
+
+            void main( void ) {
+                oColor = uColor;
+            }
+        ) )
+    );
+#else
+    auto glsl = ShaderCache::get( gl::GlslProg::Format()
+        .vertex( CI_GLSL( 300 es,
+            uniform mat4    ciModelViewProjection;
+            uniform vec3    uView;
+            in vec4         ciPosition;
+            in vec2         iBar;
+
+            void main( void ) {
+                vec4 pos = vec4( ( ciPosition.x + iBar.x ) * uView.x, uView.y - ciPosition.y * iBar.y * uView.z, 0.0, 1.0 );
+                gl_Position = ciModelViewProjection * pos;
+            }
+        ) )
+        .fragment( CI_GLSL( 300 es,
+            precision highp float;
+            uniform vec4 uColor;
+            out vec4 oColor;
+
+            void main( void ) {
+                oColor = uColor;
+            }
+        ) )
+    );
+#endif
+
+    mBatch = gl::Batch::create( mesh, glsl, { { geom::Attrib::CUSTOM_0, "iBar" } } );
+}
+
+void SpectrumView::setBands( const float *bands, size_t numBands )
+{
+    numBands = std::min( numBands, mInstances.size() );
+    for ( size_t i = 0; i < numBands; i++ ){
+        mInstances[i].height = bands[i];
+    }
+
+    // Copy the bars onto the GPU with one mapped write 
+    void *gpuMem = mInstanceVbo->mapReplace();
+    memcpy( gpuMem, mInstances.data(), mInstances.size() * sizeof( Instance ) );
+    mInstanceVbo->unmap();
+}
+
+void SpectrumView::reset()
+{
+    const std::vector< float > zeros( mInstances.size(), 0.0f );
+    setBands( zeros.data(), zeros.size() );
+}
+
+void SpectrumView::draw( float windowWidth, float bottomY, float height, const ColorA &color )
+{
+    if ( mInstances.empty() )
+        return;
+
+    const float barWidth = windowWidth / float( mInstances.size() );
+    mBatch->getGlslProg()->uniform( "uView", vec3( barWidth, bottomY, height ) );
+    mBatch->getGlslProg()->uniform( "uColor", color );
+
+    mBatch->drawInstanced( GLsizei( mInstances.size() ) );
+}
@@ -24,25 +24,27 @@
 #include "Wave.h"
 #include "DrawInfo.h"
 
+#include <algorithm>
+
 
 using namespace ci;
 
-Wave::Wave( size_t numChunks, Color selectionColor ):
+Wave::Wave( size_t numChunks, Color selectionColor, size_t maxParticles ):
+#ifdef USE_PARTICLES
+    mParticleController( maxParticles ),
+#endif
+    mChunkHasCursor( numChunks, 0 ),
     mNumChunks( numChunks ),
     mSelection( this, selectionColor ),
     mColor(Color(0.5f, 0.5f, 0.5f)),
-    mFilterCoeff( 1.0f )
+    mFilterCoeff( 1.0f ),
+    mChunkRenderer( numChunks + 2 ) // one more instance for each selection bar 
 {
     mChunks.reserve( numChunks );
 
     for ( size_t i = 0; i < numChunks; i++ ){
         mChunks.emplace_back( i );
     }
-
-    // init cinder batch drawing
-    auto lambert = gl::ShaderDef().color();
-    gl::GlslProgRef shader = gl::getStockShader( lambert );
-    mChunkBatch = gl::Batch::create( geom::Rect( ci::Rectf( 0, 0, Chunk::kWidth, 1 ) ), shader );
 }
 
 void Wave::reset( bool onlyChunks )
@@ -50,6 +52,7 @@ void Wave::reset( bool onlyChunks )
     for (size_t i = 0; i < getSize(); i++){
         mChunks[i].reset();
     }
+    mStaticLayerDirty = true;
 
     if (onlyChunks)
         return;
@@ -63,6 +66,7 @@ void Wave::setChunk(size_t index, float bottom, float top)
     Chunk &c = mChunks[index];
     c.setTop(top);
     c.setBottom(bottom);
+    mStaticLayerDirty = true;
 }
 
 inline const Chunk & Wave::getChunk(size_t index)
@@ -70,37 +74,70 @@ inline const Chunk & Wave::getChunk(size_t index)
     return mChunks[index];
 }
 
-void Wave::update( double secondsPerChunk, const DrawInfo& di ) {
-    typedef std::map<int, Cursor>::iterator MapItr;
+void Wave::removeCursor( SynthID id )
+{
+    Cursor &cursor = mCursors[cursorSlot( id )];
+    if ( cursor.activeIdx == Cursor::kInactive )
+        return;
+
+    // move the last active cursor in place of the removed one 
+    const std::uint8_t lastSlot = mActiveCursors[--mNumActiveCursors];
+    mActiveCursors[cursor.activeIdx] = lastSlot;
+    mCursors[lastSlot].activeIdx = cursor.activeIdx;
+
+    cursor.activeIdx = Cursor::kInactive;
+}
+
+bool Wave::isAnimating() const
+{
+    if ( mNumActiveCursors > 0 )
+        return true;
+
+#ifdef USE_PARTICLES
+    if ( mParticleController.getNumParticles() > 0 )
+        return true;
+#endif
 
+    for ( const auto &chunk : mChunks ){
+        if ( chunk.isAnimating() )
+            return true;
+    }
+
+    return false;
+}
+
+void Wave::update( double secondsPerChunk, const DrawInfo& di ) {
 
     // update the cursor positions
     double now = ci::app::getElapsedSeconds();
-    for (MapItr itr = mCursors.begin(); itr != mCursors.end(); ++itr){
+    for ( size_t i = 0; i < mNumActiveCursors; i++ ){
+        Cursor &cursor = mCursors[mActiveCursors[i]];
+
         if (mSelection.isNull()){
-            itr->second.pos = Cursor::kNoPosition;
+            cursor.pos = Cursor::kNoPosition;
         }
 
-        if ( itr->second.pos == Cursor::kNoPosition )
+        if ( cursor.pos == Cursor::kNoPosition )
             continue;
 
 
-        double elapsed = now - itr->second.lastUpdate;
+        double elapsed = now - cursor.lastUpdate;
 
         // A chunk of audio corresponds to a certain time lenght of audio, according to sample rate.
         // Use elapsed time to advance through chunks so that the cursor is animated. 
         // So it goes from start to end of the selection in the time span of the grain 
-        itr->second.pos = int(mSelection.getStart() + int( elapsed / secondsPerChunk ));
+        cursor.pos = int(mSelection.getStart() + int( elapsed / secondsPerChunk ));
 
         // check we don't go too far off 
-        if (itr->second.pos > mSelection.getEnd()){
-            itr->second.pos = Cursor::kNoPosition;
+        if (cursor.pos > mSelection.getEnd()){
+            cursor.pos = Cursor::kNoPosition;
         }
     }
 
-    // update chunks for animation 
+    // update chunks for animation. The static layer is drawn again only if a chunk changed 
     for ( auto &chunk : mChunks ){
-        chunk.update( di );
+        if ( chunk.update( di ) )
+            mStaticLayerDirty = true;
     }
 
 #ifdef USE_PARTICLES
@@ -118,74 +155,114 @@ void Wave::draw( const DrawInfo& di ){
 #endif
 
     /* ########### draw the wave ########## */
-    /* scale the wave to fit the window */
-    gl::pushModelView(); 
+    const ci::ivec2 windowSize( di.getWindowWidth(), di.getWindowHeight() );
 
-    
+    // the chunks are laid out again and the cache is reallocated when the window size changes 
+    if ( !mStaticLayerFbo || mStaticLayerFbo->getSize() != windowSize ){
+        mStaticLayerFbo = gl::Fbo::create( windowSize.x, windowSize.y );
+        for ( auto &chunk : mChunks ){
+            chunk.layout( di );
+        }
+        mStaticLayerDirty = true;
+    }
+
+    if ( mStaticLayerDirty ){
+        drawStaticLayer( di );
+        mStaticLayerDirty = false;
+    }
+
+    /* the static layer is drawn with premultiplied alpha in the cache */
+    {
+        gl::ScopedBlendPremult blend;
+        gl::ScopedColor color( 1.0f, 1.0f, 1.0f, 1.0f );
+        gl::draw( mStaticLayerFbo->getColorTexture(), Rectf( 0.0f, 0.0f, float( windowSize.x ), float( windowSize.y ) ) );
+    }
+
+    if ( mSelection.isNull() || mNumActiveCursors == 0 )
+        return;
+
+    /* the cursors are drawn live on top of the static layer */
+
+    // mark the chunks the cursors are on, in one pass over the cursors 
+    std::fill( mChunkHasCursor.begin(), mChunkHasCursor.end(), 0 );
+    for ( size_t i = 0; i < mNumActiveCursors; i++ ){
+        const int pos = mCursors[mActiveCursors[i]].pos;
+        if ( pos >= 0 && pos < int( mNumChunks ) )
+            mChunkHasCursor[pos] = 1;
+    }
+
+    mChunkRenderer.clear();
+    for ( size_t i = 0; i < getSize(); i++ ){
+        // draw the chunk white if one of the cursors is positioned in it 
+        if ( mChunkHasCursor[i] ){
+            mChunkRenderer.add( mChunks[i].getX(), mChunks[i].getHeight( di ), CURSOR_CLR );
+        }
+    }
+
+    gl::pushModelView();
+    scaleToWindow( di );
+    {
+        gl::ScopedBlendAlpha blend;
+        mChunkRenderer.draw( float( di.getWaveCenterY() ) );
+    }
+    gl::popModelView();
+}
+
+void Wave::scaleToWindow( const DrawInfo& di )
+{
     const float wavePixelLen =  ( mNumChunks * ( 2 + Chunk::kWidth ) );
     /* scale the x-axis for the wave to fit the window precisely */
     gl::scale( ((float)di.getWindowWidth() ) / wavePixelLen , 1.0f);
-    /* draw the chunks */
+}
+
+void Wave::drawStaticLayer( const DrawInfo& di )
+{
+    /* add the chunks to the renderer in drawing order, then draw them all at once */
+    mChunkRenderer.clear();
+
     if (mSelection.isNull()){
         /* no selection: all chunks the same color */
-        gl::color(mColor); 
         for (size_t i = 0; i < getSize(); i++){
-            mChunks[i].draw( di, mChunkBatch );
+            mChunkRenderer.add( mChunks[i].getX(), mChunks[i].getHeight( di ), mColor );
         }
     }
     else{ 
         // Selection not null 
-        gl::color(this->mColor); 
-
-        // update the array with cursor positions 
-        mCursorsPos.clear();
-        for ( auto cursor : mCursors ){
-            mCursorsPos.push_back( cursor.second.pos );
-        }
-
-        gl::enableAlphaBlending();
-
         const float selectionAlpha = 0.5f + mFilterCoeff * 0.5f;
-
+        const ColorA barColor( mSelection.getColor(), 0.5f );
+        const ColorA selectionColor( mSelection.getColor(), selectionAlpha );
+        const float barHeight = di.getSelectionBarHeight();
 
         for (size_t i = 0; i < getSize(); i++){
-            /* when in selection use selection color */
+            const Chunk &chunk = mChunks[i];
             
             if (i == mSelection.getStart()){
                 /* draw the selection bar with a transparent selection color */
-                gl::color(mSelection.getColor().r, mSelection.getColor().g, mSelection.getColor().b, 0.5f);
-                mChunks[i].drawBar( di, mChunkBatch );
-
-                /* set the color to the selection */
-                gl::color(mSelection.getColor().r, mSelection.getColor().g, mSelection.getColor().b, selectionAlpha);
+                mChunkRenderer.add( chunk.getX(), barHeight, barColor );
             }
 
-            // check if one of the cursors is positioned in this chunk, and draw it white if it is 
-            if (std::find(mCursorsPos.begin(), mCursorsPos.end(),i) != mCursorsPos.end() ){
-                gl::color(CURSOR_CLR);
-                mChunks[i].draw( di, mChunkBatch );
-                gl::color(mSelection.getColor().r, mSelection.getColor().g, mSelection.getColor().b, selectionAlpha);
-            }
-            else{
-                /* just draw with current color */
-                mChunks[i].draw( di, mChunkBatch );
-            }
+            /* when in selection use selection color */
+            const bool inSelection = i >= mSelection.getStart() && i <= mSelection.getEnd();
+            mChunkRenderer.add( chunk.getX(), chunk.getHeight( di ), inSelection ? selectionColor : ColorA( mColor ) );
             
-            /* exit selection: go back to wave color */
             if (i == mSelection.getEnd()){
                 /* draw the selection bar with a transparent selection color */
-                gl::color(mSelection.getColor().r, mSelection.getColor().g, mSelection.getColor().b, 0.5f);
-                mChunks[i].drawBar( di, mChunkBatch );
-                /* set the color to the wave */
-                gl::color(this->mColor);  
+                mChunkRenderer.add( chunk.getX(), barHeight, barColor );
             }
         }
-        gl::disableAlphaBlending();
     }
-    
 
-    gl::popModelView();
+    gl::ScopedFramebuffer framebuffer( mStaticLayerFbo );
+    gl::ScopedViewport viewport( ci::ivec2( 0 ), mStaticLayerFbo->getSize() );
+    gl::ScopedMatrices matrices;
+    gl::setMatricesWindow( mStaticLayerFbo->getSize() );
+
+    gl::clear( ColorA( 0.0f, 0.0f, 0.0f, 0.0f ) );
 
+    // blending the alpha channel with ONE, ONE_MINUS_SRC_ALPHA leaves premultiplied colors in the cache 
+    gl::ScopedBlend blend( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA );
+    scaleToWindow( di );
+    mChunkRenderer.draw( float( di.getWaveCenterY() ) );
 }
 
 
@@ -209,6 +286,7 @@ void Wave::Selection::setStart(size_t start)  {
     mWave->mChunks[start].setAsSelectionStart( true );
     
     mNull = false;
+    mWave->mStaticLayerDirty = true;
 
     size_t size = getSize();
 
@@ -221,6 +299,8 @@ void Wave::Selection::setStart(size_t start)  {
 
 void Wave::Selection::setSize(size_t size)  {
 
+    mWave->mStaticLayerDirty = true;
+
     if ( size <= 0 ){
         mNull = true;
         return;
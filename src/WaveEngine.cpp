@@ -0,0 +1,201 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WaveEngine.h"
+
+#include <algorithm>
+
+using namespace ci::audio;
+
+
+WaveOutputNode::WaveOutputNode( const Format &format ) :
+    Node( format )
+{
+}
+
+void WaveOutputNode::initialize()
+{
+    mRenderBuffer.setSize( getFramesPerBlock(), getNumChannels() );
+}
+
+void WaveOutputNode::render()
+{
+    mRenderBuffer.zero();
+    pullInputs( &mRenderBuffer );
+}
+
+
+WaveEngine::WaveEngine( const Config &config, size_t waveIdx, const InputDeviceNodeRef &inputDeviceNode, XrunMonitor &xrunMonitor, LatencyProbe &latencyProbe ) :
+    mWaveIdx( waveIdx ),
+    mCursorTriggerRingBufferPack( new RingBufferPack<CursorTriggerMsg>( config.getCursorTriggerMessageBufSize() ) )
+{
+    auto ctx = Context::master();
+
+    /* one channel router */
+    mInputRouterNode = ctx->makeNode( new ChannelRouterNode( Node::Format().channels( 1 ) ) );
+
+    /* buffer recorder */
+    mBufferRecorderNode = ctx->makeNode( new BufferToWaveRecorderNode( config.getNumChunks(), config.getWaveLen() ) );
+    /* this prevents the node from recording before record is pressed */
+    mBufferRecorderNode->setAutoEnabled( false );
+
+    // route the input part of the audio graph. One channel of the input goes into one channel route
+    // and from one channel route to one channel buffer recorder. When there are more waves than input channels
+    // the waves share the input channels
+    const size_t inputChannel = waveIdx % inputDeviceNode->getNumChannels();
+    inputDeviceNode >> mInputRouterNode->route( inputChannel, 0, 1 ) >> mBufferRecorderNode;
+
+    // the output part is mono, or it spreads the grains over the spatial channels with each wave at its own position:
+    // evenly across the stereo field, or evenly around the ring 
+    size_t numChannels = std::min( config.getNumSpatialChannels(), ctx->getOutput()->getNumChannels() );
+    numChannels = numChannels < 2 ? 1 : std::min( numChannels, PGranularNode::kMaxChannels );
+
+    const size_t numWaves = config.getNumWaves();
+    double panCenter = 0.5;
+    if ( numChannels > 2 )
+        panCenter = double( waveIdx ) / double( numWaves );
+    else if ( numWaves > 1 )
+        panCenter = double( waveIdx ) / double( numWaves - 1 );
+
+    // create PGranular loops passing the buffer of the RecorderNode as argument to the contructor
+    // one direct note queue for each MIDI port, so that each MIDI thread is the only writer of its queue 
+    // the grains start at the onsets found by the recorder 
+    mPGranularNode = ctx->makeNode( new PGranularNode( mBufferRecorderNode->getRecorderBuffer(), &mBufferRecorderNode->getOnsetIndex(), config.getGrainOnsetSnapTime(),
+        mCursorTriggerRingBufferPack->getBuffer(), 
+        xrunMonitor, latencyProbe, int( waveIdx ), config.getMaxMIDIPorts(), config.getRandomSeed() + uint32_t( waveIdx ),
+        numChannels, panCenter, config.getGrainPanSpread(), config.getGrainPanMode() == Config::GrainPanMode::VOICE ) );
+
+    // create filter node
+    mLowPassFilterNode = ctx->makeNode( new FilterLowPassNode( Node::Format().channels( numChannels ) ) );
+    mLowPassFilterNode->setCutoffFreq( config.getMaxFilterCutoffFreq() );
+    mLowPassFilterNode->setQ( 0.707f );
+
+    // create scope tap node for the oscilloscope
+    mScopeTapNode = ctx->makeNode( new ScopeTapNode( config.getOscilloscopeMaxNumPoints() * config.getOscilloscopeNumPointsDivider(), 
+        Node::Format().channels( numChannels ) ) );
+    mGainNode = ctx->makeNode( new GainNode( Node::Format().channels( numChannels ) ) );
+
+    mOutputNode = ctx->makeNode( new WaveOutputNode( Node::Format().channels( numChannels ) ) );
+
+    // the scope tap sits between the filter and the gain, so that the oscilloscope scopes the filter output
+    mPGranularNode >> mLowPassFilterNode >> mScopeTapNode >> mGainNode >> mOutputNode;
+
+    // the output node is not connected to the context output, so it has to be enabled explicitly
+    mOutputNode->enable();
+}
+
+void WaveEngine::record()
+{
+    mBufferRecorderNode->start();
+}
+
+void WaveEngine::sendNoteMsg( const NoteMsg &msg )
+{
+    mPGranularNode->getNoteRingBuffer().write( &msg, 1 );
+}
+
+bool WaveEngine::sendDirectNoteMsg( size_t port, const NoteMsg &msg )
+{
+    if ( port >= mPGranularNode->getNumDirectNoteRingBuffers() )
+        return false;
+
+    return mPGranularNode->getDirectNoteRingBuffer( port ).write( &msg, 1 );
+}
+
+size_t WaveEngine::getRecordWaveAvailable()
+{
+    return mBufferRecorderNode->getRingBuffer().getAvailableRead();
+}
+
+bool WaveEngine::readRecordWave( RecordWaveMsg* buffer, size_t count )
+{
+    return mBufferRecorderNode->getRingBuffer().read( buffer, count );
+}
+
+void WaveEngine::setSelectionSize( size_t size )
+{
+    mPGranularNode->setSelectionSize( size );
+}
+
+void WaveEngine::setSelectionStart( size_t start )
+{
+    mPGranularNode->setSelectionStart( start );
+}
+
+void WaveEngine::setGrainDurationCoeff( double coeff )
+{
+    mPGranularNode->setGrainsDurationCoeff( coeff );
+}
+
+void WaveEngine::setFilterCutoff( double cutoff )
+{
+    mLowPassFilterNode->setCutoffFreq( cutoff );
+}
+
+void WaveEngine::setGain( double gain )
+{
+    mGainNode->setValue( gain );
+}
+
+void WaveEngine::setPitchBend( double semitones )
+{
+    mPGranularNode->setPitchBend( semitones );
+}
+
+void WaveEngine::setGlideTime( double seconds )
+{
+    mPGranularNode->setGlideTime( seconds );
+}
+
+void WaveEngine::setGrainDensity( double grainsPerSecond )
+{
+    mPGranularNode->setGrainDensity( grainsPerSecond );
+}
+
+void WaveEngine::setGrainJitter( double jitter )
+{
+    mPGranularNode->setGrainJitter( jitter );
+}
+
+void WaveEngine::setGrainTime( double seconds )
+{
+    mPGranularNode->setGrainTime( seconds );
+}
+
+void WaveEngine::checkCursorTriggers( std::vector<CursorTriggerMsg>& cursorTriggers )
+{
+    ci::audio::dsp::RingBufferT<CursorTriggerMsg> &ringBuffer = mCursorTriggerRingBufferPack->getBuffer();
+    CursorTriggerMsg* ringBufferReadArray = mCursorTriggerRingBufferPack->getExchangeArray();
+
+    size_t availableRead = ringBuffer.getAvailableRead();
+    bool successfulRead = ringBuffer.read( ringBufferReadArray, availableRead );
+
+    if ( successfulRead ){
+        for ( size_t i = 0; i < availableRead; i++ ){
+            cursorTriggers.push_back( ringBufferReadArray[i] );
+        }
+    }
+}
+
+uint64_t WaveEngine::getLastRecorderOverrun()
+{
+    return mBufferRecorderNode->getLastOverrun();
+}
@@ -0,0 +1,329 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WaveMixerNode.h"
+#include "WaveEngine.h"
+#include "ClockBridge.h"
+#include "XrunMonitor.h"
+#include "LatencyProbe.h"
+#include "RtSafety.h"
+#include "cinder/audio/Context.h"
+#include "cinder/audio/dsp/Dsp.h"
+
+#include <algorithm>
+
+#if defined( __APPLE__ )
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/semaphore.h>
+#include <mach/thread_policy.h>
+#elif defined( __linux__ )
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <chrono>
+#include <thread>
+#endif
+
+
+// Parks the render threads. signal() is called by the audio thread, so it must not take a lock:
+// a Mach semaphore on macOS and a futex on Linux, where the signal is a single system call.
+class WaveMixerNode::Semaphore
+{
+public:
+#if defined( __APPLE__ )
+    Semaphore() { semaphore_create( mach_task_self(), &mSemaphore, SYNC_POLICY_FIFO, 0 ); }
+    ~Semaphore() { semaphore_destroy( mach_task_self(), mSemaphore ); }
+
+    void signal() { semaphore_signal( mSemaphore ); }
+
+    void wait()
+    {
+        while ( semaphore_wait( mSemaphore ) == KERN_ABORTED ) {}
+    }
+
+private:
+    semaphore_t mSemaphore;
+#else
+    Semaphore() : mCount( 0 ) {}
+
+    void signal()
+    {
+        mCount.fetch_add( 1, std::memory_order_release );
+#if defined( __linux__ )
+        syscall( SYS_futex, reinterpret_cast< int* >( &mCount ), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0 );
+#endif
+    }
+
+    void wait()
+    {
+        while ( true ){
+            int count = mCount.load( std::memory_order_acquire );
+            if ( count > 0 ){
+                if ( mCount.compare_exchange_weak( count, count - 1, std::memory_order_acquire ) )
+                    return;
+                continue;
+            }
+#if defined( __linux__ )
+            syscall( SYS_futex, reinterpret_cast< int* >( &mCount ), FUTEX_WAIT_PRIVATE, 0, nullptr, nullptr, 0 );
+#else
+            std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+#endif
+        }
+    }
+
+private:
+    std::atomic< int > mCount;
+#endif
+};
+
+
+namespace {
+
+// Gives the calling thread the same kind of real-time scheduling as the CoreAudio thread.
+// periodSeconds is the duration of one audio block.
+void setRealtimePriority( double periodSeconds )
+{
+#if defined( __APPLE__ )
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info( &timebase );
+    const double nsToAbs = double( timebase.denom ) / double( timebase.numer );
+    const double periodAbs = periodSeconds * 1.0e9 * nsToAbs;
+
+    thread_time_constraint_policy_data_t policy;
+    policy.period = uint32_t( periodAbs );
+    policy.computation = uint32_t( periodAbs * 0.5 );
+    policy.constraint = uint32_t( periodAbs * 0.75 );
+    policy.preemptible = 1;
+
+    thread_policy_set( mach_thread_self(), THREAD_TIME_CONSTRAINT_POLICY, (thread_policy_t)&policy, THREAD_TIME_CONSTRAINT_POLICY_COUNT );
+#endif
+}
+
+}
+
+
+WaveMixerNode::Lane::Lane() :
+    nextWave( 0 ),
+    numRendered( 0 ),
+    parked( false ),
+    wakeUp( new Semaphore() )
+{
+}
+
+WaveMixerNode::Lane::~Lane()
+{
+}
+
+
+WaveMixerNode::WaveMixerNode( const std::vector< WaveEngine* > &waves, size_t numLanes, ClockBridge &clockBridge, XrunMonitor &xrunMonitor, double waitFraction, double spinFraction, const Format &format ) :
+    Node( format ),
+    mWaves( waves ),
+    mClockBridge( clockBridge ),
+    mXrunMonitor( xrunMonitor ),
+    mBlockCounter( 0 ),
+    mWaitFraction( waitFraction ),
+    mSpinFraction( spinFraction ),
+    mRunning( false )
+{
+    numLanes = std::max< size_t >( 1, std::min( numLanes, waves.size() ) );
+
+    for ( size_t i = 0; i < numLanes; i++ ){
+        mLanes.push_back( std::unique_ptr< Lane >( new Lane() ) );
+    }
+
+    // round robin: wave i goes to lane i % numLanes
+    for ( size_t i = 0; i < waves.size(); i++ ){
+        mLanes[i % numLanes]->waves.push_back( waves[i] );
+    }
+}
+
+WaveMixerNode::~WaveMixerNode()
+{
+    stopThreads();
+}
+
+void WaveMixerNode::initialize()
+{
+    startThreads();
+}
+
+void WaveMixerNode::uninitialize()
+{
+    stopThreads();
+}
+
+void WaveMixerNode::startThreads()
+{
+    if ( mRunning )
+        return;
+
+    mRunning = true;
+
+    // lane 0 is the audio thread
+    for ( size_t i = 1; i < mLanes.size(); i++ ){
+        mLanes[i]->thread = std::thread( &WaveMixerNode::run, this, mLanes[i].get() );
+    }
+}
+
+void WaveMixerNode::stopThreads()
+{
+    if ( !mRunning )
+        return;
+
+    mRunning = false;
+
+    for ( size_t i = 1; i < mLanes.size(); i++ ){
+        unpark( mLanes[i].get() );
+        if ( mLanes[i]->thread.joinable() )
+            mLanes[i]->thread.join();
+    }
+}
+
+void WaveMixerNode::run( Lane *lane )
+{
+    const double periodSeconds = double( getFramesPerBlock() ) / double( getSampleRate() );
+    const uint64_t spinNs = uint64_t( mSpinFraction * periodSeconds * 1.0e9 );
+
+    setRealtimePriority( periodSeconds );
+
+    uint64_t lastBlock = mBlockCounter.load( std::memory_order_acquire );
+
+    while ( true ){
+        lastBlock = waitForBlock( lane, lastBlock, spinNs );
+
+        if ( !mRunning )
+            break;
+
+        renderUnclaimed( lane );
+    }
+}
+
+uint64_t WaveMixerNode::waitForBlock( Lane *lane, uint64_t lastBlock, uint64_t spinNs )
+{
+    // the next block may be just about to start, e.g. when rendering took most of the period: spin for a short while
+    const uint64_t spinEnd = LatencyProbe::now() + spinNs;
+    while ( LatencyProbe::now() < spinEnd ){
+        const uint64_t block = mBlockCounter.load( std::memory_order_acquire );
+        if ( block != lastBlock || !mRunning )
+            return block;
+
+        std::atomic_signal_fence( std::memory_order_seq_cst );
+    }
+
+    // then park. The block counter is checked again after raising the flag, so a block published in between is not missed:
+    // either this thread takes the flag back and doesn't wait, or the audio thread took it and signals
+    while ( true ){
+        lane->parked.store( true, std::memory_order_seq_cst );
+
+        const uint64_t block = mBlockCounter.load( std::memory_order_seq_cst );
+        if ( block != lastBlock || !mRunning ){
+            if ( !lane->parked.exchange( false, std::memory_order_seq_cst ) )
+                lane->wakeUp->wait(); // consume the signal already on its way
+            return block;
+        }
+
+        lane->wakeUp->wait();
+    }
+}
+
+void WaveMixerNode::unpark( Lane *lane )
+{
+    if ( lane->parked.exchange( false, std::memory_order_seq_cst ) )
+        lane->wakeUp->signal();
+}
+
+void WaveMixerNode::renderUnclaimed( Lane *lane )
+{
+    const size_t numWaves = lane->waves.size();
+
+    while ( true ){
+        const size_t i = lane->nextWave.fetch_add( 1, std::memory_order_acq_rel );
+        if ( i >= numWaves )
+            break;
+
+        lane->waves[i]->render();
+        lane->numRendered.fetch_add( 1, std::memory_order_release );
+    }
+}
+
+void WaveMixerNode::process( ci::audio::Buffer *buffer )
+{
+    RT_SAFETY_SCOPE();
+
+    const uint64_t blockStart = LatencyProbe::now();
+    const uint64_t deadline = blockStart + uint64_t( mWaitFraction * 1.0e9 * double( buffer->getNumFrames() ) / double( getSampleRate() ) );
+
+    mClockBridge.blockBegin( getContext()->getNumProcessedFrames(), buffer->getNumFrames(), getSampleRate(), blockStart );
+    mXrunMonitor.blockBegin( getContext()->getNumProcessedFrames(), buffer->getNumFrames(), getSampleRate() );
+
+    // hand out the waves of the new block, then wake up the render threads
+    for ( size_t i = 1; i < mLanes.size(); i++ ){
+        mLanes[i]->numRendered.store( 0, std::memory_order_relaxed );
+        mLanes[i]->nextWave.store( 0, std::memory_order_release );
+    }
+    mBlockCounter.fetch_add( 1, std::memory_order_seq_cst );
+    for ( size_t i = 1; i < mLanes.size(); i++ ){
+        unpark( mLanes[i].get() );
+    }
+
+    // meanwhile render lane 0 in the audio thread
+    for ( WaveEngine *wave : mLanes[0]->waves ){
+        wave->render();
+    }
+
+    // the other lanes run on other cores and take about as long as lane 0: busy wait until the deadline.
+    // Past the deadline take over the waves a late lane has not started, and wait only for those it is rendering
+    for ( size_t i = 1; i < mLanes.size(); i++ ){
+        Lane *lane = mLanes[i].get();
+        const size_t numWaves = lane->waves.size();
+
+        while ( lane->numRendered.load( std::memory_order_acquire ) != numWaves ){
+            if ( LatencyProbe::now() > deadline ){
+                renderUnclaimed( lane );
+                while ( lane->numRendered.load( std::memory_order_acquire ) != numWaves ){
+                    std::atomic_signal_fence( std::memory_order_seq_cst );
+                }
+                break;
+            }
+            std::atomic_signal_fence( std::memory_order_seq_cst );
+        }
+    }
+
+    // mix each mono wave into its own output channel, and each channel of the spatialized waves into the same output channel
+    buffer->zero();
+    const size_t numChannels = buffer->getNumChannels();
+    const size_t numFrames = buffer->getNumFrames();
+    for ( WaveEngine *wave : mWaves ){
+        const ci::audio::Buffer &rendered = wave->getRenderBuffer();
+        if ( rendered.getNumChannels() == 1 ){
+            float *channel = buffer->getChannel( wave->getWaveIdx() % numChannels );
+            ci::audio::dsp::add( rendered.getData(), channel, channel, numFrames );
+            continue;
+        }
+
+        for ( size_t ch = 0; ch < rendered.getNumChannels(); ch++ ){
+            float *channel = buffer->getChannel( ch % numChannels );
+            ci::audio::dsp::add( rendered.getChannel( ch ), channel, channel, numFrames );
+        }
+    }
+}
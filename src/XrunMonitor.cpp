@@ -0,0 +1,258 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "XrunMonitor.h"
+#include "Log.h"
+#include "AsyncLogger.h"
+
+#include <fstream>
+#include <algorithm>
+#include <ctime>
+
+
+namespace {
+
+const char* eventTypeName( XrunMonitor::EventType type )
+{
+    switch ( type ){
+    case XrunMonitor::EventType::NOTE:             return "note";
+    case XrunMonitor::EventType::GRAIN_TRIGGER:    return "grain_trigger";
+    case XrunMonitor::EventType::SYNTH_END:        return "synth_end";
+    case XrunMonitor::EventType::PARAM_CHANGE:     return "param_change";
+    case XrunMonitor::EventType::DEADLINE_MISS:    return "deadline_miss";
+    case XrunMonitor::EventType::RECORDER_OVERRUN: return "recorder_overrun";
+    case XrunMonitor::EventType::INPUT_UNDERRUN:   return "input_underrun";
+    case XrunMonitor::EventType::INPUT_OVERRUN:    return "input_overrun";
+    default:                                       return "unknown";
+    }
+}
+
+// how often the writer thread checks for a frozen trace
+const std::chrono::milliseconds kWriterPollInterval( 250 );
+
+}
+
+
+const std::size_t XrunMonitor::kMaxPendingDumps = 16;
+
+
+XrunMonitor::XrunMonitor( std::size_t numBlocks, std::size_t numEvents, double tolerance, const std::string &filePrefix ) :
+    mTolerance( tolerance ),
+    mFilePrefix( filePrefix ),
+    mCreationTime( std::chrono::steady_clock::now() ),
+    mBlocks( numBlocks, BlockRecord() ),
+    mEvents( numEvents, EventRecord() ),
+    mBlockWriteIdx( 0 ),
+    mNumBlocksTotal( 0 ),
+    mNumEventsTotal( 0 ),
+    mNumEventsLogged( 0 ),
+    mCurrentFrame( 0 ),
+    mLastBlockTimeNs( 0 ),
+    mFrozenBlocks( numBlocks, BlockRecord() ),
+    mFrozenEvents( numEvents, EventRecord() ),
+    mFrozenNumBlocks( 0 ),
+    mFrozenNumEvents( 0 ),
+    mFrozenReason( EventType::DEADLINE_MISS ),
+    mFrozen( false ),
+    mDumpRequests( kMaxPendingDumps ),
+    mNumMisses( 0 ),
+    mNumDumps( 0 ),
+    mRunning( false )
+{
+}
+
+XrunMonitor::~XrunMonitor()
+{
+    stop();
+}
+
+void XrunMonitor::start()
+{
+    if ( mRunning )
+        return;
+
+    mRunning = true;
+    mWriterThread = std::thread( &XrunMonitor::run, this );
+}
+
+void XrunMonitor::stop()
+{
+    if ( !mRunning )
+        return;
+
+    mRunning = false;
+    if ( mWriterThread.joinable() )
+        mWriterThread.join();
+}
+
+std::uint64_t XrunMonitor::nowNs() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - mCreationTime ).count();
+}
+
+void XrunMonitor::blockBegin( std::uint64_t frame, std::size_t numFrames, std::size_t sampleRate )
+{
+    const std::uint64_t now = nowNs();
+    const std::uint64_t interval = mLastBlockTimeNs == 0 ? 0 : now - mLastBlockTimeNs;
+    mLastBlockTimeNs = now;
+
+    // close the previous block with the number of events logged during it
+    BlockRecord &previous = mBlocks[(mBlockWriteIdx + mBlocks.size() - 1) % mBlocks.size()];
+    previous.numEvents = std::uint32_t( mNumEventsLogged.load() );
+    mNumEventsLogged = 0;
+
+    mCurrentFrame = frame;
+
+    const double periodNs = 1.0e9 * double( numFrames ) / double( sampleRate );
+    const bool late = interval != 0 && double( interval ) > periodNs * mTolerance;
+
+    BlockRecord &block = mBlocks[mBlockWriteIdx];
+    block.frame = frame;
+    block.timeNs = now;
+    block.intervalNs = interval;
+    block.numEvents = 0;
+    block.late = late;
+    mBlockWriteIdx = (mBlockWriteIdx + 1) % mBlocks.size();
+    mNumBlocksTotal++;
+
+    if ( late ){
+        mNumMisses++;
+        logEvent( EventType::DEADLINE_MISS, -1, 0, 0, double( interval ) / 1.0e6 );
+        AsyncLogger::instance().log( AsyncLogger::Level::WARNING, AsyncLogger::Code::DEADLINE_MISS, double( frame ), double( interval ) / 1.0e6 );
+        freeze( EventType::DEADLINE_MISS );
+    }
+    else if ( !mFrozen.load( std::memory_order_acquire ) && mDumpRequests.getAvailableRead() != 0 ){
+        // the requests wait in the ring until the previous trace has been flushed
+        DumpRequest request;
+        mDumpRequests.read( &request, 1 );
+        logEvent( request.type, request.waveIdx, std::int64_t( request.frame ) );
+        freeze( request.type );
+    }
+}
+
+void XrunMonitor::logEvent( EventType type, int waveIdx, std::int64_t arg1, std::int64_t arg2, double value )
+{
+    // the wave render threads log concurrently: each call claims its own slot
+    const std::size_t eventIdx = mNumEventsTotal.fetch_add( 1 ) % mEvents.size();
+
+    EventRecord &event = mEvents[eventIdx];
+    event.frame = mCurrentFrame;
+    event.type = type;
+    event.waveIdx = std::int8_t( waveIdx );
+    event.arg1 = arg1;
+    event.arg2 = arg2;
+    event.value = value;
+
+    mNumEventsLogged++;
+}
+
+void XrunMonitor::requestDump( EventType type, int waveIdx, std::uint64_t frame )
+{
+    // when the ring is full the requests already queued are kept
+    const DumpRequest request = { type, waveIdx, frame };
+    mDumpRequests.write( &request, 1 );
+}
+
+void XrunMonitor::freeze( EventType reason )
+{
+    // the writer thread still owns the frozen copy: this miss is counted but not traced
+    if ( mFrozen.load( std::memory_order_acquire ) )
+        return;
+
+    // copy the valid part of the rings oldest first, so that the writer thread doesn't need to know the write indexes
+    const std::size_t numBlocks = std::min( mNumBlocksTotal, mBlocks.size() );
+    const std::size_t firstBlock = mBlockWriteIdx + mBlocks.size() - numBlocks;
+    for ( std::size_t i = 0; i < numBlocks; i++ ){
+        mFrozenBlocks[i] = mBlocks[(firstBlock + i) % mBlocks.size()];
+    }
+
+    const std::size_t numEventsTotal = mNumEventsTotal;
+    const std::size_t numEvents = std::min( numEventsTotal, mEvents.size() );
+    const std::size_t firstEvent = numEventsTotal - numEvents;
+    for ( std::size_t i = 0; i < numEvents; i++ ){
+        mFrozenEvents[i] = mEvents[(firstEvent + i) % mEvents.size()];
+    }
+
+    mFrozenNumBlocks = numBlocks;
+    mFrozenNumEvents = numEvents;
+    mFrozenReason = reason;
+
+    mFrozen.store( true, std::memory_order_release );
+}
+
+void XrunMonitor::run()
+{
+    while ( mRunning ){
+        if ( mFrozen.load( std::memory_order_acquire ) ){
+            flush();
+            mFrozen.store( false, std::memory_order_release );
+        }
+
+        std::this_thread::sleep_for( kWriterPollInterval );
+    }
+
+    // last chance for a trace frozen right before stop()
+    if ( mFrozen.load( std::memory_order_acquire ) ){
+        flush();
+        mFrozen.store( false, std::memory_order_release );
+    }
+}
+
+void XrunMonitor::flush()
+{
+    const std::size_t dumpIdx = mNumDumps;
+    const std::string path = mFilePrefix + std::to_string( std::time( nullptr ) ) + "_" + std::to_string( dumpIdx ) + ".txt";
+
+    std::ofstream out( path );
+    if ( !out ){
+        logError( "XrunMonitor: cannot open trace file " + path );
+        return;
+    }
+
+    out << "reason: " << eventTypeName( mFrozenReason ) << "\n";
+    out << "total deadline misses: " << mNumMisses.load() << "\n\n";
+
+    out << "# blocks (oldest first)\n";
+    out << "frame\ttime_ms\tinterval_ms\tevents\tlate\n";
+    for ( std::size_t i = 0; i < mFrozenNumBlocks; i++ ){
+        const BlockRecord &block = mFrozenBlocks[i];
+        out << block.frame << "\t"
+            << double( block.timeNs ) / 1.0e6 << "\t"
+            << double( block.intervalNs ) / 1.0e6 << "\t"
+            << block.numEvents << "\t"
+            << (block.late ? "LATE" : "") << "\n";
+    }
+
+    out << "\n# events (oldest first)\n";
+    out << "frame\twave\ttype\targ1\targ2\tvalue\n";
+    for ( std::size_t i = 0; i < mFrozenNumEvents; i++ ){
+        const EventRecord &event = mFrozenEvents[i];
+        out << event.frame << "\t"
+            << int( event.waveIdx ) << "\t"
+            << eventTypeName( event.type ) << "\t"
+            << event.arg1 << "\t"
+            << event.arg2 << "\t"
+            << event.value << "\n";
+    }
+
+    mNumDumps++;
+    logError( std::string( "Audio glitch (" ) + eventTypeName( mFrozenReason ) + "), trace written to " + path );
+}
@@ -25,6 +25,9 @@
 #include "cinder/gl/gl.h"
 #include "cinder/Exception.h"
 #include <stdexcept>
+#include <future>
+#include <sstream>
+#include <iomanip>
 
 
 #include "Config.h"
@@ -33,8 +36,16 @@
 #include "Log.h"
 #include "AudioEngine.h"
 #include "Oscilloscope.h"
+#include "SpectrumView.h"
 #include "Messages.h"
 #include "MIDI.h"
+#include "RtSafety.h"
+#include "FrameScheduler.h"
+#include "AsyncLogger.h"
+#include "SessionStore.h"
+#include "ShaderCache.h"
+#include "ControlStream.h"
+#include "GranularComparison.h"
 
 using namespace ci;
 using namespace ci::app;
@@ -46,32 +57,69 @@ class CollidoscopeApp : public App {
 public:
     
     void setup() override;
+    /** Creates the GL resources of the waves. Doesn't need the audio engine */
     void setupGraphics();
+    /** Creates the oscilloscopes, sized after the scopes of the audio engine */
+    void setupOscilloscopes();
     
     /** Receives MIDI command messages from MIDI thread */
     void receiveCommands();
     
     /** Prints command line usage */
     void usage();
+
+    /** Restores the session saved by the previous run, if any, and starts saving the current one */
+    void restoreSession();
+
+    /* parameter changes from the MIDI knobs and the keyboard. They go to the graphic wave, the audio engine and the session */
+    void setSelectionStart( size_t waveIdx, size_t startChunk );
+    // frame where the grains of a selection starting at startChunk start: the first onset in the chunk if there is one
+    size_t selectionStartFrame( size_t waveIdx, size_t startChunk );
+    void setSelectionSize( size_t waveIdx, size_t numChunks );
+    void setGrainDuration( size_t waveIdx, float coeff );
+    void setFilter( size_t waveIdx, float value );
+    void setGain( size_t waveIdx, float value );
+
+    /** Number of audio frames in \a numChunks chunks */
+    size_t chunksToFrames( size_t numChunks );
     
     void keyDown( KeyEvent event ) override;
     void update() override;
     void draw() override;
     void resize() override;
+    void cleanup() override;
     
     Config mConfig;
-    collidoscope::MIDI mMIDI;
+    // declared before the audio engine: the audio and MIDI threads report to it until the audio engine is destroyed 
+    unique_ptr< ControlCapture > mCapture;
     AudioEngine mAudioEngine;
-    
-    array< shared_ptr< Wave >, NUM_WAVES > mWaves;
-    array< shared_ptr< DrawInfo >, NUM_WAVES > mDrawInfos;
-    array< shared_ptr< Oscilloscope >, NUM_WAVES > mOscilloscopes;
+    // declared after the audio engine: the session writer thread reads the recordings, so it must be stopped first 
+    SessionStore mSession;
+    FrameScheduler mFrameScheduler;
+    // declared after the audio engine and the frame scheduler: the MIDI threads use them, so they must be closed first 
+    collidoscope::MIDI mMIDI;
+    // replays the control stream passed with --replay, if any 
+    ControlReplayer mReplayer;
+    
+    // one element per wave, sized according to mConfig.getNumWaves() in setup()
+    vector< shared_ptr< Wave > > mWaves;
+    vector< shared_ptr< DrawInfo > > mDrawInfos;
+    vector< shared_ptr< Oscilloscope > > mOscilloscopes;
+    // spectrum of the output, drawn at the bottom of the window when toggled on 
+    unique_ptr< SpectrumView > mSpectrumView;
+    bool mShowSpectrum = false;
     // buffer to read the WAVE_* messages as a new wave gets recorded
-    array< RecordWaveMsg*, NUM_WAVES> mRecordWaveMessageBuffers;
+    vector< RecordWaveMsg* > mRecordWaveMessageBuffers;
     //buffer to read the TRIGGER_* messages as the pgranulars play
-    array< vector< CursorTriggerMsg >, NUM_WAVES > mCursorTriggerMessagesBuffers;
+    vector< vector< CursorTriggerMsg > > mCursorTriggerMessagesBuffers;
+    // buffer to read the MIDI events from the MIDI threads
+    vector< Knob > mMidiMessages;
+    // number of dropped MIDI events already reported in the log
+    size_t mNumDroppedMidiEvents = 0;
     
     double mSecondsPerChunk;
+    // whether messages came from the audio or MIDI threads in this frame 
+    bool mHadEvents = false;
     
     ~CollidoscopeApp();
 };
@@ -79,8 +127,14 @@ public:
 
 void CollidoscopeApp::setup()
 {
+    const uint64_t setupStart = LatencyProbe::now();
+    auto elapsedMs = []( uint64_t since ) { return double( LatencyProbe::now() - since ) / 1.0e6; };
+
     //hideCursor();
     /* setup is logged: setup steps and errors */
+
+    // in Debug builds report any allocation or lock in the audio thread. Must happen before the audio graph is enabled
+    collidoscope::rtsafety::install();
     
     /*try {
      mConfig.loadFromFile( "./collidoscope_config.xml" );
@@ -88,99 +142,381 @@ void CollidoscopeApp::setup()
      catch ( const Exception &e ){
      logError( string("Exception loading config from file:") + e.what() );
      }*/
+
+    // command line switches override the configuration
+    FrameScheduler::Mode frameMode = FrameScheduler::Mode::ADAPTIVE;
+    bool logBenchmark = false;
+    string capturePath;
+    string replayPath;
+    bool offlineReplay = false;
+    bool compareGranular = false;
+
+    const vector< string > &args = getCommandLineArgs();
+    for ( size_t i = 1; i < args.size(); i++ ){
+        if ( args[i] == "--waves" && i + 1 < args.size() ){
+            mConfig.setNumWaves( fromString< size_t >( args[++i] ) );
+        }
+        else if ( args[i] == "--particles" && i + 1 < args.size() ){
+            mConfig.setMaxParticles( fromString< size_t >( args[++i] ) );
+        }
+        else if ( args[i] == "--frames" && i + 1 < args.size() ){
+            const string &mode = args[++i];
+            if ( mode == "vsync" )
+                frameMode = FrameScheduler::Mode::VSYNC;
+            else if ( mode == "fixed" )
+                frameMode = FrameScheduler::Mode::FIXED;
+            else if ( mode == "adaptive" )
+                frameMode = FrameScheduler::Mode::ADAPTIVE;
+            else
+                usage();
+        }
+        else if ( args[i] == "--log-benchmark" ){
+            logBenchmark = true;
+        }
+        else if ( args[i] == "--capture" && i + 1 < args.size() ){
+            capturePath = args[++i];
+        }
+        else if ( args[i] == "--replay" && i + 1 < args.size() ){
+            replayPath = args[++i];
+        }
+        else if ( args[i] == "--offline" ){
+            offlineReplay = true;
+        }
+        else if ( args[i] == "--compare-granular" ){
+            compareGranular = true;
+        }
+        else if ( args[i] == "--rt-abort" ){
+            // Debug builds: stop at the first allocation or lock in the audio thread, with its stack trace
+            collidoscope::rtsafety::setAbortOnViolation( true );
+        }
+        else if ( args[i] == "--help" ){
+            usage();
+        }
+    }
     
+    // the real-time threads log through the async logger. Must be started before the audio graph and the MIDI callbacks
+    AsyncLogger::instance().start( "./collidoscope_rt.log", mConfig.getRtLogMaxFileSize(), mConfig.getRtLogNumFiles(),
+        mConfig.getRtLogMaxThreads(), mConfig.getRtLogRingSize() );
+
+    if ( logBenchmark ){
+        // 32 calls per block of 64 frames at 44.1 kHz, for about 3 seconds
+        console() << AsyncLogger::instance().runBenchmark( 2000, 32, 64.0 / 44100.0 ) << endl;
+    }
+
+    const size_t numWaves = mConfig.getNumWaves();
+    mRecordWaveMessageBuffers.resize( numWaves );
+    mCursorTriggerMessagesBuffers.resize( numWaves );
+    mWaves.resize( numWaves );
+    mDrawInfos.resize( numWaves );
+    mOscilloscopes.resize( numWaves );
+
     // setup buffers to read messages from audio thread
-    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+    for ( size_t i = 0; i < numWaves; i++ ){
         mRecordWaveMessageBuffers[i] = new RecordWaveMsg[mConfig.getNumChunks()];
         mCursorTriggerMessagesBuffers[i].reserve( mConfig.getCursorTriggerMessageBufSize() );
     }
     
-    mAudioEngine.setup( mConfig );
-    
-    setupGraphics();
+    mMidiMessages.reserve( mConfig.getMIDIQueueSize() );
+
+    // set up before the MIDI ports are opened, as the MIDI threads wake it up 
+    mFrameScheduler.setup( frameMode, mConfig.getTargetFrameRate(), mConfig.getIdleFrameRate() );
     
     mSecondsPerChunk = mConfig.getWaveLen() / mConfig.getNumChunks();
-    
+
+    const double initMs = elapsedMs( setupStart );
+
+    // the audio graph and the MIDI ports are set up on worker threads while the GL resources are created on this thread 
+    auto audioSetup = std::async( std::launch::async, [this, &elapsedMs]() {
+        const uint64_t start = LatencyProbe::now();
+        mAudioEngine.setup( mConfig );
+        return elapsedMs( start );
+    } );
+
+    auto midiSetup = std::async( std::launch::async, [this, &elapsedMs]() {
+        const uint64_t start = LatencyProbe::now();
+        // the audio engine is not ready yet: until setAudioEngine() the notes go through the graphic thread 
+        mMIDI.setup( mConfig, nullptr, &mFrameScheduler );
+        return elapsedMs( start );
+    } );
+
+    const uint64_t graphicsStart = LatencyProbe::now();
+    setupGraphics();
+    const double graphicsMs = elapsedMs( graphicsStart );
+
+    uint64_t waitStart = LatencyProbe::now();
+    const double audioMs = audioSetup.get();
+    const double audioWaitMs = elapsedMs( waitStart );
+
+    // started before the session is restored, so that the restored recordings are captured too
+    if ( !capturePath.empty() ){
+        mCapture.reset( new ControlCapture( mConfig.getMaxMIDIPorts(), mConfig.getControlCaptureQueueSize() ) );
+        if ( mCapture->start( capturePath, mAudioEngine, mAudioEngine.getRandomSeed() ) )
+            mAudioEngine.setCapture( mCapture.get() );
+        else
+            mCapture.reset();
+    }
+
+    // the grains scheduled by density take these until a controller changes them 
+    for ( size_t i = 0; i < mConfig.getNumWaves(); i++ ){
+        mAudioEngine.setGrainJitter( i, mConfig.getGrainJitter() );
+        mAudioEngine.setGrainTime( i, mConfig.getGrainTime() );
+    }
+
+    const uint64_t sessionStart = LatencyProbe::now();
+    setupOscilloscopes();
+    restoreSession();
+    const double sessionMs = elapsedMs( sessionStart );
+
+    waitStart = LatencyProbe::now();
+    double midiMs = 0.0;
     try {
-        mMIDI.setup( mConfig );
+        midiMs = midiSetup.get();
+        // notes go straight from the MIDI threads to the audio engine 
+        mMIDI.setAudioEngine( &mAudioEngine );
     }
     catch ( const collidoscope::MIDIException &e ){
         logError( string( "Exception opening MIDI input device: " ) + e.getMessage() );
     }
-    
+    const double midiWaitMs = elapsedMs( waitStart );
+
+    ostringstream report;
+    report << fixed << setprecision( 1 )
+        << "Startup: " << elapsedMs( setupStart ) << " ms\n"
+        << "  init " << initMs << " ms\n"
+        << "  graphics " << graphicsMs << " ms (" << ShaderCache::getNumPrograms() << " programs built, " << ShaderCache::getNumHits() << " shared)\n"
+        << "  audio " << audioMs << " ms on a worker, waited " << audioWaitMs << " ms\n"
+        << "  oscilloscopes and session " << sessionMs << " ms\n"
+        << "  MIDI " << midiMs << " ms on a worker, waited " << midiWaitMs << " ms";
+    console() << report.str() << endl;
+
+    if ( compareGranular ){
+        // same sample rate and block size as the audio engine 
+        GranularComparison comparison( mConfig.getRandomSeed(), mAudioEngine.getSampleRate(), mAudioEngine.getFramesPerBlock() );
+        comparison.run( mConfig.getGranularComparisonDuration(), { mConfig.getGranularMaxErrorBudget(), 
+            mConfig.getGranularRmsErrorBudget(), mConfig.getGranularSpectralErrorBudget() } );
+        console() << comparison.getReport() << endl;
+    }
+
+    if ( !replayPath.empty() && mReplayer.load( replayPath ) ){
+        if ( offlineReplay ){
+            console() << mReplayer.runOffline( mAudioEngine ) << endl;
+            quit();
+        }
+        else {
+            console() << "Replaying " << mReplayer.getNumEvents() << " events from " << replayPath << endl;
+            mReplayer.start( mAudioEngine );
+        }
+    }
+}
+
+void CollidoscopeApp::usage()
+{
+    console() << "Usage: macollidoscope [--waves <number of waves>] [--particles <max particles per wave>] [--frames <vsync|fixed|adaptive>] [--log-benchmark] [--capture <file>] [--replay <file> [--offline]] [--compare-granular] [--rt-abort] [--help]" << endl;
+}
+
+void CollidoscopeApp::restoreSession()
+{
+    const uint64_t restoreStart = LatencyProbe::now();
+    const size_t numWaves = mConfig.getNumWaves();
+
+    const bool restored = mSession.open( "./collidoscope_session.bin", numWaves, mConfig.getNumChunks(), 
+        mAudioEngine.getWaveNumFrames( 0 ), mAudioEngine.getSampleRate() );
+
+    if ( restored ){
+        for ( size_t i = 0; i < numWaves; i++ ){
+            // the samples are copied straight from the mapped file into the recorder buffer
+            const size_t numFrames = mSession.getNumRecordedFrames( i );
+            if ( numFrames > 0 )
+                mAudioEngine.restoreRecording( i, mSession.getSamples( i ), numFrames );
+
+            for ( size_t chunk = 0; chunk < mSession.getNumChunksSet( i ); chunk++ ){
+                float min, max;
+                mSession.getChunk( i, chunk, min, max );
+                mWaves[i]->setChunk( chunk, min, max );
+            }
+
+            float value;
+            if ( mSession.getParam( i, SessionStore::kParamSelectionSize, value ) )
+                setSelectionSize( i, size_t( value ) );
+            if ( mSession.getParam( i, SessionStore::kParamSelectionStart, value ) )
+                setSelectionStart( i, size_t( value ) );
+            if ( mSession.getParam( i, SessionStore::kParamDuration, value ) )
+                setGrainDuration( i, value );
+            if ( mSession.getParam( i, SessionStore::kParamFilter, value ) )
+                setFilter( i, value );
+            if ( mSession.getParam( i, SessionStore::kParamGain, value ) )
+                setGain( i, value );
+        }
+
+        console() << "Session restored in " << double( LatencyProbe::now() - restoreStart ) / 1.0e6 << " ms" << endl;
+    }
+
+    mSession.start( mAudioEngine );
+}
+
+size_t CollidoscopeApp::chunksToFrames( size_t numChunks )
+{
+    return numChunks * ( mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks() );
+}
+
+size_t CollidoscopeApp::selectionStartFrame( size_t waveIdx, size_t startChunk )
+{
+    const size_t startFrame = chunksToFrames( startChunk );
+    if ( !mConfig.getSnapSelectionToOnsets() )
+        return startFrame;
+
+    size_t onset;
+    if ( mAudioEngine.getOnsetIndex( waveIdx ).findFirst( startFrame, chunksToFrames( startChunk + 1 ), onset ) )
+        return onset;
+
+    return startFrame;
+}
+
+void CollidoscopeApp::setSelectionStart( size_t waveIdx, size_t startChunk )
+{
+    const size_t selectionSizeBeforeStartUpdate = mWaves[waveIdx]->getSelection().getSize();
+    mWaves[waveIdx]->getSelection().setStart( startChunk );
+
+    const size_t selectionStart = mWaves[waveIdx]->getSelection().getStart();
+    mAudioEngine.setSelectionStart( waveIdx, selectionStartFrame( waveIdx, selectionStart ) );
+    mSession.setParam( waveIdx, SessionStore::kParamSelectionStart, float( selectionStart ) );
+
+    // the selection shrinks when it's moved against the end of the wave 
+    const size_t newSelectionSize = mWaves[waveIdx]->getSelection().getSize();
+    if ( selectionSizeBeforeStartUpdate != newSelectionSize ){
+        mAudioEngine.setSelectionSize( waveIdx, chunksToFrames( newSelectionSize ) );
+        mSession.setParam( waveIdx, SessionStore::kParamSelectionSize, float( newSelectionSize ) );
+    }
+}
+
+void CollidoscopeApp::setSelectionSize( size_t waveIdx, size_t numChunks )
+{
+    mWaves[waveIdx]->getSelection().setSize( numChunks );
+
+    const size_t selectionSize = mWaves[waveIdx]->getSelection().getSize();
+    mAudioEngine.setSelectionSize( waveIdx, chunksToFrames( selectionSize ) );
+    mSession.setParam( waveIdx, SessionStore::kParamSelectionSize, float( selectionSize ) );
+}
+
+void CollidoscopeApp::setGrainDuration( size_t waveIdx, float coeff )
+{
+    mAudioEngine.setGrainDurationCoeff( waveIdx, coeff );
+    mWaves[waveIdx]->getSelection().setParticleSpread( coeff );
+    mSession.setParam( waveIdx, SessionStore::kParamDuration, coeff );
+}
+
+void CollidoscopeApp::setFilter( size_t waveIdx, float value )
+{
+    const double minCutoff = mConfig.getMinFilterCutoffFreq();
+    const double maxCutoff = mConfig.getMaxFilterCutoffFreq();
+    const double cutoff = pow( maxCutoff / 200., value ) * minCutoff;
+    mAudioEngine.setFilterCutoff( waveIdx, cutoff );
+    mWaves[waveIdx]->setselectionAlpha( value );
+    mSession.setParam( waveIdx, SessionStore::kParamFilter, value );
+}
+
+void CollidoscopeApp::setGain( size_t waveIdx, float value )
+{
+    const float gain = ci::lmap<double>( value, 0.f, 1.f, 0.25f, 4.f );
+    mAudioEngine.setGain( waveIdx, gain );
+    mSession.setParam( waveIdx, SessionStore::kParamGain, value );
 }
 
 void CollidoscopeApp::setupGraphics()
 {
-    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+    for ( size_t i = 0; i < mConfig.getNumWaves(); i++ ){
         
-        mDrawInfos[i] = make_shared< DrawInfo >( i );
-        mWaves[i] = make_shared< Wave >(mConfig.getNumChunks(), mConfig.getWaveSelectionColor(i) );
-        mOscilloscopes[i] = make_shared< Oscilloscope >( mAudioEngine.getAudioOutputBuffer( i ).getNumFrames() / mConfig.getOscilloscopeNumPointsDivider() );
+        mDrawInfos[i] = make_shared< DrawInfo >( i, mConfig.getNumWaves() );
+        mWaves[i] = make_shared< Wave >(mConfig.getNumChunks(), mConfig.getWaveSelectionColor(i), mConfig.getMaxParticles() );
         
     }
 }
 
+void CollidoscopeApp::setupOscilloscopes()
+{
+    for ( size_t i = 0; i < mConfig.getNumWaves(); i++ ){
+        const size_t numScopePoints = std::min( mAudioEngine.getScopeNumFrames( i ) / mConfig.getOscilloscopeNumPointsDivider(), mConfig.getOscilloscopeMaxNumPoints() );
+        mOscilloscopes[i] = make_shared< Oscilloscope >( numScopePoints );
+    }
+
+    mSpectrumView.reset( new SpectrumView( mConfig.getSpectrumNumBands() ) );
+}
+
 void CollidoscopeApp::keyDown( KeyEvent event )
 {
+    mFrameScheduler.wake();
+
     char c = event.getChar();
     
     const size_t waveIdx = 0;
+
+    if ( mCapture )
+        mCapture->write( controlstream::makeControlEvent( controlstream::Source::KEY, 0, mAudioEngine.getCurrentFrame(), waveIdx, c ) );
     
     switch (c){
         case 'r' :
             mAudioEngine.record( waveIdx );
             break;
             
-        case 'w': {
-            
-            mWaves[waveIdx]->getSelection().setSize(mWaves[waveIdx]->getSelection().getSize() + 1);
-            
-            size_t numSelectionChunks = mWaves[waveIdx]->getSelection().getSize();
-            // how many samples in one selection ?
-            size_t selectionSize = numSelectionChunks * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks());
-            
-            mAudioEngine.setSelectionSize(waveIdx, selectionSize);
-        };
+        case 'w':
+            setSelectionSize( waveIdx, mWaves[waveIdx]->getSelection().getSize() + 1 );
             break;
             
-        case 's': {
-            
-            mWaves[waveIdx]->getSelection().setSize( mWaves[waveIdx]->getSelection().getSize() - 1 );
-            
-            size_t selectionSize = mWaves[waveIdx]->getSelection().getSize() *(mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks());
-            mAudioEngine.setSelectionSize( waveIdx, selectionSize );
-        };
+        case 's':
+            setSelectionSize( waveIdx, mWaves[waveIdx]->getSelection().getSize() - 1 );
             break;
             
-        case 'd': {
-            
-            size_t selectionStart = mWaves[waveIdx]->getSelection().getStart();
-            mWaves[waveIdx]->getSelection().setStart( selectionStart + 1 );
-            
-            selectionStart = mWaves[waveIdx]->getSelection().getStart();
-            mAudioEngine.setSelectionStart( waveIdx, selectionStart * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks()) );
-        };
-            
+        case 'd':
+            setSelectionStart( waveIdx, mWaves[waveIdx]->getSelection().getStart() + 1 );
             break;
             
         case 'a': {
-            size_t selectionStart = mWaves[waveIdx]->getSelection().getStart();
+            const size_t selectionStart = mWaves[waveIdx]->getSelection().getStart();
             
             if ( selectionStart == 0 )
                 return;
             
-            mWaves[waveIdx]->getSelection().setStart( selectionStart - 1 );
-            
-            selectionStart = mWaves[waveIdx]->getSelection().getStart();
-            
-            mAudioEngine.setSelectionStart( waveIdx, selectionStart * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks()) );
+            setSelectionStart( waveIdx, selectionStart - 1 );
         };
             break;
             
         case 'f':
             setFullScreen( !isFullScreen() );
             break;
+
+        case 'l':
+            console() << mAudioEngine.getLatencyProbe().getReport() << endl;
+            console() << "audio clock drift: " << mAudioEngine.getClockBridge().getDriftPpm() << " ppm" << endl;
+            break;
+
+        case 'p':
+            console() << mFrameScheduler.getReport() << endl;
+            break;
+
+        case 'o':
+            // cycle through the oscilloscope decimation modes 
+            for ( auto &oscilloscope : mOscilloscopes ){
+                switch ( oscilloscope->getDecimationMode() ){
+                case Oscilloscope::DecimationMode::EVERY_NTH: oscilloscope->setDecimationMode( Oscilloscope::DecimationMode::AVERAGE ); break;
+                case Oscilloscope::DecimationMode::AVERAGE: oscilloscope->setDecimationMode( Oscilloscope::DecimationMode::PEAK ); break;
+                case Oscilloscope::DecimationMode::PEAK: oscilloscope->setDecimationMode( Oscilloscope::DecimationMode::EVERY_NTH ); break;
+                }
+            }
+            break;
+
+        case 'v':
+            // toggle the spectrum of the output 
+            mShowSpectrum = !mShowSpectrum;
+            mSpectrumView->reset();
+            break;
+
+        case 't': {
+            // toggle the alignment of the oscilloscope on zero crossings 
+            static bool freeRun = false;
+            freeRun = !freeRun;
+            mAudioEngine.setScopeTriggerMode( freeRun ? ScopeTapNode::TriggerMode::FREE_RUN : ScopeTapNode::TriggerMode::ZERO_CROSSING );
+        };
+            break;
             
         case ' ': {
             static bool isOn = false;
@@ -201,8 +537,7 @@ void CollidoscopeApp::keyDown( KeyEvent event )
             else
                 c -= 1;
             
-            mAudioEngine.setGrainDurationCoeff( waveIdx, c );
-            mWaves[waveIdx]->getSelection().setParticleSpread( float( c ) );
+            setGrainDuration( waveIdx, float( c ) );
             
         }; break;
             
@@ -213,39 +548,54 @@ void CollidoscopeApp::keyDown( KeyEvent event )
             else
                 c += 1;
             
-            mAudioEngine.setGrainDurationCoeff( waveIdx, c );
-            mWaves[waveIdx]->getSelection().setParticleSpread( float( c ) );
+            setGrainDuration( waveIdx, float( c ) );
         }; break;
     }
 }
 
 void CollidoscopeApp::update()
 {
+    mFrameScheduler.frameBegin();
+    mHadEvents = false;
+
     // check incoming commands
     receiveCommands();
+
+    // send the replayed calls that are due 
+    if ( mReplayer.isRunning() ){
+        mReplayer.update( mAudioEngine );
+        mHadEvents = true;
+    }
+    
+    // report overruns and underruns to the xrun monitor
+    mAudioEngine.checkXruns();
     
     // check new wave chunks from recorder buffer
-    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+    for ( size_t i = 0; i < mWaves.size(); i++ ){
         size_t availableRead = mAudioEngine.getRecordWaveAvailable( i );
         mAudioEngine.readRecordWave( i, mRecordWaveMessageBuffers[i], availableRead );
+        mHadEvents |= availableRead > 0;
         
         for ( size_t msgIndex = 0; msgIndex < availableRead; msgIndex++ ){
             const RecordWaveMsg & msg = mRecordWaveMessageBuffers[i][msgIndex];
             
             if ( msg.cmd == Command::WAVE_CHUNK ){
                 mWaves[i]->setChunk( msg.index, msg.arg1, msg.arg2 );
+                mSession.setChunk( i, msg.index, msg.arg1, msg.arg2 );
             }
             else if ( msg.cmd == Command::WAVE_START ){
                 mWaves[i]->reset( true ); // reset only chunks but leave selection
+                mSession.clearChunks( i );
             }
             
         }
     }
     
     // check if new cursors have been triggered
-    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+    for ( size_t i = 0; i < mWaves.size(); i++ ){
         
         mAudioEngine.checkCursorTriggers( i, mCursorTriggerMessagesBuffers[i] );
+        mHadEvents |= !mCursorTriggerMessagesBuffers[i].empty();
         for ( auto & trigger : mCursorTriggerMessagesBuffers[i] ){
             const int nodeID = trigger.synthID;
             
@@ -270,19 +620,26 @@ void CollidoscopeApp::update()
     }
     
     // update cursors
-    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+    for ( size_t i = 0; i < mWaves.size(); i++ ){
         mWaves[i]->update( mSecondsPerChunk, *mDrawInfos[i] );
     }
     
-    // update oscilloscope
+    // update oscilloscope, only when the audio thread has published a new snapshot 
     
-    for ( size_t i = 0; i < NUM_WAVES; i++ ){
-        const audio::Buffer &audioOutBuffer = mAudioEngine.getAudioOutputBuffer( i );
-        // one oscilloscope sample
-        
-        for ( size_t j = 0; j < mOscilloscopes[i]->getNumPoints(); j++ ){
-            mOscilloscopes[i]->setPoint( int(j), audioOutBuffer.getData()[j], *mDrawInfos[i] );
-        }
+    for ( size_t i = 0; i < mWaves.size(); i++ ){
+        if ( !mAudioEngine.updateScopeSnapshot( i ) )
+            continue;
+
+        const std::vector< float > &scopeSnapshot = mAudioEngine.getScopeSnapshot( i );
+        mOscilloscopes[i]->setPoints( scopeSnapshot.data(), scopeSnapshot.size(), *mDrawInfos[i] );
+        mHadEvents = true;
+    }
+
+    // update the spectrum, only when shown and the analyzer thread has published new bands 
+    if ( mShowSpectrum && mAudioEngine.updateSpectrum() ){
+        const std::vector< float > &spectrum = mAudioEngine.getSpectrum();
+        mSpectrumView->setBands( spectrum.data(), spectrum.size() );
+        mHadEvents = true;
     }
     
     
@@ -293,9 +650,9 @@ void CollidoscopeApp::draw()
 {
     gl::clear( Color( 0, 0, 0 ) );
     
-    for ( int i = 0; i < NUM_WAVES; i++ ){
-        if ( i == 1 ){
-            /* for the upper wave flip the x over the center of the screen which is
+    for ( size_t i = 0; i < mWaves.size(); i++ ){
+        if ( i % 2 == 1 ){
+            /* for the waves played from the other side of the screen flip the x over the center of the screen which is
              the composition of rotate on the y-axis and translate by -screenwidth*/
             gl::pushModelMatrix();
             gl::rotate( float(M_PI), ci::vec3( 0, 1, 0 ) );
@@ -310,20 +667,30 @@ void CollidoscopeApp::draw()
             mWaves[i]->draw( *mDrawInfos[i] );
         }
     }
+
+    if ( mShowSpectrum ){
+        gl::ScopedBlendAlpha blend;
+        mSpectrumView->draw( float( getWindowWidth() ), float( getWindowHeight() ), getWindowHeight() / 4.0f, ColorA( 1.0f, 1.0f, 1.0f, 0.35f ) );
+    }
+
+    // keep the full frame rate as long as something moves 
+    bool animating = mHadEvents;
+    for ( size_t i = 0; i < mWaves.size() && !animating; i++ ){
+        animating = mWaves[i]->isAnimating();
+    }
+    mFrameScheduler.frameEnd( animating );
 }
 
 void CollidoscopeApp::resize()
 {
     App::resize();
     
-    for ( int i = 0; i < NUM_WAVES; i++ ){
+    for ( size_t i = 0; i < mWaves.size(); i++ ){
         // reset the drawing information with the new windows size and same shrink factor
         mDrawInfos[i]->reset( getWindow()->getBounds(), 3.0f / 5.0f );
         
         /* reset the oscilloscope points to zero */
-        for ( int j = 0; j < mOscilloscopes[i]->getNumPoints(); j++ ){
-            mOscilloscopes[i]->setPoint(j, 0.0f, *mDrawInfos[i] );
-        }
+        mOscilloscopes[i]->reset( *mDrawInfos[i] );
     }
 }
 
@@ -332,45 +699,40 @@ void CollidoscopeApp::resize()
 void CollidoscopeApp::receiveCommands()
 {
     // check new midi messages
-    static std::vector<Knob*> midiMessages;
-    mMIDI.checkMessages( midiMessages );
+    mMIDI.checkMessages( mMidiMessages );
+    mHadEvents |= !mMidiMessages.empty();
     
-    for ( auto& m : midiMessages ) {
+    for ( const Knob &m : mMidiMessages ) {
         
-        const size_t waveIdx = 0; //mConfig.getWaveForMIDIChannel( m.getChannel() );
+        const size_t waveIdx = mConfig.getWaveForMIDIChannel( m.mChannel );
+
+        if ( mCapture ){
+            const int32_t arg = ( int32_t( m.mPort ) << 16 ) | ( int32_t( m.mChannel ) << 8 ) | int32_t( m.mNumber );
+            mCapture->write( controlstream::makeControlEvent( controlstream::Source::KNOB, uint8_t( m.mType ), mAudioEngine.getCurrentFrame(), 
+                waveIdx, arg, m.mValue ) );
+        }
         
-        switch ( m->mType ) {
+        switch ( m.mType ) {
             case Knob::NOTEON: {
-                mAudioEngine.noteOn( waveIdx, m->mValue );
+                mAudioEngine.noteOn( waveIdx, m.mValue );
             } break;
                 
             case Knob::NOTEOFF: {
-                mAudioEngine.noteOff( waveIdx, m->mValue );
+                mAudioEngine.noteOff( waveIdx, m.mValue );
             } break;
                 
             case Knob::SELECTIONSTART: {
-                size_t startChunk = m->mValue * 149.f;
-                
-                const size_t selectionSizeBeforeStartUpdate = mWaves[waveIdx]->getSelection().getSize();
-                mWaves[waveIdx]->getSelection().setStart( startChunk );
-                
-                mAudioEngine.setSelectionStart( waveIdx, startChunk * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks()) );
-                
-                const size_t newSelectionSize = mWaves[waveIdx]->getSelection().getSize();
-                if ( selectionSizeBeforeStartUpdate != newSelectionSize ){
-                    mAudioEngine.setSelectionSize( waveIdx, newSelectionSize * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks()) );
-                }
+                size_t startChunk = m.mValue * 149.f;
+                setSelectionStart( waveIdx, startChunk );
             } break;
                 
             case Knob::SELECTIONSIZE: {
-                size_t numSelectionChunks = m->mValue * (mConfig.getMaxSelectionNumChunks() - 1) + 1;
-                mWaves[waveIdx]->getSelection().setSize( numSelectionChunks );
-                size_t selectionSize = mWaves[waveIdx]->getSelection().getSize() * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks());
-                mAudioEngine.setSelectionSize( waveIdx, selectionSize );
+                size_t numSelectionChunks = m.mValue * (mConfig.getMaxSelectionNumChunks() - 1) + 1;
+                setSelectionSize( waveIdx, numSelectionChunks );
             } break;
                 
             case Knob::LOOPTOGGLE: {
-                if ( m->mValue ) {
+                if ( m.mValue ) {
                     mAudioEngine.loopOn( waveIdx );
                 } else {
                     mAudioEngine.loopOff( waveIdx );
@@ -382,34 +744,68 @@ void CollidoscopeApp::receiveCommands()
             } break;
                 
             case Knob::DURATION: {
-                const float coeff = m->mValue * (mConfig.getMaxGrainDurationCoeff() - 1) + 1;
-                mAudioEngine.setGrainDurationCoeff( waveIdx, coeff );
-                mWaves[waveIdx]->getSelection().setParticleSpread( coeff );
+                const float coeff = m.mValue * (mConfig.getMaxGrainDurationCoeff() - 1) + 1;
+                setGrainDuration( waveIdx, coeff );
             } break;
                 
-            case Knob::FILTERFREQ: {
-                const double minCutoff = mConfig.getMinFilterCutoffFreq();
-                const double maxCutoff = mConfig.getMaxFilterCutoffFreq();
-                const double cutoff = pow( maxCutoff / 200., m->mValue ) * minCutoff;
-                mAudioEngine.setFilterCutoff( waveIdx, cutoff );
-                mWaves[waveIdx]->setselectionAlpha( m->mValue );
-            } break;
+            case Knob::FILTERFREQ:
+                setFilter( waveIdx, m.mValue );
+                break;
                 
-            case Knob::GAIN: {
-                const float alpha = ci::lmap<double>( m->mValue, 0.f, 1.f, 0.25f, 4.f );
-                mAudioEngine.setGain( waveIdx, alpha );
-            } break;
+            case Knob::GAIN:
+                setGain( waveIdx, m.mValue );
+                break;
+
+            case Knob::PITCHBEND:
+                mAudioEngine.setPitchBend( waveIdx, m.mValue * mConfig.getPitchBendRange() );
+                break;
+
+            case Knob::GLIDE:
+                mAudioEngine.setGlideTime( waveIdx, m.mValue * mConfig.getMaxGlideTime() );
+                break;
+
+            case Knob::DENSITY:
+                // all the way down goes back to one grain every selection size 
+                mAudioEngine.setGrainDensity( waveIdx, m.mValue * mConfig.getMaxGrainDensity() );
+                break;
+
+            case Knob::JITTER:
+                mAudioEngine.setGrainJitter( waveIdx, m.mValue );
+                break;
         }
     }
     
-    midiMessages.clear();
+    mMidiMessages.clear();
+
+    const size_t numDroppedMidiEvents = mMIDI.getNumDroppedEvents();
+    if ( numDroppedMidiEvents != mNumDroppedMidiEvents ){
+        logError( "MIDI queue full, " + to_string( numDroppedMidiEvents - mNumDroppedMidiEvents ) + " events dropped" );
+        mNumDroppedMidiEvents = numDroppedMidiEvents;
+    }
 }
 
 
 
+void CollidoscopeApp::cleanup()
+{
+    // the GL objects must go while the window's context is still alive: the batches of the waves, the oscilloscopes
+    // and the spectrum view first, then the programs they share
+    mWaves.clear();
+    mOscilloscopes.clear();
+    mSpectrumView.reset();
+    ShaderCache::clear();
+}
+
 CollidoscopeApp::~CollidoscopeApp()
 {
-    for ( int chan = 0; chan < NUM_WAVES; chan++ ){
+    if ( mCapture ){
+        mAudioEngine.setCapture( nullptr );
+        mCapture->stop();
+        if ( mCapture->getNumDropped() > 0 )
+            logError( "Control capture: " + to_string( mCapture->getNumDropped() ) + " events dropped" );
+    }
+
+    for ( size_t chan = 0; chan < mRecordWaveMessageBuffers.size(); chan++ ){
         delete[] mRecordWaveMessageBuffers[chan];
     }
 }
@@ -425,6 +821,6 @@ CINDER_APP( CollidoscopeApp, RendererGl, [] ( App::Settings *settings) {
     
     settings->setWindowSize( width, height );
     settings->setMultiTouchEnabled( false );
-    settings->disableFrameRate();
+    // the frame rate is set up by the FrameScheduler
     
 } )